@@ -29,7 +29,6 @@
 #endif /* TEST_MODE */
 #include "esp_version.h"
 
-extern struct completion *gl_bootup_cplx; 
 
 static void esp_tx_ba_session_op(struct esp_sip *sip, struct esp_node *node, trc_ampdu_state_t state, u8 tid )
 {
@@ -125,20 +124,27 @@ int sip_parse_events(struct esp_sip *sip, u8 *buf)
 
         case SIP_EVT_BOOTUP: {
            	struct sip_evt_bootup2 *bootup_evt = (struct sip_evt_bootup2 *)(buf + SIP_CTRL_HDR_LEN);
-		if (sip->rawbuf)
+		if (sip->rawbuf) {
                 	kfree(sip->rawbuf);
+			sip->rawbuf = NULL;
+		}
 		
 		sip_post_init(sip, bootup_evt);
 		
-		if (gl_bootup_cplx)	
-			complete(gl_bootup_cplx);
+		if (sip->epub->bootup_cplx)
+			complete(sip->epub->bootup_cplx);
                 
 		break;
         }
 	case SIP_EVT_RESETTING:{
+		/* not booting, the running firmware went down on its own */
+		if (atomic_read(&sip->state) == SIP_RUN) {
+			esp_schedule_recovery(sip->epub, "target reset");
+			break;
+		}
         	sip->epub->wait_reset = 1;                       
-        	if (gl_bootup_cplx)	
-			complete(gl_bootup_cplx);
+        	if (sip->epub->bootup_cplx)
+			complete(sip->epub->bootup_cplx);
 		break;
 	}
 	case SIP_EVT_SLEEP:{
@@ -199,15 +205,22 @@ int sip_parse_events(struct esp_sip *sip, u8 *buf)
         case SIP_EVT_CREDIT_RPT:
                 break;
 
-#ifdef TEST_MODE
         case SIP_EVT_WAKEUP: {
-                u8 check_str[12];
                 struct sip_evt_wakeup* wakeup_evt=  (struct sip_evt_wakeup *)(buf + SIP_CTRL_HDR_LEN);
-                sprintf((char *)&check_str, "%d", wakeup_evt->check_data);
-                esp_test_cmd_event(TEST_CMD_WAKEUP, (char *)&check_str);
+                if (esp_pm_wakeup_event(sip->epub, wakeup_evt->check_data))
+                        break;
+#ifdef TEST_MODE
+                {
+                        u8 check_str[12];
+                        sprintf((char *)&check_str, "%d", wakeup_evt->check_data);
+                        esp_test_cmd_event(TEST_CMD_WAKEUP, (char *)&check_str);
+                }
+#endif /* TEST_MODE */
                 break;
         }
 
+#ifdef TEST_MODE
+
         case SIP_EVT_DEBUG: {
                 u8 check_str[640];
 		sip_parse_event_debug(sip->epub, buf, check_str);
@@ -221,6 +234,9 @@ int sip_parse_events(struct esp_sip *sip, u8 *buf)
                 struct sip_evt_loopback *loopback_evt = (struct sip_evt_loopback *)(buf + SIP_CTRL_HDR_LEN);
                 esp_dbg(ESP_DBG_LOG, "%s loopback len %d seq %u\n", __func__,hdr->len, hdr->seq);
 
+                if (esp_test_bench_loopback(sip, loopback_evt))
+                        break;
+
                 if(loopback_evt->pack_id!=get_loopback_id()) {
                         sprintf((char *)&check_str, "seq id error %d, expect %d", loopback_evt->pack_id, get_loopback_id());
                         esp_test_cmd_event(TEST_CMD_LOOPBACK, (char *)&check_str);
@@ -83,7 +83,18 @@ struct pending_intr_list_info {
 	spinlock_t spin_lock;
 };
 
-u16 ext_gpio_get_int_mask_reg(void);
+/* per-device ext gpio state, hangs off esp_pub */
+struct esp_ext_gpio {
+	struct esp_pub *epub;
+	u16 intr_mask_reg;
+	struct workqueue_struct *wkq;
+	struct work_struct work;
+	struct mutex mutex_lock;
+	struct ext_gpio_info gpio_list[EXT_GPIO_MAX_NUM];
+	struct pending_intr_list_info pending_intr_list;
+};
+
+u16 ext_gpio_get_int_mask_reg(struct esp_pub *epub);
 
 /* for extern user start */
 int ext_gpio_request(int gpio_no);
@@ -98,10 +109,10 @@ int ext_gpio_get_state(int gpio_no);
 int ext_irq_ack(int gpio_no);
 /* for extern user end */
 
-void ext_gpio_int_process(u16 value);
+void ext_gpio_int_process(struct esp_pub *epub, u16 value);
 
 int ext_gpio_init(struct esp_pub *epub);
-void ext_gpio_deinit(void);
+void ext_gpio_deinit(struct esp_pub *epub);
 #endif /* _ESP_EXT_H_ */
 
 #endif /* USE_EXT_GPIO */
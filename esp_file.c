@@ -158,6 +158,55 @@ void esp_release_firmware(const struct firmware *firmware)
         }
 }
 
+/* open a file under the eagle path for sequential reads, no copy is made */
+struct file *esp_open_firmware(const char *name)
+{
+        struct file *filp;
+        char filename[256];
+
+	if (mod_eagle_path_get() == NULL)
+        	snprintf(filename, sizeof(filename), "%s/%s", FWPATH, name);
+	else
+        	snprintf(filename, sizeof(filename), "%s/%s", mod_eagle_path_get(), name);
+
+        filp = filp_open(filename, O_RDONLY, 0);
+        if (IS_ERR(filp)) {
+                esp_dbg(ESP_DBG_ERROR, "%s: file %s filp_open error\n", __FUNCTION__, filename);
+                return filp;
+        }
+
+        if (!(filp->f_mode & FMODE_CAN_READ)) {
+                esp_dbg(ESP_DBG_ERROR, "%s: cannot read file %s\n", __FUNCTION__, filename);
+                filp_close(filp, NULL);
+                return ERR_PTR(-EACCES);
+        }
+
+        return filp;
+}
+
+int esp_read_firmware(struct file *filp, loff_t *pos, u8 *buf, size_t len)
+{
+        int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+        ret = kernel_read(filp, buf, len, pos);
+#else
+        ret = kernel_read(filp, *pos, buf, len);
+        if (ret > 0)
+                *pos += ret;
+#endif
+        if (ret < 0)
+                esp_dbg(ESP_DBG_ERROR, "%s: read %u bytes at %lld error %d\n", __FUNCTION__,
+                        (unsigned int)len, *pos, ret);
+
+        return ret;
+}
+
+void esp_close_firmware(struct file *filp)
+{
+        filp_close(filp, NULL);
+}
+
 #ifdef ESP_ANDROID_LOGGER
 int logger_write( const unsigned char prio,
                   const char __kernel * const tag,
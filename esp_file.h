@@ -26,6 +26,13 @@ int esp_request_firmware(const struct firmware **firmware_p, const char *name, s
 
 void esp_release_firmware(const struct firmware *firmware);
 
+struct file;
+struct file *esp_open_firmware(const char *name);
+
+int esp_read_firmware(struct file *filp, loff_t *pos, u8 *buf, size_t len);
+
+void esp_close_firmware(struct file *filp);
+
 #ifdef INIT_DATA_CONF
 #define INIT_CONF_FILE "init_data.conf"
 #endif /* def INIT_DATA_CONF */
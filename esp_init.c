@@ -30,6 +30,9 @@ int esp_common_init(void)
 #ifdef ESP_USE_SPI
 	ret = esp_spi_init();
 #endif
+#ifdef ESP_USE_VIRT
+	ret = esp_virt_init();
+#endif
 #if (defined(CONFIG_DEBUG_FS) && defined(DEBUGFS_BOOTMODE)) || defined(ESP_CLASS)
 	if (ret == 0)
 		sif_record_esp_run(1);
@@ -50,6 +53,9 @@ void esp_common_exit(void)
 #ifdef ESP_USE_SPI
 	esp_spi_exit();
 #endif
+#ifdef ESP_USE_VIRT
+	esp_virt_exit();
+#endif
 #if (defined(CONFIG_DEBUG_FS) && defined(DEBUGFS_BOOTMODE)) || defined(ESP_CLASS)
 	sif_record_esp_run(0);
 #endif
@@ -10,15 +10,42 @@
  */
 
 #include <linux/mmc/sdio_func.h>
+#include <linux/module.h>
 #include "esp_sif.h"
 #include "slc_host_register.h"
 #include "esp_debug.h"
+#include "esp_trace.h"
+#include "esp_sched.h"
 
 #ifdef SIF_DEBUG_DSR_DUMP_REG
 static void dump_slc_regs(struct slc_host_regs *regs);
 #endif /* SIF_DEBUG_DSR_DUMP_REG */
 
-int esp_common_read(struct esp_pub *epub, u8 *buf, u32 len, int sync, bool noround)
+static bool dsr_regs_full = false;
+module_param(dsr_regs_full, bool, 0644);
+MODULE_PARM_DESC(dsr_regs_full, "read the whole slc register block on every interrupt");
+
+/*
+ * sip_rx() only looks at intr_raw and config_w0, plus config_w3 for the
+ * ext gpio interrupts, so the dsr status read stops there. The rest of
+ * the block stays zero.
+ */
+#ifdef USE_EXT_GPIO
+#define SIF_DSR_REGS_LEN	(offsetof(struct slc_host_regs, config_w3) + sizeof(u32))
+#else
+#define SIF_DSR_REGS_LEN	(offsetof(struct slc_host_regs, config_w0) + sizeof(u32))
+#endif
+
+static inline u32 sif_dsr_regs_len(void)
+{
+#ifdef SIF_DEBUG_DSR_DUMP_REG
+	return sizeof(struct slc_host_regs);
+#else
+	return dsr_regs_full ? sizeof(struct slc_host_regs) : SIF_DSR_REGS_LEN;
+#endif
+}
+
+static int __esp_common_read(struct esp_pub *epub, u8 *buf, u32 len, int sync, bool noround)
 {
 	if (sync) {
 #ifdef ESP_USE_SDIO
@@ -26,6 +53,9 @@ int esp_common_read(struct esp_pub *epub, u8 *buf, u32 len, int sync, bool norou
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_read_sync(epub, buf, len, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_lldesc_io(epub, buf, len, SIF_FROM_DEVICE | SIF_SYNC);
 #endif
 	} else {
 #ifdef ESP_USE_SDIO
@@ -33,12 +63,29 @@ int esp_common_read(struct esp_pub *epub, u8 *buf, u32 len, int sync, bool norou
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_read_nosync(epub, buf, len, NOT_DUMMYMODE, noround);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_lldesc_io(epub, buf, len, SIF_FROM_DEVICE);
 #endif
 	}
 }
 
+int esp_common_read(struct esp_pub *epub, u8 *buf, u32 len, int sync, bool noround)
+{
+	u64 t0;
+	int ret;
 
-int esp_common_write(struct esp_pub *epub, u8 *buf, u32 len, int sync)
+	if (!sif_trace_on(epub))
+		return __esp_common_read(epub, buf, len, sync, noround);
+
+	t0 = sif_trace_clock();
+	ret = __esp_common_read(epub, buf, len, sync, noround);
+	sif_trace_record(epub, SIF_TR_READ, 0, buf, len, sync, ret, t0);
+	return ret;
+}
+
+
+static int __esp_common_write(struct esp_pub *epub, u8 *buf, u32 len, int sync)
 {
 	if (sync) {
 #ifdef ESP_USE_SDIO
@@ -46,6 +93,9 @@ int esp_common_write(struct esp_pub *epub, u8 *buf, u32 len, int sync)
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_write_sync(epub, buf, len, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_lldesc_io(epub, buf, len, SIF_TO_DEVICE | SIF_SYNC);
 #endif
 	} else {
 #ifdef ESP_USE_SDIO
@@ -53,12 +103,59 @@ int esp_common_write(struct esp_pub *epub, u8 *buf, u32 len, int sync)
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_write_nosync(epub, buf, len, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_lldesc_io(epub, buf, len, SIF_TO_DEVICE);
 #endif
 	}
 }
 
+int esp_common_write(struct esp_pub *epub, u8 *buf, u32 len, int sync)
+{
+	u64 t0;
+	int ret;
 
-int esp_common_read_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, int sync)
+	if (!sif_trace_on(epub))
+		return __esp_common_write(epub, buf, len, sync);
+
+	t0 = sif_trace_clock();
+	ret = __esp_common_write(epub, buf, len, sync);
+	sif_trace_record(epub, SIF_TR_WRITE, 0, buf, len, sync, ret, t0);
+	return ret;
+}
+
+/*
+ * queue an lldesc write and return, ctx->done() runs once it is on the
+ * bus. 0 means done() will be called exactly once, an error that it
+ * won't. Buses without a request engine write it here and now.
+ */
+int esp_common_write_async(struct esp_pub *epub, u8 *buf, u32 len, struct sif_io_ctx *ctx)
+{
+	u64 t0 = 0;
+	int ret;
+
+	if (sif_trace_on(epub))
+		t0 = sif_trace_clock();
+
+#if defined(ESP_USE_SDIO) || defined(ESP_USE_SPI)
+	ret = sif_lldesc_write_async(epub, buf, len, ctx);
+#else
+	ret = __esp_common_write(epub, buf, len, ESP_SIF_SYNC);
+#endif
+
+	/* recorded at submit, the data is already final */
+	if (sif_trace_on(epub))
+		sif_trace_record(epub, SIF_TR_WRITE, 0, buf, len, ESP_SIF_NOSYNC, ret, t0);
+
+#ifdef ESP_USE_VIRT
+	if (ret == 0)
+		ctx->done(epub, ctx, 0);
+#endif
+	return ret;
+}
+
+
+static int __esp_common_read_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, int sync)
 {
 	if (sync) {
 #ifdef ESP_USE_SDIO
@@ -66,6 +163,9 @@ int esp_common_read_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len,
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_epub_read_mix_sync(epub, addr, buf, len, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_io(epub, addr, buf, len, SIF_FROM_DEVICE | SIF_SYNC);
 #endif
 	} else {
 #ifdef ESP_USE_SDIO
@@ -73,13 +173,30 @@ int esp_common_read_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len,
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_epub_read_mix_nosync(epub, addr, buf, len, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_io(epub, addr, buf, len, SIF_FROM_DEVICE);
 #endif
 	}
 
 }
 
+int esp_common_read_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, int sync)
+{
+	u64 t0;
+	int ret;
 
-int esp_common_write_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, int sync)
+	if (!sif_trace_on(epub))
+		return __esp_common_read_with_addr(epub, addr, buf, len, sync);
+
+	t0 = sif_trace_clock();
+	ret = __esp_common_read_with_addr(epub, addr, buf, len, sync);
+	sif_trace_record(epub, SIF_TR_REG_READ, addr, buf, len, sync, ret, t0);
+	return ret;
+}
+
+
+static int __esp_common_write_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, int sync)
 {
 	if (sync) {
 #ifdef ESP_USE_SDIO
@@ -87,6 +204,9 @@ int esp_common_write_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len,
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_epub_write_mix_sync(epub, addr, buf, len, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_io(epub, addr, buf, len, SIF_TO_DEVICE | SIF_SYNC);
 #endif
 	} else {
 #ifdef ESP_USE_SDIO
@@ -94,11 +214,28 @@ int esp_common_write_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len,
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_epub_write_mix_nosync(epub, addr, buf, len, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_io(epub, addr, buf, len, SIF_TO_DEVICE);
 #endif
 	}
 }
 
-int esp_common_readbyte_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, int sync)
+int esp_common_write_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, int sync)
+{
+	u64 t0;
+	int ret;
+
+	if (!sif_trace_on(epub))
+		return __esp_common_write_with_addr(epub, addr, buf, len, sync);
+
+	t0 = sif_trace_clock();
+	ret = __esp_common_write_with_addr(epub, addr, buf, len, sync);
+	sif_trace_record(epub, SIF_TR_REG_WRITE, addr, buf, len, sync, ret, t0);
+	return ret;
+}
+
+static int __esp_common_readbyte_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, int sync)
 {
 	if(sync){
 #ifdef ESP_USE_SDIO
@@ -110,6 +247,9 @@ int esp_common_readbyte_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, int s
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_epub_read_mix_sync(epub, addr, buf, 1, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_io(epub, addr, buf, 1, SIF_FROM_DEVICE | SIF_SYNC);
 #endif
 	} else {
 #ifdef ESP_USE_SDIO
@@ -119,14 +259,31 @@ int esp_common_readbyte_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, int s
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_epub_read_mix_nosync(epub, addr, buf, 1, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_io(epub, addr, buf, 1, SIF_FROM_DEVICE);
 #endif
 	}
 
 }
 
+int esp_common_readbyte_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, int sync)
+{
+	u64 t0;
+	int ret;
 
+	if (!sif_trace_on(epub))
+		return __esp_common_readbyte_with_addr(epub, addr, buf, sync);
 
-int esp_common_writebyte_with_addr(struct esp_pub *epub, u32 addr, u8 buf, int sync)
+	t0 = sif_trace_clock();
+	ret = __esp_common_readbyte_with_addr(epub, addr, buf, sync);
+	sif_trace_record(epub, SIF_TR_REG_READ, addr, buf, 1, sync, ret, t0);
+	return ret;
+}
+
+
+
+static int __esp_common_writebyte_with_addr(struct esp_pub *epub, u32 addr, u8 buf, int sync)
 {
 	if(sync){
 #ifdef ESP_USE_SDIO
@@ -138,6 +295,9 @@ int esp_common_writebyte_with_addr(struct esp_pub *epub, u32 addr, u8 buf, int s
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_epub_write_mix_sync(epub, addr, &buf, 1, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_io(epub, addr, &buf, 1, SIF_TO_DEVICE | SIF_SYNC);
 #endif
 	} else {
 #ifdef ESP_USE_SDIO
@@ -147,106 +307,175 @@ int esp_common_writebyte_with_addr(struct esp_pub *epub, u32 addr, u8 buf, int s
 #endif
 #ifdef ESP_USE_SPI
 		return sif_spi_epub_write_mix_nosync(epub, addr, &buf, 1, NOT_DUMMYMODE);
+#endif
+#ifdef ESP_USE_VIRT
+		return sif_virt_io(epub, addr, &buf, 1, SIF_TO_DEVICE);
 #endif
 	}
 }
 
-int sif_read_reg_window(struct esp_pub *epub, unsigned int reg_addr, u8 *value)
+int esp_common_writebyte_with_addr(struct esp_pub *epub, u32 addr, u8 buf, int sync)
 {
-        u8 *p_tbuf = NULL;
-	int ret = 0;
-	int retry = 20;
+	u64 t0;
+	int ret;
 
-	reg_addr >>= 2;
-	if(reg_addr > 0x1f)
-		return -1;
-        
-	p_tbuf = kzalloc(4, GFP_KERNEL);
-	if(p_tbuf == NULL)
-                return -ENOMEM;
+	if (!sif_trace_on(epub))
+		return __esp_common_writebyte_with_addr(epub, addr, buf, sync);
+
+	t0 = sif_trace_clock();
+	ret = __esp_common_writebyte_with_addr(epub, addr, buf, sync);
+	sif_trace_record(epub, SIF_TR_REG_WRITE, addr, &buf, 1, sync, ret, t0);
+	return ret;
+}
+
+/*
+ * slc window registers go through SLC_HOST_WIN_CMD: a read is a cmd
+ * write plus a read of SLC_HOST_STATE_W0, a write is value and cmd in
+ * one 8 byte write at SLC_HOST_CONF_W5. All of it runs with the bus
+ * held by the caller, so one preallocated scratch per device does.
+ */
+
+int sif_reg_win_attach(struct esp_pub *epub)
+{
+	epub->reg_win.buf = kzalloc(8, GFP_KERNEL);
+	if (epub->reg_win.buf == NULL)
+		return -ENOMEM;
 
-	p_tbuf[0] = 0x80 | (reg_addr & 0x1f);
+	return 0;
+}
 
-	ret = esp_common_write_with_addr(epub, SLC_HOST_WIN_CMD, p_tbuf, 4, ESP_SIF_NOSYNC);
+void sif_reg_win_detach(struct esp_pub *epub)
+{
+	kfree(epub->reg_win.buf);
+	epub->reg_win.buf = NULL;
+}
+
+static int sif_reg_win_read(struct esp_pub *epub, u32 idx, u32 *value)
+{
+	struct esp_reg_win *rw = &epub->reg_win;
+	int ret;
+	int retry = 20;
+
+	memset(rw->buf, 0, 4);
+	rw->buf[0] = 0x80 | idx;
+
+	ret = esp_common_write_with_addr(epub, SLC_HOST_WIN_CMD, rw->buf, 4, ESP_SIF_NOSYNC);
 
 	if(ret == 0)
 	{
 		do{
 			if(retry < 20)
-				mdelay(10);
+				usleep_range(10000, 11000);
 			retry --;
-			ret = esp_common_read_with_addr(epub, SLC_HOST_STATE_W0, p_tbuf, 4, ESP_SIF_NOSYNC);
+			ret = esp_common_read_with_addr(epub, SLC_HOST_STATE_W0, rw->buf, 4, ESP_SIF_NOSYNC);
 		}while(retry >0 && ret != 0);
 	}
+	if (ret)
+		return ret;
 
-	if(ret ==0)
-		memcpy(value,p_tbuf,4);
+	memcpy(value, rw->buf, 4);
 
-	kfree(p_tbuf);
-	return ret;
+	return 0;
 }
 
-int sif_write_reg_window(struct esp_pub *epub, unsigned int reg_addr,u8 *value)
+static int sif_reg_win_write(struct esp_pub *epub, u32 idx, u32 value)
 {
-        u8 *p_tbuf = NULL;
-	int ret = 0;
+	struct esp_reg_win *rw = &epub->reg_win;
 
-	reg_addr >>= 2;
-	if(reg_addr > 0x1f)
-		return -1;
-	
-	p_tbuf = kzalloc(8, GFP_KERNEL);
-	if(p_tbuf == NULL)
-                return -ENOMEM;
-    	memcpy(p_tbuf,value,4);
-    	p_tbuf[4] = 0xc0 |(reg_addr & 0x1f);
+	memcpy(rw->buf, &value, 4);
+	rw->buf[4] = 0xc0 | idx;
+	rw->buf[5] = rw->buf[6] = rw->buf[7] = 0;
 
-    	ret = esp_common_write_with_addr(epub, SLC_HOST_CONF_W5, p_tbuf, 8, ESP_SIF_NOSYNC);
+	return esp_common_write_with_addr(epub, SLC_HOST_CONF_W5, rw->buf, 8, ESP_SIF_NOSYNC);
+}
 
-	kfree(p_tbuf);
-    	return ret;
+/*
+ * run a list of window register reads, writes and read-modify-writes
+ * back to back under the caller's bus hold. Stops at the first error.
+ */
+int sif_reg_window_batch(struct esp_pub *epub, struct sif_reg_op *ops, int n)
+{
+	u32 idx, old;
+	int i, ret = 0;
+
+	if (epub->reg_win.buf == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < n && ret == 0; i++) {
+		idx = ops[i].reg >> 2;
+		if (idx >= ESP_REG_WIN_NR)
+			return -EINVAL;
+
+		switch (ops[i].op) {
+		case SIF_REG_RD:
+			ret = sif_reg_win_read(epub, idx, &ops[i].val);
+			break;
+		case SIF_REG_WR:
+			ret = sif_reg_win_write(epub, idx, ops[i].val);
+			break;
+		case SIF_REG_RMW:
+			ret = sif_reg_win_read(epub, idx, &old);
+			if (ret)
+				break;
+			ops[i].val = (old & ~ops[i].mask) | ops[i].val;
+			ret = sif_reg_win_write(epub, idx, ops[i].val);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	return ret;
 }
 
-int sif_ack_target_read_err(struct esp_pub *epub)
+int sif_update_reg_window(struct esp_pub *epub, unsigned int reg_addr, u32 clr, u32 set)
+{
+	struct sif_reg_op op = { .op = SIF_REG_RMW, .reg = reg_addr, .val = set, .mask = clr };
+
+	return sif_reg_window_batch(epub, &op, 1);
+}
+
+int sif_read_reg_window(struct esp_pub *epub, unsigned int reg_addr, u8 *value)
 {
-	u32 value[1];
+	struct sif_reg_op op = { .op = SIF_REG_RD, .reg = reg_addr };
 	int ret;
 
-	ret = sif_read_reg_window(epub, SLC_RX_LINK, (u8 *)value);
-	if(ret)
-		return ret;
-	value[0] |= SLC_RXLINK_START;
-	ret = sif_write_reg_window(epub, SLC_RX_LINK, (u8 *)value);
+	ret = sif_reg_window_batch(epub, &op, 1);
+	if (ret == 0)
+		memcpy(value, &op.val, 4);
+
 	return ret;
 }
 
+int sif_write_reg_window(struct esp_pub *epub, unsigned int reg_addr,u8 *value)
+{
+	struct sif_reg_op op = { .op = SIF_REG_WR, .reg = reg_addr };
+
+	memcpy(&op.val, value, 4);
+	return sif_reg_window_batch(epub, &op, 1);
+}
+
+int sif_ack_target_read_err(struct esp_pub *epub)
+{
+	return sif_update_reg_window(epub, SLC_RX_LINK, 0, SLC_RXLINK_START);
+}
+
 int sif_hda_io_enable(struct esp_pub *epub)
 {
-        u32 *p_tbuf = NULL;
+	u32 conf = SLC_TXEOF_ENA | (0x4 << SLC_FIFO_MAP_ENA_S) | SLC_TX_DUMMY_MODE | SLC_HDA_MAP_128K | (0xFE << SLC_TX_PUSH_IDLE_NUM_S);
 	int ret;
-	
-	p_tbuf = kzalloc(sizeof(u32), GFP_KERNEL);
-	if(p_tbuf == NULL)
-                return -ENOMEM;
-
-	*p_tbuf = SLC_TXEOF_ENA | (0x4 << SLC_FIFO_MAP_ENA_S) | SLC_TX_DUMMY_MODE | SLC_HDA_MAP_128K | (0xFE << SLC_TX_PUSH_IDLE_NUM_S);
-	ret = sif_write_reg_window(epub, SLC_BRIDGE_CONF, (u8 *)p_tbuf);
 
+	ret = sif_write_reg_window(epub, SLC_BRIDGE_CONF, (u8 *)&conf);
 	if(ret)
-		goto _err;
-	
-	*p_tbuf = 0x30;
-	ret = esp_common_writebyte_with_addr((epub), SLC_HOST_CONF_W4 + 1, (u8)*p_tbuf,  ESP_SIF_NOSYNC);
+		return ret;
 
+	ret = esp_common_writebyte_with_addr((epub), SLC_HOST_CONF_W4 + 1, 0x30,  ESP_SIF_NOSYNC);
 	if(ret)
-		goto _err;
-	//set w3 0
-	*p_tbuf = 0x1;
-	ret = esp_common_writebyte_with_addr((epub), SLC_HOST_CONF_W3, (u8)*p_tbuf,  ESP_SIF_NOSYNC);
+		return ret;
 
-_err:
-	kfree(p_tbuf);
-	return ret;
+	//set w3 0
+	return esp_common_writebyte_with_addr((epub), SLC_HOST_CONF_W3, 0x1,  ESP_SIF_NOSYNC);
 }
 
 typedef enum _SDIO_INTR_MODE {
@@ -283,10 +512,6 @@ u16 gpio_sel_sets[17] = {
 	//GEN_GPIO_SEL(2, 0, SDIO_INTR_OOB_TOGGLE, 0x38)
 	GEN_GPIO_SEL(2, 0, SDIO_INTR_OOB_LOW_LEVEL, 0x38)
 };
-#if defined(USE_EXT_GPIO)
-u16 gpio_forbidden = 0;
-#endif
-
 int sif_interrupt_target(struct esp_pub *epub, u8 index)
 {
 	u8 low_byte = BIT(index);
@@ -300,7 +525,7 @@ int sif_config_gpio_mode(struct esp_pub *epub, u8 gpio_num, u8 gpio_mode)
 	u32 *p_tbuf = NULL;
 	int err;
     
-	if((BIT(gpio_num) & gpio_forbidden) || gpio_num > 15)
+	if((BIT(gpio_num) & EPUB_TO_CTRL(epub)->gpio_forbidden) || gpio_num > 15)
 		return -EINVAL;    
 
 	p_tbuf = kzalloc(sizeof(u32), GFP_KERNEL);
@@ -320,7 +545,7 @@ int sif_set_gpio_output(struct esp_pub *epub, u16 mask, u16 value)
 	u32 *p_tbuf = NULL;
 	int err;
         
-	mask &= ~gpio_forbidden;
+	mask &= ~EPUB_TO_CTRL(epub)->gpio_forbidden;
 	p_tbuf = kzalloc(sizeof(u32), GFP_KERNEL);
 	if(p_tbuf == NULL)
 		return -ENOMEM;
@@ -420,17 +645,17 @@ void check_target_id(struct esp_pub *epub)
 			low_byte = gpio_sel;
 			high_byte = gpio_sel >> 8;
 #ifdef USE_EXT_GPIO
-			gpio_forbidden |= BIT(gpio_sel & 0xf);
+			EPUB_TO_CTRL(epub)->gpio_forbidden |= BIT(gpio_sel & 0xf);
 #endif /* USE_EXT_GPIO */
 #endif /* USE_OOB_INTR */
 
-			if(sif_get_bt_config() == 1 && sif_get_rst_config() != 1){
-				u8 gpio_num = sif_get_wakeup_gpio_config();
+			if(epub->conf.bt == 1 && epub->conf.rst != 1){
+				u8 gpio_num = epub->conf.wakeup_gpio;
 				gpio_sel = gpio_sel_sets[gpio_num];
 				byte2 = gpio_sel;
 				byte3 = gpio_sel >> 8;
 #ifdef USE_EXT_GPIO
-				gpio_forbidden |= BIT(gpio_num);
+				EPUB_TO_CTRL(epub)->gpio_forbidden |= BIT(gpio_num);
 #endif
 			}
 			sif_lock_bus(epub);
@@ -471,14 +696,18 @@ _err:
 void sif_dsr(struct sdio_func *func)
 {
         struct esp_sdio_ctrl *sctrl = sdio_get_drvdata(func);
+#elif defined(ESP_USE_VIRT)
+void sif_dsr(struct platform_device *pdev)
+{
+        struct esp_virt_ctrl *sctrl = platform_get_drvdata(pdev);
 #else
 void sif_dsr(struct spi_device *spi)
 {
         struct esp_spi_ctrl *sctrl = spi_get_drvdata(spi);
-        u32 buf[1];
 #endif
         static int dsr_cnt = 0, real_intr_cnt = 0, bogus_intr_cnt = 0;
         struct slc_host_regs *regs = &(sctrl->slc_regs);
+        u32 regs_len = sif_dsr_regs_len();
 	esp_dbg(ESP_DBG_TRACE, "%s enter %d\n", __func__, dsr_cnt++);
 
 #ifdef ESP_USE_SPI
@@ -489,15 +718,6 @@ void sif_dsr(struct spi_device *spi)
            return;
        }
 
-       if(sctrl->epub->enable_int  == 1)
-       {
-           sif_read_reg_window(sctrl->epub, SLC_INT_ENA, (u8 *)buf);
-           buf[0] &= ~(SLC_RX_EOF_INT_ENA);
-           buf[0] |= SLC_FRHOST_BIT2_INT_ENA;
-           sif_write_reg_window(sctrl->epub, SLC_INT_ENA, (u8 *)buf);
-
-           sctrl->epub->enable_int = 0;
-        }
 #endif
         atomic_set(&sctrl->irq_handling, 1);
 
@@ -505,16 +725,30 @@ void sif_dsr(struct spi_device *spi)
         sdio_release_host(sctrl->func);
 #endif
 
-
+        sif_bus_get(sctrl->epub, SIF_BUS_RX);
         sif_lock_bus(sctrl->epub);
 
+#ifdef ESP_USE_SPI
+        /* the window RMW needs the bus held like any other transfer */
+        if (sctrl->epub->enable_int == 1) {
+                sif_update_reg_window(sctrl->epub, SLC_INT_ENA, SLC_RX_EOF_INT_ENA, SLC_FRHOST_BIT2_INT_ENA);
+                sctrl->epub->enable_int = 0;
+        }
+#endif
+
 
         do {
                 int ret =0;
 
 		memset(regs, 0x0, sizeof(struct slc_host_regs));
 
-		ret = esp_common_read_with_addr(sctrl->epub, REG_SLC_HOST_BASE + 8, (u8 *)regs, sizeof(struct slc_host_regs), ESP_SIF_NOSYNC);
+		if (sif_trace_on(sctrl->epub)) {
+			u64 t0 = sif_trace_clock();
+
+			ret = __esp_common_read_with_addr(sctrl->epub, REG_SLC_HOST_BASE + 8, (u8 *)regs, regs_len, ESP_SIF_NOSYNC);
+			sif_trace_record(sctrl->epub, SIF_TR_DSR_REGS, REG_SLC_HOST_BASE + 8, regs, regs_len, ESP_SIF_NOSYNC, ret, t0);
+		} else
+			ret = esp_common_read_with_addr(sctrl->epub, REG_SLC_HOST_BASE + 8, (u8 *)regs, regs_len, ESP_SIF_NOSYNC);
 
                 if ( (regs->intr_raw & SLC_HOST_RX_ST) && (ret == 0) ) {
                         esp_dbg(ESP_DBG_TRACE, "%s eal intr cnt: %d", __func__, ++real_intr_cnt);
@@ -536,6 +770,8 @@ void sif_dsr(struct spi_device *spi)
 
         } while (0);
 
+        sif_bus_put(sctrl->epub);
+
 #ifdef ESP_USE_SDIO
         sdio_claim_host(func);
 #endif
@@ -665,6 +901,20 @@ int sif_get_fccmode(void)
 }
 #endif
 
+/* the records above are module-wide defaults, filled from init_data.conf
+ * and debugfs before any device is probed; each device keeps its own copy */
+void sif_load_config(struct esp_pub *epub)
+{
+	epub->conf.bt = bt_config;
+	epub->conf.rst = rst_config;
+	epub->conf.ate = ate_test;
+	epub->conf.retry = retry_reset;
+	epub->conf.wakeup_gpio = wakeup_gpio;
+#ifdef ESP_CLASS
+	epub->conf.fccmode = fcc_mode;
+#endif
+}
+
 #if (defined(CONFIG_DEBUG_FS) && defined(DEBUGFS_BOOTMODE)) || defined(ESP_CLASS)
 static int esp_run = 0;
 void sif_record_esp_run(int value)
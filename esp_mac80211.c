@@ -27,6 +27,8 @@
 #include "esp_wl.h"
 #include "esp_utils.h"
 #include "esp_mac80211.h"
+#include "esp_trace.h"
+#include "esp_sched.h"
 
 #define ESP_IEEE80211_DBG esp_dbg
 
@@ -34,13 +36,10 @@
 
 extern void reset_signal_count(void);
 
-static void beacon_tim_init(void);
-static u8 beacon_tim_save(u8 this_tim);
-static bool beacon_tim_alter(struct sk_buff *beacon);
+static void beacon_tim_init(struct esp_vif *evif);
+static u8 beacon_tim_save(struct esp_vif *evif, u8 this_tim);
+static bool beacon_tim_alter(struct esp_vif *evif, struct sk_buff *beacon);
 
-#ifdef P2P_CONCURRENT
-static u8 esp_mac_addr[ETH_ALEN * 2];
-#endif
 static u8 getaddr_index(u8 * addr, struct esp_pub *epub);
 static int dup_addr_by_index(u8 *addr, struct esp_pub *epub, u8 index);
 
@@ -435,34 +434,30 @@ static void esp_op_remove_interface(struct ieee80211_hw *hw,
 
 }
 
-#define BEACON_TIM_SAVE_MAX 12
-u8 beacon_tim_saved[BEACON_TIM_SAVE_MAX];
-int beacon_tim_count;
-spinlock_t tim_lock;
-static void beacon_tim_init(void)
+static void beacon_tim_init(struct esp_vif *evif)
 {
-	memset(beacon_tim_saved, BEACON_TIM_SAVE_MAX, 0);
-	beacon_tim_count = 0;
-	spin_lock_init(&tim_lock);
+	memset(evif->beacon_tim_saved, 0, sizeof(evif->beacon_tim_saved));
+	evif->beacon_tim_count = 0;
+	spin_lock_init(&evif->tim_lock);
 }
 
-static u8 beacon_tim_save(u8 this_tim)
+static u8 beacon_tim_save(struct esp_vif *evif, u8 this_tim)
 {
 	u8 all_tim = 0;
 	int i;
 
-	spin_lock(&tim_lock);
-	beacon_tim_saved[beacon_tim_count] = this_tim;
-	if(++beacon_tim_count >= BEACON_TIM_SAVE_MAX)
-		beacon_tim_count = 0;
+	spin_lock(&evif->tim_lock);
+	evif->beacon_tim_saved[evif->beacon_tim_count] = this_tim;
+	if(++evif->beacon_tim_count >= BEACON_TIM_SAVE_MAX)
+		evif->beacon_tim_count = 0;
 	for(i = 0; i < BEACON_TIM_SAVE_MAX; i++)
-		all_tim |= beacon_tim_saved[i];
-	spin_unlock(&tim_lock);
+		all_tim |= evif->beacon_tim_saved[i];
+	spin_unlock(&evif->tim_lock);
 
 	return all_tim;
 }
 
-static bool beacon_tim_alter(struct sk_buff *beacon)
+static bool beacon_tim_alter(struct esp_vif *evif, struct sk_buff *beacon)
 {
         u8 *p, *tim_end;
 	u8 tim_count;
@@ -489,7 +484,7 @@ static bool beacon_tim_alter(struct sk_buff *beacon)
 			    *p |= 0x1;
 			if((*p & 0xfe) == 0 && tim_end >= p+1){// we only support 8 sta in this case
                         	p++;
-				*p = beacon_tim_save(*p);
+				*p = beacon_tim_save(evif, *p);
 			}
                         return tim_count == 0;
                 } else {
@@ -502,8 +497,6 @@ static bool beacon_tim_alter(struct sk_buff *beacon)
         return false;
 }
 
-unsigned long init_jiffies;
-unsigned long cycle_beacon_count;
 static void drv_handle_beacon(unsigned long data)
 {
 	struct ieee80211_vif *vif = (struct ieee80211_vif *) data;
@@ -516,11 +509,11 @@ static void drv_handle_beacon(unsigned long data)
 	if(evif->epub == NULL)
 		return;
 
-	mdelay(2400 * (cycle_beacon_count % 25) % 10000 /1000);
+	mdelay(2400 * (evif->cycle_beacon_count % 25) % 10000 /1000);
 	
 	beacon = ieee80211_beacon_get(evif->epub->hw, vif);
 
-	tim_reach = beacon_tim_alter(beacon);
+	tim_reach = beacon_tim_alter(evif, beacon);
 
 	if (beacon && !(dbgcnt++ % 600)) {
 		ESP_IEEE80211_DBG(ESP_DBG_TRACE, "beacon length:%d,fc:0x%x\n", beacon->len,
@@ -531,11 +524,11 @@ static void drv_handle_beacon(unsigned long data)
 	if(beacon)
 		sip_tx_data_pkt_enqueue(evif->epub, beacon);
 
-	if(cycle_beacon_count++ == 100){
-		init_jiffies = jiffies;
-		cycle_beacon_count -= 100;
+	if(evif->cycle_beacon_count++ == 100){
+		evif->init_jiffies = jiffies;
+		evif->cycle_beacon_count -= 100;
 	}
-	mod_timer(&evif->beacon_timer, init_jiffies + msecs_to_jiffies(cycle_beacon_count * vif->bss_conf.beacon_int*1024/1000));
+	mod_timer(&evif->beacon_timer, evif->init_jiffies + msecs_to_jiffies(evif->cycle_beacon_count * vif->bss_conf.beacon_int*1024/1000));
 	//FIXME:the packets must be sent at home channel
 	//send buffer mcast frames
 	if(tim_reach){
@@ -553,11 +546,11 @@ static void init_beacon_timer(struct ieee80211_vif *vif)
 
 	ESP_IEEE80211_DBG(ESP_DBG_OP, "%s enter: beacon interval %x\n", __func__, evif->beacon_interval);
 
-	beacon_tim_init();
+	beacon_tim_init(evif);
 	init_timer(&evif->beacon_timer);  //TBD, not init here...
-	cycle_beacon_count = 1;
-	init_jiffies = jiffies;
-	evif->beacon_timer.expires = init_jiffies + msecs_to_jiffies(cycle_beacon_count * vif->bss_conf.beacon_int*1024/1000);
+	evif->cycle_beacon_count = 1;
+	evif->init_jiffies = jiffies;
+	evif->beacon_timer.expires = evif->init_jiffies + msecs_to_jiffies(evif->cycle_beacon_count * vif->bss_conf.beacon_int*1024/1000);
 	evif->beacon_timer.data = (unsigned long) vif;
 	evif->beacon_timer.function = drv_handle_beacon;
 	add_timer(&evif->beacon_timer);
@@ -1304,7 +1297,7 @@ void esp_op_flush(struct ieee80211_hw *hw, struct ieee80211_vif *vif,
 			if(!time_before(jiffies, time)){
 				break;
 			}
-            if(sif_get_ate_config() == 0){
+            if(epub->conf.ate == 0){
                 ieee80211_queue_work(epub->hw, &epub->tx_work);
             } else {
                 queue_work(epub->esp_wkq, &epub->tx_work);
@@ -1556,6 +1549,15 @@ struct esp_pub * esp_pub_alloc_mac80211(struct device *dev)
         epub->scan_permit_valid = false;
         INIT_DELAYED_WORK(&epub->scan_timeout_work, hw_scan_timeout_report);
 
+        if (esp_trace_attach(epub))    /* if failed, continue */
+                esp_dbg(ESP_DBG_ERROR, "sif trace not available\n");
+        if (esp_sched_attach(epub))
+                esp_dbg(ESP_DBG_ERROR, "bus scheduler not available\n");
+        esp_pm_attach(epub);
+        esp_recovery_attach(epub);
+        if (sif_reg_win_attach(epub))
+                esp_dbg(ESP_DBG_ERROR, "no mem for the register window scratch\n");
+
         return epub;
 }
 
@@ -1564,6 +1566,11 @@ int esp_pub_dealloc_mac80211(struct esp_pub *epub)
 {
         set_bit(ESP_WL_FLAG_RFKILL, &epub->wl.flags);
 
+        esp_trace_detach(epub);
+        esp_sched_detach(epub);
+        esp_pm_detach(epub);
+        esp_recovery_detach(epub);
+        sif_reg_win_detach(epub);
         destroy_workqueue(epub->esp_wkq);
         mutex_destroy(&epub->tx_mtx);
 
@@ -1773,7 +1780,7 @@ esp_register_mac80211(struct esp_pub *epub)
         esp_pub_init_mac80211(epub);
 
 #ifdef P2P_CONCURRENT
-	epub->hw->wiphy->addresses = (struct mac_address *)esp_mac_addr;
+	epub->hw->wiphy->addresses = (struct mac_address *)epub->wiphy_addr;
 	memcpy(&epub->hw->wiphy->addresses[0], epub->mac_addr, ETH_ALEN);
 	memcpy(&epub->hw->wiphy->addresses[1], epub->mac_addr, ETH_ALEN);
 	wlan_addr = (u8 *)&epub->hw->wiphy->addresses[0];
@@ -1818,6 +1825,54 @@ esp_register_mac80211(struct esp_pub *epub)
         return ret;
 }
 
+static void esp_restart_vif_iter(void *data, u8 *mac, struct ieee80211_vif *vif)
+{
+	struct esp_pub *epub = (struct esp_pub *)data;
+	struct esp_vif *evif = (struct esp_vif *)vif->drv_priv;
+
+	/* bss_info_changed() starts these again during the reconfig */
+	if (evif->ap_up) {
+		evif->beacon_interval = 0;
+		del_timer_sync(&evif->beacon_timer);
+		evif->ap_up = false;
+	}
+	if (epub->master_ifidx == evif->index)
+		esp_sta_gc_conn_monitor_close(epub, evif);
+}
+
+/*
+ * the target was rebooted under mac80211, forget what the old firmware
+ * was told so the replayed add_interface/sta_add/set_key start clean
+ */
+void esp_restart_mac80211(struct esp_pub *epub)
+{
+	ieee80211_iterate_active_interfaces_atomic(epub->hw, IEEE80211_IFACE_ITER_NORMAL,
+						   esp_restart_vif_iter, epub);
+
+	spin_lock_bh(&epub->tx_ampdu_lock);
+	epub->enodes_map = 0;
+	memset(epub->enodes_maps, 0, sizeof(epub->enodes_maps));
+	memset(epub->enodes, 0, sizeof(epub->enodes));
+	spin_unlock_bh(&epub->tx_ampdu_lock);
+
+	spin_lock_bh(&epub->rx_ampdu_lock);
+	epub->rxampdu_map = 0;
+	memset(epub->rxampdu_node, 0, sizeof(epub->rxampdu_node));
+	spin_unlock_bh(&epub->rx_ampdu_lock);
+
+	memset(epub->hi_map, 0, sizeof(epub->hi_map));
+	memset(epub->low_map, 0, sizeof(epub->low_map));
+	atomic_set(&epub->wl.ptk_cnt, 0);
+	atomic_set(&epub->wl.gtk_cnt, 0);
+	atomic_set(&epub->wl.tkip_key_set, 0);
+	epub->vif_slot = 0;
+	epub->roc_flags = 0;
+
+	atomic_set(&epub->txq_stopped, false);
+	ieee80211_wake_queues(epub->hw);
+	ieee80211_restart_hw(epub->hw);
+}
+
 static u8 getaddr_index(u8 * addr, struct esp_pub *epub)
 {
 #ifdef P2P_CONCURRENT
@@ -17,6 +17,11 @@
 #include <net/mac80211.h>
 #include <linux/time.h>
 #include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#ifdef HAS_FW
+#include <linux/zlib.h>
+#include <linux/vmalloc.h>
+#endif /* HAS_FW */
 
 #include "esp_pub.h"
 #include "esp_sip.h"
@@ -25,8 +30,6 @@
 #include "esp_file.h"
 #include "esp_wl.h"
 
-struct completion *gl_bootup_cplx = NULL;
-
 #ifndef FPGA_DEBUG
 static int esp_download_fw(struct esp_pub * epub);
 #endif /* !FGPA_DEBUG */
@@ -42,6 +45,20 @@ static char *modparam_eagle_path = "";
 module_param_named(eagle_path, modparam_eagle_path, charp, 0444);
 MODULE_PARM_DESC(eagle_path, "eagle path");
 
+static int modparam_fw_batch = 8;
+static int modparam_fw_delay_us = 0;
+module_param_named(fw_batch, modparam_fw_batch, int, 0644);
+MODULE_PARM_DESC(fw_batch, "WRITE_MEMORY cmds per bus transfer during fw download (1-16).");
+module_param_named(fw_delay_us, modparam_fw_delay_us, int, 0644);
+MODULE_PARM_DESC(fw_delay_us, "Delay after each fw download transfer, 0 for none.");
+
+static int modparam_recovery = 1;
+static int modparam_recovery_max_ms = 5000;
+module_param_named(recovery, modparam_recovery, int, 0644);
+MODULE_PARM_DESC(recovery, "Reboot the target in place when it resets or stops answering.");
+module_param_named(recovery_max_ms, modparam_recovery_max_ms, int, 0644);
+MODULE_PARM_DESC(recovery_max_ms, "Outage budget for one recovery, every boot wait and retry is bounded by it.");
+
 bool mod_support_no_txampdu()
 {
         return modparam_no_txampdu;
@@ -57,6 +74,16 @@ void mod_support_no_txampdu_set(bool value)
 	modparam_no_txampdu = value;
 }
 
+int mod_fw_batch(void)
+{
+	return clamp(modparam_fw_batch, 1, SIP_FW_BATCH_MAX);
+}
+
+int mod_fw_delay_us(void)
+{
+	return max(modparam_fw_delay_us, 0);
+}
+
 char *mod_eagle_path_get(void)
 {
 	if (modparam_eagle_path[0] == '\0')
@@ -68,11 +95,13 @@ char *mod_eagle_path_get(void)
 int esp_pub_init_all(struct esp_pub *epub)
 {
         int ret = 0;
+        ktime_t t0, t1;
 
 	/* completion for bootup event poll*/
 	DECLARE_COMPLETION_ONSTACK(complete);
 	atomic_set(&epub->ps.state, ESP_PM_OFF);
-	if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+	/* a recovery runs the first stage again on the sip it has */
+	if (epub->sip == NULL) {
 		epub->sip = sip_attach(epub);
 		if (epub->sip == NULL) {
 			printk(KERN_ERR "%s sip alloc failed\n", __func__);
@@ -81,26 +110,33 @@ int esp_pub_init_all(struct esp_pub *epub)
 	} else {
 		atomic_set(&epub->sip->state, SIP_PREPARE_BOOT);
 		atomic_set(&epub->sip->tx_credits, 0);
+		/* freed at the last bootup, needed again for a recovery */
+		if (epub->sip->rawbuf == NULL) {
+			epub->sip->rawbuf = kzalloc(SIP_FW_RAWBUF_SIZE, GFP_KERNEL);
+			if (epub->sip->rawbuf == NULL)
+				return -ENOMEM;
+		}
 	}
 
 	epub->sip->to_host_seq = 0;
 
 #ifdef TEST_MODE
-    if(sif_get_ate_config() != 0 &&  sif_get_ate_config() != 1 && sif_get_ate_config() !=6 )
+    if(epub->conf.ate != 0 &&  epub->conf.ate != 1 && epub->conf.ate !=6 )
     {
         esp_test_init(epub);
         return -1;
     }
 #endif
 
+        t0 = ktime_get();
 #ifndef FPGA_DEBUG
         ret = esp_download_fw(epub);
 #ifdef ESP_USE_SPI
-	if(sif_get_ate_config() != 1)
+	if(epub->conf.ate != 1)
         	epub->enable_int = 1;
 #endif
 #ifdef TEST_MODE
-        if(sif_get_ate_config() == 6)
+        if(epub->conf.ate == 6)
         {
             sif_enable_irq(epub);
             mdelay(500);
@@ -119,11 +155,12 @@ int esp_pub_init_all(struct esp_pub *epub)
         sip_send_bootup(epub->sip);
 #endif /* FPGA_DEBUG */
 
-	gl_bootup_cplx = &complete;
+	t1 = ktime_get();
+	epub->bootup_cplx = &complete;
 	epub->wait_reset = 0;
 	sif_enable_irq(epub);
 
-	if(epub->sdio_state == ESP_SDIO_STATE_SECOND_INIT || sif_get_ate_config() == 1){
+	if(epub->sdio_state == ESP_SDIO_STATE_SECOND_INIT || epub->conf.ate == 1){
 		ret = sip_poll_bootup_event(epub->sip);
 	} else {
 	    ret = sip_poll_resetting_event(epub->sip);
@@ -134,9 +171,14 @@ int esp_pub_init_all(struct esp_pub *epub)
 	    }
 	}
 
-	gl_bootup_cplx = NULL;
+	epub->bootup_cplx = NULL;
+
+	esp_dbg(ESP_SHOW, "%s stage %d: fw download %lld us, %s wait %lld us\n", __func__,
+		epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT ? 1 : 2, ktime_us_delta(t1, t0),
+		epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT ? "resetting" : "bootup",
+		ktime_us_delta(ktime_get(), t1));
 
-	if (sif_get_ate_config() == 1)
+	if (epub->conf.ate == 1)
 		ret = -EOPNOTSUPP;
 
         return ret;
@@ -148,6 +190,148 @@ esp_dsr(struct esp_pub *epub)
         sip_rx(epub);
 }
 
+#define ESP_RECOVERY_RETRY 2
+
+/*
+ * in-place recovery: the chip is reset into its rom and booted through
+ * both stages again, fw1 then fw2, with the bus re-initialised in place
+ * of the rescan between them. The firmware that went down may be hung,
+ * so nothing is asked of it. mac80211 keeps its vif/sta/key state and
+ * replays it through the driver ops from ieee80211_restart_hw(), so no
+ * interface goes down.
+ */
+static int esp_recovery_boot(struct esp_pub *epub)
+{
+	int err;
+
+	sif_reset_target(epub);
+
+	err = sif_reinit_card(epub);
+	if (err) {
+		esp_dbg(ESP_DBG_ERROR, "%s card re-init failed %d\n", __func__, err);
+		return err;
+	}
+
+	epub->sdio_state = ESP_SDIO_STATE_FIRST_INIT;
+	err = esp_pub_init_all(epub);
+	if (err == 0 && esp_boot_timeout(epub, 1) == 0)
+		err = -ETIMEDOUT;
+	if (err == 0)
+		err = sif_reinit_card(epub);
+	if (err == 0) {
+		epub->sdio_state = ESP_SDIO_STATE_SECOND_INIT;
+		err = esp_pub_init_all(epub);
+	}
+
+	/* to the remove path this is still a running second stage device */
+	epub->sdio_state = ESP_SDIO_STATE_SECOND_INIT;
+	if (err)
+		sif_disable_irq(epub);
+
+	return err;
+}
+
+static void esp_recovery_work(struct work_struct *work)
+{
+	struct esp_pub *epub = container_of(work, struct esp_pub, recovery_work);
+	struct esp_recovery_stat *st = &epub->recovery_stat;
+	ktime_t t0 = ktime_get();
+	int i, err = -ETIMEDOUT;
+	u32 ms;
+
+	esp_dbg(ESP_SHOW, "%s %s, recovering target\n", __func__, epub->recovery_reason);
+
+	sip_quiesce(epub->sip);
+
+	epub->recovery_deadline = jiffies + msecs_to_jiffies(modparam_recovery_max_ms);
+	for (i = 0; i < ESP_RECOVERY_RETRY; i++) {
+		if (i && time_after_eq(jiffies, epub->recovery_deadline))
+			break;
+		err = esp_recovery_boot(epub);
+		if (err == 0)
+			break;
+		esp_dbg(ESP_DBG_ERROR, "%s attempt %d failed %d\n", __func__, i + 1, err);
+	}
+
+	ms = ktime_ms_delta(ktime_get(), t0);
+
+	if (err) {
+		/* leave recovering set, nothing more can be done in place */
+		st->failed++;
+		esp_dbg(ESP_DBG_ERROR, "%s gave up after %u ms (%d), reload the driver\n",
+			__func__, ms, err);
+		return;
+	}
+
+	st->recovered++;
+	st->last_ms = ms;
+	st->max_ms = max(st->max_ms, ms);
+	if (ms > modparam_recovery_max_ms)
+		st->over_budget++;
+	esp_dbg(ESP_SHOW, "%s target back in %u ms\n", __func__, ms);
+
+	esp_restart_mac80211(epub);
+	atomic_set(&epub->recovering, 0);
+}
+
+/* the boot waits of a recovery are cut to what is left of its budget */
+long esp_boot_timeout(struct esp_pub *epub, long timeout)
+{
+	long left;
+
+	if (!atomic_read(&epub->recovering))
+		return timeout;
+
+	left = (long)(epub->recovery_deadline - jiffies);
+	return clamp(left, 0L, timeout);
+}
+
+/*
+ * any context, the recovery itself runs from the system workqueue.
+ * true if a recovery is pending, this one or one already under way
+ */
+bool esp_schedule_recovery(struct esp_pub *epub, const char *reason)
+{
+	if (!modparam_recovery || epub->conf.ate != 0 || epub->sip == NULL
+	    || atomic_read(&epub->sip->state) != SIP_RUN)
+		return false;
+
+	if (atomic_cmpxchg(&epub->recovering, 0, 1) != 0)
+		return true;
+
+	epub->recovery_reason = reason;
+	epub->recovery_stat.triggered++;
+	schedule_work(&epub->recovery_work);
+	return true;
+}
+
+void esp_recovery_attach(struct esp_pub *epub)
+{
+	char name[32];
+
+	INIT_WORK(&epub->recovery_work, esp_recovery_work);
+	atomic_set(&epub->recovering, 0);
+
+	snprintf(name, sizeof(name), "recovery_%s", wiphy_name(epub->hw->wiphy));
+	epub->recovery_dir = esp_debugfs_add_sub_dir(name);
+	if (epub->recovery_dir == NULL)
+		return;
+
+	esp_dump_var("triggered", epub->recovery_dir, &epub->recovery_stat.triggered, ESP_U32);
+	esp_dump_var("recovered", epub->recovery_dir, &epub->recovery_stat.recovered, ESP_U32);
+	esp_dump_var("failed", epub->recovery_dir, &epub->recovery_stat.failed, ESP_U32);
+	esp_dump_var("over_budget", epub->recovery_dir, &epub->recovery_stat.over_budget, ESP_U32);
+	esp_dump_var("last_ms", epub->recovery_dir, &epub->recovery_stat.last_ms, ESP_U32);
+	esp_dump_var("max_ms", epub->recovery_dir, &epub->recovery_stat.max_ms, ESP_U32);
+}
+
+void esp_recovery_detach(struct esp_pub *epub)
+{
+	cancel_work_sync(&epub->recovery_work);
+	debugfs_remove_recursive(epub->recovery_dir);
+	epub->recovery_dir = NULL;
+}
+
 
 struct esp_fw_hdr {
         u8 magic;
@@ -165,94 +349,275 @@ struct esp_fw_blk_hdr {
 #define ESP_FW_NAME2 "eagle_fw2.bin"
 #define ESP_FW_NAME3 "eagle_fw3.bin"
 
+#define ESP_FW_CSUM_SEED 0xEF
+#define ESP_FW_CSUM_ALIGN 16
+
 #ifndef FPGA_DEBUG
-static int esp_download_fw(struct esp_pub * epub)
+/* xor of all block data, a word at a time and folded down to a byte */
+static u8 esp_fw_csum(const u8 *p, u32 len, u8 csum)
 {
-#ifndef HAS_FW
-	char * esp_fw_name = NULL;
-        const struct firmware *fw_entry;
-#endif /* !HAS_FW */
-        u8 * fw_buf = NULL;
-        u32 offset = 0;
-        int ret = 0;
-        u8 blocks;
-        struct esp_fw_hdr *fhdr;
-        struct esp_fw_blk_hdr *bhdr=NULL;
-        struct sip_cmd_bootup bootcmd;
+        u32 w = 0;
 
-#ifndef HAS_FW
+        while (len && ((unsigned long)p & 3)) {
+                csum ^= *p++;
+                len--;
+        }
+        for (; len >= 4; len -= 4, p += 4)
+                w ^= *(const u32 *)p;
+        while (len--)
+                csum ^= *p++;
 
-        if(sif_get_ate_config() == 1) {
-		esp_fw_name = ESP_FW_NAME3;
-	} else {
-		esp_fw_name = epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT ? ESP_FW_NAME1 : ESP_FW_NAME2;
-	}
-        ret = esp_request_firmware(&fw_entry, esp_fw_name, epub->dev);
+        w ^= w >> 16;
+        w ^= w >> 8;
 
-        if (ret)
-                return ret;
+        return csum ^ (u8)w;
+}
 
-        fw_buf = kmemdup(fw_entry->data, fw_entry->size, GFP_KERNEL);
+/*
+ * whole WRITE_MEMORY payloads for the largest batch, SIP_FW_BATCH_MAX
+ * cmds. sip_write_memory() splits a chunk into transfers of fw_batch
+ * cmds, so with the default of 8 one chunk goes out as two.
+ */
+#define ESP_FW_CHUNK ((SIP_BOOT_BUF_SIZE - sizeof(struct sip_hdr) - \
+                       sizeof(struct sip_cmd_write_memory)) * SIP_FW_BATCH_MAX)
 
-        esp_release_firmware(fw_entry);
+/*
+ * the image is pulled through a stream, read from the firmware file or
+ * inflated from eagle_fwX.h, so it is never held in memory as a whole
+ */
+struct esp_fw_stream {
+        int (*read)(struct esp_fw_stream *fs, u8 *buf, u32 len);
+        u32 pos;
+#ifdef HAS_FW
+        const u8 *data;
+        u32 size;
+        u32 image_size;         /* EAGLE_FWx_SIZE, the inflated length */
+        z_stream zs;
+#else
+        struct file *filp;
+        loff_t off;
+#endif /* HAS_FW */
+};
 
-        if (fw_buf == NULL) {
-                return -ENOMEM;
+#ifndef HAS_FW
+static int esp_fw_file_read(struct esp_fw_stream *fs, u8 *buf, u32 len)
+{
+        u32 done = 0;
+        int ret;
+
+        /* short reads are fine for a file, only stop at eof */
+        while (done < len) {
+                ret = esp_read_firmware(fs->filp, &fs->off, buf + done, len - done);
+                if (ret < 0)
+                        return ret;
+                if (ret == 0)
+                        break;
+                done += ret;
         }
+        fs->pos += done;
+
+        return done;
+}
 #else
+static int esp_fw_inflate_read(struct esp_fw_stream *fs, u8 *buf, u32 len)
+{
+        int ret;
 
-#include "eagle_fw1.h"
-#include "eagle_fw2.h"
-#include "eagle_fw3.h"
-        if(sif_get_ate_config() == 1){
-            fw_buf =  &eagle_fw3[0];
-        } else {
-            fw_buf = epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT ? &eagle_fw1[0] : &eagle_fw2[0];
+        fs->zs.next_out = buf;
+        fs->zs.avail_out = len;
+
+        ret = zlib_inflate(&fs->zs, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                esp_dbg(ESP_DBG_ERROR, "%s inflate failed %d\n", __func__, ret);
+                return -EINVAL;
         }
+        fs->pos += len - fs->zs.avail_out;
+
+        return len - fs->zs.avail_out;
+}
+
+static int esp_fw_inflate_open(struct esp_fw_stream *fs, const u8 *data, u32 size, u32 image_size)
+{
+        fs->zs.workspace = vmalloc(zlib_inflate_workspacesize());
+        if (fs->zs.workspace == NULL)
+                return -ENOMEM;
+
+        fs->zs.next_in = data;
+        fs->zs.avail_in = size;
+        if (zlib_inflateInit(&fs->zs) != Z_OK) {
+                vfree(fs->zs.workspace);
+                return -EINVAL;
+        }
+
+        fs->read = esp_fw_inflate_read;
+        fs->data = data;
+        fs->size = size;
+        fs->image_size = image_size;
+
+        return 0;
+}
+
+static void esp_fw_inflate_close(struct esp_fw_stream *fs)
+{
+        zlib_inflateEnd(&fs->zs);
+        vfree(fs->zs.workspace);
+}
 #endif /* HAS_FW */
 
-        fhdr = (struct esp_fw_hdr *)fw_buf;
+static int esp_fw_read_full(struct esp_fw_stream *fs, void *buf, u32 len)
+{
+        int ret = fs->read(fs, buf, len);
 
-        if (fhdr->magic != 0xE9) {
-                esp_dbg(ESP_DBG_ERROR, "%s wrong magic! \n", __func__);
-                goto _err;
+        if (ret < 0)
+                return ret;
+        if (ret != len) {
+                esp_dbg(ESP_DBG_ERROR, "%s image truncated at %u\n", __func__, fs->pos);
+                return -EINVAL;
         }
 
-        blocks = fhdr->blocks;
-        offset += sizeof(struct esp_fw_hdr);
+        return 0;
+}
+
+/*
+ * rom image: | esp_fw_hdr | (esp_fw_blk_hdr | data) x blocks | 0 pad | csum |
+ * the checksum byte ends the image on a 16 byte boundary. It is only known
+ * once every block is written, a bad image is caught before BOOTUP is sent
+ * rather than by the bootup timeout.
+ */
+static int esp_fw_stream_download(struct esp_pub *epub, struct esp_fw_stream *fs,
+                                  u32 *entry_addr, u32 *fw_bytes)
+{
+        struct esp_fw_hdr fhdr;
+        struct esp_fw_blk_hdr bhdr;
+        u8 csum = ESP_FW_CSUM_SEED;
+        u32 offset, done, n, pad;
+        u8 blocks;
+        u8 *buf;
+        int ret;
 
-        while (blocks) {
+        buf = kmalloc(ESP_FW_CHUNK, GFP_KERNEL);
+        if (buf == NULL)
+                return -ENOMEM;
 
-                bhdr = (struct esp_fw_blk_hdr *)(&fw_buf[offset]);
+        ret = esp_fw_read_full(fs, &fhdr, sizeof(struct esp_fw_hdr));
+        if (ret)
+                goto _out;
+
+        if (fhdr.magic != 0xE9) {
+                esp_dbg(ESP_DBG_ERROR, "%s wrong magic! \n", __func__);
+                ret = -EINVAL;
+                goto _out;
+        }
+        offset = sizeof(struct esp_fw_hdr);
+
+        for (blocks = fhdr.blocks; blocks; blocks--) {
+                ret = esp_fw_read_full(fs, &bhdr, sizeof(struct esp_fw_blk_hdr));
+                if (ret)
+                        goto _out;
                 offset += sizeof(struct esp_fw_blk_hdr);
 
-                ret = sip_write_memory(epub->sip, bhdr->load_addr, &fw_buf[offset], bhdr->data_len);
+                for (done = 0; done < bhdr.data_len; done += n) {
+                        n = min_t(u32, bhdr.data_len - done, ESP_FW_CHUNK);
+                        ret = esp_fw_read_full(fs, buf, n);
+                        if (ret)
+                                goto _out;
+
+                        csum = esp_fw_csum(buf, n, csum);
 
-                if (ret) {
-                        esp_dbg(ESP_DBG_ERROR, "%s Failed to write fw, err: %d\n", __func__, ret);
-                        goto _err;
+                        ret = sip_write_memory(epub->sip, bhdr.load_addr + done, buf, n);
+                        if (ret) {
+                                esp_dbg(ESP_DBG_ERROR, "%s Failed to write fw, err: %d\n", __func__, ret);
+                                goto _out;
+                        }
                 }
 
-                blocks--;
-                offset += bhdr->data_len;
+                offset += bhdr.data_len;
+                *fw_bytes += bhdr.data_len;
         }
 
-        /* TODO: last byte should be the checksum and skip checksum for now */
-        esp_dbg(ESP_SHOW, "FW loaded, sending BOOTUP command\n");
+        pad = roundup(offset + 1, ESP_FW_CSUM_ALIGN) - offset;
+        ret = esp_fw_read_full(fs, buf, pad);
+        if (ret)
+                goto _out;
+
+        if (buf[pad - 1] != csum) {
+                esp_dbg(ESP_DBG_ERROR, "%s checksum 0x%02x, image says 0x%02x\n",
+                        __func__, csum, buf[pad - 1]);
+                ret = -EILSEQ;
+                goto _out;
+        }
 
-        bootcmd.boot_addr = fhdr->entry_addr;
-        ret = sip_send_cmd(epub->sip, SIP_CMD_BOOTUP, sizeof(struct sip_cmd_bootup), &bootcmd);
+        *entry_addr = fhdr.entry_addr;
 
-        if (ret)
-                goto _err;
+_out:
+        kfree(buf);
+        return ret;
+}
 
-_err:
+static int esp_download_fw(struct esp_pub * epub)
+{
 #ifndef HAS_FW
-        kfree(fw_buf);
+	char * esp_fw_name = NULL;
 #endif /* !HAS_FW */
+        struct esp_fw_stream fs;
+        int ret = 0;
+        struct sip_cmd_bootup bootcmd;
+        u32 fw_bytes = 0;
+        ktime_t t0;
 
-        return ret;
+        memset(&fs, 0, sizeof(struct esp_fw_stream));
+
+#ifndef HAS_FW
+
+        if(epub->conf.ate == 1) {
+		esp_fw_name = ESP_FW_NAME3;
+	} else {
+		esp_fw_name = epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT ? ESP_FW_NAME1 : ESP_FW_NAME2;
+	}
+        fs.filp = esp_open_firmware(esp_fw_name);
+
+        if (IS_ERR(fs.filp))
+                return PTR_ERR(fs.filp);
+
+        fs.read = esp_fw_file_read;
+#else
+
+#include "eagle_fw1.h"
+#include "eagle_fw2.h"
+#include "eagle_fw3.h"
+        if(epub->conf.ate == 1){
+            ret = esp_fw_inflate_open(&fs, eagle_fw3_z, sizeof(eagle_fw3_z), EAGLE_FW3_SIZE);
+        } else if (epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT) {
+            ret = esp_fw_inflate_open(&fs, eagle_fw1_z, sizeof(eagle_fw1_z), EAGLE_FW1_SIZE);
+        } else {
+            ret = esp_fw_inflate_open(&fs, eagle_fw2_z, sizeof(eagle_fw2_z), EAGLE_FW2_SIZE);
+        }
+
+        if (ret)
+                return ret;
+#endif /* HAS_FW */
+
+        t0 = ktime_get();
+        ret = esp_fw_stream_download(epub, &fs, &bootcmd.boot_addr, &fw_bytes);
+
+#ifndef HAS_FW
+        esp_close_firmware(fs.filp);
+#else
+        /* the image ends at its checksum, anything else is a bad array */
+        if (ret == 0 && fs.pos != fs.image_size) {
+                esp_dbg(ESP_DBG_ERROR, "%s inflated %u bytes, image is %u\n", __func__, fs.pos, fs.image_size);
+                ret = -EINVAL;
+        }
+        esp_fw_inflate_close(&fs);
+#endif /* HAS_FW */
+
+        if (ret)
+                return ret;
+
+        esp_dbg(ESP_SHOW, "FW loaded, %u bytes in %lld us, sending BOOTUP command\n",
+                fw_bytes, ktime_us_delta(ktime_get(), t0));
 
+        return sip_send_cmd(epub->sip, SIP_CMD_BOOTUP, sizeof(struct sip_cmd_bootup), &bootcmd);
 }
 #endif /* !FPGA_DEBUG */
 
@@ -13,7 +13,17 @@
 #ifdef CONFIG_HAS_EARLYSUSPEND
 #include <linux/earlysuspend.h>
 #endif
+#include <linux/module.h>
+#include <linux/ktime.h>
 #include "esp_pub.h"
+#include "esp_sip.h"
+#include "esp_debug.h"
+
+static int warm_suspend = 0;
+module_param(warm_suspend, int, 0644);
+MODULE_PARM_DESC(warm_suspend, "keep the target powered and asleep across host suspend");
+
+#define ESP_PM_WAKEUP_TIMEOUT	(HZ / 2)
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 
@@ -79,3 +89,115 @@ void esp_wake_unlock(void)
         wake_unlock(&esp_wake_lock_);
 #endif
 }
+
+/*
+ * warm suspend: the target is put to sleep with SIP_CMD_SUSPEND and keeps
+ * its firmware and association state. Resume wakes it and checks it is
+ * alive with a SIP_CMD_WAKEUP echo instead of a reboot.
+ */
+int esp_pm_suspend(struct esp_pub *epub, bool keep_power)
+{
+	struct sip_cmd_suspend cmd;
+	int err;
+
+	epub->pm_warm = false;
+	epub->pm_stat.suspends++;
+
+	if (!warm_suspend || !keep_power || epub->sip == NULL
+	    || atomic_read(&epub->sip->state) != SIP_RUN)
+		return 0;
+
+	/* mac80211 is quiesced by now, let a tx pass still running finish */
+	flush_work(&epub->tx_work);
+
+	memset(&cmd, 0, sizeof(struct sip_cmd_suspend));
+	cmd.suspend = 1;
+	err = sip_send_cmd_sync(epub->sip, SIP_CMD_SUSPEND, sizeof(struct sip_cmd_suspend), &cmd);
+	if (err) {
+		esp_dbg(ESP_DBG_ERROR, "%s suspend cmd failed %d\n", __func__, err);
+		return err;
+	}
+
+	epub->pm_warm = true;
+
+	return 0;
+}
+
+int esp_pm_resume(struct esp_pub *epub)
+{
+	struct sip_cmd_suspend scmd;
+	struct sip_cmd_wakeup wcmd;
+	ktime_t t0 = ktime_get();
+	u32 us;
+	int err;
+
+	if (!epub->pm_warm)
+		return 0;
+	epub->pm_warm = false;
+
+	memset(&scmd, 0, sizeof(struct sip_cmd_suspend));
+	err = sip_send_cmd_sync(epub->sip, SIP_CMD_SUSPEND, sizeof(struct sip_cmd_suspend), &scmd);
+	if (err)
+		goto _err;
+
+	reinit_completion(&epub->pm_wakeup);
+	wcmd.check_data = ++epub->pm_check;
+	epub->pm_check_pending = true;
+	err = sip_send_cmd_sync(epub->sip, SIP_CMD_WAKEUP, sizeof(struct sip_cmd_wakeup), &wcmd);
+	if (err == 0 && wait_for_completion_timeout(&epub->pm_wakeup, ESP_PM_WAKEUP_TIMEOUT) == 0)
+		err = -ETIMEDOUT;
+	epub->pm_check_pending = false;
+	if (err)
+		goto _err;
+
+	us = ktime_us_delta(ktime_get(), t0);
+	epub->pm_stat.warm_resumes++;
+	epub->pm_stat.last_us = us;
+	epub->pm_stat.max_us = max(epub->pm_stat.max_us, us);
+	esp_dbg(ESP_SHOW, "%s warm resume in %u us\n", __func__, us);
+
+	return 0;
+
+_err:
+	epub->pm_stat.failed++;
+	esp_dbg(ESP_DBG_ERROR, "%s target did not wake up (%d)\n", __func__, err);
+	/* a target that lost its state is rebooted and mac80211 restarted */
+	if (esp_schedule_recovery(epub, "warm resume"))
+		return 0;
+	return err;
+}
+
+/* SIP_EVT_WAKEUP, true when it answers our resume handshake */
+bool esp_pm_wakeup_event(struct esp_pub *epub, u32 check)
+{
+	if (!epub->pm_check_pending || check != epub->pm_check)
+		return false;
+
+	complete(&epub->pm_wakeup);
+
+	return true;
+}
+
+void esp_pm_attach(struct esp_pub *epub)
+{
+	char name[32];
+
+	init_completion(&epub->pm_wakeup);
+
+	snprintf(name, sizeof(name), "pm_%s", wiphy_name(epub->hw->wiphy));
+	epub->pm_dir = esp_debugfs_add_sub_dir(name);
+	if (epub->pm_dir == NULL)
+		return;
+
+	esp_dump_var("suspends", epub->pm_dir, &epub->pm_stat.suspends, ESP_U32);
+	esp_dump_var("warm_resumes", epub->pm_dir, &epub->pm_stat.warm_resumes, ESP_U32);
+	esp_dump_var("resume_failed", epub->pm_dir, &epub->pm_stat.failed, ESP_U32);
+	esp_dump_var("resume_last_us", epub->pm_dir, &epub->pm_stat.last_us, ESP_U32);
+	esp_dump_var("resume_max_us", epub->pm_dir, &epub->pm_stat.max_us, ESP_U32);
+}
+
+void esp_pm_detach(struct esp_pub *epub)
+{
+	debugfs_remove_recursive(epub->pm_dir);
+	epub->pm_dir = NULL;
+}
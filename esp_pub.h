@@ -18,6 +18,7 @@
 #include <net/mac80211.h>
 #include <net/cfg80211.h>
 #include <linux/version.h>
+#include <linux/completion.h>
 #include "sip2_common.h"
 
 enum esp_sdio_state{
@@ -78,6 +79,8 @@ struct llc_snap_hdr {
         __be16 eth_type;
 } __packed;
 
+#define BEACON_TIM_SAVE_MAX 12
+
 struct esp_vif {
 	struct esp_pub *epub;
 	u8 index;
@@ -85,6 +88,13 @@ struct esp_vif {
 	bool ap_up;
 	struct timer_list beacon_timer;
 	struct timer_list nulldata_timer; /* gc use this, too */
+
+	/* soft-AP beacon state, see drv_handle_beacon() */
+	u8 beacon_tim_saved[BEACON_TIM_SAVE_MAX];
+	int beacon_tim_count;
+	spinlock_t tim_lock;
+	unsigned long init_jiffies;
+	unsigned long cycle_beacon_count;
 };
 
 /* WLAN related, mostly... */
@@ -139,6 +149,50 @@ struct esp_ps {
         bool nulldata_pm_on;
 };
 
+/* host suspend/resume, see esp_pm.c */
+struct esp_pm_stat {
+	u32 suspends;
+	u32 warm_resumes;
+	u32 failed;	/* no answer to the wakeup handshake */
+	u32 last_us;	/* resume until the target takes traffic */
+	u32 max_us;
+};
+
+/* slc window registers, see sif_reg_window_batch() */
+#define ESP_REG_WIN_NR	32
+struct esp_reg_win {
+	u8 *buf;		/* dma-safe scratch for the cmd and value */
+};
+
+/* in-place firmware recovery, see esp_main.c */
+struct esp_recovery_stat {
+	u32 triggered;
+	u32 recovered;
+	u32 failed;	/* gave up, the driver has to be reloaded */
+	u32 over_budget;	/* took longer than recovery_max_ms */
+	u32 last_ms;	/* quiesce until the new firmware is up */
+	u32 max_ms;
+};
+
+/* per-device copy of the config records kept in esp_io.c,
+ * taken once at probe so each chip boots with its own settings */
+struct esp_conf_rec {
+	int bt;
+	int rst;
+	int ate;
+	int retry;
+	int wakeup_gpio;
+	int fccmode;
+};
+
+#ifdef USE_EXT_GPIO
+struct esp_ext_gpio;
+#endif
+#ifdef SIF_TRACE
+struct esp_trace;
+#endif
+struct esp_bus_sched;
+
 struct esp_mac_prefix {  
 	u8 mac_index;
 	u8 mac_addr_prefix[3];
@@ -197,8 +251,34 @@ struct esp_pub {
 	struct esp_node * rxampdu_node[ESP_PUB_MAX_RXAMPDU];
 	u8 rxampdu_tid[ESP_PUB_MAX_RXAMPDU];
 	struct esp_ps ps;
+	bool pm_warm;		/* target left asleep and powered */
+	bool pm_check_pending;
+	u32 pm_check;
+	struct completion pm_wakeup;
+	struct esp_pm_stat pm_stat;
+	struct dentry *pm_dir;
+	struct work_struct recovery_work;
+	atomic_t recovering;
+	unsigned long recovery_deadline;	/* jiffies, bounds the boot waits */
+	const char *recovery_reason;
+	struct esp_recovery_stat recovery_stat;
+	struct dentry *recovery_dir;
 	int enable_int;
 	int wait_reset;
+	struct esp_reg_win reg_win;
+
+	struct completion *bootup_cplx; /* bootup/resetting event poll */
+	struct esp_conf_rec conf;
+#ifdef P2P_CONCURRENT
+	u8 wiphy_addr[ETH_ALEN * 2];
+#endif
+#ifdef USE_EXT_GPIO
+	struct esp_ext_gpio *ext_gpio;
+#endif
+#ifdef SIF_TRACE
+	struct esp_trace *trace;
+#endif
+	struct esp_bus_sched *sched;	/* NULL: bus_sched=0, no arbitration */
 };
 
 typedef struct esp_pub esp_pub_t;
@@ -206,9 +286,15 @@ typedef struct esp_pub esp_pub_t;
 struct esp_pub *esp_pub_alloc_mac80211(struct device *dev);
 int esp_pub_dealloc_mac80211(struct esp_pub  *epub);
 int esp_register_mac80211(struct esp_pub *epub);
+void esp_restart_mac80211(struct esp_pub *epub);
 
 int esp_pub_init_all(struct esp_pub *epub);
 
+void esp_recovery_attach(struct esp_pub *epub);
+void esp_recovery_detach(struct esp_pub *epub);
+bool esp_schedule_recovery(struct esp_pub *epub, const char *reason);
+long esp_boot_timeout(struct esp_pub *epub, long timeout);
+
 char *mod_eagle_path_get(void);
 
 void esp_dsr(struct esp_pub *epub);
@@ -218,6 +304,12 @@ void esp_rocdone_process(struct ieee80211_hw *hw, struct sip_evt_roc *report);
 void esp_ps_config(struct esp_pub *epub, struct esp_ps *ps, bool on);
 
 
+void esp_pm_attach(struct esp_pub *epub);
+void esp_pm_detach(struct esp_pub *epub);
+int esp_pm_suspend(struct esp_pub *epub, bool keep_power);
+int esp_pm_resume(struct esp_pub *epub);
+bool esp_pm_wakeup_event(struct esp_pub *epub, u32 check);
+
 void esp_register_early_suspend(void);
 void esp_unregister_early_suspend(void);
 void esp_wakelock_init(void);
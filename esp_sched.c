@@ -0,0 +1,290 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   sif bus scheduler
+ *    - sif_dsr, the tx path and sip cmds ask for the bus by class
+ *    - cmds go first, rx and tx share by weight and deadline
+ *    - esp_debug/bus_sched_<phy>/stats has occupancy per class
+ */
+
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+
+#include "esp_pub.h"
+#include "esp_debug.h"
+#include "esp_sched.h"
+
+static bool bus_sched = true;
+module_param(bus_sched, bool, 0444);
+MODULE_PARM_DESC(bus_sched, "arbitrate the sif bus between cmds, rx and tx");
+
+static const char *sif_bus_name[SIF_BUS_NR] = { "ctrl", "rx", "tx" };
+
+static inline u64 sif_bus_clock(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static inline int sif_bus_other(int cls)
+{
+	return cls == SIF_BUS_RX ? SIF_BUS_TX : SIF_BUS_RX;
+}
+
+static bool sif_bus_overdue(struct esp_bus_sched *s, int cls, u64 now)
+{
+	return s->waiting[cls] && s->deadline_us[cls] &&
+	       now - s->wait_since[cls] > (u64)s->deadline_us[cls] * NSEC_PER_USEC;
+}
+
+/* who gets the free bus, -1 if nobody waits */
+static int sif_bus_pick(struct esp_bus_sched *s, u64 now, bool *overdue)
+{
+	int other;
+
+	*overdue = false;
+	if (s->waiting[SIF_BUS_CTRL])
+		return SIF_BUS_CTRL;
+	if (!s->waiting[SIF_BUS_RX] && !s->waiting[SIF_BUS_TX])
+		return -1;
+	if (!s->waiting[SIF_BUS_RX])
+		return SIF_BUS_TX;
+	if (!s->waiting[SIF_BUS_TX])
+		return SIF_BUS_RX;
+
+	other = sif_bus_other(s->last);
+	if (s->turn_left == 0)
+		return other;
+	if (sif_bus_overdue(s, other, now)) {
+		*overdue = true;
+		return other;
+	}
+	return s->last;
+}
+
+static bool sif_bus_try_grant(struct esp_bus_sched *s, int cls)
+{
+	u64 now = sif_bus_clock();
+	bool overdue, granted = false;
+
+	spin_lock_bh(&s->lock);
+	if (s->owner == NULL && sif_bus_pick(s, now, &overdue) == cls) {
+		s->owner = current;
+		s->owner_cls = cls;
+		s->owner_t0 = now;
+		s->depth = 1;
+
+		if (--s->waiting[cls])
+			s->wait_since[cls] = now;
+
+		if (cls != SIF_BUS_CTRL) {
+			if (cls == s->last && s->turn_left) {
+				s->turn_left--;
+			} else {
+				s->last = cls;
+				s->turn_left = max_t(u32, s->weight[cls], 1) - 1;
+			}
+		}
+		if (overdue)
+			s->stat[cls].deadline_hits++;
+		granted = true;
+	}
+	spin_unlock_bh(&s->lock);
+
+	return granted;
+}
+
+/* sleeps until the bus is ours, take it before sif_lock_bus() */
+void sif_bus_get(struct esp_pub *epub, int cls)
+{
+	struct esp_bus_sched *s = epub->sched;
+	struct sif_bus_stat *st;
+	bool slept = false;
+	u64 t0, waited;
+
+	if (s == NULL)
+		return;
+
+	spin_lock_bh(&s->lock);
+	if (s->owner == current) {
+		/* e.g. a cmd sent from inside the rx path */
+		s->depth++;
+		spin_unlock_bh(&s->lock);
+		return;
+	}
+	t0 = sif_bus_clock();
+	if (s->waiting[cls]++ == 0)
+		s->wait_since[cls] = t0;
+	spin_unlock_bh(&s->lock);
+
+	if (!sif_bus_try_grant(s, cls)) {
+		slept = true;
+		wait_event(s->wq, sif_bus_try_grant(s, cls));
+	}
+
+	/* only the owner touches its class stats */
+	st = &s->stat[cls];
+	st->grants++;
+	if (slept) {
+		waited = s->owner_t0 - t0;
+		st->waits++;
+		st->wait_ns += waited;
+		if (waited > (u64)st->max_wait_us * NSEC_PER_USEC)
+			st->max_wait_us = div_u64(waited, NSEC_PER_USEC);
+	}
+}
+
+void sif_bus_put(struct esp_pub *epub)
+{
+	struct esp_bus_sched *s = epub->sched;
+
+	if (s == NULL)
+		return;
+
+	spin_lock_bh(&s->lock);
+	if (s->owner != current) {
+		spin_unlock_bh(&s->lock);
+		ESSERT(0);
+		return;
+	}
+	if (--s->depth) {
+		spin_unlock_bh(&s->lock);
+		return;
+	}
+	s->stat[s->owner_cls].busy_ns += sif_bus_clock() - s->owner_t0;
+	s->owner = NULL;
+	spin_unlock_bh(&s->lock);
+
+	wake_up_all(&s->wq);
+}
+
+/*
+ * for an owner running a batch: should the bus go to someone else
+ * before the next transaction. Each one done while the other side
+ * waits counts against the turn.
+ */
+bool sif_bus_yield(struct esp_pub *epub)
+{
+	struct esp_bus_sched *s = epub->sched;
+	bool yield = false;
+	int other;
+
+	if (s == NULL)
+		return false;
+
+	spin_lock_bh(&s->lock);
+	if (s->waiting[SIF_BUS_CTRL]) {
+		yield = true;
+	} else if (s->owner_cls != SIF_BUS_CTRL) {
+		other = sif_bus_other(s->owner_cls);
+		if (s->waiting[other]) {
+			if (s->turn_left == 0) {
+				yield = true;
+			} else if (sif_bus_overdue(s, other, sif_bus_clock())) {
+				s->stat[other].deadline_hits++;
+				yield = true;
+			} else {
+				s->turn_left--;
+			}
+		}
+	}
+	spin_unlock_bh(&s->lock);
+
+	return yield;
+}
+
+static ssize_t esp_sched_stats_read(struct file *filp, char __user *buffer,
+				    size_t count, loff_t *ppos)
+{
+	struct esp_bus_sched *s = filp->private_data;
+	struct sif_bus_stat *st;
+	char buf[512];
+	u64 elapsed;
+	int i, len = 0;
+
+	elapsed = max_t(u64, sif_bus_clock() - s->since_ns, 1);
+	for (i = 0; i < SIF_BUS_NR; i++) {
+		st = &s->stat[i];
+		len += snprintf(buf + len, sizeof(buf) - len,
+				"%s grants %u waits %u deadline_hits %u wait_us avg %llu max %u busy_ms %llu permille %llu\n",
+				sif_bus_name[i], st->grants, st->waits, st->deadline_hits,
+				st->waits ? div_u64(div_u64(st->wait_ns, st->waits), NSEC_PER_USEC) : 0,
+				st->max_wait_us, div_u64(st->busy_ns, NSEC_PER_MSEC),
+				div64_u64(st->busy_ns * 1000, elapsed));
+	}
+
+	return simple_read_from_buffer(buffer, count, ppos, buf, len);
+}
+
+/* any write starts a new measurement window */
+static ssize_t esp_sched_stats_write(struct file *filp, const char __user *buffer,
+				     size_t count, loff_t *ppos)
+{
+	struct esp_bus_sched *s = filp->private_data;
+
+	spin_lock_bh(&s->lock);
+	memset(s->stat, 0, sizeof(s->stat));
+	s->since_ns = sif_bus_clock();
+	spin_unlock_bh(&s->lock);
+
+	return count;
+}
+
+static const struct file_operations esp_sched_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = esp_sched_stats_read,
+	.write = esp_sched_stats_write,
+};
+
+int esp_sched_attach(struct esp_pub *epub)
+{
+	struct esp_bus_sched *s;
+	char name[32];
+
+	if (!bus_sched)
+		return 0;
+
+	s = kzalloc(sizeof(struct esp_bus_sched), GFP_KERNEL);
+	if (s == NULL)
+		return -ENOMEM;
+
+	spin_lock_init(&s->lock);
+	init_waitqueue_head(&s->wq);
+	s->last = SIF_BUS_RX;
+	s->weight[SIF_BUS_RX] = 2;
+	s->weight[SIF_BUS_TX] = 2;
+	s->deadline_us[SIF_BUS_RX] = 1000;
+	s->deadline_us[SIF_BUS_TX] = 2000;
+	s->since_ns = sif_bus_clock();
+
+	snprintf(name, sizeof(name), "bus_sched_%s", wiphy_name(epub->hw->wiphy));
+	s->dir = esp_debugfs_add_sub_dir(name);
+	if (s->dir) {
+		esp_dump_var("rx_weight", s->dir, &s->weight[SIF_BUS_RX], ESP_U32);
+		esp_dump_var("tx_weight", s->dir, &s->weight[SIF_BUS_TX], ESP_U32);
+		esp_dump_var("rx_deadline_us", s->dir, &s->deadline_us[SIF_BUS_RX], ESP_U32);
+		esp_dump_var("tx_deadline_us", s->dir, &s->deadline_us[SIF_BUS_TX], ESP_U32);
+		esp_dump("stats", s->dir, s, 0, (struct file_operations *)&esp_sched_stats_fops);
+	}
+
+	epub->sched = s;
+	return 0;
+}
+
+void esp_sched_detach(struct esp_pub *epub)
+{
+	struct esp_bus_sched *s = epub->sched;
+
+	if (s == NULL)
+		return;
+
+	epub->sched = NULL;
+	debugfs_remove_recursive(s->dir);
+	kfree(s);
+}
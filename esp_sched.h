@@ -0,0 +1,65 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   sif bus scheduler
+ */
+
+#ifndef _ESP_SCHED_H_
+#define _ESP_SCHED_H_
+
+#include <linux/wait.h>
+#include "esp_pub.h"
+
+enum sif_bus_class {
+	SIF_BUS_CTRL = 0,	/* sip cmds, served first */
+	SIF_BUS_RX,		/* sif_dsr, status and lldesc reads */
+	SIF_BUS_TX,		/* tx aggregates */
+	SIF_BUS_NR,
+};
+
+struct sif_bus_stat {
+	u32 grants;
+	u32 waits;		/* had to sleep for the bus */
+	u32 deadline_hits;	/* taken out of turn, waited past the deadline */
+	u32 max_wait_us;
+	u64 wait_ns;
+	u64 busy_ns;		/* time holding the bus */
+};
+
+/*
+ * one holder at a time, taken before the host/bus lock. While both rx
+ * and tx wait they alternate in turns of weight transactions, unless one
+ * side has waited longer than its deadline.
+ */
+struct esp_bus_sched {
+	spinlock_t lock;
+	wait_queue_head_t wq;
+	struct task_struct *owner;
+	int owner_cls;
+	int depth;		/* nested gets from the owner */
+	u64 owner_t0;
+
+	u32 waiting[SIF_BUS_NR];
+	u64 wait_since[SIF_BUS_NR];	/* roughly the oldest waiter */
+	int last;		/* rx or tx, whose turn it is */
+	u32 turn_left;
+
+	u32 weight[SIF_BUS_NR];		/* rx and tx only */
+	u32 deadline_us[SIF_BUS_NR];	/* 0: none */
+
+	u64 since_ns;
+	struct sif_bus_stat stat[SIF_BUS_NR];
+	struct dentry *dir;
+};
+
+int esp_sched_attach(struct esp_pub *epub);
+void esp_sched_detach(struct esp_pub *epub);
+void sif_bus_get(struct esp_pub *epub, int cls);
+void sif_bus_put(struct esp_pub *epub);
+bool sif_bus_yield(struct esp_pub *epub);
+
+#endif /* _ESP_SCHED_H_ */
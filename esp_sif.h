@@ -17,6 +17,7 @@
 #include "esp_pub.h"
 #include <linux/mmc/host.h>
 #include <linux/spi/spi.h>
+#include <linux/platform_device.h>
 
 /*
  *  H/W SLC module definitions
@@ -52,9 +53,122 @@ enum io_sync_type {
 	ESP_SIF_SYNC, 
 };
 
+#ifdef ESP_USE_SPI
+/* a start token window learnt from where the 0xFE actually shows up */
+struct esp_spi_win {
+	u32 cur;	/* bytes to clock, 0: the protocol default */
+	u32 hw;		/* furthest token this epoch */
+	u32 n;		/* tokens seen this epoch */
+};
+
+#define SPI_WIN_BYTE_SHIFT	6	/* byte reads learnt per 64 bytes of count */
+#define SPI_WIN_BYTE_NR		((512 >> SPI_WIN_BYTE_SHIFT) + 1)
+
+#define SPI_IRQ_LAT_NR		12	/* log2 us buckets, the last one open */
+
+/* hard irq to sif_dsr() start, esp_debug/spi_irq_<phy>/stats */
+struct esp_spi_irq_stat {
+	u32 irqs;
+	u32 bogus;
+	u32 max_us;
+	u64 sum_us;
+	u32 lat[SPI_IRQ_LAT_NR];
+};
+
+struct esp_spi_resp {
+	u32 max_dataW_resp_size;
+	u32 max_dataR_resp_size;
+	u32 max_block_dataW_resp_size;
+	u32 max_block_dataR_resp_size;
+	u32 max_cmd_resp_size;
+	u32 data_resp_size_w;
+	u32 data_resp_size_r;
+	u32 block_w_data_resp_size_final;
+	u32 block_r_data_resp_size_final;
+
+	struct esp_spi_win byte_r_win[SPI_WIN_BYTE_NR];
+	struct esp_spi_win block_r_1st_win;
+	struct esp_spi_win block_r_each_win;
+
+	/* since load, esp_debug/spi_resp_<phy> */
+	u32 token_hits;
+	u32 token_misses;	/* not in the window, drained by polling */
+	u32 polls;		/* 256 byte dummy reads waiting on the target */
+	u32 retries;		/* whole transfers issued again */
+	u32 ready_waits;	/* slept on the ready line */
+	u32 ready_timeouts;
+	u64 wasted_bytes;	/* window clocked past the token, and the polls */
+};
+#endif
+
+#ifdef ESP_USE_VIRT
+struct esp_virt_target;
+#endif
+
+/*
+ * async bus requests, see sif_io_async(). The buffer belongs to the bus
+ * until done() has run; it runs with the bus held, from the io worker
+ * on sdio and from the spi completion (maybe atomic) on spi.
+ */
+struct sif_io_ctx {
+        void (*done)(struct esp_pub *epub, struct sif_io_ctx *ctx, int err);
+};
+
+/*
+ * requests queued or on the bus at once. The only async user is the sip
+ * tx path and it has two aggregate buffers, one filling while the other
+ * is on the bus, so a third request can never be outstanding.
+ */
+#define SIF_REQ_DEPTH 2
+
+struct sif_req {
+        struct list_head list;
+        u32 addr;
+        u8 *buf;
+        u32 len;
+        u32 flag;
+        struct sif_io_ctx *ctx;
+#ifdef ESP_USE_SPI
+        /* block write framed at submit, chained from the completion */
+        struct spi_device *spi;
+        u8 *ctl;                        /* framing and responses */
+        struct spi_transfer *xfers;
+        struct spi_message msg[2];      /* with the cmd, then the rest */
+        int ctl_b;                      /* framing of msg[1] in ctl */
+        int blks;
+        int blks_a;                     /* blocks in msg[0] */
+        int stage;
+#endif
+};
+
 #ifdef ESP_USE_SDIO
+/* transfers copied through dma_buffer because the caller's buffer can't be mapped */
+struct esp_sdio_bounce {
+        u32 tx;
+        u32 rx;
+        u32 big;                /* larger than dma_buffer, allocated per call */
+        u64 bytes;
+};
+
+/* clock picked by sif_sdio_tune(), stepped down on bursts of crc errors */
+struct esp_sdio_tune {
+        u32 clk;                /* MHz, 0: not tuned, host default */
+        u32 probe_us;           /* id readback rounds at clk */
+        u32 crc_errs;
+        u32 fallbacks;
+        u32 win_errs;           /* crc errors in the current second */
+        unsigned long win_start;
+        struct work_struct work;
+        struct dentry *dir;
+};
+#endif
+
+#if defined(ESP_USE_SDIO)
 typedef struct esp_sdio_ctrl {
         struct sdio_func *func;
+#elif defined(ESP_USE_VIRT)
+typedef struct esp_virt_ctrl {
+        struct platform_device *pdev;
 #else
 typedef struct esp_spi_ctrl {
         struct spi_device *spi;
@@ -62,19 +176,27 @@ typedef struct esp_spi_ctrl {
         struct esp_pub *epub;
 
 
-        struct list_head free_req;
+        struct list_head free_req;      /* idle sif_req descriptors */
 
         u8 *dma_buffer;
 
-        spinlock_t scat_lock;
-        struct list_head scat_req;
+        spinlock_t scat_lock;           /* free_req and scat_req */
+        struct list_head scat_req;      /* submitted, in bus order */
 
         bool off;
         atomic_t irq_handling;
-#ifdef ESP_USE_SDIO
+#if defined(ESP_USE_SDIO)
         const struct sdio_device_id *id;
+#elif defined(ESP_USE_VIRT)
+        const struct platform_device_id *id;
 #else
         const struct spi_device_id *id;
+#endif
+#if defined(ESP_USE_SDIO) || defined(ESP_USE_SPI)
+        struct sif_req reqs[SIF_REQ_DEPTH];
+        struct work_struct io_work;
+        u32 io_reqs;
+        u32 io_busy;    /* refused, every descriptor in use */
 #endif
         u32 slc_blk_sz;
         u32 target_id;
@@ -83,26 +205,58 @@ typedef struct esp_spi_ctrl {
         struct slc_host_regs slc_regs;
         atomic_t 	irq_installed;
 
+        /* first stage ctrl waiting for the same bus to be probed again */
+        struct list_head pending_list;
+        void *bus_key;
+#ifdef USE_EXT_GPIO
+        u16 gpio_forbidden;
+#endif
 #ifdef ESP_USE_SDIO
+        struct esp_sdio_bounce bounce;
+        struct dentry *dma_dir;
+        struct esp_sdio_tune tune;
+#endif
+#ifdef ESP_USE_SPI
+        u64 irq_t0;                     /* last hard irq, ns */
+        bool irq_prio_set;
+        struct esp_spi_irq_stat irq_stat;
+        struct dentry *irq_dir;
+        struct esp_spi_resp spi_resp;
+
+        /* staging buffers for cmd/token/crc framing */
+        unsigned char *buf_addr;
+        unsigned char *tx_cmd;
+        unsigned char *rx_cmd;
+        unsigned char *check_buf;
+        unsigned char *ff_buf;
+        struct spi_transfer *xfers;     /* zero-copy block writes */
+
+        /* optional target ready line, see sif_spi_ready_gpio() */
+        int ready_gpio;
+        int ready_irq;
+        bool ready_dflt;                /* ready_gpio is spi_ready_gpio */
+        struct completion ready;
+        struct dentry *resp_dir;
+
+        /* async chain, owned by io_work while it holds the bus */
+        struct completion io_idle;      /* chain stopped */
+        struct sif_req *io_stalled;     /* target busy, io_work polls */
+        int io_budget;                  /* requests left in this chain */
+#endif
+#ifdef ESP_USE_VIRT
+        struct mutex bus_mtx;
+        struct work_struct irq_work;
+        struct esp_virt_target *target;
+#endif
+
+#if defined(ESP_USE_SDIO)
 } esp_sdio_ctrl_t;
+#elif defined(ESP_USE_VIRT)
+} esp_virt_ctrl_t;
 #else
 } esp_spi_ctrl_t;
 #endif
 
-#ifdef ESP_USE_SPI
-struct esp_spi_resp {
-	u32 max_dataW_resp_size;
-	u32 max_dataR_resp_size;
-	u32 max_block_dataW_resp_size;
-	u32 max_block_dataR_resp_size;
-	u32 max_cmd_resp_size;
-	u32 data_resp_size_w;
-	u32 data_resp_size_r;
-	u32 block_w_data_resp_size_final;
-	u32 block_r_data_resp_size_final;
-};
-#endif
-
 #define SIF_TO_DEVICE                    0x1
 #define SIF_FROM_DEVICE                    0x2
 
@@ -180,6 +334,38 @@ struct esp_spi_resp {
 #define EPUB_TO_FUNC(_epub) (((struct esp_spi_ctrl *)(_epub)->sif)->spi)
 #endif
 
+#ifdef ESP_USE_VIRT
+#define EPUB_CTRL_CHECK(_epub, _go_err) do{\
+	if (_epub == NULL) {\
+		ESSERT(0);\
+		goto _go_err;\
+	}\
+	if ((_epub)->sif == NULL) {\
+		ESSERT(0);\
+		goto _go_err;\
+	}\
+}while(0)
+
+#define EPUB_FUNC_CHECK(_epub, _go_err) do{\
+	if (_epub == NULL) {\
+		ESSERT(0);\
+		goto _go_err;\
+	}\
+	if ((_epub)->sif == NULL) {\
+		ESSERT(0);\
+		goto _go_err;\
+	}\
+	if (((struct esp_virt_ctrl *)(_epub)->sif)->pdev == NULL) {\
+		ESSERT(0);\
+		goto _go_err;\
+	}\
+}while(0)
+
+#define EPUB_TO_CTRL(_epub) (((struct esp_virt_ctrl *)(_epub)->sif))
+
+#define EPUB_TO_FUNC(_epub) (((struct esp_virt_ctrl *)(_epub)->sif)->pdev)
+#endif
+
 void sdio_io_writeb(struct esp_pub *epub, u8 value, int addr, int *res);
 u8 sdio_io_readb(struct esp_pub *epub, int addr, int *res);
 
@@ -191,11 +377,16 @@ void sif_disable_target_interrupt(struct esp_pub *epub);
 u32 sif_get_blksz(struct esp_pub *epub);
 u32 sif_get_target_id(struct esp_pub *epub);
 
+/* reset the chip into its rom whatever the firmware is doing */
+#define ESP_RESET_OFF_MS	20
+void sif_reset_target(struct esp_pub *epub);
+/* bring the bus back up after the target was reset into the rom */
+int sif_reinit_card(struct esp_pub *epub);
+
 #ifdef ESP_USE_SDIO
 void sif_dsr(struct sdio_func *func);
 int sif_io_raw(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag);
 int sif_io_sync(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag);
-int sif_io_async(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag, void * context);
 int sif_lldesc_read_sync(struct esp_pub *epub, u8 *buf, u32 len);
 int sif_lldesc_write_sync(struct esp_pub *epub, u8 *buf, u32 len);
 int sif_lldesc_read_raw(struct esp_pub *epub, u8 *buf, u32 len, bool noround);
@@ -206,6 +397,15 @@ int esp_sdio_init(void);
 void esp_sdio_exit(void);
 #endif 
 
+#if defined(ESP_USE_SDIO) || defined(ESP_USE_SPI)
+int sif_io_async(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag, void * context);
+int sif_lldesc_write_async(struct esp_pub *epub, u8 *buf, u32 len, struct sif_io_ctx *ctx);
+void sif_io_flush(struct esp_pub *epub);
+#else
+/* no request engine, esp_common_write_async() is done inline */
+static inline void sif_io_flush(struct esp_pub *epub) { }
+#endif
+
 #ifdef ESP_USE_SPI
 enum if_dummymode {
 	NOT_DUMMYMODE = 0,
@@ -238,23 +438,50 @@ void sif_platform_irq_deinit(void);
 
 int sif_spi_write_bytes(struct spi_device *spi, unsigned int addr,unsigned char *dst, int count, int check_idle);
 int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *dst, int count, int check_idle);
-struct esp_spi_resp *sif_get_spi_resp(void);
+struct esp_spi_resp *sif_get_spi_resp(struct esp_pub *epub);
 
 int esp_spi_init(void);
 void esp_spi_exit(void);
 #endif
 
+#ifdef ESP_USE_VIRT
+void sif_dsr(struct platform_device *pdev);
+int sif_virt_io(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag);
+int sif_virt_lldesc_io(struct esp_pub *epub, u8 *buf, u32 len, u32 flag);
+
+int esp_virt_init(void);
+void esp_virt_exit(void);
+#endif
+
 int esp_common_init(void);
 void esp_common_exit(void);
 
 int esp_common_read(struct esp_pub *epub, u8 *buf, u32 len, int sync, bool noround);
 int esp_common_write(struct esp_pub *epub, u8 *buf, u32 len, int sync);
+int esp_common_write_async(struct esp_pub *epub, u8 *buf, u32 len, struct sif_io_ctx *ctx);
 int esp_common_read_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, int sync);
 int esp_common_write_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, int sync);
 
 int esp_common_readbyte_with_addr(struct esp_pub *epub, u32 addr, u8 *buf, int sync);
 int esp_common_writebyte_with_addr(struct esp_pub *epub, u32 addr, u8 buf, int sync);
 
+enum sif_reg_op_type {
+	SIF_REG_RD = 0,
+	SIF_REG_WR,
+	SIF_REG_RMW,		/* val = (old & ~mask) | val */
+};
+
+struct sif_reg_op {
+	u8 op;
+	u32 reg;		/* SLC_* window register */
+	u32 val;		/* to write, or what was read/written back */
+	u32 mask;		/* RMW only, bits cleared */
+};
+
+int sif_reg_win_attach(struct esp_pub *epub);
+void sif_reg_win_detach(struct esp_pub *epub);
+int sif_reg_window_batch(struct esp_pub *epub, struct sif_reg_op *ops, int n);
+int sif_update_reg_window(struct esp_pub *epub, unsigned int reg_addr, u32 clr, u32 set);
 int sif_read_reg_window(struct esp_pub *epub, unsigned int reg_addr, unsigned char *value);
 int sif_write_reg_window(struct esp_pub *epub, unsigned int reg_addr, unsigned char *value);
 int sif_ack_target_read_err(struct esp_pub *epub);
@@ -292,6 +519,7 @@ void sif_record_retry_config(void);
 int sif_get_retry_config(void);
 void sif_record_wakeup_gpio_config(int value);
 int sif_get_wakeup_gpio_config(void);
+void sif_load_config(struct esp_pub *epub);
 
 #ifdef ESP_CLASS
 void sif_record_fccmode(int value);
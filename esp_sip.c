@@ -32,6 +32,8 @@
 #include "slc_host_register.h"
 #include "esp_wmac.h"
 #include "esp_utils.h"
+#include "sip_parse.h"
+#include "esp_sched.h"
 #ifdef TEST_MODE
 #include "testmode.h"
 #endif
@@ -40,7 +42,6 @@
 #include "esp_ext.h"
 #endif /* USE_EXT_GPIO */
 
-extern struct completion *gl_bootup_cplx; 
 
 static int avg_signal = 0;
 static int signal_count = 0;
@@ -106,8 +107,6 @@ static struct sip_trace str;
 #define SIP_PENDING_RESUME_TX_THRESHOLD 6
 #endif /* !FAST_TX_STATUS */
 
-#define SIP_MIN_DATA_PKT_LEN    (sizeof(struct esp_mac_rx_ctrl) + 24) //24 is min 80211hdr
-
 #ifdef ESP_PREALLOC
 extern struct sk_buff *esp_get_sip_skb(int size, gfp_t type);
 extern void esp_put_sip_skb(struct sk_buff **skb);
@@ -131,12 +130,10 @@ static void sip_free_init_ctrl_buf(struct esp_sip *sip);
 
 static int sip_pack_pkt(struct esp_sip *sip, struct sk_buff *skb, int *pm_state);
 
-static struct esp_mac_rx_ctrl *sip_parse_normal_mac_ctrl(struct sk_buff *skb, int * pkt_len_enc, int *buf_len, int *pulled_len);
-
-static struct sk_buff * sip_parse_data_rx_info(struct esp_sip *sip, struct sk_buff *skb, int pkt_len_enc, int buf_len, struct esp_mac_rx_ctrl *mac_ctrl, int *pulled_len);
-
 static inline void sip_rx_pkt_enqueue(struct esp_sip *sip, struct sk_buff *skb);
 
+static int sip_parse_mac_rx_info(struct esp_sip *sip, struct esp_mac_rx_ctrl * mac_ctrl, struct sk_buff *skb);
+
 #ifndef FAST_TX_STATUS
 static void sip_after_tx_status_update(struct esp_sip *sip);
 #endif /* !FAST_TX_STATUS */
@@ -214,12 +211,22 @@ static void sip_recalc_credit_timeout(unsigned long data)
 
 	esp_dbg(ESP_DBG_ERROR, "rct");
 
+	sip->resync_stat.timeouts++;
+
+	/* the target stopped answering, claiming again won't help */
+	if (++sip->credit_timeouts >= SIP_RECALC_CREDIT_MAX_RETRY) {
+		esp_schedule_recovery(sip->epub, "credit recalc timeout");
+		return;
+	}
+
 	sip_recalc_credit_claim(sip, 1);      /* recalc again */
 }
 
 static void sip_recalc_credit_init(struct esp_sip *sip)
 {
 	atomic_set(&sip->credit_status, RECALC_CREDIT_DISABLE);  //set it disable
+	atomic_set(&sip->resync_spent, 0);
+	sip->resync_sent = false;
 
 	init_timer(&sip->credit_timer);
 	sip->credit_timer.data = (unsigned long)sip;
@@ -233,6 +240,18 @@ static int sip_recalc_credit_claim(struct esp_sip *sip, int force)
 	if (atomic_read(&sip->credit_status) == RECALC_CREDIT_ENABLE && force == 0)
 		return 1;
 
+	/*
+	 * tx goes on while the recalc is in flight, see sip_txq_process().
+	 * The report answers the latest cmd, so a re-claim holds tx back
+	 * until its cmd is out and counts from there. Only the stats run
+	 * from the first claim.
+	 */
+	if (atomic_read(&sip->credit_status) != RECALC_CREDIT_ENABLE) {
+		sip->resync_start = ktime_get();
+		sip->resync_stat.resyncs++;
+	}
+	sip->resync_sent = false;
+
 	atomic_set(&sip->credit_status, RECALC_CREDIT_ENABLE);
         ret = sip_send_recalc_credit(sip->epub);
 	if (ret) {
@@ -249,11 +268,22 @@ static int sip_recalc_credit_claim(struct esp_sip *sip, int force)
 
 static void sip_recalc_credit_release(struct esp_sip *sip)
 {
+	struct sip_resync_stat *st = &sip->resync_stat;
+	u32 us;
+
 	esp_dbg(ESP_SHOW, "rcr");
 
+	sip->credit_timeouts = 0;
 	if (atomic_read(&sip->credit_status) == RECALC_CREDIT_ENABLE) {
 		atomic_set(&sip->credit_status, RECALC_CREDIT_DISABLE);
 		del_timer_sync(&sip->credit_timer);
+
+		us = ktime_us_delta(ktime_get(), sip->resync_start);
+		st->last_us = us;
+		st->max_us = max(st->max_us, us);
+		st->total_us += us;
+		atomic_set(&sip->resync_spent, 0);
+		sip->resync_sent = false;
 	} else
 		esp_dbg(ESP_SHOW, "maybe bogus credit");
 }
@@ -263,7 +293,8 @@ static void sip_update_tx_credits(struct esp_sip *sip, u16 recycled_credits)
         esp_sip_dbg(ESP_DBG_TRACE, "%s:before add, credits is %d\n", __func__, atomic_read(&sip->tx_credits));
         
 	if (recycled_credits & 0x800) {
-		atomic_set(&sip->tx_credits, (recycled_credits & 0x7ff));
+		/* blocks sent behind the recalc cmd are not in the absolute count */
+		atomic_set(&sip->tx_credits, max_t(int, (recycled_credits & 0x7ff) - atomic_read(&sip->resync_spent), 0));
 		sip_recalc_credit_release(sip);
 	} else
 		atomic_add(recycled_credits, &sip->tx_credits);
@@ -274,7 +305,8 @@ static void sip_update_tx_credits(struct esp_sip *sip, u16 recycled_credits)
 void sip_trigger_txq_process(struct esp_sip *sip)
 {
         if (atomic_read(&sip->tx_credits) <= sip->credit_to_reserve + SIP_CTRL_CREDIT_RESERVE             //no credits, do nothing
-		|| atomic_read(&sip->credit_status) == RECALC_CREDIT_ENABLE)
+		|| (atomic_read(&sip->credit_status) == RECALC_CREDIT_ENABLE
+		    && atomic_read(&sip->resync_spent) >= SIP_RESYNC_CREDITS))
                 return;
 
         if (sip_queue_may_resume(sip)) {
@@ -291,7 +323,7 @@ void sip_trigger_txq_process(struct esp_sip *sip)
                 esp_sip_dbg(ESP_DBG_TRACE, "%s resume sip txq \n", __func__);
 
 #ifndef FPGA_TXDATA
-                if(sif_get_ate_config() == 0){
+                if(sip->epub->conf.ate == 0){
                         ieee80211_queue_work(sip->epub->hw, &sip->epub->tx_work);
                 } else {
                         queue_work(sip->epub->esp_wkq, &sip->epub->tx_work);
@@ -302,276 +334,69 @@ void sip_trigger_txq_process(struct esp_sip *sip)
         }
 }
 
-static bool sip_ampdu_occupy_buf(struct esp_sip *sip, struct esp_rx_ampdu_len * ampdu_len)
+static void sip_rx_credits(void *priv, u16 credits)
 {
-        return (ampdu_len->substate == 0 || esp_wmac_rxsec_error(ampdu_len->substate) || (sip->dump_rpbm_err && ampdu_len->substate == RX_RPBM_ERR));
+        sip_update_tx_credits((struct esp_sip *)priv, credits);
 }
 
-static bool sip_rx_pkt_process(struct esp_sip * sip, struct sk_buff *skb)
+static int sip_rx_event(void *priv, u8 *buf)
 {
-#define DO_NOT_COPY false
-#define DO_COPY true
-
-	struct sip_hdr * hdr = NULL;
-	struct sk_buff * rskb = NULL;
-	int remains_len = 0;
-	int first_pkt_len = 0;
-	u8 *bufptr = NULL;
-	int ret = 0;
-	bool trigger_rxq = false;
-
-	if (skb == NULL) {
-		esp_sip_dbg(ESP_DBG_ERROR, "%s NULL SKB!!!!!!!! \n", __func__);
-		return trigger_rxq;
-	}
-
-	hdr = (struct sip_hdr *)skb->data;
-	bufptr = skb->data;
-
-
-	esp_sip_dbg(ESP_DBG_TRACE, "%s Hcredits 0x%08x, realCredits %d\n", __func__, hdr->h_credits, hdr->h_credits & SIP_CREDITS_MASK);
-	if (hdr->h_credits & SIP_CREDITS_MASK) {
-		sip_update_tx_credits(sip, hdr->h_credits & SIP_CREDITS_MASK);
-	}
-
-	hdr->h_credits &= ~SIP_CREDITS_MASK; /* clean credits in sip_hdr, prevent over-add */
-
-	esp_sip_dbg(ESP_DBG_TRACE, "%s credits %d\n", __func__, hdr->h_credits);
-
-	/*
-	 * first pkt's length is stored in  recycled_credits first 20 bits
-	 * config w3 [31:12]
-	 * repair hdr->len of first pkt
-	 */
-	remains_len = hdr->len;
-	first_pkt_len = hdr->h_credits >> 12;
-	hdr->len = first_pkt_len;
-
-	esp_dbg(ESP_DBG_TRACE, "%s first_pkt_len %d, whole pkt len %d\n", __func__, first_pkt_len, remains_len);
-	if (first_pkt_len > remains_len) {
-		sip_recalc_credit_claim(sip, 0);
-		show_buf((u8 *)hdr, first_pkt_len);
-		ESSERT(0);
-                goto _exit;
-	}
-
-	/*
-	 * pkts handling, including the first pkt, should alloc new skb for each data pkt.
-	 * free the original whole skb after parsing is done.
-	 */
-	while (remains_len) {
-		if (remains_len < sizeof(struct sip_hdr)) {
-			sip_recalc_credit_claim(sip, 0);
-			ESSERT(0);
-			show_buf((u8 *)hdr, 512);
-                	goto _exit;
-		}
-		
-		hdr = (struct sip_hdr *)bufptr;
-		if (hdr->len <= 0) {
-			sip_recalc_credit_claim(sip, 0);
-			show_buf((u8 *)hdr, 512);
-			ESSERT(0);
-			goto _exit;
-		}
-
-		if((hdr->len & 3) != 0) {
-			sip_recalc_credit_claim(sip, 0);
-			show_buf((u8 *)hdr, 512);
-			ESSERT(0);
-                	goto _exit;
-		}
-		if (unlikely(hdr->seq != sip->rxseq++)) {
-			sip_recalc_credit_claim(sip, 0);
-			esp_dbg(ESP_DBG_ERROR, "%s seq mismatch! got %u, expect %u\n", __func__, hdr->seq, sip->rxseq-1);
-			sip->rxseq = hdr->seq + 1;
-			show_buf(bufptr, 32);
-			ESSERT(0);
-		}
-
-		if (SIP_HDR_IS_CTRL(hdr)) {
-			STRACE_RX_EVENT_INC();
-			esp_sip_dbg(ESP_DBG_TRACE, "%s CTRL_HDR seq %u\n", __func__, hdr->seq);
-
-			ret = sip_parse_events(sip, bufptr);
-
-			skb_pull(skb, hdr->len);
-
-		} else if (SIP_HDR_IS_DATA(hdr)) {
-			struct esp_mac_rx_ctrl * mac_ctrl = NULL;
-			int pkt_len_enc = 0, buf_len = 0, pulled_len = 0;
+        STRACE_RX_EVENT_INC();
+        return sip_parse_events((struct esp_sip *)priv, buf);
+}
 
-			STRACE_RX_DATA_INC();
-			esp_sip_dbg(ESP_DBG_TRACE, "%s DATA_HDR seq %u\n", __func__, hdr->seq);
-			mac_ctrl = sip_parse_normal_mac_ctrl(skb, &pkt_len_enc, &buf_len, &pulled_len);
-			rskb = sip_parse_data_rx_info(sip, skb, pkt_len_enc, buf_len, mac_ctrl, &pulled_len);
+static bool sip_rx_mpdu(void *priv, struct sk_buff *rskb, struct esp_mac_rx_ctrl *mac_ctrl, bool sendup)
+{
+        struct esp_sip *sip = (struct esp_sip *)priv;
 
-			if(rskb == NULL)
-				goto _move_on;
+        STRACE_RX_DATA_INC();
+        sip_parse_mac_rx_info(sip, mac_ctrl, rskb);
 
-			if (likely(atomic_read(&sip->epub->wl.off) == 0)) {
+        if (!sendup) {
+                /* still need go thro parsing as skb_pull should invoke */
+                kfree_skb(rskb);
+                return false;
+        }
 #ifndef RX_SENDUP_SYNC
-				skb_queue_tail(&sip->epub->rxq, rskb);
-				trigger_rxq = true;
+        skb_queue_tail(&sip->epub->rxq, rskb);
+        return true;
 #else
 #ifdef RX_CHECKSUM_TEST
-				esp_rx_checksum_test(rskb);
+        esp_rx_checksum_test(rskb);
 #endif
-				local_bh_disable();
-				ieee80211_rx(sip->epub->hw, rskb);
-				local_bh_enable();
+        local_bh_disable();
+        ieee80211_rx(sip->epub->hw, rskb);
+        local_bh_enable();
+        return false;
 #endif /* RX_SENDUP_SYNC */
-			} else {
-				/* still need go thro parsing as skb_pull should invoke */
-				kfree_skb(rskb);
-			}
-		} else if (SIP_HDR_IS_AMPDU(hdr)) {
-			struct esp_mac_rx_ctrl * mac_ctrl = NULL;
-			struct esp_mac_rx_ctrl new_mac_ctrl;
-			struct esp_rx_ampdu_len *ampdu_len;
-			int pkt_num;
-			int pulled_len = 0;
-			static int pkt_dropped = 0;
-			static int pkt_total = 0;
-			bool have_rxabort = false;
-			bool have_goodpkt = false;
-			static u8 frame_head[16];
-			static u8 frame_buf_ttl = 0;
-
-			ampdu_len = (struct esp_rx_ampdu_len *)(skb->data + hdr->len/sip->rx_blksz * sip->rx_blksz);
-			esp_sip_dbg(ESP_DBG_TRACE, "%s AMPDU_HDR rx ampdu total len %u\n", __func__, hdr->len);
-			if(skb->data != (u8 *)hdr) {
-				esp_sip_dbg(ESP_DBG, "%s APMDU %p %p\n", __func__, skb->data, hdr);
-				show_buf(skb->data, 512);
-				show_buf((u8 *)hdr, 512);
-				ESSERT(0);
-				goto _exit;
-			}
-			mac_ctrl = sip_parse_normal_mac_ctrl(skb, NULL, NULL, &pulled_len);
-			memcpy(&new_mac_ctrl, mac_ctrl, sizeof(struct esp_mac_rx_ctrl));
-			mac_ctrl = &new_mac_ctrl;
-			pkt_num = mac_ctrl->ampdu_cnt;
-			esp_sip_dbg(ESP_DBG_TRACE, "%s %d rx ampdu %u pkts, %d pkts dumped, first len %u\n",__func__,
-				__LINE__, (unsigned int)((hdr->len % sip->rx_blksz) / sizeof(struct esp_rx_ampdu_len)),
-				pkt_num, (unsigned int)ampdu_len->sublen);
-
-			pkt_total += mac_ctrl->ampdu_cnt;
-			//esp_sip_dbg(ESP_DBG_ERROR, "%s ampdu dropped %d/%d\n", __func__, pkt_dropped, pkt_total);
-			while (pkt_num > 0) {
-				esp_sip_dbg(ESP_DBG_TRACE, "%s %d ampdu sub state %02x,\n", __func__, __LINE__,
-					ampdu_len->substate);
-
-				if (sip_ampdu_occupy_buf(sip, ampdu_len)) { //pkt is dumped
-
-					rskb = sip_parse_data_rx_info(sip, skb, ampdu_len->sublen - FCS_LEN, 0, mac_ctrl, &pulled_len);
-					if (!rskb) {
-						ESSERT(0);
-						goto _exit;
-					}
+}
 
-					if (likely(atomic_read(&sip->epub->wl.off) == 0) &&
-							(ampdu_len->substate == 0 || ampdu_len->substate == RX_TKIPMIC_ERR ||
-							 (sip->sendup_rpbm_pkt && ampdu_len->substate == RX_RPBM_ERR)) &&
-							(sip->rxabort_fixed || !have_rxabort) ) 
-					{
-						if(!have_goodpkt) {
-							have_goodpkt = true;
-							memcpy(frame_head, rskb->data, 16);
-							frame_head[1] &= ~0x80;
-							frame_buf_ttl = 3;
-						}
-#ifndef RX_SENDUP_SYNC
-						skb_queue_tail(&sip->epub->rxq, rskb);
-						trigger_rxq = true;
-#else
-#ifdef RX_CHECKSUM_TEST
-						esp_rx_checksum_test(rskb);
-#endif
-						local_bh_disable();
-						ieee80211_rx(sip->epub->hw, rskb);
-						local_bh_enable();
-#endif /* RX_SENDUP_SYNC */
+static void sip_rx_error(void *priv)
+{
+        sip_recalc_credit_claim((struct esp_sip *)priv, 0);
+}
 
-					} else {
-						kfree_skb(rskb);
-					}
-				} else {
-					if (ampdu_len->substate == RX_ABORT) {
-						u8 * a;
-						have_rxabort = true;
-						esp_sip_dbg(ESP_DBG_TRACE, "rx abort %d %d\n", frame_buf_ttl, pkt_num);
-						if(frame_buf_ttl && !sip->rxabort_fixed) {
-							struct esp_rx_ampdu_len * next_good_ampdu_len = ampdu_len + 1;
-							a = frame_head;
-							esp_sip_dbg(ESP_DBG_TRACE, "frame:%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
-									a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15]);
-							while(!sip_ampdu_occupy_buf(sip, next_good_ampdu_len)) {
-								if(next_good_ampdu_len > ampdu_len + pkt_num - 1)
-									break;
-								next_good_ampdu_len++;
-
-							}
-							if(next_good_ampdu_len <= ampdu_len + pkt_num -1) {
-								bool b0, b10, b11;
-								a = skb->data;
-								esp_sip_dbg(ESP_DBG_TRACE, "buf:%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
-										a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15]);
-								b0 = memcmp(frame_head + 4, skb->data + 4, 12) == 0;
-								b10 = memcmp(frame_head + 10, skb->data, 6) == 0;
-								b11 = memcpy(frame_head + 11, skb->data, 5) == 0;
-								esp_sip_dbg(ESP_DBG_TRACE, "com %d %d %d\n", b0, b10, b11);
-								if(b0 && !b10 && !b11) {
-									have_rxabort = false;
-									esp_sip_dbg(ESP_DBG_TRACE, "repair 0\n");
-								} else if(!b0 && b10 && !b11) {
-									skb_push(skb, 10);
-									memcpy(skb->data, frame_head, 10);
-									have_rxabort = false;
-									pulled_len -= 10;
-									esp_sip_dbg(ESP_DBG_TRACE, "repair 10\n");
-								} else if(!b0 && !b10 && b11) {
-									skb_push(skb, 11);
-									memcpy(skb->data, frame_head, 11);
-									have_rxabort = false;
-									pulled_len -= 11;
-									esp_sip_dbg(ESP_DBG_TRACE, "repair 11\n");
-								}
-							}
-						}
-					}
-					pkt_dropped++;
-					esp_sip_dbg(ESP_DBG_LOG, "%s ampdu dropped %d/%d\n", __func__, pkt_dropped, pkt_total);
-				}
-				pkt_num--;
-				ampdu_len++;
-			}
-			if(frame_buf_ttl)
-				frame_buf_ttl--;
-			skb_pull(skb, hdr->len - pulled_len);
-		} else {
-			esp_sip_dbg(ESP_DBG_ERROR, "%s %d unknown type\n", __func__, __LINE__);
-		}
+static const struct sip_rx_ops sip_rx_ops = {
+        .credits = sip_rx_credits,
+        .event = sip_rx_event,
+        .mpdu = sip_rx_mpdu,
+        .error = sip_rx_error,
+};
 
-_move_on:
-		if (hdr->len < remains_len) {
-			remains_len -= hdr->len;
-		} else {
-			break;
-		}
-		bufptr += hdr->len;
-	}
+static bool sip_rx_pkt_process(struct esp_sip * sip, struct sk_buff *skb)
+{
+        bool trigger_rxq;
+
+        sip->rxp.off = atomic_read(&sip->epub->wl.off) != 0;
+        trigger_rxq = sip_rx_parse(&sip->rxp, skb);
 
-_exit:
 #ifdef ESP_PREALLOC 
-	esp_put_sip_skb(&skb);
+        esp_put_sip_skb(&skb);
 #else
-	kfree_skb(skb);
+        kfree_skb(skb);
 #endif
 
-	return trigger_rxq;
-
-#undef DO_NOT_COPY
-#undef DO_COPY
+        return trigger_rxq;
 }
 
 static void _sip_rxq_process(struct esp_sip *sip)
@@ -593,6 +418,85 @@ static void _sip_rxq_process(struct esp_sip *sip)
         sip_trigger_txq_process(sip);
 }
 
+#ifdef SIF_TRACE
+/*
+ * feed one captured rx transfer back through the parser at full speed.
+ * Credits are stripped, events turned into credit reports and seqs
+ * renumbered from rxseq, which is put back afterwards, so the live link
+ * is left alone; data is sent up as usual.
+ */
+int sip_rx_replay(struct esp_sip *sip, const u8 *buf, u32 len)
+{
+        struct sk_buff *skb;
+        struct sip_hdr *hdr;
+        u32 remains, plen, seq, saved_seq;
+        u8 *p;
+        bool sendup;
+
+        if (len < sizeof(struct sip_hdr) || atomic_read(&sip->state) != SIP_RUN)
+                return -EINVAL;
+
+#ifdef ESP_PREALLOC
+        skb = esp_get_sip_skb(len, GFP_KERNEL);
+#else
+        skb = __dev_alloc_skb(len, GFP_KERNEL);
+#endif /* ESP_PREALLOC */
+        if (skb == NULL)
+                return -ENOMEM;
+        p = skb_put(skb, len);
+        memcpy(p, buf, len);
+
+        hdr = (struct sip_hdr *)p;
+        hdr->h_credits &= ~SIP_CREDITS_MASK;
+        remains = hdr->len;
+        plen = hdr->h_credits >> 12;
+        if (remains > len || remains < sizeof(struct sip_hdr))
+                goto _drop;
+
+        mutex_lock(&sip->rx_mtx);
+        saved_seq = sip->rxp.rxseq;
+        seq = saved_seq;
+
+        /* walk the chain the same way sip_rx_pkt_process will */
+        for (;;) {
+                if (plen == 0 || (plen & 3))
+                        goto _unlock_drop;
+                hdr = (struct sip_hdr *)p;
+                hdr->seq = seq++;
+                if (SIP_HDR_IS_CTRL(hdr))
+                        hdr->c_evtid = SIP_EVT_CREDIT_RPT;
+                if (plen >= remains)
+                        break;
+                remains -= plen;
+                p += plen;
+                if (remains < sizeof(struct sip_hdr))
+                        goto _unlock_drop;
+                plen = ((struct sip_hdr *)p)->len;
+        }
+
+        sendup = sip_rx_pkt_process(sip, skb);
+        /* the live link must not see the replayed frames in its seq */
+        sip->rxp.rxseq = saved_seq;
+        mutex_unlock(&sip->rx_mtx);
+
+#ifndef RX_SENDUP_SYNC
+        if (sendup)
+                queue_work(sip->epub->esp_wkq, &sip->epub->sendup_work);
+#endif /* !RX_SENDUP_SYNC */
+        return 0;
+
+_unlock_drop:
+        mutex_unlock(&sip->rx_mtx);
+_drop:
+#ifdef ESP_PREALLOC
+        esp_put_sip_skb(&skb);
+#else
+        kfree_skb(skb);
+#endif /* ESP_PREALLOC */
+        return -EINVAL;
+}
+#endif /* SIF_TRACE */
+
 void sip_rxq_process(struct work_struct *work)
 {
         struct esp_sip *sip = container_of(work, struct esp_sip, rx_process_work);
@@ -621,15 +525,14 @@ static inline struct sk_buff * sip_rx_pkt_dequeue(struct esp_sip *sip) {
         return skb_dequeue(&sip->rxq);
 }
 
-static u32 sip_rx_count = 0;
 void sip_debug_show(struct esp_sip *sip)
 {
 	esp_sip_dbg(ESP_DBG_ERROR, "txq left %d %d\n", skb_queue_len(&sip->epub->txq), atomic_read(&sip->tx_data_pkt_queued));
 	esp_sip_dbg(ESP_DBG_ERROR, "tx queues stop ? %d\n", atomic_read(&sip->epub->txq_stopped));
 	esp_sip_dbg(ESP_DBG_ERROR, "txq stop?  %d\n", test_bit(ESP_WL_FLAG_STOP_TXQ, &sip->epub->wl.flags));
 	esp_sip_dbg(ESP_DBG_ERROR, "tx credit %d\n", atomic_read(&sip->tx_credits));
-	esp_sip_dbg(ESP_DBG_ERROR, "rx collect %d\n", sip_rx_count);
-	sip_rx_count = 0;
+	esp_sip_dbg(ESP_DBG_ERROR, "rx collect %d\n", sip->rx_count);
+	sip->rx_count = 0;
 }
 
 int sip_rx(struct esp_pub *epub)
@@ -646,7 +549,7 @@ int sip_rx(struct esp_pub *epub)
 
         first_sz = sif_get_regs(epub)->config_w0;
 
-	if (likely(sif_get_ate_config() != 1)) {
+	if (likely(epub->conf.ate != 1)) {
 		do {
 			u8 raw_seq = sif_get_regs(epub)->intr_raw & 0xff;
 
@@ -657,6 +560,7 @@ int sip_rx(struct esp_pub *epub)
 					break;
 				}     
 				esp_dbg(ESP_DBG_ERROR, "err: to_host_seq reg 0x%02x, seq 0x%02x", raw_seq, sip->to_host_seq);
+				esp_schedule_recovery(epub, "to_host_seq mismatch");
 				goto _err;
 			}
 		} while (0);
@@ -691,7 +595,7 @@ int sip_rx(struct esp_pub *epub)
 	do{
 		int err2 = 0;
 		u16 value = 0;
-		u16 intr_mask = ext_gpio_get_int_mask_reg();
+		u16 intr_mask = ext_gpio_get_int_mask_reg(epub);
 		if(!intr_mask)
 			break;
 		value = sif_get_regs(epub)->config_w3 & intr_mask;
@@ -703,7 +607,7 @@ int sip_rx(struct esp_pub *epub)
 
 		if(!err2 && value) {
             		esp_sip_dbg(ESP_DBG_TRACE, "%s intr_mask[0x%04x] value[0x%04x]\n", __func__, intr_mask, value);
-			ext_gpio_int_process(value);
+			ext_gpio_int_process(epub, value);
 		}
 	}while(0);
 #endif
@@ -719,7 +623,7 @@ int sip_rx(struct esp_pub *epub)
 #else
         err = esp_common_read(epub, rx_buf, first_sz, ESP_SIF_NOSYNC, false);
 #endif //ESP_ACK_INTERRUPT
-	sip_rx_count++;
+	sip->rx_count++;
         if (unlikely(err)) {
                 esp_dbg(ESP_DBG_ERROR, " %s first read err %d %d\n", __func__, err, sif_get_regs(epub)->config_w0);
 #ifdef ESP_PREALLOC
@@ -737,7 +641,7 @@ int sip_rx(struct esp_pub *epub)
 		esp_dbg(ESP_DBG_TRACE, "s\n");
 	}
 
-	if (likely(sif_get_ate_config() != 1)) {
+	if (likely(sip->epub->conf.ate != 1)) {
 		sip->to_host_seq++;
 	}
  
@@ -806,14 +710,14 @@ int sip_post_init(struct esp_sip *sip, struct sip_evt_bootup2 *bevt)
         sip->tx_aggr_write_ptr = sip->tx_aggr_buf;
 
         sip->tx_blksz = bevt->tx_blksz;
-        sip->rx_blksz = bevt->rx_blksz;
+        sip->rxp.rx_blksz = bevt->rx_blksz;
         sip->credit_to_reserve = bevt->credit_to_reserve;
 
-        sip->dump_rpbm_err = (bevt->options & SIP_DUMP_RPBM_ERR);
-        sip->rxabort_fixed = (bevt->options & SIP_RXABORT_FIXED);
+        sip->rxp.dump_rpbm_err = (bevt->options & SIP_DUMP_RPBM_ERR);
+        sip->rxp.rxabort_fixed = (bevt->options & SIP_RXABORT_FIXED);
         sip->support_bgscan = (bevt->options & SIP_SUPPORT_BGSCAN);
 
-        sip->sendup_rpbm_pkt = sip->dump_rpbm_err && false;
+        sip->rxp.sendup_rpbm_pkt = sip->rxp.dump_rpbm_err && false;
 
         /* print out MAC addr... */
         memcpy(epub->mac_addr, bevt->mac_addr, ETH_ALEN);
@@ -838,11 +742,54 @@ int sip_post_init(struct esp_sip *sip, struct sip_evt_bootup2 *bevt)
 
 	sip_recalc_credit_init(sip);
 
-        esp_sip_dbg(ESP_DBG_TRACE, "%s tx_blksz %d rx_blksz %d mac addr %pM\n", __func__, sip->tx_blksz, sip->rx_blksz, epub->mac_addr);
+        esp_sip_dbg(ESP_DBG_TRACE, "%s tx_blksz %d rx_blksz %d mac addr %pM\n", __func__, sip->tx_blksz, sip->rxp.rx_blksz, epub->mac_addr);
 
        	return 0;
 }
 
+static void sip_tx_io_done(struct esp_pub *epub, struct sif_io_ctx *ctx, int err)
+{
+        struct sip_tx_io *io = container_of(ctx, struct sip_tx_io, ctx);
+
+        io->err = err;
+        if (err)
+                esp_sip_dbg(ESP_DBG_ERROR, "%s err %d\n", __func__, err);
+        complete(&io->done);
+}
+
+/*
+ * hand the filled buffer to the bus and keep packing into the other one,
+ * only wait if that one is still being written
+ */
+static void sip_write_pkts_async(struct esp_sip *sip, int tx_aggr_len)
+{
+        struct sip_tx_io *io = &sip->tx_io[sip->tx_io_cur];
+        int err;
+
+        reinit_completion(&io->done);
+        err = esp_common_write_async(sip->epub, sip->tx_aggr_buf, tx_aggr_len, &io->ctx);
+        if (err == -EBUSY) {
+                /* no free request, keep the bus order and go sync */
+                sif_io_flush(sip->epub);
+                sif_bus_get(sip->epub, SIF_BUS_TX);
+                sif_lock_bus(sip->epub);
+                err = esp_common_write(sip->epub, sip->tx_aggr_buf, tx_aggr_len, ESP_SIF_NOSYNC);
+                sif_unlock_bus(sip->epub);
+                sif_bus_put(sip->epub);
+        }
+        if (err) {
+                esp_sip_dbg(ESP_DBG_ERROR, "func %s err!!!!!!!!!: %d\n", __func__, err);
+                complete(&io->done);
+        }
+
+        sip->tx_io_cur ^= 1;
+        wait_for_completion(&sip->tx_io[sip->tx_io_cur].done);
+
+        sip->tx_aggr_buf = sip->tx_aggr_bufs[sip->tx_io_cur];
+        sip->tx_aggr_write_ptr = sip->tx_aggr_buf;
+        sip->tx_tot_len = 0;
+}
+
 /* write pkts in aggr buf to target memory */
 static void sip_write_pkts(struct esp_sip *sip, int pm_state)
 {
@@ -867,7 +814,13 @@ static void sip_write_pkts(struct esp_sip *sip, int pm_state)
                 first_shdr->fc[1] |= SIP_HDR_F_NEED_CRDT_RPT;
         }
 
+        if (sip->tx_aggr_bufs[1]) {
+                sip_write_pkts_async(sip, tx_aggr_len);
+                return;
+        }
+
         /* still use lock bus instead of sif_lldesc_write_sync since we want to protect several global varibles assignments */
+        sif_bus_get(sip->epub, SIF_BUS_TX);
         sif_lock_bus(sip->epub);
 
 	err = esp_common_write(sip->epub, sip->tx_aggr_buf, tx_aggr_len, ESP_SIF_NOSYNC);
@@ -876,6 +829,7 @@ static void sip_write_pkts(struct esp_sip *sip, int pm_state)
         sip->tx_tot_len = 0;
 
         sif_unlock_bus(sip->epub);
+        sif_bus_put(sip->epub);
 
 	if (err)
 		esp_sip_dbg(ESP_DBG_ERROR, "func %s err!!!!!!!!!: %d\n", __func__, err);
@@ -887,7 +841,7 @@ static int sip_pack_pkt(struct esp_sip *sip, struct sk_buff *skb, int *pm_state)
 {
         struct ieee80211_tx_info *itx_info;
         struct sip_hdr *shdr;
-        u32 tx_len = 0, offset = 0;
+        u32 tx_len = 0;
         bool is_data = true;
 
         itx_info = IEEE80211_SKB_CB(skb);
@@ -971,37 +925,28 @@ static int sip_pack_pkt(struct esp_sip *sip, struct sk_buff *skb, int *pm_state)
                 }
 
 
-                /* make sure data is start at 4 bytes aligned addr. */
-                offset = roundup(sizeof(struct sip_hdr), 4);
-
 #ifdef HOST_RC
-                esp_sip_dbg(ESP_DBG_TRACE, "%s offset0 %d \n", __func__, offset);
-                memcpy(sip->tx_aggr_write_ptr + offset, (void *)&itx_info->control,
+                /* right behind the sip_hdr, sip_pack_data() leaves room for it */
+                memcpy(sip->tx_aggr_write_ptr + roundup(sizeof(struct sip_hdr), 4), (void *)&itx_info->control,
                        sizeof(struct sip_tx_rc));
 
-                offset += roundup(sizeof(struct sip_tx_rc), 4);
                 esp_show_tx_rates(&itx_info->control.rates[0]);
 
 #endif /* HOST_RC */
 
-                if (SIP_HDR_IS_AMPDU(shdr)) {
-                        memset(sip->tx_aggr_write_ptr + offset, 0, sizeof(struct esp_tx_ampdu_entry));
-                        offset += roundup(sizeof(struct esp_tx_ampdu_entry), 4);
-                }
+                /* ampdu entry, frame copy, len and seq */
+                tx_len = sip_pack_data(sip->tx_aggr_write_ptr, skb->data, skb->len, sip->txseq++);
 
-                tx_len = offset + skb->len;
-                shdr->len = tx_len;  /* actual len */
+                esp_sip_dbg(ESP_DBG_TRACE, "%s skblen %d txlen %d\n", __func__, skb->len, tx_len);
 
-                esp_sip_dbg(ESP_DBG_TRACE, "%s offset %d skblen %d txlen %d\n", __func__, offset, skb->len, tx_len);
+        } else {
+                shdr->seq = sip->txseq++;
+                //esp_sip_dbg(ESP_DBG_ERROR, "%s seq %u, %u %u\n", __func__, shdr->seq, SIP_HDR_GET_TYPE(shdr->fc[0]),shdr->c_cmdid);
 
+                /* copy skb to aggr buf */
+                memcpy(sip->tx_aggr_write_ptr, skb->data, skb->len);
         }
 
-        shdr->seq = sip->txseq++;
-        //esp_sip_dbg(ESP_DBG_ERROR, "%s seq %u, %u %u\n", __func__, shdr->seq, SIP_HDR_GET_TYPE(shdr->fc[0]),shdr->c_cmdid);
-
-        /* copy skb to aggr buf */
-        memcpy(sip->tx_aggr_write_ptr + offset, skb->data, skb->len);
-
         if (is_data) {
 			spin_lock_bh(&sip->epub->tx_lock);
 			sip->txdataseq = shdr->seq;
@@ -1254,8 +1199,10 @@ sip_txq_process(struct esp_pub *epub)
         bool out_of_credits = false;
         struct ieee80211_tx_info *itx_info;
         int pm_state = 0;
+        bool resync, is_recalc;
 	
         while ((skb = skb_dequeue(&epub->txq))) {
+                is_recalc = false;
 
                 /* cmd skb->len does not include sip_hdr too */
                 pkt_len = skb->len;
@@ -1275,17 +1222,33 @@ sip_txq_process(struct esp_pub *epub)
                 blknum = pkt_len / sip->tx_blksz;
                 esp_dbg(ESP_DBG_TRACE, "%s skb_len %d pkt_len %d blknum %d\n", __func__, skb->len, pkt_len, blknum);
 
-	        if (unlikely(atomic_read(&sip->credit_status) == RECALC_CREDIT_ENABLE)) {      /* need recalc credit */
+		resync = atomic_read(&sip->credit_status) == RECALC_CREDIT_ENABLE;
+		if (resync) {
 			struct sip_hdr *hdr = (struct sip_hdr*)skb->data;
-			itx_info = IEEE80211_SKB_CB(skb);
-        		if (!(itx_info->flags == 0xffffffff && SIP_HDR_GET_TYPE(hdr->fc[0]) == SIP_CTRL && hdr->c_cmdid == SIP_CMD_RECALC_CREDIT
-					&& blknum <= atomic_read(&sip->tx_credits) - sip->credit_to_reserve)) {         /* except cmd recalc credit */
+			is_recalc = itx_info->flags == 0xffffffff && SIP_HDR_GET_TYPE(hdr->fc[0]) == SIP_CTRL
+					&& hdr->c_cmdid == SIP_CMD_RECALC_CREDIT;
+		}
+
+	        if (unlikely(resync && is_recalc)) {      /* need recalc credit */
+			if (blknum > atomic_read(&sip->tx_credits) - sip->credit_to_reserve) {
                         	esp_dbg(ESP_DBG_ERROR, "%s recalc credits!\n", __func__);
                         	STRACE_TX_OUT_OF_CREDIT_INC();
                         	queued_back = true;
                         	out_of_credits = true;
                         	break;
 			}
+		} else if (unlikely(resync && (!sip->resync_sent
+				|| atomic_read(&sip->resync_spent) + blknum > SIP_RESYNC_CREDITS
+				|| blknum > atomic_read(&sip->tx_credits) - sip->credit_to_reserve - SIP_CTRL_CREDIT_RESERVE))) {
+			/*
+			 * the old estimate is only trusted for a small slice, and
+			 * ctrl pkts get no share of the reserve while it is in use
+			 */
+			esp_dbg(ESP_DBG_TRACE, "%s resync budget used up\n", __func__);
+			STRACE_TX_OUT_OF_CREDIT_INC();
+			queued_back = true;
+			out_of_credits = true;
+			break;
                 } else {                  /* normal situation */
                 	if (unlikely(blknum > (atomic_read(&sip->tx_credits) - sip->credit_to_reserve - SIP_CTRL_CREDIT_RESERVE))) {
 				itx_info = IEEE80211_SKB_CB(skb);
@@ -1322,6 +1285,17 @@ sip_txq_process(struct esp_pub *epub)
                         continue;
                 }
 
+                if (unlikely(resync)) {
+                        if (is_recalc) {
+                                /* blocks before this cmd are in its report */
+                                atomic_set(&sip->resync_spent, 0);
+                                sip->resync_sent = true;
+                        } else {
+                                atomic_add(blknum, &sip->resync_spent);
+                                sip->resync_stat.tx_blocks += blknum;
+                        }
+                }
+
                 esp_sip_dbg(ESP_DBG_TRACE, "%s before sub, credits is %d\n", __func__, atomic_read(&sip->tx_credits));
                 atomic_sub(blknum, &sip->tx_credits);
                 esp_sip_dbg(ESP_DBG_TRACE, "%s after sub %d,credits remains %d\n", __func__, blknum, atomic_read(&sip->tx_credits));
@@ -1581,84 +1555,22 @@ static int sip_parse_mac_rx_info(struct esp_sip *sip, struct esp_mac_rx_ctrl * m
         return 0;
 }
 
-static struct esp_mac_rx_ctrl *sip_parse_normal_mac_ctrl(struct sk_buff *skb, int * pkt_len_enc, int *buf_len, int *pulled_len) 
+static void sip_resync_debugfs(struct esp_sip *sip)
 {
-        struct esp_mac_rx_ctrl *mac_ctrl = NULL;
-        struct sip_hdr *hdr =(struct sip_hdr *)skb->data;
-        int len_in_hdr = hdr->len;
-
-        ESSERT(skb != NULL);
-        ESSERT(skb->len > SIP_MIN_DATA_PKT_LEN);
-
-        skb_pull(skb, sizeof(struct sip_hdr));
-        *pulled_len += sizeof(struct sip_hdr);
-        mac_ctrl = (struct esp_mac_rx_ctrl *)skb->data;
-        if(!mac_ctrl->Aggregation) {
-                ESSERT(pkt_len_enc != NULL);
-                ESSERT(buf_len != NULL);
-                *pkt_len_enc = (mac_ctrl->sig_mode?mac_ctrl->HT_length:mac_ctrl->legacy_length) - FCS_LEN;
-                *buf_len = len_in_hdr - sizeof(struct sip_hdr) - sizeof(struct esp_mac_rx_ctrl);
-        }
-        skb_pull(skb, sizeof(struct esp_mac_rx_ctrl));
-        *pulled_len += sizeof(struct esp_mac_rx_ctrl);
-
-        return mac_ctrl;
-}
-
-/*
- * for one MPDU (including subframe in AMPDU)
- *
- */
-static struct sk_buff * sip_parse_data_rx_info(struct esp_sip *sip, struct sk_buff *skb, int pkt_len_enc, int buf_len, struct esp_mac_rx_ctrl *mac_ctrl, int *pulled_len) {
-        /*
-         *   | mac_rx_ctrl | real_data_payload | ampdu_entries |
-         */
-        //without enc
-        int pkt_len = 0;
-        struct sk_buff *rskb = NULL;
-        int ret;
-
-        if (mac_ctrl->Aggregation) {
-                struct ieee80211_hdr * wh = (struct ieee80211_hdr *)skb->data;
-                pkt_len = pkt_len_enc;
-                if (ieee80211_has_protected(wh->frame_control))//ampdu, it is CCMP enc
-                        pkt_len -= 8;
-                buf_len = roundup(pkt_len, 4);
-        } else
-                pkt_len  = buf_len - 3 + ((pkt_len_enc - 1) & 0x3);
-        esp_dbg(ESP_DBG_TRACE, "%s pkt_len %u, pkt_len_enc %u!, delta %d \n", __func__, pkt_len, pkt_len_enc, pkt_len_enc - pkt_len);
-        do {
-#ifndef NO_WMM_DUMMY
-                rskb = __dev_alloc_skb(pkt_len_enc + sizeof(esp_wmm_param) + 2, GFP_ATOMIC);
-#else
-                rskb = __dev_alloc_skb(pkt_len_enc, GFP_ATOMIC);
-#endif /* NO_WMM_DUMMY */
-                if (unlikely(rskb == NULL)) {
-                        esp_sip_dbg(ESP_DBG_ERROR, "%s no mem for rskb\n", __func__);
-                        return NULL;
-                }
-                skb_put(rskb, pkt_len_enc);
-        } while(0);
-
-        do {
-                memcpy(rskb->data, skb->data, pkt_len);
-                if (pkt_len_enc > pkt_len) {
-                        memset(rskb->data + pkt_len, 0, pkt_len_enc - pkt_len);
-                }
-                /* strip out current pkt, move to the next one */
-                skb_pull(skb, buf_len);
-                *pulled_len += buf_len;
-        } while (0);
-
-        ret = sip_parse_mac_rx_info(sip, mac_ctrl, rskb);
-        if(ret == -1 && !mac_ctrl->Aggregation) {
-                kfree_skb(rskb);
-                return NULL;
-        }
+	struct sip_resync_stat *st = &sip->resync_stat;
+	char name[32];
 
-        esp_dbg(ESP_DBG_LOG, "%s after pull headers, skb->len %d rskb->len %d \n", __func__, skb->len, rskb->len);
+	snprintf(name, sizeof(name), "credit_%s", wiphy_name(sip->epub->hw->wiphy));
+	sip->resync_dir = esp_debugfs_add_sub_dir(name);
+	if (sip->resync_dir == NULL)
+		return;
 
-        return rskb;
+	esp_dump_var("resyncs", sip->resync_dir, &st->resyncs, ESP_U32);
+	esp_dump_var("resync_timeouts", sip->resync_dir, &st->timeouts, ESP_U32);
+	esp_dump_var("resync_tx_blocks", sip->resync_dir, &st->tx_blocks, ESP_U32);
+	esp_dump_var("resync_last_us", sip->resync_dir, &st->last_us, ESP_U32);
+	esp_dump_var("resync_max_us", sip->resync_dir, &st->max_us, ESP_U32);
+	esp_dump_var("resync_total_us", sip->resync_dir, &st->total_us, ESP_U64);
 }
 
 struct esp_sip * sip_attach(struct esp_pub *epub) 
@@ -1686,6 +1598,18 @@ struct esp_sip * sip_attach(struct esp_pub *epub)
                 esp_dbg(ESP_DBG_ERROR, "no mem for tx_aggr_buf! \n");
 		goto _err_aggr;
         }
+        sip->tx_aggr_bufs[0] = sip->tx_aggr_buf;
+#ifndef ESP_PREALLOC
+        /* second buffer to pack into while the first is on the bus */
+        sip->tx_aggr_bufs[1] = (u8 *)__get_free_pages(GFP_KERNEL, po);
+        if (sip->tx_aggr_bufs[1] == NULL)
+                esp_dbg(ESP_DBG_ERROR, "no mem for 2nd tx_aggr_buf, sync tx\n");
+#endif
+        for (i = 0; i < 2; i++) {
+                sip->tx_io[i].ctx.done = sip_tx_io_done;
+                init_completion(&sip->tx_io[i].done);
+                complete(&sip->tx_io[i].done);
+        }
 
         spin_lock_init(&sip->lock);
 
@@ -1723,11 +1647,17 @@ struct esp_sip * sip_attach(struct esp_pub *epub)
         sip->epub = epub;
 	atomic_set(&sip->noise_floor, -96);
 
+        sip->rxp.ops = &sip_rx_ops;
+        sip->rxp.priv = sip;
+#ifndef NO_WMM_DUMMY
+        sip->rxp.rx_tailroom = sizeof(esp_wmm_param) + 2;
+#endif /* NO_WMM_DUMMY */
+
         atomic_set(&sip->state, SIP_INIT);
 	atomic_set(&sip->tx_credits, 0);
 
         if (sip->rawbuf == NULL) {
-                sip->rawbuf = kzalloc(SIP_BOOT_BUF_SIZE, GFP_KERNEL);
+                sip->rawbuf = kzalloc(SIP_FW_RAWBUF_SIZE, GFP_KERNEL);
                 if (sip->rawbuf == NULL) {
                 	esp_dbg(ESP_DBG_ERROR, "no mem for rawbuf! \n");
 			goto _err_pkt;
@@ -1735,6 +1665,8 @@ struct esp_sip * sip_attach(struct esp_pub *epub)
 	}
 
         atomic_set(&sip->state, SIP_PREPARE_BOOT);
+
+        sip_resync_debugfs(sip);
      
         return sip;
 
@@ -1748,6 +1680,8 @@ _err_pkt:
                 po = get_order(SIP_TX_AGGR_BUF_SIZE);
                 free_pages((unsigned long)sip->tx_aggr_buf, po);
                 sip->tx_aggr_buf = NULL;
+                if (sip->tx_aggr_bufs[1])
+                        free_pages((unsigned long)sip->tx_aggr_bufs[1], po);
 #endif
 	}
 _err_aggr:
@@ -1789,6 +1723,52 @@ static void sip_free_init_ctrl_buf(struct esp_sip *sip)
         }
 }
 
+/*
+ * stop a running sip for an in-place reboot: no irq, no workers, no
+ * pending frames, but all buffers kept for the next bootup
+ */
+void sip_quiesce(struct esp_sip *sip)
+{
+        struct esp_pub *epub = sip->epub;
+
+        atomic_set(&epub->txq_stopped, true);
+        ieee80211_stop_queues(epub->hw);
+
+        sif_disable_target_interrupt(epub);
+        atomic_set(&sip->state, SIP_STOP);
+        atomic_set(&sip->tx_credits, 0);
+        sif_disable_irq(epub);
+
+        del_timer_sync(&sip->credit_timer);
+        atomic_set(&sip->credit_status, RECALC_CREDIT_DISABLE);
+        sip->credit_timeouts = 0;
+
+        cancel_work_sync(&sip->rx_process_work);
+        cancel_work_sync(&epub->tx_work);
+        sif_io_flush(epub);
+#ifndef RX_SENDUP_SYNC
+        cancel_work_sync(&epub->sendup_work);
+#endif
+
+        /* mac80211 won't restart while it thinks a hw scan is running */
+        cancel_delayed_work_sync(&epub->scan_timeout_work);
+        if (epub->wl.scan_req)
+                hw_scan_done(epub, true);
+
+#ifndef ESP_PREALLOC
+        skb_queue_purge(&sip->rxq);
+#else
+        esp_prealloc_skb_queue_purge(&sip->rxq);
+#endif
+        skb_queue_purge(&epub->rxq);
+        skb_queue_purge(&epub->txq);
+        skb_queue_purge(&epub->txdoneq);
+        atomic_set(&sip->tx_data_pkt_queued, 0);
+#ifndef FAST_TX_STATUS
+        atomic_set(&sip->pending_tx_status, 0);
+#endif
+}
+
 void sip_detach(struct esp_sip *sip)
 {
 #ifndef ESP_PREALLOC
@@ -1797,9 +1777,14 @@ void sip_detach(struct esp_sip *sip)
 	if (sip == NULL)
 		return ;
 
+        cancel_work_sync(&sip->epub->recovery_work);
+        debugfs_remove_recursive(sip->resync_dir);
+
         sip_free_init_ctrl_buf(sip);
 
-        if (atomic_read(&sip->state) == SIP_RUN) {
+        /* a failed recovery leaves a registered hw in a boot state */
+        if (atomic_read(&sip->state) == SIP_RUN
+            || test_bit(ESP_WL_FLAG_HW_REGISTERED, &sip->epub->wl.flags)) {
 
                 sif_disable_target_interrupt(sip->epub);
 
@@ -1829,16 +1814,20 @@ void sip_detach(struct esp_sip *sip)
 
                 /* cancel all worker/timer */
                 cancel_work_sync(&sip->epub->tx_work);
+                sif_io_flush(sip->epub);
                 skb_queue_purge(&sip->epub->txq);
                 skb_queue_purge(&sip->epub->txdoneq);
 
 #ifdef ESP_PREALLOC
-		esp_put_tx_aggr_buf(&sip->tx_aggr_buf);
+		esp_put_tx_aggr_buf(&sip->tx_aggr_bufs[0]);
 #else
                 po = get_order(SIP_TX_AGGR_BUF_SIZE);
-                free_pages((unsigned long)sip->tx_aggr_buf, po);
-                sip->tx_aggr_buf = NULL;
+                free_pages((unsigned long)sip->tx_aggr_bufs[0], po);
+                if (sip->tx_aggr_bufs[1])
+                        free_pages((unsigned long)sip->tx_aggr_bufs[1], po);
 #endif
+                sip->tx_aggr_buf = NULL;
+                kfree(sip->rawbuf);
 
                 atomic_set(&sip->state, SIP_INIT);
         } else if (atomic_read(&sip->state) >= SIP_BOOT && atomic_read(&sip->state) <= SIP_WAIT_BOOTUP) {
@@ -1877,14 +1866,25 @@ void sip_detach(struct esp_sip *sip)
         kfree(sip);
 }
 
-int sip_write_memory(struct esp_sip *sip, u32 addr, u8 *buf, u16 len)
+/*
+ * the rom loader takes at most SIP_BOOT_BUF_SIZE per WRITE_MEMORY, so
+ * pack up to mod_fw_batch() of them into one bus transfer the way tx
+ * data is aggregated, each sip_hdr starting a new block. The sync write
+ * only returns once the transfer is done on the bus, no extra settle
+ * delay is needed. A failed transfer is resent right away rather than
+ * left to the bootup timeout.
+ */
+int sip_write_memory(struct esp_sip *sip, u32 addr, u8 *buf, u32 len)
 {
         struct sip_cmd_write_memory *cmd;
         struct sip_hdr *chdr;
-        u16 remains, hdrs, bufsize;
+        u32 remains, hdrs, bufsize, fill;
         u32 loadaddr;
         u8 *src;
         int err = 0;
+        int batch = mod_fw_batch();
+        int n, retry;
+        u32 blksz;
 	u32 *t = NULL;
 
 	if (sip == NULL || sip->rawbuf == NULL) {
@@ -1893,49 +1893,65 @@ int sip_write_memory(struct esp_sip *sip, u32 addr, u8 *buf, u16 len)
 		return -EINVAL;
 	}
 
-        memset(sip->rawbuf, 0, SIP_BOOT_BUF_SIZE);
-
-        chdr = (struct sip_hdr *)sip->rawbuf;
-        SIP_HDR_SET_TYPE(chdr->fc[0], SIP_CTRL);
-        chdr->c_cmdid = SIP_CMD_WRITE_MEMORY;
-
         remains = len;
         hdrs = sizeof(struct sip_hdr) + sizeof(struct sip_cmd_write_memory);
+        blksz = sif_get_blksz(sip->epub);
 
         while (remains) {
-                src = &buf[len - remains];
-                loadaddr = addr + (len - remains);
-
-                if (remains < (SIP_BOOT_BUF_SIZE - hdrs)) {
-                        /* aligned with 4 bytes */
-                        bufsize = roundup(remains, 4);
-                        memset(sip->rawbuf + hdrs, 0, bufsize);
-                        remains = 0;
-                } else {
-                        bufsize = SIP_BOOT_BUF_SIZE - hdrs;
-                        remains -=  bufsize;
-                }
+                fill = 0;
+
+                for (n = 0; n < batch && remains; n++) {
+                        if (roundup(fill, blksz) + SIP_BOOT_BUF_SIZE > SIP_FW_RAWBUF_SIZE)
+                                break;
+                        memset(sip->rawbuf + fill, 0, roundup(fill, blksz) - fill);
+                        fill = roundup(fill, blksz);
+
+                        src = &buf[len - remains];
+                        loadaddr = addr + (len - remains);
+                        chdr = (struct sip_hdr *)(sip->rawbuf + fill);
+
+                        if (remains < (SIP_BOOT_BUF_SIZE - hdrs)) {
+                                /* aligned with 4 bytes */
+                                bufsize = roundup(remains, 4);
+                                memset((u8 *)chdr + hdrs, 0, bufsize);
+                                memcpy((u8 *)chdr + hdrs, src, remains);
+                                remains = 0;
+                        } else {
+                                bufsize = SIP_BOOT_BUF_SIZE - hdrs;
+                                memcpy((u8 *)chdr + hdrs, src, bufsize);
+                                remains -=  bufsize;
+                        }
+
+                        memset(chdr, 0, sizeof(struct sip_hdr));
+                        SIP_HDR_SET_TYPE(chdr->fc[0], SIP_CTRL);
+                        chdr->c_cmdid = SIP_CMD_WRITE_MEMORY;
+                        chdr->len = bufsize + hdrs;
+                        chdr->seq = sip->txseq++;
+                        cmd = (struct sip_cmd_write_memory *)((u8 *)chdr + SIP_CTRL_HDR_LEN);
+                        cmd->len = bufsize;
+                        cmd->addr = loadaddr;
 
-                chdr->len = bufsize + hdrs;
-                chdr->seq = sip->txseq++;
-                cmd = (struct sip_cmd_write_memory *)(sip->rawbuf + SIP_CTRL_HDR_LEN);
-                cmd->len = bufsize;
-                cmd->addr = loadaddr;
-                memcpy(sip->rawbuf+hdrs, src, bufsize);
+                        t = (u32 *)chdr;
+                        esp_dbg(ESP_DBG_LOG, "%s t0: 0x%08x t1: 0x%08x t2:0x%08x loadaddr 0x%08x \n", __func__, t[0], t[1], t[2], loadaddr);
 
-                t = (u32 *)sip->rawbuf;
-                esp_dbg(ESP_DBG_LOG, "%s t0: 0x%08x t1: 0x%08x t2:0x%08x loadaddr 0x%08x \n", __func__, t[0], t[1], t[2], loadaddr);
+                        fill += chdr->len;
+                }
 
-				err = esp_common_write(sip->epub, sip->rawbuf, chdr->len, ESP_SIF_SYNC);
+                for (retry = 0; ; retry++) {
+                        err = esp_common_write(sip->epub, sip->rawbuf, fill, ESP_SIF_SYNC);
+                        if (err == 0 || retry == SIP_FW_WRITE_RETRY)
+                                break;
+                        esp_dbg(ESP_DBG_ERROR, "%s resend %u bytes before 0x%08x, err %d\n",
+                                __func__, fill, addr + (len - remains), err);
+                }
 
                 if (err) {
                         esp_dbg(ESP_DBG_ERROR, "%s send buffer failed\n", __func__);
                         return err;
                 }
 
-                // 1ms is enough, in fact on dell-d430, need not delay at all.
-                mdelay(1);
-
+                if (mod_fw_delay_us())
+                        usleep_range(mod_fw_delay_us(), mod_fw_delay_us() + 50);
         }
 
         return err;
@@ -1967,7 +1983,11 @@ int sip_send_cmd(struct esp_sip *sip, int cid, u32 cmdlen, void *cmd)
 
         esp_dbg(ESP_DBG_TRACE, "%s c1 0x%08x c2 0x%08x\n", __func__, *(u32 *)&pkt->buf[0], *(u32 *)&pkt->buf[4]);
 
-		ret = esp_common_write(sip->epub, pkt->buf_begin, chdr->len, ESP_SIF_SYNC);
+        /* seq is already taken, let queued aggregates reach the bus first */
+        sif_io_flush(sip->epub);
+        sif_bus_get(sip->epub, SIF_BUS_CTRL);
+        ret = esp_common_write(sip->epub, pkt->buf_begin, chdr->len, ESP_SIF_SYNC);
+        sif_bus_put(sip->epub);
 
         if (ret)
                 esp_dbg(ESP_DBG_ERROR, "%s send cmd %d failed \n", __func__, cid);
@@ -1978,7 +1998,7 @@ int sip_send_cmd(struct esp_sip *sip, int cid, u32 cmdlen, void *cmd)
          *  Hack here: reset tx/rx seq before target ram code is up...
          */
         if (cid == SIP_CMD_BOOTUP) {
-                sip->rxseq = 0;
+                sip->rxp.rxseq = 0;
                 sip->txseq = 0;
 		sip->txdataseq = 0;
         }
@@ -1986,6 +2006,28 @@ int sip_send_cmd(struct esp_sip *sip, int cid, u32 cmdlen, void *cmd)
         return ret;
 }
 
+/*
+ * ctrl cmd written straight to the bus while the tx path is idle, e.g.
+ * around host suspend when mac80211 work is quiesced. Charged to the
+ * credits like sip_write_pkts() would.
+ */
+int sip_send_cmd_sync(struct esp_sip *sip, int cid, u32 cmdlen, void *cmd)
+{
+        int blknum = roundup(SIP_CTRL_HDR_LEN + cmdlen, sip->tx_blksz) / sip->tx_blksz;
+        int ret;
+
+        if (blknum > atomic_read(&sip->tx_credits) - sip->credit_to_reserve) {
+                esp_dbg(ESP_DBG_ERROR, "%s cmd %d out of credits\n", __func__, cid);
+                return -EBUSY;
+        }
+
+        ret = sip_send_cmd(sip, cid, cmdlen, cmd);
+        if (ret == 0)
+                atomic_sub(blknum, &sip->tx_credits);
+
+        return ret;
+}
+
 struct sk_buff *
 sip_alloc_ctrl_skbuf(struct esp_sip *sip, u16 len, u32 cid) {
         struct sip_hdr *si = NULL;
@@ -2078,20 +2120,27 @@ sip_poll_bootup_event(struct esp_sip *sip)
 
         esp_dbg(ESP_DBG_TRACE, "%s polling bootup event... \n", __func__);
 
-	if (gl_bootup_cplx)
-		ret = wait_for_completion_timeout(gl_bootup_cplx, 2 * HZ);
+	if (sip->epub->bootup_cplx)
+		ret = wait_for_completion_timeout(sip->epub->bootup_cplx, esp_boot_timeout(sip->epub, 2 * HZ));
 
 	if (ret <= 0) {
 		esp_dbg(ESP_DBG_ERROR, "%s bootup event timeout\n", __func__);
 		return -ETIMEDOUT;
 	}
-	if(sif_get_ate_config() == 0
+	/* a recovery reboot, mac80211 is replayed by ieee80211_restart_hw() */
+	if (test_bit(ESP_WL_FLAG_HW_REGISTERED, &sip->epub->wl.flags)) {
+		atomic_set(&sip->state, SIP_RUN);
+		esp_dbg(ESP_DBG_TRACE, "%s target rebooted\n", __func__);
+		return 0;
+	}
+
+	if(sip->epub->conf.ate == 0
 #if defined(CONFIG_DEBUG_FS) && defined(DEBUGFS_BOOTMODE)
 		&& dbgfs_get_bootmode_var(DBGFS_FCC_MODE) == 0
 
 #endif
 #ifdef ESP_CLASS
-		&& sif_get_fccmode() == 0
+		&& sip->epub->conf.fccmode == 0
 #endif
 	) {
 		 ret = esp_register_mac80211(sip->epub);
@@ -2118,15 +2167,15 @@ sip_poll_resetting_event(struct esp_sip *sip)
 
         esp_dbg(ESP_DBG_TRACE, "%s polling resetting event... \n", __func__);
 
-	if (gl_bootup_cplx)
-		ret = wait_for_completion_timeout(gl_bootup_cplx, 100 * HZ);
+	if (sip->epub->bootup_cplx)
+		ret = wait_for_completion_timeout(sip->epub->bootup_cplx, esp_boot_timeout(sip->epub, 100 * HZ));
 
 	if (ret <= 0) {
 		esp_dbg(ESP_DBG_ERROR, "%s resetting event timeout\n", __func__);
 		return -ETIMEDOUT;
 	}
 
-        esp_dbg(ESP_DBG_TRACE, "%s target reset %d %p\n", __func__, ret, gl_bootup_cplx);
+        esp_dbg(ESP_DBG_TRACE, "%s target reset %d %p\n", __func__, ret, sip->epub->bootup_cplx);
 
 	return 0;
 }
@@ -2201,7 +2250,7 @@ sip_cmd_enqueue(struct esp_sip *sip, struct sk_buff *skb, int prior)
 	else
         	skb_queue_tail(&sip->epub->txq, skb);
 
-        if(sif_get_ate_config() == 0){
+        if(sip->epub->conf.ate == 0){
             ieee80211_queue_work(sip->epub->hw, &sip->epub->tx_work);
         } else {
             queue_work(sip->epub->esp_wkq, &sip->epub->tx_work);
@@ -2232,7 +2281,7 @@ void sip_tx_data_pkt_enqueue(struct esp_pub *epub, struct sk_buff *skb)
 		}
 
 	}
-        if(sif_get_ate_config() == 0){
+        if(epub->conf.ate == 0){
             ieee80211_queue_work(epub->hw, &epub->tx_work);
         } else {
             queue_work(epub->esp_wkq, &epub->tx_work);
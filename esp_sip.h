@@ -11,7 +11,11 @@
 #ifndef _ESP_SIP_H
 #define _ESP_SIP_H
 
+#include <linux/ktime.h>
+#include <linux/completion.h>
 #include "sip2_common.h"
+#include "sip_parse.h"
+#include "esp_sif.h"
 
 #define SIP_CTRL_CREDIT_RESERVE      2
 
@@ -20,6 +24,11 @@
 /* 16KB on normal X86 system, should check before porting to orhters */
 
 #define SIP_TX_AGGR_BUF_SIZE (4 * PAGE_SIZE)
+#define SIP_FW_BATCH_MAX 16   /* WRITE_MEMORY cmds per fw download transfer */
+#define SIP_FW_RAWBUF_SIZE (SIP_FW_BATCH_MAX * 512)  /* one cmd per sif block */
+#define SIP_FW_WRITE_RETRY 3
+#define SIP_RECALC_CREDIT_MAX_RETRY 3  /* unanswered recalc claims before a recovery */
+#define SIP_RESYNC_CREDITS 16  /* blocks sent on the old estimate while a recalc is in flight */
 #define SIP_RX_AGGR_BUF_SIZE (4 * PAGE_SIZE)
 
 struct sk_buff;
@@ -60,11 +69,28 @@ enum sip_notifier {
 
 #define SIP_CREDITS_LOW_THRESHOLD  64  //i.e. 4k
 
+/* credit resync, see sip_recalc_credit_claim() */
+struct sip_resync_stat {
+	u32 resyncs;
+	u32 timeouts;	/* claims re-sent after 2s without an answer */
+	u32 tx_blocks;	/* sent on the estimate while resyncing */
+	u32 last_us;	/* claim until the absolute count came back */
+	u32 max_us;
+	u64 total_us;
+};
+
+/* one tx aggregate on its way to the bus */
+struct sip_tx_io {
+        struct sif_io_ctx ctx;
+        struct completion done;
+        int err;
+};
+
 struct esp_sip {
         struct list_head free_ctrl_txbuf;
         struct list_head free_ctrl_rxbuf;
 
-        u32 rxseq; /* sip pkt seq, should match target side */
+        struct sip_rx_parser rxp; /* rxseq, rx_blksz and the rx options */
         u32 txseq;
 	u32 txdataseq;
 
@@ -77,7 +103,10 @@ struct esp_sip {
         atomic_t tx_ask_credit_update;
 
         u8 * rawbuf;  /* used in boot stage, free once chip is fully up */
-        u8 * tx_aggr_buf;
+        u8 * tx_aggr_buf;       /* the one being filled, one of tx_aggr_bufs */
+        u8 * tx_aggr_bufs[2];   /* [1] NULL: single buffer, sync writes */
+        struct sip_tx_io tx_io[2];
+        int tx_io_cur;
         u8 * tx_aggr_write_ptr;  /* update after insertion of each pkt */
         u8 * tx_aggr_lastpkt_ptr;
 
@@ -86,21 +115,24 @@ struct esp_sip {
         struct work_struct rx_process_work;
 
         u16 tx_blksz;
-        u16 rx_blksz;
 
-        bool dump_rpbm_err;
-        bool sendup_rpbm_pkt;
-        bool rxabort_fixed;
         bool support_bgscan;
         u8 credit_to_reserve;
 	
 	atomic_t credit_status;
 	struct timer_list credit_timer;
+	u8 credit_timeouts;	/* recalc claims unanswered in a row */
+	bool resync_sent;	/* the recalc cmd is out, later blocks are counted */
+	atomic_t resync_spent;	/* blocks sent behind the recalc cmd */
+	ktime_t resync_start;
+	struct sip_resync_stat resync_stat;
+	struct dentry *resync_dir;
 
 	atomic_t noise_floor;
 
         u32 tx_tot_len; /* total len for one transaction */
         u32 rx_tot_len;
+        u32 rx_count; /* rx reads since last sip_debug_show */
 
         atomic_t rx_handling;
         atomic_t tx_data_pkt_queued;
@@ -116,19 +148,26 @@ struct esp_sip {
 };
 
 int sip_rx(struct esp_pub * epub);
+#ifdef SIF_TRACE
+int sip_rx_replay(struct esp_sip *sip, const u8 *buf, u32 len);
+#endif /* SIF_TRACE */
 //int sip_download_fw(struct esp_sip *sip, u32 load_addr, u32 boot_addr);
 
 
-int sip_write_memory(struct esp_sip *, u32 addr, u8* buf, u16 len);
+int sip_write_memory(struct esp_sip *, u32 addr, u8* buf, u32 len);
 
 void sip_credit_process(struct esp_pub *, u8 credits);
 
 int sip_send_cmd(struct esp_sip *sip, int cid, u32 cmdlen, void * cmd);
 
+int sip_send_cmd_sync(struct esp_sip *sip, int cid, u32 cmdlen, void *cmd);
+
 struct esp_sip * sip_attach(struct esp_pub *);
 
 int sip_post_init(struct esp_sip *sip, struct sip_evt_bootup2 *bevt);
 
+void sip_quiesce(struct esp_sip *sip);
+
 void sip_detach(struct esp_sip *sip);
 
 void sip_txq_process(struct esp_pub *epub);
@@ -161,6 +200,10 @@ bool mod_support_no_rxampdu(void);
 
 void mod_support_no_txampdu_set(bool value);
 
+int mod_fw_batch(void);
+
+int mod_fw_delay_us(void);
+
 #ifdef FPGA_DEBUG
 int sip_send_bootup(struct esp_sip *sip);
 #endif /* FPGA_DEBUG */
@@ -0,0 +1,330 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   sif bus capture and replay
+ *    - timestamped esp_common_* transactions into a byte ring
+ *    - esp_debug/sif_trace_<phy>/capture drains whole records
+ *    - writing a capture to .../replay feeds rx transfers to the parser
+ */
+#ifdef SIF_TRACE
+
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h>
+
+#include "esp_pub.h"
+#include "esp_sip.h"
+#include "esp_debug.h"
+#include "esp_trace.h"
+
+static unsigned int sif_trace_kb = 1024;
+module_param(sif_trace_kb, uint, 0444);
+MODULE_PARM_DESC(sif_trace_kb, "sif capture ring size per device in KB");
+
+#define SIF_TRACE_MAX_CAP	SIP_PKT_MAX_LEN
+#define SIF_TRACE_REC_MAX	(sizeof(struct sif_trace_rec) + SIF_TRACE_MAX_CAP)
+#define SIF_TRACE_REPLAY_BUF	(2 * SIF_TRACE_REC_MAX)
+
+static inline u32 sif_trace_rec_size(u32 caplen)
+{
+	return sizeof(struct sif_trace_rec) + roundup(caplen, 4);
+}
+
+static void sif_trace_copy_in(struct esp_trace *tr, u32 off, const void *src, u32 n)
+{
+	u32 pos = off & (tr->size - 1);
+	u32 first = min(n, tr->size - pos);
+
+	memcpy(tr->buf + pos, src, first);
+	if (n > first)
+		memcpy(tr->buf, (const u8 *)src + first, n - first);
+}
+
+static void sif_trace_copy_out(struct esp_trace *tr, u32 off, void *dst, u32 n)
+{
+	u32 pos = off & (tr->size - 1);
+	u32 first = min(n, tr->size - pos);
+
+	memcpy(dst, tr->buf + pos, first);
+	if (n > first)
+		memcpy((u8 *)dst + first, tr->buf, n - first);
+}
+
+void sif_trace_record(struct esp_pub *epub, u8 type, u32 addr, const void *data,
+		      u32 len, int sync, int ret, u64 t0)
+{
+	struct esp_trace *tr = epub->trace;
+	struct sif_trace_rec rec, old;
+	unsigned long flags;
+	u32 need;
+
+	rec.ts_ns = t0;
+	rec.dur_ns = (u32)min_t(u64, sif_trace_clock() - t0, U32_MAX);
+	rec.addr = addr;
+	rec.len = len;
+	rec.caplen = min_t(u32, len, SIF_TRACE_MAX_CAP);
+	if (tr->snaplen && rec.caplen > tr->snaplen)
+		rec.caplen = tr->snaplen;
+	rec.type = type;
+	rec.sync = sync;
+	rec.ret = ret;
+	need = sif_trace_rec_size(rec.caplen);
+
+	spin_lock_irqsave(&tr->lock, flags);
+
+	/* overwrite the oldest records, the reader only ever sees whole ones */
+	while (tr->head - tr->tail + need > tr->size) {
+		sif_trace_copy_out(tr, tr->tail, &old, sizeof(old));
+		tr->tail += sif_trace_rec_size(old.caplen);
+		tr->dropped++;
+	}
+
+	sif_trace_copy_in(tr, tr->head, &rec, sizeof(rec));
+	sif_trace_copy_in(tr, tr->head + sizeof(rec), data, rec.caplen);
+	tr->head += need;
+	tr->records++;
+
+	spin_unlock_irqrestore(&tr->lock, flags);
+}
+
+static ssize_t esp_trace_capture_read(struct file *filp, char __user *buffer,
+				      size_t count, loff_t *ppos)
+{
+	struct esp_trace *tr = filp->private_data;
+	struct sif_trace_rec rec;
+	size_t done = 0;
+	u32 size;
+	u8 *kbuf;
+
+	kbuf = kmalloc(SIF_TRACE_REC_MAX, GFP_KERNEL);
+	if (kbuf == NULL)
+		return -ENOMEM;
+
+	while (done < count) {
+		spin_lock_irq(&tr->lock);
+		if (tr->head == tr->tail) {
+			spin_unlock_irq(&tr->lock);
+			break;
+		}
+		sif_trace_copy_out(tr, tr->tail, &rec, sizeof(rec));
+		size = sif_trace_rec_size(rec.caplen);
+		if (done + size > count) {
+			spin_unlock_irq(&tr->lock);
+			break;
+		}
+		sif_trace_copy_out(tr, tr->tail, kbuf, size);
+		tr->tail += size;
+		spin_unlock_irq(&tr->lock);
+
+		if (copy_to_user(buffer + done, kbuf, size)) {
+			kfree(kbuf);
+			return -EFAULT;
+		}
+		done += size;
+	}
+
+	kfree(kbuf);
+
+	/* buffer too small for even one record */
+	if (done == 0 && count && tr->head != tr->tail)
+		return -EINVAL;
+
+	*ppos += done;
+	return done;
+}
+
+static const struct file_operations esp_trace_capture_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = esp_trace_capture_read,
+	.llseek = no_llseek,
+};
+
+/* feed every complete record in the replay buffer, keep the partial tail */
+static int esp_trace_replay_records(struct esp_trace *tr)
+{
+	struct sif_trace_rec *rec;
+	struct esp_sip *sip = tr->epub->sip;
+	u32 off = 0, size;
+	u64 t0;
+
+	while (tr->replay_fill - off >= sizeof(struct sif_trace_rec)) {
+		rec = (struct sif_trace_rec *)(tr->replay_buf + off);
+		if (rec->caplen > SIF_TRACE_MAX_CAP)
+			return -EINVAL;
+		size = sif_trace_rec_size(rec->caplen);
+		if (tr->replay_fill - off < size)
+			break;
+
+		/* only whole rx transfers can go through the parser */
+		if (rec->type == SIF_TR_READ && rec->ret == 0 && rec->caplen == rec->len && sip) {
+			t0 = sif_trace_clock();
+			if (sip_rx_replay(sip, (u8 *)(rec + 1), rec->len) == 0) {
+				tr->replay_ns += sif_trace_clock() - t0;
+				tr->replay_xfers++;
+				tr->replay_bytes += rec->len;
+			} else {
+				tr->replay_skipped++;
+			}
+		}
+		off += size;
+	}
+
+	memmove(tr->replay_buf, tr->replay_buf + off, tr->replay_fill - off);
+	tr->replay_fill -= off;
+
+	return 0;
+}
+
+static int esp_trace_replay_open(struct inode *inode, struct file *filp)
+{
+	struct esp_trace *tr = inode->i_private;
+
+	filp->private_data = tr;
+
+	mutex_lock(&tr->replay_mtx);
+	tr->replay_fill = 0;
+	tr->replay_xfers = 0;
+	tr->replay_bytes = 0;
+	tr->replay_skipped = 0;
+	tr->replay_ns = 0;
+	mutex_unlock(&tr->replay_mtx);
+
+	return 0;
+}
+
+static ssize_t esp_trace_replay_write(struct file *filp, const char __user *buffer,
+				      size_t count, loff_t *ppos)
+{
+	struct esp_trace *tr = filp->private_data;
+	size_t done = 0;
+	u32 n;
+	int err = 0;
+
+	mutex_lock(&tr->replay_mtx);
+	while (done < count) {
+		n = min_t(size_t, count - done, SIF_TRACE_REPLAY_BUF - tr->replay_fill);
+		if (n == 0) {
+			err = -EINVAL;
+			break;
+		}
+		if (copy_from_user(tr->replay_buf + tr->replay_fill, buffer + done, n)) {
+			err = -EFAULT;
+			break;
+		}
+		tr->replay_fill += n;
+		done += n;
+
+		err = esp_trace_replay_records(tr);
+		if (err)
+			break;
+	}
+	mutex_unlock(&tr->replay_mtx);
+
+	if (err) {
+		esp_dbg(ESP_DBG_ERROR, "%s bad capture stream %d\n", __func__, err);
+		return err;
+	}
+
+	*ppos += done;
+	return done;
+}
+
+static const struct file_operations esp_trace_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = esp_trace_replay_open,
+	.write = esp_trace_replay_write,
+	.llseek = no_llseek,
+};
+
+static ssize_t esp_trace_stats_read(struct file *filp, char __user *buffer,
+				    size_t count, loff_t *ppos)
+{
+	struct esp_trace *tr = filp->private_data;
+	char buf[256];
+	u64 per_xfer = 0, mbps = 0;
+	int len;
+
+	mutex_lock(&tr->replay_mtx);
+	if (tr->replay_xfers)
+		per_xfer = div_u64(tr->replay_ns, tr->replay_xfers);
+	if (tr->replay_ns)
+		mbps = div64_u64((u64)tr->replay_bytes * 8 * 1000, tr->replay_ns);
+	len = snprintf(buf, sizeof(buf),
+		       "records %u dropped %u\nreplay xfers %u bytes %u skipped %u ns %llu ns/xfer %llu mbps %llu\n",
+		       tr->records, tr->dropped, tr->replay_xfers, tr->replay_bytes,
+		       tr->replay_skipped, tr->replay_ns, per_xfer, mbps);
+	mutex_unlock(&tr->replay_mtx);
+
+	return simple_read_from_buffer(buffer, count, ppos, buf, len);
+}
+
+static const struct file_operations esp_trace_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = esp_trace_stats_read,
+};
+
+int esp_trace_attach(struct esp_pub *epub)
+{
+	struct esp_trace *tr;
+	char name[32];
+
+	tr = kzalloc(sizeof(struct esp_trace), GFP_KERNEL);
+	if (tr == NULL)
+		return -ENOMEM;
+
+	tr->size = roundup_pow_of_two(max(sif_trace_kb, 64U) * 1024);
+	tr->buf = vmalloc(tr->size);
+	if (tr->buf == NULL)
+		goto _err_tr;
+
+	tr->replay_buf = vmalloc(SIF_TRACE_REPLAY_BUF);
+	if (tr->replay_buf == NULL)
+		goto _err_buf;
+
+	spin_lock_init(&tr->lock);
+	mutex_init(&tr->replay_mtx);
+	tr->epub = epub;
+
+	snprintf(name, sizeof(name), "sif_trace_%s", wiphy_name(epub->hw->wiphy));
+	tr->dir = esp_debugfs_add_sub_dir(name);
+	if (tr->dir) {
+		esp_dump_var("enable", tr->dir, &tr->enabled, ESP_U32);
+		esp_dump_var("snaplen", tr->dir, &tr->snaplen, ESP_U32);
+		esp_dump("capture", tr->dir, tr, 0, (struct file_operations *)&esp_trace_capture_fops);
+		esp_dump("replay", tr->dir, tr, 0, (struct file_operations *)&esp_trace_replay_fops);
+		esp_dump("stats", tr->dir, tr, 0, (struct file_operations *)&esp_trace_stats_fops);
+	}
+
+	epub->trace = tr;
+	return 0;
+
+_err_buf:
+	vfree(tr->buf);
+_err_tr:
+	kfree(tr);
+	return -ENOMEM;
+}
+
+void esp_trace_detach(struct esp_pub *epub)
+{
+	struct esp_trace *tr = epub->trace;
+
+	if (tr == NULL)
+		return;
+
+	epub->trace = NULL;
+	debugfs_remove_recursive(tr->dir);
+	mutex_destroy(&tr->replay_mtx);
+	vfree(tr->replay_buf);
+	vfree(tr->buf);
+	kfree(tr);
+}
+
+#endif /* SIF_TRACE */
@@ -0,0 +1,93 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   sif bus capture and replay
+ */
+
+#ifndef _ESP_TRACE_H_
+#define _ESP_TRACE_H_
+
+#include <linux/ktime.h>
+#include "esp_pub.h"
+
+enum sif_trace_type {
+	SIF_TR_READ = 1,	/* lldesc read, rx transfer */
+	SIF_TR_WRITE,		/* lldesc write, tx aggregate */
+	SIF_TR_REG_READ,
+	SIF_TR_REG_WRITE,
+	SIF_TR_DSR_REGS,	/* slc_host_regs snapshot taken in sif_dsr */
+};
+
+/*
+ * one record in the capture stream, followed by caplen bytes of data
+ * padded to 4. Little endian, as produced on the host.
+ */
+struct sif_trace_rec {
+	u64 ts_ns;	/* start of the transaction */
+	u32 dur_ns;
+	u32 addr;	/* register address, 0 for lldesc */
+	u32 len;	/* bytes on the bus */
+	u32 caplen;	/* bytes captured, less than len when snapped */
+	u8 type;
+	u8 sync;
+	s16 ret;
+} __packed;
+
+#ifdef SIF_TRACE
+
+struct esp_trace {
+	spinlock_t lock;
+	u8 *buf;
+	u32 size;	/* power of two */
+	u32 head;	/* free running byte offsets */
+	u32 tail;
+
+	u32 enabled;
+	u32 snaplen;	/* 0: capture whole transfers */
+	u32 records;
+	u32 dropped;	/* overwritten before being read out */
+
+	struct dentry *dir;
+	struct esp_pub *epub;
+
+	/* replay input, records may straddle writes */
+	struct mutex replay_mtx;
+	u8 *replay_buf;
+	u32 replay_fill;
+	u32 replay_xfers;
+	u32 replay_bytes;
+	u32 replay_skipped;
+	u64 replay_ns;
+};
+
+int esp_trace_attach(struct esp_pub *epub);
+void esp_trace_detach(struct esp_pub *epub);
+void sif_trace_record(struct esp_pub *epub, u8 type, u32 addr, const void *data,
+		      u32 len, int sync, int ret, u64 t0);
+
+static inline bool sif_trace_on(struct esp_pub *epub)
+{
+	return unlikely(epub && epub->trace && epub->trace->enabled);
+}
+
+static inline u64 sif_trace_clock(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+#else
+
+static inline int esp_trace_attach(struct esp_pub *epub) { return 0; }
+static inline void esp_trace_detach(struct esp_pub *epub) { }
+static inline void sif_trace_record(struct esp_pub *epub, u8 type, u32 addr, const void *data,
+				    u32 len, int sync, int ret, u64 t0) { }
+#define sif_trace_on(epub) false
+#define sif_trace_clock() 0
+
+#endif /* SIF_TRACE */
+
+#endif /* _ESP_TRACE_H_ */
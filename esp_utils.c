@@ -107,11 +107,6 @@ s8 esp_wmac_rate2idx(u8 rate)
         return 0;
 }
 
-bool esp_wmac_rxsec_error(u8 error)
-{
-        return (error >= RX_SECOV_ERR && error <= RX_SECFIFO_TIMEOUT) || (error >= RX_WEPICV_ERR && error <= RX_WAPIMIC_ERR);
-}
-
 int esp_cipher2alg(int cipher)
 {
         if (cipher == WLAN_CIPHER_SUITE_TKIP)
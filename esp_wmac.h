@@ -87,6 +87,9 @@ struct esp_tx_ampdu_entry {
 #define RX_WAPIMIC_ERR 0xFC
 
 s8 esp_wmac_rate2idx(u8 rate);
-bool esp_wmac_rxsec_error(u8 error);
+static inline bool esp_wmac_rxsec_error(u8 error)
+{
+        return (error >= RX_SECOV_ERR && error <= RX_SECFIFO_TIMEOUT) || (error >= RX_WEPICV_ERR && error <= RX_WAPIMIC_ERR);
+}
 
 #endif /* _ESP_WMAC_H_ */
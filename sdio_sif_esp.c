@@ -23,36 +23,54 @@
 #include <net/mac80211.h>
 #include <linux/time.h>
 #include <linux/pm.h>
+#include <linux/version.h>
+#include <linux/ktime.h>
 
 #include "esp_pub.h"
 #include "esp_sif.h"
 #include "esp_sip.h"
+#include "esp_sched.h"
 #include "esp_debug.h"
 #include "slc_host_register.h"
 #include "esp_version.h"
 #include "esp_ctrl.h"
 #include "esp_file.h"
+#include "esp_path.h"
 #ifdef USE_EXT_GPIO
 #include "esp_ext.h"
 #endif /* USE_EXT_GPIO */
 
 
-#define ESP_DMA_IBUFSZ   2048
+/* room for the largest sip transfer */
+#define ESP_DMA_IBUFSZ   SIP_PKT_MAX_LEN
 
 //unsigned int esp_msg_level = 0;
 unsigned int esp_msg_level = ESP_DBG_ERROR | ESP_SHOW; // | ESP_DBG_TRACE | ESP_DBG_OP;
 
+/* the dummy driver's power-up check only, any chip will do */
 static struct semaphore esp_powerup_sem;
 
-static enum esp_sdio_state sif_sdio_state;
-struct esp_sdio_ctrl *sif_sctrl = NULL;
-
 #ifdef ESP_ANDROID_LOGGER
 bool log_off = false;
 #endif /* ESP_ANDROID_LOGGER */
 
+/* 0: reset and rescan the card between fw1 and fw2, 1: re-init it in place */
+/* fw1 still runs, only the rescan between the stages is replaced */
+static int sif_inplace_reinit = 0;
+module_param(sif_inplace_reinit, int, 0644);
+MODULE_PARM_DESC(sif_inplace_reinit, "re-init the card in place after fw1 instead of a rescan");
+
+static bool sdio_autotune = false;
+module_param(sdio_autotune, bool, 0444);
+MODULE_PARM_DESC(sdio_autotune, "step the sdio clock up at boot, keep the fastest stable one");
+
+static unsigned int sdio_max_clk = 50;
+module_param(sdio_max_clk, uint, 0444);
+MODULE_PARM_DESC(sdio_max_clk, "autotune ceiling in MHz");
+
 static int esdio_power_off(struct esp_sdio_ctrl *sctrl);
 static int esdio_power_on(struct esp_sdio_ctrl *sctrl);
+static void sif_sdio_tune_crc(struct esp_sdio_ctrl *sctrl);
 
 void sif_set_clock(struct sdio_func *func, int clk);
 
@@ -114,11 +132,55 @@ void sdio_io_writeb(struct esp_pub *epub, u8 value, int addr, int *res)
 	sif_platform_check_r1_ready(epub);
 }
 
+/*
+ * sdio dma wants a word aligned, linear mapped buffer. Anything else is
+ * copied through dma_buffer, which is shared: the host must be claimed.
+ */
+static u8 *sif_bounce_get(struct esp_sdio_ctrl *sctrl, u8 *buf, u32 len, u32 flag)
+{
+        u8 *ibuf;
+
+        if (!bad_buf(buf))
+                return buf;
+
+        if (len <= ESP_DMA_IBUFSZ) {
+                ibuf = sctrl->dma_buffer;
+        } else {
+                /* no reclaim io, it may need this very host */
+                ibuf = kmalloc(len, GFP_NOIO);
+                if (ibuf == NULL)
+                        return NULL;
+                sctrl->bounce.big++;
+        }
+
+        if (flag & SIF_TO_DEVICE) {
+                memcpy(ibuf, buf, len);
+                sctrl->bounce.tx++;
+        } else {
+                sctrl->bounce.rx++;
+        }
+        sctrl->bounce.bytes += len;
+
+        esp_dbg(ESP_DBG_TRACE, "%s buf %p len %d bounced\n", __func__, buf, len);
+        return ibuf;
+}
+
+static void sif_bounce_put(struct esp_sdio_ctrl *sctrl, u8 *buf, u8 *ibuf, u32 len, u32 flag, int err)
+{
+        if (ibuf == buf)
+                return;
+
+        if (!err && (flag & SIF_FROM_DEVICE))
+                memcpy(buf, ibuf, len);
+        if (ibuf != sctrl->dma_buffer)
+                kfree(ibuf);
+}
+
+/* host claimed by the caller */
 int sif_io_raw(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag)
 {
         int err = 0;
         u8 *ibuf = NULL;
-        bool need_ibuf = false;
         struct esp_sdio_ctrl *sctrl = NULL;
         struct sdio_func *func = NULL;
 
@@ -136,12 +198,10 @@ int sif_io_raw(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag)
 		goto _exit;
 	}
 
-        if (bad_buf(buf)) {
-                esp_dbg(ESP_DBG_TRACE, "%s dst 0x%08x, len %d badbuf\n", __func__, addr, len);
-                need_ibuf = true;
-                ibuf = sctrl->dma_buffer;
-        } else {
-                ibuf = buf;
+        ibuf = sif_bounce_get(sctrl, buf, len, flag);
+        if (ibuf == NULL) {
+                err = -ENOMEM;
+                goto _exit;
         }
 
         if (flag & SIF_BLOCK_BASIS) {
@@ -150,9 +210,6 @@ int sif_io_raw(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag)
 
         if (flag & SIF_TO_DEVICE) {
 
-                if (need_ibuf)
-                        memcpy(ibuf, buf, len);
-
                 if (flag & SIF_FIXED_ADDR)
                         err = sdio_writesb(func, addr, ibuf, len);
                 else if (flag & SIF_INC_ADDR) {
@@ -166,11 +223,12 @@ int sif_io_raw(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag)
                 else if (flag & SIF_INC_ADDR) {
                         err = sdio_memcpy_fromio(func, ibuf, addr, len);
                 }
+        }
 
+        if (err == -EILSEQ)
+                sif_sdio_tune_crc(sctrl);
 
-                if (!err && need_ibuf)
-                        memcpy(buf, ibuf, len);
-        }
+        sif_bounce_put(sctrl, buf, ibuf, len, flag, err);
 
 _exit:
        return err;
@@ -179,9 +237,6 @@ _exit:
 int sif_io_sync(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag)
 {
         int err = 0;
-        u8 * ibuf = NULL;
-        bool need_ibuf = false;
-        struct esp_sdio_ctrl *sctrl = NULL;
         struct sdio_func *func = NULL;
 
 	if (epub == NULL || buf == NULL) {
@@ -190,61 +245,169 @@ int sif_io_sync(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag)
 		goto _exit;
 	}
 
-        sctrl = (struct esp_sdio_ctrl *)epub->sif;
-        func = sctrl->func;
+        func = ((struct esp_sdio_ctrl *)epub->sif)->func;
 	if (func == NULL) {
 		ESSERT(0);	
 		err = -EINVAL;
 		goto _exit;
 	}
 
-        if (bad_buf(buf)) {
-                esp_dbg(ESP_DBG_TRACE, "%s dst 0x%08x, len %d badbuf\n", __func__, addr, len);
-                need_ibuf = true;
-                ibuf = sctrl->dma_buffer;
-        } else {
-                ibuf = buf;
-        }
+        esp_dbg(ESP_DBG_LOG, "%s %s addr 0x%08x, len %d \n", __func__,
+                (flag & SIF_TO_DEVICE) ? "to" : "from", addr, len);
 
-        if (flag & SIF_BLOCK_BASIS) {
-                /* round up for block data transcation */
-        }
+        /* the bounce copy too happens under the claim */
+        sdio_claim_host(func);
+        err = sif_io_raw(epub, addr, buf, len, flag);
+        sdio_release_host(func);
 
-        if (flag & SIF_TO_DEVICE) {
+_exit:
+        return err;
+}
 
-                esp_dbg(ESP_DBG_LOG, "%s to addr 0x%08x, len %d \n", __func__, addr, len);
-                if (need_ibuf)
-                        memcpy(ibuf, buf, len);
+static void sif_sdio_dma_debugfs(struct esp_sdio_ctrl *sctrl)
+{
+	struct esp_sdio_bounce *b = &sctrl->bounce;
+	char name[32];
+
+	if (sctrl->dma_dir)
+		return;
+
+	snprintf(name, sizeof(name), "sdio_dma_%s", wiphy_name(sctrl->epub->hw->wiphy));
+	sctrl->dma_dir = esp_debugfs_add_sub_dir(name);
+	if (sctrl->dma_dir == NULL)
+		return;
+
+	esp_dump_var("bounce_tx", sctrl->dma_dir, &b->tx, ESP_U32);
+	esp_dump_var("bounce_rx", sctrl->dma_dir, &b->rx, ESP_U32);
+	esp_dump_var("bounce_big", sctrl->dma_dir, &b->big, ESP_U32);
+	esp_dump_var("bounce_bytes", sctrl->dma_dir, &b->bytes, ESP_U64);
+	esp_dump_var("async_reqs", sctrl->dma_dir, &sctrl->io_reqs, ESP_U32);
+	esp_dump_var("async_busy", sctrl->dma_dir, &sctrl->io_busy, ESP_U32);
+}
 
-                sdio_claim_host(func);
+/*
+ * async request engine: callers queue a preallocated descriptor and go
+ * on, one worker claims the host once and runs the queue back to back.
+ * At most SIF_REQ_DEPTH requests are outstanding, past that the caller
+ * gets -EBUSY and can fall back to a sync transfer.
+ */
+static void sif_io_work(struct work_struct *work)
+{
+        struct esp_sdio_ctrl *sctrl = container_of(work, struct esp_sdio_ctrl, io_work);
+        struct sif_req *req;
+        struct sif_io_ctx *ctx;
+        int err;
 
-                if (flag & SIF_FIXED_ADDR)
-                        err = sdio_writesb(func, addr, ibuf, len);
-                else if (flag & SIF_INC_ADDR) {
-                        err = sdio_memcpy_toio(func, addr, ibuf, len);
-                }
-                sif_platform_check_r1_ready(epub);
-                sdio_release_host(func);
-        } else if (flag & SIF_FROM_DEVICE) {
+        while (!list_empty_careful(&sctrl->scat_req)) {
+                sif_bus_get(sctrl->epub, SIF_BUS_TX);
+                sdio_claim_host(sctrl->func);
 
-                esp_dbg(ESP_DBG_LOG, "%s from addr 0x%08x, len %d \n", __func__, addr, len);
+                do {
+                        spin_lock_bh(&sctrl->scat_lock);
+                        req = list_first_entry_or_null(&sctrl->scat_req, struct sif_req, list);
+                        if (req)
+                                list_del(&req->list);
+                        spin_unlock_bh(&sctrl->scat_lock);
+                        if (req == NULL)
+                                break;
 
-                sdio_claim_host(func);
+                        err = sif_io_raw(sctrl->epub, req->addr, req->buf, req->len, req->flag);
+                        ctx = req->ctx;
 
-                if (flag & SIF_FIXED_ADDR)
-                        err = sdio_readsb(func, ibuf, addr, len);
-                else if (flag & SIF_INC_ADDR) {
-                        err = sdio_memcpy_fromio(func, ibuf, addr, len);
-                }
+                        spin_lock_bh(&sctrl->scat_lock);
+                        list_add_tail(&req->list, &sctrl->free_req);
+                        spin_unlock_bh(&sctrl->scat_lock);
 
-                sdio_release_host(func);
+                        if (ctx && ctx->done)
+                                ctx->done(sctrl->epub, ctx, err);
+                } while (!sif_bus_yield(sctrl->epub));
+
+                /* let rx or a cmd in before the rest of the queue */
+                sdio_release_host(sctrl->func);
+                sif_bus_put(sctrl->epub);
+        }
+}
 
-                if (!err && need_ibuf)
-                        memcpy(buf, ibuf, len);
+static void sif_io_engine_init(struct esp_sdio_ctrl *sctrl)
+{
+        int i;
+
+        spin_lock_init(&sctrl->scat_lock);
+        INIT_LIST_HEAD(&sctrl->free_req);
+        INIT_LIST_HEAD(&sctrl->scat_req);
+        for (i = 0; i < SIF_REQ_DEPTH; i++)
+                list_add_tail(&sctrl->reqs[i].list, &sctrl->free_req);
+        INIT_WORK(&sctrl->io_work, sif_io_work);
+}
+
+/* context is a struct sif_io_ctx, or NULL when nobody waits for it */
+int sif_io_async(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag, void * context)
+{
+        struct esp_sdio_ctrl *sctrl = NULL;
+        struct sif_req *req;
+
+	if (epub == NULL || buf == NULL) {
+        	ESSERT(0);
+		return -EINVAL;
+	}
+
+        sctrl = (struct esp_sdio_ctrl *)epub->sif;
+
+        spin_lock_bh(&sctrl->scat_lock);
+        req = list_first_entry_or_null(&sctrl->free_req, struct sif_req, list);
+        if (req == NULL) {
+                sctrl->io_busy++;
+                spin_unlock_bh(&sctrl->scat_lock);
+                return -EBUSY;
         }
+        list_del(&req->list);
+        req->addr = addr;
+        req->buf = buf;
+        req->len = len;
+        req->flag = flag | SIF_ASYNC;
+        req->ctx = (struct sif_io_ctx *)context;
+        list_add_tail(&req->list, &sctrl->scat_req);
+        sctrl->io_reqs++;
+        spin_unlock_bh(&sctrl->scat_lock);
+
+        queue_work(system_highpri_wq, &sctrl->io_work);
+
+        return 0;
+}
 
+/* wait for every queued request, must not be called with the bus held */
+void sif_io_flush(struct esp_pub *epub)
+{
+        EPUB_CTRL_CHECK(epub, _exit);
+
+        flush_work(&EPUB_TO_CTRL(epub)->io_work);
 _exit:
-        return err;
+        return;
+}
+
+int sif_lldesc_write_async(struct esp_pub *epub, u8 *buf, u32 len, struct sif_io_ctx *ctx)
+{
+        struct esp_sdio_ctrl *sctrl = NULL;
+        u32 write_len;
+
+	if (epub == NULL || buf == NULL) {
+        	ESSERT(0);
+		return -EINVAL;
+	}
+
+        sctrl = (struct esp_sdio_ctrl *)epub->sif;
+
+        switch(sctrl->target_id) {
+        case 0x600:
+                write_len = roundup(len, sctrl->slc_blk_sz);
+                break;
+        default:
+                write_len = len;
+                break;
+        }
+
+        return sif_io_async(epub, sctrl->slc_window_end_addr - len, buf, write_len,
+                            SIF_TO_DEVICE | SIF_BYTE_BASIS | SIF_INC_ADDR, ctx);
 }
 
 int sif_lldesc_read_sync(struct esp_pub *epub, u8 *buf, u32 len)
@@ -490,27 +653,396 @@ void sif_set_clock(struct sdio_func *func, int clk)
 	sdio_release_host(func);
 }
 
+/*
+ * clock autotune: with the id registers as a known pattern, step the
+ * clock up until readback fails, keep the fastest clean step and store
+ * it under eagle_path for the next boot.
+ *
+ * the block size is not tuned, the fw reports 512 in its bootup event
+ * and the slc framing is built around it.
+ */
+#define SIF_TUNE_ROUNDS         64
+#define SIF_TUNE_CRC_MAX        8       /* per second, before stepping down */
+#define SIF_TUNE_FILE           "sdio_tune"
+
+static const u32 sif_tune_clks[] = { 20, 25, 30, 35, 40, 45, 50 };
+
+static void sif_sdio_tune_path(char *filename, size_t len)
+{
+	if (mod_eagle_path_get() == NULL)
+		snprintf(filename, len, "%s/%s", FWPATH, SIF_TUNE_FILE);
+	else
+		snprintf(filename, len, "%s/%s", mod_eagle_path_get(), SIF_TUNE_FILE);
+}
+
+static u32 sif_sdio_tune_load(void)
+{
+	char filename[256];
+	char buf[8] = { 0 };
+	u32 clk;
+
+	sif_sdio_tune_path(filename, sizeof(filename));
+	if (esp_readwrite_file(filename, buf, NULL, sizeof(buf) - 1) <= 0)
+		return 0;
+	if (kstrtou32(buf, 10, &clk))
+		return 0;
+
+	return clk;
+}
+
+static void sif_sdio_tune_store(u32 clk)
+{
+	char filename[256];
+	char buf[8];
+
+	sif_sdio_tune_path(filename, sizeof(filename));
+	/* fixed width, the file is rewritten in place */
+	snprintf(buf, sizeof(buf), "%03u\n", clk);
+	esp_readwrite_file(filename, NULL, buf, 4);
+}
+
+static int sif_sdio_tune_step(u32 clk)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sif_tune_clks); i++)
+		if (sif_tune_clks[i] == clk)
+			return i;
+	return -1;
+}
+
+static bool sif_sdio_tune_usable(struct esp_sdio_ctrl *sctrl, u32 clk)
+{
+	return clk <= sdio_max_clk &&
+	       clk * 1000000 <= sctrl->func->card->host->f_max;
+}
+
+/* date and id over cmd52, the reference for the cmd53 rounds */
+static int sif_sdio_tune_ref(struct esp_sdio_ctrl *sctrl, u32 *ref)
+{
+	u8 *p = (u8 *)ref;
+	int i, err = 0;
+
+	sdio_claim_host(sctrl->func);
+	for (i = 0; i < 8 && !err; i++)
+		p[i] = sdio_readb(sctrl->func, SLC_HOST_DATE + i, &err);
+	sdio_release_host(sctrl->func);
+
+	return err;
+}
+
+static int sif_sdio_tune_probe(struct esp_sdio_ctrl *sctrl, u32 clk, const u32 *ref, u32 *us)
+{
+	u32 *buf = (u32 *)sctrl->dma_buffer;
+	ktime_t t0;
+	int i, err = 0;
+
+	sif_set_clock(sctrl->func, clk);
+
+	sdio_claim_host(sctrl->func);
+	t0 = ktime_get();
+	for (i = 0; i < SIF_TUNE_ROUNDS && !err; i++) {
+		buf[0] = buf[1] = 0;
+		err = sif_io_raw(sctrl->epub, SLC_HOST_DATE, (u8 *)buf, 8,
+				 SIF_FROM_DEVICE | SIF_BYTE_BASIS | SIF_INC_ADDR);
+		if (!err && (buf[0] != ref[0] || buf[1] != ref[1]))
+			err = -EIO;
+	}
+	*us = ktime_us_delta(ktime_get(), t0);
+	sdio_release_host(sctrl->func);
+
+	return err;
+}
+
+static void sif_sdio_tune(struct esp_sdio_ctrl *sctrl)
+{
+	struct esp_sdio_tune *t = &sctrl->tune;
+	u32 ref[2], saved, clk, us, best = 0, best_us = U32_MAX;
+	u32 orig = sctrl->func->card->host->ios.clock / 1000000;
+	int i, err;
+
+	if (!sdio_autotune)
+		return;
+
+	/* card re-probed or re-initialised, back to the settled clock */
+	if (t->clk) {
+		sif_set_clock(sctrl->func, t->clk);
+		return;
+	}
+
+	if (!sif_sdio_tune_usable(sctrl, sif_tune_clks[0]))
+		return;
+
+	sif_set_clock(sctrl->func, sif_tune_clks[0]);
+	err = sif_sdio_tune_ref(sctrl, ref);
+	if (err) {
+		esp_dbg(ESP_DBG_ERROR, "%s no reference read %d\n", __func__, err);
+		goto _restore;
+	}
+
+	/* last boot's pick only has to pass twice */
+	saved = sif_sdio_tune_load();
+	if (sif_sdio_tune_step(saved) >= 0 && sif_sdio_tune_usable(sctrl, saved) &&
+	    !sif_sdio_tune_probe(sctrl, saved, ref, &us) &&
+	    !sif_sdio_tune_probe(sctrl, saved, ref, &us)) {
+		best = saved;
+		best_us = us;
+		goto _done;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(sif_tune_clks); i++) {
+		clk = sif_tune_clks[i];
+		if (!sif_sdio_tune_usable(sctrl, clk))
+			break;
+		err = sif_sdio_tune_probe(sctrl, clk, ref, &us);
+		esp_dbg(ESP_SHOW, "%s %u MHz err %d %u us/%u rounds\n", __func__,
+			clk, err, us, SIF_TUNE_ROUNDS);
+		if (err)
+			break;
+		/* the host may round or cap the clock, only a faster step counts */
+		if (us < best_us) {
+			best = clk;
+			best_us = us;
+		}
+	}
+
+	/* and it has to hold up a second time */
+	if (best && sif_sdio_tune_probe(sctrl, best, ref, &us)) {
+		esp_dbg(ESP_DBG_ERROR, "%s %u MHz unstable, using %u\n", __func__,
+			best, sif_tune_clks[0]);
+		best = sif_tune_clks[0];
+	}
+	if (best == 0)
+		goto _restore;
+	if (best != saved)
+		sif_sdio_tune_store(best);
+
+_done:
+	esp_dbg(ESP_SHOW, "%s settled on %u MHz\n", __func__, best);
+	sif_set_clock(sctrl->func, best);
+	t->probe_us = best_us;
+	t->win_start = jiffies;
+	t->win_errs = 0;
+	t->clk = best;
+	return;
+
+_restore:
+	sif_set_clock(sctrl->func, orig);
+}
+
+static void sif_sdio_tune_work(struct work_struct *work)
+{
+	struct esp_sdio_ctrl *sctrl = container_of(work, struct esp_sdio_ctrl, tune.work);
+	struct esp_sdio_tune *t = &sctrl->tune;
+	int i = sif_sdio_tune_step(t->clk);
+
+	if (i <= 0)
+		return;
+
+	esp_dbg(ESP_DBG_ERROR, "%s crc errors at %u MHz, down to %u\n", __func__,
+		t->clk, sif_tune_clks[i - 1]);
+	t->clk = sif_tune_clks[i - 1];
+	t->fallbacks++;
+	sif_set_clock(sctrl->func, t->clk);
+	sif_sdio_tune_store(t->clk);
+}
+
+/* host held, the step down runs from the work */
+static void sif_sdio_tune_crc(struct esp_sdio_ctrl *sctrl)
+{
+	struct esp_sdio_tune *t = &sctrl->tune;
+
+	t->crc_errs++;
+	if (t->clk == 0)
+		return;
+
+	if (time_after(jiffies, t->win_start + HZ)) {
+		t->win_start = jiffies;
+		t->win_errs = 0;
+	}
+	if (++t->win_errs == SIF_TUNE_CRC_MAX)
+		schedule_work(&t->work);
+}
+
+static void sif_sdio_tune_debugfs(struct esp_sdio_ctrl *sctrl)
+{
+	struct esp_sdio_tune *t = &sctrl->tune;
+	char name[32];
+
+	if (t->dir)
+		return;
+
+	snprintf(name, sizeof(name), "sdio_tune_%s", wiphy_name(sctrl->epub->hw->wiphy));
+	t->dir = esp_debugfs_add_sub_dir(name);
+	if (t->dir == NULL)
+		return;
+
+	esp_dump_var("clk_mhz", t->dir, &t->clk, ESP_U32);
+	esp_dump_var("probe_us", t->dir, &t->probe_us, ESP_U32);
+	esp_dump_var("crc_errs", t->dir, &t->crc_errs, ESP_U32);
+	esp_dump_var("fallbacks", t->dir, &t->fallbacks, ESP_U32);
+}
+
 static int esp_sdio_probe(struct sdio_func *func, const struct sdio_device_id *id);
 static void esp_sdio_remove(struct sdio_func *func);
 
+/* first stage ctrls parked until their host is probed again,
+ * one per chip so several eagles can come up side by side */
+static LIST_HEAD(sif_pending_ctrls);
+static DEFINE_MUTEX(sif_pending_lock);
+
+static void sif_park_ctrl(struct esp_sdio_ctrl *sctrl, void *key)
+{
+	sctrl->bus_key = key;
+	mutex_lock(&sif_pending_lock);
+	list_add_tail(&sctrl->pending_list, &sif_pending_ctrls);
+	mutex_unlock(&sif_pending_lock);
+}
+
+static struct esp_sdio_ctrl *sif_unpark_ctrl(void *key)
+{
+	struct esp_sdio_ctrl *sctrl = NULL, *pos;
+
+	mutex_lock(&sif_pending_lock);
+	list_for_each_entry(pos, &sif_pending_ctrls, pending_list) {
+		if (pos->bus_key == key) {
+			list_del_init(&pos->pending_list);
+			sctrl = pos;
+			break;
+		}
+	}
+	mutex_unlock(&sif_pending_lock);
+
+	return sctrl;
+}
+
+/* some chip finished its first stage and waits for the second */
+static bool sif_any_parked(void)
+{
+	bool parked;
+
+	mutex_lock(&sif_pending_lock);
+	parked = !list_empty(&sif_pending_ctrls);
+	mutex_unlock(&sif_pending_lock);
+
+	return parked;
+}
+
+static void esp_sdio_free_ctrl(struct esp_sdio_ctrl *sctrl)
+{
+	if (sctrl->epub->sip) {
+		sip_detach(sctrl->epub->sip);
+		sctrl->epub->sip = NULL;
+		esp_dbg(ESP_DBG_TRACE, "%s sip detached \n", __func__);
+	}
+#ifdef USE_EXT_GPIO
+	if (sctrl->epub->conf.ate == 0)
+		ext_gpio_deinit(sctrl->epub);
+#endif
+	cancel_work_sync(&sctrl->io_work);
+	cancel_work_sync(&sctrl->tune.work);
+	debugfs_remove_recursive(sctrl->dma_dir);
+	debugfs_remove_recursive(sctrl->tune.dir);
+	esp_pub_dealloc_mac80211(sctrl->epub);
+	esp_dbg(ESP_DBG_TRACE, "%s dealloc mac80211 \n", __func__);
+
+	if (sctrl->dma_buffer) {
+		kfree(sctrl->dma_buffer);
+		sctrl->dma_buffer = NULL;
+		esp_dbg(ESP_DBG_TRACE, "%s free dma_buffer \n", __func__);
+	}
+
+	kfree(sctrl);
+}
+
+/*
+ * the target has reset itself into the second stage rom, bring the card
+ * back up on the same func instead of having the host rescan it
+ */
+static int esp_sdio_reinit_card(struct esp_sdio_ctrl *sctrl)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+        struct sdio_func *func = sctrl->func;
+        int err;
+
+        sif_disable_irq(sctrl->epub);
+        esdio_power_off(sctrl);
+
+        sdio_claim_host(func);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+        err = mmc_sw_reset(func->card);
+#else
+        err = mmc_sw_reset(func->card->host);
+#endif
+        sdio_release_host(func);
+        if (err) {
+                esp_dbg(ESP_DBG_ERROR, "%s card reset failed: %d\n", __func__, err);
+                return err;
+        }
+
+        err = esdio_power_on(sctrl);
+        if (err)
+                return err;
+
+        sdio_claim_host(func);
+        err = sdio_set_block_size(func, sctrl->slc_blk_sz);
+        sdio_release_host(func);
+
+        return err;
+#else
+        return -EOPNOTSUPP;
+#endif
+}
+
+/* a hung fw2 ignores interrupt 7, only the board's power and reset lines reach the rom */
+void sif_reset_target(struct esp_pub *epub)
+{
+        sif_disable_irq(epub);
+
+        sif_platform_target_poweroff();
+        msleep(ESP_RESET_OFF_MS);
+        sif_platform_target_poweron();
+        sif_platform_reset_target();
+}
+
+int sif_reinit_card(struct esp_pub *epub)
+{
+        struct esp_sdio_ctrl *sctrl = (struct esp_sdio_ctrl *)epub->sif;
+        int err;
+
+        err = esp_sdio_reinit_card(sctrl);
+        /* the reset dropped the host back to its default clock */
+        if (err == 0 && sctrl->tune.clk)
+                sif_set_clock(sctrl->func, sctrl->tune.clk);
+
+        return err;
+}
+
 static int esp_sdio_probe(struct sdio_func *func, const struct sdio_device_id *id) 
 {
         int err = 0;
         struct esp_pub *epub;
         struct esp_sdio_ctrl *sctrl;
         struct mmc_host *host = func->card->host;
+        ktime_t t0 = ktime_get();
 	esp_dbg(ESP_SHOW, "%s enter\n", __func__);
         esp_dbg(ESP_SHOW,
                         "%s sdio_func_num: 0x%X, vendor id: 0x%X, dev id: 0x%X, block size: 0x%X/0x%X\n",
 			__func__,
                         func->num, func->vendor, func->device, func->max_blksize,
                         func->cur_blksize);
-	if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+
+	/* a host with a parked ctrl has already run the first stage */
+	sctrl = sif_unpark_ctrl(host);
+	if (sctrl == NULL) {
 		sctrl = kzalloc(sizeof(struct esp_sdio_ctrl), GFP_KERNEL);
 
 		if (sctrl == NULL) {
 			return -ENOMEM;
 		}
+		INIT_LIST_HEAD(&sctrl->pending_list);
+		sif_io_engine_init(sctrl);
+		INIT_WORK(&sctrl->tune.work, sif_sdio_tune_work);
 
 		/* temp buffer reserved for un-dma-able request */
 		sctrl->dma_buffer = kzalloc(ESP_DMA_IBUFSZ, GFP_KERNEL);
@@ -519,7 +1051,6 @@ static int esp_sdio_probe(struct sdio_func *func, const struct sdio_device_id *i
                 	err = -ENOMEM;
 			goto _err_last;
 		}
-		sif_sctrl = sctrl;
         	sctrl->slc_blk_sz = SIF_SLC_BLOCK_SIZE;
 
 		epub = esp_pub_alloc_mac80211(&func->dev);
@@ -531,9 +1062,13 @@ static int esp_sdio_probe(struct sdio_func *func, const struct sdio_device_id *i
         	}
         	epub->sif = (void *)sctrl;
         	sctrl->epub = epub;
+		sif_load_config(epub);
+		sif_sdio_dma_debugfs(sctrl);
+		sif_sdio_tune_debugfs(sctrl);
+		epub->sdio_state = ESP_SDIO_STATE_FIRST_INIT;
 
 #ifdef USE_EXT_GPIO
-		if (sif_get_ate_config() == 0) {
+		if (epub->conf.ate == 0) {
 			err = ext_gpio_init(epub);
 			if (err) {
 				esp_dbg(ESP_DBG_ERROR, "%s ext_irq_work_init failed %d\n", __func__, err);
@@ -543,15 +1078,12 @@ static int esp_sdio_probe(struct sdio_func *func, const struct sdio_device_id *i
 #endif
 
 	} else {
-		sctrl = sif_sctrl;
-		sif_sctrl = NULL;
 		epub = sctrl->epub;
 		SET_IEEE80211_DEV(epub->hw, &func->dev);
 		epub->dev = &func->dev;
+		epub->sdio_state = ESP_SDIO_STATE_SECOND_INIT;
 	}
 
-        epub->sdio_state = sif_sdio_state;
-
         sctrl->func = func;
         sdio_set_drvdata(func, sctrl);
 
@@ -564,7 +1096,7 @@ static int esp_sdio_probe(struct sdio_func *func, const struct sdio_device_id *i
         err = esdio_power_on(sctrl);
         if (err){
 		esp_dbg(ESP_DBG_TRACE, "%s power_on err %d \n", __func__, err);
-                if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT)
+                if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT)
                 	goto _err_ext_gpio;
 		else
 			goto _err_second_init;
@@ -580,7 +1112,7 @@ static int esp_sdio_probe(struct sdio_func *func, const struct sdio_device_id *i
 				__func__,
                                 sctrl->slc_blk_sz, err);
                 sdio_release_host(func);
-                if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT)
+                if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT)
                 	goto _err_off;
 		else
 			goto _err_second_init;
@@ -588,32 +1120,53 @@ static int esp_sdio_probe(struct sdio_func *func, const struct sdio_device_id *i
 
         sdio_release_host(func);
 
+_second_stage:
 #ifdef LOWER_CLK
         /* fix clock for dongle */
 	sif_set_clock(func, 23);
+#else
+	sif_sdio_tune(sctrl);
 #endif //LOWER_CLK
 
         err = esp_pub_init_all(epub);
 
         if (err) {
                 esp_dbg(ESP_DBG_ERROR, "%s esp_pub_init_all failed: %d\n", __func__, err);
-                if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+                if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+			epub->sdio_state = ESP_SDIO_STATE_FIRST_ERROR_EXIT;
 			err = 0;
 			goto _err_first_init;
 		}
-                if(sif_sdio_state == ESP_SDIO_STATE_SECOND_INIT)
+                if(epub->sdio_state == ESP_SDIO_STATE_SECOND_INIT)
 			goto _err_second_init;
         }
 
-	if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+	if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT && sif_inplace_reinit){
+		ktime_t t1 = ktime_get();
+
+		err = esp_sdio_reinit_card(sctrl);
+		if (err == 0) {
+			esp_dbg(ESP_SHOW, "%s first stage %lld us, card re-init %lld us\n", __func__,
+				ktime_us_delta(t1, t0), ktime_us_delta(ktime_get(), t1));
+			epub->sdio_state = ESP_SDIO_STATE_SECOND_INIT;
+			t0 = ktime_get();
+			goto _second_stage;
+		}
+		esp_dbg(ESP_DBG_ERROR, "%s in place re-init failed (%d), rescan instead\n", __func__, err);
+		err = 0;
+	}
+
+	if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT){
 		esp_dbg(ESP_DBG_ERROR, "%s first normal exit (%d)\n", __func__, err);
-		sif_sdio_state = ESP_SDIO_STATE_FIRST_NORMAL_EXIT;
-		up(&esp_powerup_sem);
+		esp_dbg(ESP_SHOW, "%s first stage %lld us\n", __func__, ktime_us_delta(ktime_get(), t0));
+		epub->sdio_state = ESP_SDIO_STATE_FIRST_NORMAL_EXIT;
+		sif_park_ctrl(sctrl, host);
 		/* Rescan the esp8089 after loading the initial firmware */
 		mmc_force_detect_change(host, msecs_to_jiffies(100));
 		return 0;
 	} else {
 	    esp_dbg(ESP_DBG_ERROR, "%s second normal exit (%d)\n", __func__, err);
+	    esp_dbg(ESP_SHOW, "%s second stage %lld us\n", __func__, ktime_us_delta(ktime_get(), t0));
 	    return 0;
 	}
 
@@ -622,25 +1175,23 @@ _err_off:
         esdio_power_off(sctrl);
 _err_ext_gpio:
 #ifdef USE_EXT_GPIO
-	if (sif_get_ate_config() == 0)
-		ext_gpio_deinit();
+	if (epub->conf.ate == 0)
+		ext_gpio_deinit(epub);
 _err_epub:
 #endif
+        debugfs_remove_recursive(sctrl->dma_dir);
+        debugfs_remove_recursive(sctrl->tune.dir);
         esp_pub_dealloc_mac80211(epub);
 _err_dma:
         kfree(sctrl->dma_buffer);
 _err_last:
         kfree(sctrl);
 _err_first_init:
-	if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT){
-		esp_dbg(ESP_DBG_ERROR, "%s first error exit (%d)\n", __func__, err);
-		sif_sdio_state = ESP_SDIO_STATE_FIRST_ERROR_EXIT;
-		up(&esp_powerup_sem);
-	}
+	esp_dbg(ESP_DBG_ERROR, "%s first error exit (%d)\n", __func__, err);
         return err;
 _err_second_init:
 	esp_dbg(ESP_DBG_ERROR, "%s second error exit (%d)\n", __func__, err);
-	sif_sdio_state = ESP_SDIO_STATE_SECOND_ERROR_EXIT;
+	epub->sdio_state = ESP_SDIO_STATE_SECOND_ERROR_EXIT;
 	esp_sdio_remove(func);
 	return err;
 }
@@ -663,18 +1214,7 @@ static void esp_sdio_remove(struct sdio_func *func)
                         esp_dbg(ESP_DBG_ERROR, "%s epub null\n", __func__);
                         break;
                 }
-		sctrl->epub->sdio_state = sif_sdio_state;
-		if(sif_sdio_state != ESP_SDIO_STATE_FIRST_NORMAL_EXIT){
-                	if (sctrl->epub->sip) {
-                        	sip_detach(sctrl->epub->sip);
-                        	sctrl->epub->sip = NULL;
-                        	esp_dbg(ESP_DBG_TRACE, "%s sip detached \n", __func__);
-                	}
-#ifdef USE_EXT_GPIO
-			if (sif_get_ate_config() == 0)
-				ext_gpio_deinit();
-#endif
-		} else {
+		if(sctrl->epub->sdio_state == ESP_SDIO_STATE_FIRST_NORMAL_EXIT){
 //			sif_disable_target_interrupt(sctrl->epub);
 			atomic_set(&sctrl->epub->sip->state, SIP_STOP);
 			sif_disable_irq(sctrl->epub);
@@ -683,18 +1223,9 @@ static void esp_sdio_remove(struct sdio_func *func)
 #ifdef TEST_MODE
                 test_exit_netlink();
 #endif /* TEST_MODE */
-		if(sif_sdio_state != ESP_SDIO_STATE_FIRST_NORMAL_EXIT){
-                	esp_pub_dealloc_mac80211(sctrl->epub);
-                	esp_dbg(ESP_DBG_TRACE, "%s dealloc mac80211 \n", __func__);
-
-			if (sctrl->dma_buffer) {
-				kfree(sctrl->dma_buffer);
-				sctrl->dma_buffer = NULL;
-				esp_dbg(ESP_DBG_TRACE, "%s free dma_buffer \n", __func__);
-			}
-
-			kfree(sctrl);
-		}
+		/* a parked ctrl is kept for the second stage probe */
+		if(sctrl->epub->sdio_state != ESP_SDIO_STATE_FIRST_NORMAL_EXIT)
+			esp_sdio_free_ctrl(sctrl);
 
         } while (0);
 
@@ -711,10 +1242,9 @@ static int esp_sdio_suspend(struct device *dev)
 	struct esp_sdio_ctrl *sctrl = sdio_get_drvdata(func);
 	struct esp_pub *epub = sctrl->epub;	
 
+        bool keep_power = true;
+
         printk("%s", __func__);
-#if 0
-	sip_send_suspend_config(epub, 1);
-#endif
 	atomic_set(&epub->ps.state, ESP_PM_ON);
 
     do{
@@ -724,15 +1254,19 @@ static int esp_sdio_suspend(struct device *dev)
 
         if (!(sdio_flags & MMC_PM_KEEP_POWER)) {
             printk("%s can't keep power while host is suspended\n", __func__);
+            keep_power = false;
         }
 
         /* keep power while host suspended */
         ret = sdio_set_host_pm_flags(func, MMC_PM_KEEP_POWER);
         if (ret) {
                 printk("%s error while trying to keep power\n", __func__);
+                keep_power = false;
         }
     }while(0);
 
+	/* the target can only stay asleep if it keeps its power */
+	esp_pm_suspend(epub, keep_power);
 
         return 0;
 
@@ -740,9 +1274,12 @@ static int esp_sdio_suspend(struct device *dev)
 
 static int esp_sdio_resume(struct device *dev)
 {
+        struct sdio_func *func = dev_to_sdio_func(dev);
+	struct esp_sdio_ctrl *sctrl = sdio_get_drvdata(func);
+
         esp_dbg(ESP_DBG_ERROR, "%s", __func__);
 
-        return 0;
+        return esp_pm_resume(sctrl->epub);
 }
 
 static const struct dev_pm_ops esp_sdio_pm_ops = {
@@ -831,24 +1368,18 @@ int esp_sdio_init(void)
 
         esp_dbg(ESP_SHOW, "%s power up OK\n", __func__);
 
-        sif_sdio_state = ESP_SDIO_STATE_FIRST_INIT;
-	sema_init(&esp_powerup_sem, 0);
-
+        /* probes the cards already seen, each chip's stage lives in its ctrl */
         sdio_register_driver(&esp_sdio_driver);
 
-        if ((down_timeout(&esp_powerup_sem,
-                                 msecs_to_jiffies(ESP_WAIT_UP_TIME_MS)) == 0 ) && sif_get_ate_config() == 0) {
-		if(sif_sdio_state == ESP_SDIO_STATE_FIRST_NORMAL_EXIT){
-			esp_dbg(ESP_SHOW, "%s first stage finished\n", __func__);
-                	sdio_unregister_driver(&esp_sdio_driver);
+        if (sif_get_ate_config() == 0 && sif_any_parked()) {
+		esp_dbg(ESP_SHOW, "%s first stage finished\n", __func__);
+		sdio_unregister_driver(&esp_sdio_driver);
 
-                	sif_platform_rescan_card(0);
-			msleep(100);
-			sif_platform_rescan_card(1);
+		sif_platform_rescan_card(0);
+		msleep(100);
+		sif_platform_rescan_card(1);
 
-			sif_sdio_state = ESP_SDIO_STATE_SECOND_INIT;
-			sdio_register_driver(&esp_sdio_driver);
-		}
+		sdio_register_driver(&esp_sdio_driver);
         }
 
 
@@ -865,9 +1396,17 @@ _fail:
 
 void esp_sdio_exit(void) 
 {
+	struct esp_sdio_ctrl *sctrl, *tmp;
+
 	esp_dbg(ESP_SHOW, "%s\n", __func__);
         esp_unregister_early_suspend();
 	sdio_unregister_driver(&esp_sdio_driver);
+
+	/* chips that never came back for the second stage */
+	list_for_each_entry_safe(sctrl, tmp, &sif_pending_ctrls, pending_list) {
+		list_del(&sctrl->pending_list);
+		esp_sdio_free_ctrl(sctrl);
+	}
 	sif_platform_rescan_card(0);
 
 #ifndef FPGA_DEBUG
@@ -0,0 +1,382 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   SIP rx chain walk and tx frame packing
+ */
+
+#ifdef __KERNEL__
+#include <linux/ieee80211.h>
+#include <linux/skbuff.h>
+#include <linux/string.h>
+#include "esp_debug.h"
+#else
+#include "sip_shim.h"
+#endif /* __KERNEL__ */
+
+#include "sip_parse.h"
+
+#ifdef SIP_DEBUG
+#define esp_sip_dbg esp_dbg
+#else
+#define esp_sip_dbg(...)
+#endif /* SIP_DEBUG */
+
+#define SIP_MIN_DATA_PKT_LEN    (sizeof(struct esp_mac_rx_ctrl) + 24) //24 is min 80211hdr
+
+static bool sip_ampdu_occupy_buf(struct sip_rx_parser *rxp, struct esp_rx_ampdu_len * ampdu_len)
+{
+        return (ampdu_len->substate == 0 || esp_wmac_rxsec_error(ampdu_len->substate) || (rxp->dump_rpbm_err && ampdu_len->substate == RX_RPBM_ERR));
+}
+
+static struct esp_mac_rx_ctrl *sip_parse_normal_mac_ctrl(struct sk_buff *skb, int * pkt_len_enc, int *buf_len, int *pulled_len)
+{
+        struct esp_mac_rx_ctrl *mac_ctrl = NULL;
+        struct sip_hdr *hdr =(struct sip_hdr *)skb->data;
+        int len_in_hdr = hdr->len;
+
+        ESSERT(skb != NULL);
+        ESSERT(skb->len > SIP_MIN_DATA_PKT_LEN);
+
+        skb_pull(skb, sizeof(struct sip_hdr));
+        *pulled_len += sizeof(struct sip_hdr);
+        mac_ctrl = (struct esp_mac_rx_ctrl *)skb->data;
+        if(!mac_ctrl->Aggregation) {
+                ESSERT(pkt_len_enc != NULL);
+                ESSERT(buf_len != NULL);
+                *pkt_len_enc = sip_rx_mpdu_len_enc(mac_ctrl);
+                *buf_len = len_in_hdr - sizeof(struct sip_hdr) - sizeof(struct esp_mac_rx_ctrl);
+        }
+        skb_pull(skb, sizeof(struct esp_mac_rx_ctrl));
+        *pulled_len += sizeof(struct esp_mac_rx_ctrl);
+
+        return mac_ctrl;
+}
+
+/*
+ * copy one MPDU (including subframe in AMPDU) out of the chain
+ *
+ */
+static struct sk_buff * sip_parse_data_rx_info(struct sip_rx_parser *rxp, struct sk_buff *skb, int pkt_len_enc, int buf_len, struct esp_mac_rx_ctrl *mac_ctrl, int *pulled_len) {
+        /*
+         *   | mac_rx_ctrl | real_data_payload | ampdu_entries |
+         */
+        //without enc
+        int pkt_len = 0;
+        struct sk_buff *rskb = NULL;
+
+        if (mac_ctrl->Aggregation) {
+                struct ieee80211_hdr * wh = (struct ieee80211_hdr *)skb->data;
+                pkt_len = pkt_len_enc;
+                if (ieee80211_has_protected(wh->frame_control))//ampdu, it is CCMP enc
+                        pkt_len -= 8;
+                buf_len = roundup(pkt_len, 4);
+        } else
+                pkt_len = sip_rx_mpdu_len(buf_len, pkt_len_enc);
+        esp_dbg(ESP_DBG_TRACE, "%s pkt_len %u, pkt_len_enc %u!, delta %d \n", __func__, pkt_len, pkt_len_enc, pkt_len_enc - pkt_len);
+        if (unlikely(pkt_len < 0)) {
+                esp_sip_dbg(ESP_DBG_ERROR, "%s bad pkt_len %d\n", __func__, pkt_len);
+                return NULL;
+        }
+        do {
+                rskb = __dev_alloc_skb(pkt_len_enc + rxp->rx_tailroom, GFP_ATOMIC);
+                if (unlikely(rskb == NULL)) {
+                        esp_sip_dbg(ESP_DBG_ERROR, "%s no mem for rskb\n", __func__);
+                        return NULL;
+                }
+                skb_put(rskb, pkt_len_enc);
+        } while(0);
+
+        do {
+                memcpy(rskb->data, skb->data, pkt_len);
+                if (pkt_len_enc > pkt_len) {
+                        memset(rskb->data + pkt_len, 0, pkt_len_enc - pkt_len);
+                }
+                /* strip out current pkt, move to the next one */
+                skb_pull(skb, buf_len);
+                *pulled_len += buf_len;
+        } while (0);
+
+        esp_dbg(ESP_DBG_LOG, "%s after pull headers, skb->len %d rskb->len %d \n", __func__, skb->len, rskb->len);
+
+        return rskb;
+}
+
+/*
+ * walk one rx chain, hand every event and frame in it to rxp->ops.
+ * returns true if a frame was queued for sendup, skb is the caller's
+ */
+bool sip_rx_parse(struct sip_rx_parser *rxp, struct sk_buff *skb)
+{
+	const struct sip_rx_ops *ops = rxp->ops;
+	struct sip_hdr * hdr = NULL;
+	struct sk_buff * rskb = NULL;
+	int remains_len = 0;
+	int first_pkt_len = 0;
+	u8 *bufptr = NULL;
+	bool trigger_rxq = false;
+
+	if (skb == NULL) {
+		esp_sip_dbg(ESP_DBG_ERROR, "%s NULL SKB!!!!!!!! \n", __func__);
+		return trigger_rxq;
+	}
+
+	if (skb->len < sizeof(struct sip_hdr)) {
+		ops->error(rxp->priv);
+		ESSERT(0);
+		return trigger_rxq;
+	}
+
+	hdr = (struct sip_hdr *)skb->data;
+	bufptr = skb->data;
+
+
+	esp_sip_dbg(ESP_DBG_TRACE, "%s Hcredits 0x%08x, realCredits %d\n", __func__, hdr->h_credits, hdr->h_credits & SIP_CREDITS_MASK);
+	if (hdr->h_credits & SIP_CREDITS_MASK) {
+		ops->credits(rxp->priv, hdr->h_credits & SIP_CREDITS_MASK);
+	}
+
+	hdr->h_credits &= ~SIP_CREDITS_MASK; /* clean credits in sip_hdr, prevent over-add */
+
+	esp_sip_dbg(ESP_DBG_TRACE, "%s credits %d\n", __func__, hdr->h_credits);
+
+	/*
+	 * first pkt's length is stored in  recycled_credits first 20 bits
+	 * config w3 [31:12]
+	 * repair hdr->len of first pkt
+	 */
+	remains_len = hdr->len;
+	first_pkt_len = hdr->h_credits >> 12;
+	hdr->len = first_pkt_len;
+
+	esp_dbg(ESP_DBG_TRACE, "%s first_pkt_len %d, whole pkt len %d\n", __func__, first_pkt_len, remains_len);
+	if (first_pkt_len > remains_len || remains_len > skb->len) {
+		ops->error(rxp->priv);
+		show_buf((u8 *)hdr, first_pkt_len);
+		ESSERT(0);
+		return trigger_rxq;
+	}
+
+	/*
+	 * pkts handling, including the first pkt, should alloc new skb for each data pkt.
+	 * the caller frees the original whole skb after parsing is done.
+	 */
+	while (remains_len) {
+		if (remains_len < sizeof(struct sip_hdr)) {
+			ops->error(rxp->priv);
+			ESSERT(0);
+			show_buf((u8 *)hdr, 512);
+			return trigger_rxq;
+		}
+
+		hdr = (struct sip_hdr *)bufptr;
+		if (hdr->len <= 0 || hdr->len > remains_len) {
+			ops->error(rxp->priv);
+			show_buf((u8 *)hdr, 512);
+			ESSERT(0);
+			return trigger_rxq;
+		}
+
+		if((hdr->len & 3) != 0) {
+			ops->error(rxp->priv);
+			show_buf((u8 *)hdr, 512);
+			ESSERT(0);
+			return trigger_rxq;
+		}
+		if (unlikely(hdr->seq != rxp->rxseq++)) {
+			ops->error(rxp->priv);
+			esp_dbg(ESP_DBG_ERROR, "%s seq mismatch! got %u, expect %u\n", __func__, hdr->seq, rxp->rxseq-1);
+			rxp->rxseq = hdr->seq + 1;
+			show_buf(bufptr, 32);
+			ESSERT(0);
+		}
+
+		if (SIP_HDR_IS_CTRL(hdr)) {
+			esp_sip_dbg(ESP_DBG_TRACE, "%s CTRL_HDR seq %u\n", __func__, hdr->seq);
+
+			ops->event(rxp->priv, bufptr);
+
+			skb_pull(skb, hdr->len);
+
+		} else if (SIP_HDR_IS_DATA(hdr)) {
+			struct esp_mac_rx_ctrl * mac_ctrl = NULL;
+			int pkt_len_enc = 0, buf_len = 0, pulled_len = 0;
+
+			esp_sip_dbg(ESP_DBG_TRACE, "%s DATA_HDR seq %u\n", __func__, hdr->seq);
+			if (!sip_rx_mpdu_valid(hdr)) {
+				ops->error(rxp->priv);
+				esp_sip_dbg(ESP_DBG_ERROR, "%s bad mpdu len %u\n", __func__, hdr->len);
+				ESSERT(0);
+				return trigger_rxq;
+			}
+			mac_ctrl = sip_parse_normal_mac_ctrl(skb, &pkt_len_enc, &buf_len, &pulled_len);
+			rskb = sip_parse_data_rx_info(rxp, skb, pkt_len_enc, buf_len, mac_ctrl, &pulled_len);
+
+			if(rskb == NULL) {
+				skb_pull(skb, hdr->len - pulled_len);
+				goto _move_on;
+			}
+
+			if (ops->mpdu(rxp->priv, rskb, mac_ctrl, !rxp->off))
+				trigger_rxq = true;
+		} else if (SIP_HDR_IS_AMPDU(hdr)) {
+			struct esp_mac_rx_ctrl * mac_ctrl = NULL;
+			struct esp_mac_rx_ctrl new_mac_ctrl;
+			struct esp_rx_ampdu_len *ampdu_len;
+			int pkt_num;
+			int pulled_len = 0;
+			bool have_rxabort = false;
+			bool have_goodpkt = false;
+			bool sendup;
+
+			ampdu_len = (struct esp_rx_ampdu_len *)(skb->data + hdr->len/rxp->rx_blksz * rxp->rx_blksz);
+			esp_sip_dbg(ESP_DBG_TRACE, "%s AMPDU_HDR rx ampdu total len %u\n", __func__, hdr->len);
+			if(skb->data != (u8 *)hdr) {
+				esp_sip_dbg(ESP_DBG, "%s APMDU %p %p\n", __func__, skb->data, hdr);
+				show_buf(skb->data, 512);
+				show_buf((u8 *)hdr, 512);
+				ESSERT(0);
+				return trigger_rxq;
+			}
+			if (!sip_rx_ampdu_valid(hdr, rxp->rx_blksz)) {
+				ops->error(rxp->priv);
+				esp_sip_dbg(ESP_DBG_ERROR, "%s bad ampdu len %u cnt %u\n", __func__, hdr->len,
+					((struct esp_mac_rx_ctrl *)(hdr + 1))->ampdu_cnt);
+				ESSERT(0);
+				return trigger_rxq;
+			}
+			mac_ctrl = sip_parse_normal_mac_ctrl(skb, NULL, NULL, &pulled_len);
+			memcpy(&new_mac_ctrl, mac_ctrl, sizeof(struct esp_mac_rx_ctrl));
+			mac_ctrl = &new_mac_ctrl;
+			pkt_num = mac_ctrl->ampdu_cnt;
+			esp_sip_dbg(ESP_DBG_TRACE, "%s %d rx ampdu %u pkts, %d pkts dumped, first len %u\n",__func__,
+				__LINE__, (unsigned int)((hdr->len % rxp->rx_blksz) / sizeof(struct esp_rx_ampdu_len)),
+				pkt_num, (unsigned int)ampdu_len->sublen);
+
+			rxp->ampdu_total += mac_ctrl->ampdu_cnt;
+			while (pkt_num > 0) {
+				esp_sip_dbg(ESP_DBG_TRACE, "%s %d ampdu sub state %02x,\n", __func__, __LINE__,
+					ampdu_len->substate);
+
+				if (sip_ampdu_occupy_buf(rxp, ampdu_len)) { //pkt is dumped
+
+					if (!sip_rx_ampdu_sub_fits(hdr, rxp->rx_blksz, pulled_len, ampdu_len)) {
+						ops->error(rxp->priv);
+						esp_sip_dbg(ESP_DBG_ERROR, "%s ampdu sublen %u overruns %u\n", __func__,
+							ampdu_len->sublen, hdr->len);
+						ESSERT(0);
+						return trigger_rxq;
+					}
+					rskb = sip_parse_data_rx_info(rxp, skb, ampdu_len->sublen - FCS_LEN, 0, mac_ctrl, &pulled_len);
+					if (!rskb) {
+						ops->error(rxp->priv);
+						ESSERT(0);
+						return trigger_rxq;
+					}
+
+					sendup = !rxp->off &&
+							(ampdu_len->substate == 0 || ampdu_len->substate == RX_TKIPMIC_ERR ||
+							 (rxp->sendup_rpbm_pkt && ampdu_len->substate == RX_RPBM_ERR)) &&
+							(rxp->rxabort_fixed || !have_rxabort);
+					if (sendup && !have_goodpkt && rskb->len >= sizeof(rxp->frame_head)) {
+						have_goodpkt = true;
+						memcpy(rxp->frame_head, rskb->data, 16);
+						rxp->frame_head[1] &= ~0x80;
+						rxp->frame_buf_ttl = 3;
+					}
+					if (ops->mpdu(rxp->priv, rskb, mac_ctrl, sendup))
+						trigger_rxq = true;
+				} else {
+					if (ampdu_len->substate == RX_ABORT) {
+						u8 * a;
+						have_rxabort = true;
+						esp_sip_dbg(ESP_DBG_TRACE, "rx abort %d %d\n", rxp->frame_buf_ttl, pkt_num);
+						if(rxp->frame_buf_ttl && !rxp->rxabort_fixed) {
+							struct esp_rx_ampdu_len * next_good_ampdu_len = ampdu_len + 1;
+							a = rxp->frame_head;
+							esp_sip_dbg(ESP_DBG_TRACE, "frame:%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
+									a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15]);
+							while(next_good_ampdu_len <= ampdu_len + pkt_num - 1 &&
+									!sip_ampdu_occupy_buf(rxp, next_good_ampdu_len))
+								next_good_ampdu_len++;
+							/* the next good subframe must be in the body to compare against */
+							if(next_good_ampdu_len <= ampdu_len + pkt_num -1 &&
+									pulled_len + sizeof(rxp->frame_head) <= hdr->len / rxp->rx_blksz * rxp->rx_blksz) {
+								bool b0, b10, b11;
+								a = skb->data;
+								esp_sip_dbg(ESP_DBG_TRACE, "buf:%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
+										a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15]);
+								b0 = memcmp(rxp->frame_head + 4, skb->data + 4, 12) == 0;
+								b10 = memcmp(rxp->frame_head + 10, skb->data, 6) == 0;
+								b11 = memcmp(rxp->frame_head + 11, skb->data, 5) == 0;
+								esp_sip_dbg(ESP_DBG_TRACE, "com %d %d %d\n", b0, b10, b11);
+								if(b0 && !b10 && !b11) {
+									have_rxabort = false;
+									esp_sip_dbg(ESP_DBG_TRACE, "repair 0\n");
+								} else if(!b0 && b10 && !b11) {
+									skb_push(skb, 10);
+									memcpy(skb->data, rxp->frame_head, 10);
+									have_rxabort = false;
+									pulled_len -= 10;
+									esp_sip_dbg(ESP_DBG_TRACE, "repair 10\n");
+								} else if(!b0 && !b10 && b11) {
+									skb_push(skb, 11);
+									memcpy(skb->data, rxp->frame_head, 11);
+									have_rxabort = false;
+									pulled_len -= 11;
+									esp_sip_dbg(ESP_DBG_TRACE, "repair 11\n");
+								}
+							}
+						}
+					}
+					rxp->ampdu_dropped++;
+					esp_sip_dbg(ESP_DBG_LOG, "%s ampdu dropped %d/%d\n", __func__, rxp->ampdu_dropped, rxp->ampdu_total);
+				}
+				pkt_num--;
+				ampdu_len++;
+			}
+			if(rxp->frame_buf_ttl)
+				rxp->frame_buf_ttl--;
+			skb_pull(skb, hdr->len - pulled_len);
+		} else {
+			esp_sip_dbg(ESP_DBG_ERROR, "%s %d unknown type\n", __func__, __LINE__);
+			/* keep skb->data on the next packet */
+			skb_pull(skb, hdr->len);
+		}
+
+_move_on:
+		if (hdr->len < remains_len) {
+			remains_len -= hdr->len;
+		} else {
+			break;
+		}
+		bufptr += hdr->len;
+	}
+
+	return trigger_rxq;
+}
+
+/*
+ * | sip_hdr | [sip_tx_rc] | [esp_tx_ampdu_entry] | frame |
+ * buf holds a sip_hdr with the type and tx info already set, fill in
+ * the rest and copy the frame behind it. returns the unpadded length
+ */
+u32 sip_pack_data(u8 *buf, const u8 *frame, u32 frame_len, u32 seq)
+{
+        struct sip_hdr *shdr = (struct sip_hdr *)buf;
+        bool ampdu = SIP_HDR_IS_AMPDU(shdr);
+        u32 offset = sip_tx_data_offset(ampdu);
+
+        if (ampdu)
+                memset(buf + offset - roundup(sizeof(struct esp_tx_ampdu_entry), 4), 0,
+                       sizeof(struct esp_tx_ampdu_entry));
+
+        shdr->len = offset + frame_len;  /* actual len */
+        shdr->seq = seq;
+        memcpy(buf + offset, frame, frame_len);
+
+        return shdr->len;
+}
@@ -0,0 +1,153 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   SIP buffer layout helpers and the rx aggregate walk
+ *
+ *   The inline helpers are pure arithmetic over sip_hdr / esp_mac_rx_ctrl
+ *   laid out in a flat buffer and build wherever sip2_common.h does
+ *   (kernel, __ets__, or user space with the basic u8/u16/u32 types and
+ *   roundup()).  sip_parse.c adds the walk over a whole rx chain and the
+ *   tx frame packing; it only needs skb_put/pull/push and
+ *   __dev_alloc_skb, everything that touches esp_pub or mac80211 goes
+ *   through struct sip_rx_ops, so tools/sip builds it against a user
+ *   space skb shim.
+ */
+
+#ifndef _SIP_PARSE_H_
+#define _SIP_PARSE_H_
+
+#include "sip2_common.h"
+#include "esp_wmac.h"
+
+#ifndef FCS_LEN
+#define FCS_LEN 4
+#endif
+
+/* where the 802.11 frame starts in a tx data packet */
+static inline u32 sip_tx_data_offset(bool ampdu)
+{
+        u32 offset = roundup(sizeof(struct sip_hdr), 4);
+
+#ifdef HOST_RC
+        offset += roundup(sizeof(struct sip_tx_rc), 4);
+#endif /* HOST_RC */
+        if (ampdu)
+                offset += roundup(sizeof(struct esp_tx_ampdu_entry), 4);
+
+        return offset;
+}
+
+/* frame length the target reports for a single mpdu, FCS stripped */
+static inline int sip_rx_mpdu_len_enc(const struct esp_mac_rx_ctrl *mac_ctrl)
+{
+        return (mac_ctrl->sig_mode ? mac_ctrl->HT_length : mac_ctrl->legacy_length) - FCS_LEN;
+}
+
+/* real frame length from the 4 byte padded length in the buffer */
+static inline int sip_rx_mpdu_len(int buf_len, int pkt_len_enc)
+{
+        return buf_len - 3 + ((pkt_len_enc - 1) & 0x3);
+}
+
+/*
+ * | sip_hdr | mac_rx_ctrl | subframes | pad to rx_blksz | esp_rx_ampdu_len x ampdu_cnt |
+ * check the fixed part and the trailers fit in hdr->len
+ */
+static inline bool sip_rx_ampdu_valid(const struct sip_hdr *hdr, u32 rx_blksz)
+{
+        const struct esp_mac_rx_ctrl *mac_ctrl = (const struct esp_mac_rx_ctrl *)(hdr + 1);
+        u32 body;
+
+        if (rx_blksz == 0 || hdr->len < sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl))
+                return false;
+        if (!mac_ctrl->Aggregation)
+                return false;
+
+        body = hdr->len / rx_blksz * rx_blksz;
+        if (body < sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl))
+                return false;
+
+        return hdr->len - body >= mac_ctrl->ampdu_cnt * sizeof(struct esp_rx_ampdu_len);
+}
+
+/*
+ * | sip_hdr | mac_rx_ctrl | frame padded to 4 |
+ * check a single mpdu packet is long enough and the frame fits in it
+ */
+static inline bool sip_rx_mpdu_valid(const struct sip_hdr *hdr)
+{
+        const struct esp_mac_rx_ctrl *mac_ctrl = (const struct esp_mac_rx_ctrl *)(hdr + 1);
+        int buf_len, pkt_len_enc, pkt_len;
+
+        if (hdr->len < sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl))
+                return false;
+        /* lengths of aggregated frames are only in the ampdu trailers */
+        if (mac_ctrl->Aggregation)
+                return false;
+
+        buf_len = hdr->len - sizeof(struct sip_hdr) - sizeof(struct esp_mac_rx_ctrl);
+        pkt_len_enc = sip_rx_mpdu_len_enc(mac_ctrl);
+        pkt_len = sip_rx_mpdu_len(buf_len, pkt_len_enc);
+
+        return pkt_len_enc > 0 && pkt_len >= 0 && pkt_len <= pkt_len_enc;
+}
+
+/* does the next subframe, padded to 4, still fit in the aggregate body */
+static inline bool sip_rx_ampdu_sub_fits(const struct sip_hdr *hdr, u32 rx_blksz,
+                                         u32 pulled_len, const struct esp_rx_ampdu_len *ampdu_len)
+{
+        u32 body = hdr->len / rx_blksz * rx_blksz;
+
+        if (ampdu_len->sublen < FCS_LEN)
+                return false;
+
+        return pulled_len + roundup(ampdu_len->sublen - FCS_LEN, 4) <= body;
+}
+
+struct sk_buff;
+
+/*
+ * driver side of sip_rx_parse(), priv is handed back as is
+ *
+ * credits: credits returned in the first sip_hdr of the chain
+ * event:   one ctrl packet, buf points at its sip_hdr
+ * mpdu:    one frame copied out of the chain, the driver owns rskb.
+ *          sendup false means it is to be dropped once the driver has
+ *          looked at it.  returns true if rskb was queued for sendup
+ * error:   the chain is malformed, nothing after it is parsed
+ */
+struct sip_rx_ops {
+        void (*credits)(void *priv, u16 credits);
+        int (*event)(void *priv, u8 *buf);
+        bool (*mpdu)(void *priv, struct sk_buff *rskb, struct esp_mac_rx_ctrl *mac_ctrl, bool sendup);
+        void (*error)(void *priv);
+};
+
+struct sip_rx_parser {
+        const struct sip_rx_ops *ops;
+        void *priv;
+
+        u32 rxseq; /* sip pkt seq, should match target side */
+        u16 rx_blksz;
+        u16 rx_tailroom; /* extra room allocated behind each frame */
+        bool off; /* frames are parsed but none is sent up */
+        bool dump_rpbm_err;
+        bool sendup_rpbm_pkt;
+        bool rxabort_fixed;
+
+        /* rx abort repair, carried from one aggregate to the next */
+        u8 frame_head[16];
+        u8 frame_buf_ttl;
+        u32 ampdu_dropped;
+        u32 ampdu_total;
+};
+
+bool sip_rx_parse(struct sip_rx_parser *rxp, struct sk_buff *skb);
+
+u32 sip_pack_data(u8 *buf, const u8 *frame, u32 frame_len, u32 seq);
+
+#endif /* _SIP_PARSE_H_ */
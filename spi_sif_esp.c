@@ -18,12 +18,19 @@
 #include <linux/pm.h>
 #include <linux/spi/spi.h>
 #include <linux/interrupt.h>
-#include <linux/kthread.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/gpio.h>
+#include <linux/of_gpio.h>
+#include <linux/version.h>
+#include <linux/sched.h>
+#include <linux/log2.h>
 
 
 #include "esp_pub.h"
 #include "esp_sif.h"
 #include "esp_sip.h"
+#include "esp_sched.h"
 #include "esp_debug.h"
 #include "slc_host_register.h"
 #include "esp_version.h"
@@ -42,12 +49,8 @@ extern void esp_put_lspi_buf(u8 **p);
 #define SPI_BLOCK_SIZE              (512)
 
 #define MAX_BUF_SIZE        (48*1024)
-
-static unsigned char *buf_addr = NULL;
-static unsigned char *tx_cmd;
-static unsigned char *rx_cmd;
-static unsigned char *check_buf = NULL;
-static unsigned char *ff_buf = NULL;
+#define SPI_MAX_XFERS       (2 * (MAX_BUF_SIZE / SPI_BLOCK_SIZE) + 1)
+#define SPI_WRITE_MAX_BLKS  ((SPI_MAX_XFERS - 1) / 2)   /* per block write cmd */
 
 unsigned int crc_ta_8[256]={ 
                                 0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
@@ -100,19 +103,129 @@ unsigned int crc_cal_by_byte(unsigned char* ptr, int len)
     return crc;
 }
 
-struct task_struct *sif_irq_thread;
+/*
+ * slicing-by-8: crc_ta_s8[k][b] is byte b followed by k zero bytes, so
+ * eight bytes cost eight independent lookups instead of a dependent
+ * chain. Same crc as crc_cal_by_byte(), checked at init.
+ */
+static u16 crc_ta_s8[8][256];
+
+static unsigned int crc_cal_slice8(unsigned char *ptr, int len)
+{
+    u16 crc = 0;
+
+    while (len >= 8) {
+        crc = crc_ta_s8[7][ptr[0] ^ (crc >> 8)] ^
+              crc_ta_s8[6][ptr[1] ^ (crc & 0xff)] ^
+              crc_ta_s8[5][ptr[2]] ^ crc_ta_s8[4][ptr[3]] ^
+              crc_ta_s8[3][ptr[4]] ^ crc_ta_s8[2][ptr[5]] ^
+              crc_ta_s8[1][ptr[6]] ^ crc_ta_s8[0][ptr[7]];
+        ptr += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0) {
+        crc = (crc << 8) ^ crc_ta_s8[0][(crc >> 8) ^ *ptr];
+        ptr++;
+    }
+
+    return crc;
+}
+
+/* crc over spi data blocks, slice8 unless its self-test failed */
+static unsigned int (*spi_crc16)(unsigned char *ptr, int len) = crc_cal_by_byte;
+
+static bool spi_crc_bench;
+module_param(spi_crc_bench, bool, 0444);
+MODULE_PARM_DESC(spi_crc_bench, "time the spi block crc routines at load");
+
+static int spi_crc_selftest(void)
+{
+    static unsigned char check[] = "123456789";
+    unsigned char *buf;
+    int off, len, err = 0;
+
+    /* CRC-16/XMODEM check value */
+    if (crc_cal_slice8(check, 9) != 0x31c3 || crc_cal_by_byte(check, 9) != 0x31c3)
+        return -EINVAL;
+
+    buf = kmalloc(SPI_BLOCK_SIZE + 8, GFP_KERNEL);
+    if (buf == NULL)
+        return -ENOMEM;
+    get_random_bytes(buf, SPI_BLOCK_SIZE + 8);
+
+    /* every tail length and misalignment */
+    for (off = 0; off < 8 && !err; off++)
+        for (len = 0; len <= SPI_BLOCK_SIZE; len++)
+            if (crc_cal_slice8(buf + off, len) != crc_cal_by_byte(buf + off, len)) {
+                err = -EINVAL;
+                break;
+            }
+
+    kfree(buf);
+    return err;
+}
+
+static void spi_crc_benchmark(void)
+{
+#define SPI_CRC_BENCH_LOOPS 4096
+    unsigned char *buf;
+    unsigned int sum = 0;
+    u64 t0, byte_ns, slice_ns;
+    int i;
+
+    buf = kmalloc(SPI_BLOCK_SIZE, GFP_KERNEL);
+    if (buf == NULL)
+        return;
+    get_random_bytes(buf, SPI_BLOCK_SIZE);
+
+    t0 = ktime_to_ns(ktime_get());
+    for (i = 0; i < SPI_CRC_BENCH_LOOPS; i++)
+        sum += crc_cal_by_byte(buf, SPI_BLOCK_SIZE);
+    byte_ns = ktime_to_ns(ktime_get()) - t0;
+
+    t0 = ktime_to_ns(ktime_get());
+    for (i = 0; i < SPI_CRC_BENCH_LOOPS; i++)
+        sum += crc_cal_slice8(buf, SPI_BLOCK_SIZE);
+    slice_ns = ktime_to_ns(ktime_get()) - t0;
+
+    esp_dbg(ESP_SHOW, "spi crc per %d byte block: by_byte %llu ns, slice8 %llu ns (%u)\n",
+            SPI_BLOCK_SIZE, div_u64(byte_ns, SPI_CRC_BENCH_LOOPS),
+            div_u64(slice_ns, SPI_CRC_BENCH_LOOPS), sum & 1);
+
+    kfree(buf);
+}
+
+static void spi_crc_init(void)
+{
+    int i, k;
+
+    for (i = 0; i < 256; i++)
+        crc_ta_s8[0][i] = crc_ta_8[i];
+    for (k = 1; k < 8; k++)
+        for (i = 0; i < 256; i++)
+            crc_ta_s8[k][i] = (crc_ta_s8[k - 1][i] << 8) ^
+                              crc_ta_s8[0][crc_ta_s8[k - 1][i] >> 8];
+
+    if (spi_crc_selftest()) {
+        esp_dbg(ESP_DBG_ERROR, "spi crc slice8 self-test failed, using byte table\n");
+        spi_crc16 = crc_cal_by_byte;
+    } else {
+        spi_crc16 = crc_cal_slice8;
+    }
+
+    if (spi_crc_bench)
+        spi_crc_benchmark();
+}
 
 #define ESP_DMA_IBUFSZ   2048
 
 //unsigned int esp_msg_level = 0;
 unsigned int esp_msg_level = ESP_DBG_ERROR | ESP_SHOW;
 
+/* the dummy driver's power-up check only, any chip will do */
 static struct semaphore esp_powerup_sem;
 
-static enum esp_sdio_state sif_sdio_state;
-struct esp_spi_ctrl *sif_sctrl = NULL;
-static struct esp_spi_resp spi_resp;
-
 #ifdef ESP_ANDROID_LOGGER
 bool log_off = false;
 #endif /* ESP_ANDROID_LOGGER */
@@ -123,9 +236,9 @@ extern int request_rtc_irq(void);
 
 #include "spi_stub.c"
 
-struct esp_spi_resp *sif_get_spi_resp(void)
+struct esp_spi_resp *sif_get_spi_resp(struct esp_pub *epub)
 {
-    return &spi_resp;
+    return &EPUB_TO_CTRL(epub)->spi_resp;
 }
 
 void sif_lock_bus(struct esp_pub *epub)
@@ -186,6 +299,21 @@ int sif_spi_write_async_read(struct spi_device *spi, unsigned char* bufwrite,uns
 	return 0;
 }
 
+/* append one transfer of a multi-transfer message, cs held throughout */
+static void sif_spi_xfer_add(struct spi_transfer *xfers, struct spi_message *msg, int *nx,
+                             const void *tx, void *rx, int len)
+{
+	struct spi_transfer *xfer = &xfers[(*nx)++];
+
+	memset(xfer, 0, sizeof(struct spi_transfer));
+	xfer->tx_buf = tx;
+	xfer->rx_buf = rx;
+	xfer->len = len;
+	xfer->bits_per_word = 8;
+	xfer->speed_hz = SPI_FREQ;
+	spi_message_add_tail(xfer, msg);
+}
+
 int sif_spi_write_raw(struct spi_device *spi, unsigned char* buf, int size)
 {
 	int err;
@@ -217,14 +345,196 @@ int sif_spi_read_raw(struct spi_device *spi, unsigned char* buf, int size)
         return sif_spi_write_async_read(spi,buf,buf,size);
 }
 
+/*
+ * The windows clocked for a 0xFE start token are sized for the slowest
+ * target. Once a whole epoch of tokens came in well inside one, clock
+ * only up to the furthest seen plus a margin; the first miss goes back
+ * to the protocol default.
+ */
+#define SPI_WIN_EPOCH   256
+
+static bool spi_resp_adapt = true;
+module_param(spi_resp_adapt, bool, 0644);
+MODULE_PARM_DESC(spi_resp_adapt, "size spi read windows from the observed start token positions");
+
+static unsigned int spi_resp_margin = 16;
+module_param(spi_resp_margin, uint, 0644);
+MODULE_PARM_DESC(spi_resp_margin, "bytes clocked past the furthest start token seen");
+
+static int spi_ready_gpio = -1;
+module_param(spi_ready_gpio, int, 0444);
+MODULE_PARM_DESC(spi_ready_gpio, "ready gpio of a device without a ready-gpios property, one device only, -1: poll");
+static bool spi_ready_dflt_used;
+
+#define SPI_READY_TIMEOUT_MS    20
+#define SPI_POLL_TIMEOUT        200
+
+static inline u32 sif_spi_win(struct esp_spi_win *w, u32 dflt)
+{
+	if (!spi_resp_adapt || w->cur == 0)
+		return dflt;
+	return min(w->cur, dflt);
+}
+
+static void sif_spi_win_hit(struct esp_spi_ctrl *sctrl, struct esp_spi_win *w, u32 pos, u32 win)
+{
+	sctrl->spi_resp.token_hits++;
+	sctrl->spi_resp.wasted_bytes += win - pos - 1;
+
+	if (pos > w->hw)
+		w->hw = pos;
+	if (++w->n < SPI_WIN_EPOCH)
+		return;
+
+	w->cur = roundup(w->hw + 1 + spi_resp_margin, 8);
+	w->hw = 0;
+	w->n = 0;
+}
+
+static void sif_spi_win_miss(struct esp_spi_ctrl *sctrl, struct esp_spi_win *w, u32 win)
+{
+	sctrl->spi_resp.token_misses++;
+	sctrl->spi_resp.wasted_bytes += win;
+
+	w->cur = 0;
+	w->hw = 0;
+	w->n = 0;
+}
+
+static irqreturn_t sif_spi_ready_irq(int irq, void *dev_id)
+{
+	struct esp_spi_ctrl *sctrl = dev_id;
+
+	complete(&sctrl->ready);
+	return IRQ_HANDLED;
+}
+
+/* 0 once the ready line is up, else the caller just polls */
+static int sif_spi_wait_ready(struct esp_spi_ctrl *sctrl)
+{
+	if (sctrl->ready_irq <= 0)
+		return -ENODEV;
+
+	reinit_completion(&sctrl->ready);
+	if (gpio_get_value(sctrl->ready_gpio))
+		return 0;
+
+	sctrl->spi_resp.ready_waits++;
+	if (wait_for_completion_timeout(&sctrl->ready, msecs_to_jiffies(SPI_READY_TIMEOUT_MS)) == 0) {
+		sctrl->spi_resp.ready_timeouts++;
+		return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+/*
+ * clock 256 byte dummy reads into check_buf until the target answers:
+ * a 0xFE start token when token, else a whole read of 0xff (not busy).
+ * With a ready line each read waits for it instead of going blind.
+ */
+static int sif_spi_poll_target(struct spi_device *spi, bool token)
+{
+	struct esp_spi_ctrl *sctrl = spi_get_drvdata(spi);
+	int timeout = SPI_POLL_TIMEOUT;
+
+	do {
+		sif_spi_wait_ready(sctrl);
+		sif_spi_read_raw(spi, sctrl->check_buf, 256);
+		sctrl->spi_resp.polls++;
+		sctrl->spi_resp.wasted_bytes += 256;
+
+		if (token) {
+			if (memchr(sctrl->check_buf, 0xFE, 256))
+				return 0;
+		} else if (memcmp(sctrl->check_buf, sctrl->ff_buf, 256) == 0) {
+			return 0;
+		}
+	} while (--timeout > 0);
+
+	return -ETIMEDOUT;
+}
+
+/*
+ * the ready line of this device: its "ready-gpios" property, else
+ * spi_ready_gpio if no other device holds that one, else -1 (poll)
+ */
+static int sif_spi_ready_gpio(struct esp_spi_ctrl *sctrl)
+{
+	int gpio = -1;
+
+#ifdef CONFIG_OF_GPIO
+	if (sctrl->spi->dev.of_node)
+		gpio = of_get_named_gpio(sctrl->spi->dev.of_node, "ready-gpios", 0);
+#endif
+	if (gpio >= 0 || spi_ready_gpio < 0 || spi_ready_dflt_used)
+		return gpio;
+
+	spi_ready_dflt_used = true;
+	sctrl->ready_dflt = true;
+	return spi_ready_gpio;
+}
+
+static void sif_spi_ready_init(struct esp_spi_ctrl *sctrl)
+{
+	int gpio, irq, err;
+
+	if (sctrl->ready_irq > 0)
+		return;
+
+	gpio = sif_spi_ready_gpio(sctrl);
+	if (gpio < 0)
+		return;
+
+	init_completion(&sctrl->ready);
+
+	err = gpio_request_one(gpio, GPIOF_IN, "esp_spi_ready");
+	if (err) {
+		esp_dbg(ESP_DBG_ERROR, "%s gpio %d busy %d, polling\n", __func__, gpio, err);
+		goto _err;
+	}
+
+	irq = gpio_to_irq(gpio);
+	if (irq > 0)
+		err = request_irq(irq, sif_spi_ready_irq, IRQF_TRIGGER_RISING, "esp_spi_ready", sctrl);
+	if (irq <= 0 || err) {
+		esp_dbg(ESP_DBG_ERROR, "%s no irq on gpio %d, polling\n", __func__, gpio);
+		gpio_free(gpio);
+		goto _err;
+	}
+
+	sctrl->ready_gpio = gpio;
+	sctrl->ready_irq = irq;
+	return;
+
+_err:
+	if (sctrl->ready_dflt) {
+		spi_ready_dflt_used = false;
+		sctrl->ready_dflt = false;
+	}
+}
+
+static void sif_spi_ready_free(struct esp_spi_ctrl *sctrl)
+{
+	if (sctrl->ready_irq <= 0)
+		return;
+
+	free_irq(sctrl->ready_irq, sctrl);
+	gpio_free(sctrl->ready_gpio);
+	sctrl->ready_irq = 0;
+	if (sctrl->ready_dflt) {
+		spi_ready_dflt_used = false;
+		sctrl->ready_dflt = false;
+	}
+}
+
 int sif_spi_write_bytes(struct spi_device *spi, unsigned int addr, unsigned char *src,int count, int dummymode)
 {
+    struct esp_spi_ctrl *sctrl = NULL;
     int i;
     int pos,len;       
     unsigned char *tx_data = (unsigned char*)src;
     int err_ret = 0;     
-    u32 timeout = 200;
-    spi_resp.data_resp_size_w = ((((((count>>5)+1) *75)) +44)>>3) +1;
 
     if (spi == NULL) {
     	ESSERT(0);
@@ -232,13 +542,16 @@ int sif_spi_write_bytes(struct spi_device *spi, unsigned int addr, unsigned char
 	goto goto_err;
     }
 
+    sctrl = spi_get_drvdata(spi);
+    sctrl->spi_resp.data_resp_size_w = ((((((count>>5)+1) *75)) +44)>>3) +1;
+
     if(count > 512 )
     {
         err_ret = -1;
         goto goto_err;
     }
 
-    tx_cmd[0]=0x75;
+    sctrl->tx_cmd[0]=0x75;
 
     if( addr >= (1<<17) )
     {
@@ -248,72 +561,72 @@ int sif_spi_write_bytes(struct spi_device *spi, unsigned int addr, unsigned char
     }
     else
     {
-        tx_cmd[1]=0x90|0x04|(addr>>15);    //0x94;
-        tx_cmd[2]=addr>>7;    
+        sctrl->tx_cmd[1]=0x90|0x04|(addr>>15);    //0x94;
+        sctrl->tx_cmd[2]=addr>>7;    
 
         if(count == 512 )
         {
-            tx_cmd[3]=( addr<<1|0x0 );
-            tx_cmd[4]= 0x00;     //0x08;
+            sctrl->tx_cmd[3]=( addr<<1|0x0 );
+            sctrl->tx_cmd[4]= 0x00;     //0x08;
         }
         else
         {
-            tx_cmd[3]=( addr<<1|(count>>8 & 0x01) );
-            tx_cmd[4]= count & 0xff;     //0x08;
+            sctrl->tx_cmd[3]=( addr<<1|(count>>8 & 0x01) );
+            sctrl->tx_cmd[4]= count & 0xff;     //0x08;
         }
     }
 
-    tx_cmd[5]=0x01;
+    sctrl->tx_cmd[5]=0x01;
     pos = 5+1;
 
     //Add cmd respon
-    memset(tx_cmd+pos,0xff,CMD_RESP_SIZE);
+    memset(sctrl->tx_cmd+pos,0xff,CMD_RESP_SIZE);
     pos =pos+ CMD_RESP_SIZE;
 
     //Add token        
-    tx_cmd[pos]=0xFE;
+    sctrl->tx_cmd[pos]=0xFE;
     pos = pos+1;
 
     //Add data  
-    memcpy(tx_cmd+pos,tx_data,count);
+    memcpy(sctrl->tx_cmd+pos,tx_data,count);
     pos = pos+count;
 
     //Add data respon
-    memset(tx_cmd+pos,0xff,spi_resp.data_resp_size_w);
-    pos = pos+ spi_resp.data_resp_size_w ;
+    memset(sctrl->tx_cmd+pos,0xff,sctrl->spi_resp.data_resp_size_w);
+    pos = pos+ sctrl->spi_resp.data_resp_size_w ;
 
 
     if(pos <128)
     {
         len = 128-pos;
-        memset(tx_cmd+pos,0xff,len);
+        memset(sctrl->tx_cmd+pos,0xff,len);
     }
     else
     {
         if( pos%8 )
         {
             len = (8 - pos%8);
-            memset(tx_cmd+pos,0xff,len);
+            memset(sctrl->tx_cmd+pos,0xff,len);
         }
         else
             len = 0;
     }
 
-    sif_spi_write_async_read(spi, tx_cmd,tx_cmd,pos+len);
+    sif_spi_write_async_read(spi, sctrl->tx_cmd,sctrl->tx_cmd,pos+len);
 
     pos = 5+1;
     for(i=0;i<CMD_RESP_SIZE;i++)
     {
-        if(tx_cmd[pos+i] == 0x00 && tx_cmd[pos+i-1] == 0xff)
+        if(sctrl->tx_cmd[pos+i] == 0x00 && sctrl->tx_cmd[pos+i-1] == 0xff)
         {
-            if(tx_cmd[pos+i+1] == 0x00 && tx_cmd[pos+i+2] == 0xff)
+            if(sctrl->tx_cmd[pos+i+1] == 0x00 && sctrl->tx_cmd[pos+i+2] == 0xff)
                 break;      
         }
     }
 
-    if(i>spi_resp.max_cmd_resp_size)
+    if(i>sctrl->spi_resp.max_cmd_resp_size)
     {
-        spi_resp.max_cmd_resp_size = i;
+        sctrl->spi_resp.max_cmd_resp_size = i;
     }
 
     if(i>=CMD_RESP_SIZE)
@@ -324,21 +637,21 @@ int sif_spi_write_bytes(struct spi_device *spi, unsigned int addr, unsigned char
     }
 
     pos = pos+CMD_RESP_SIZE+count+1;
-    for(i=0;i<spi_resp.data_resp_size_w;i++)
+    for(i=0;i<sctrl->spi_resp.data_resp_size_w;i++)
     {
-        if(tx_cmd[pos+i] == 0xE5)
+        if(sctrl->tx_cmd[pos+i] == 0xE5)
         {
             //esp_dbg(ESP_DBG_ERROR, "0xE5 pos:%d",i);
-            for(i++;i<spi_resp.data_resp_size_w ;i++)
+            for(i++;i<sctrl->spi_resp.data_resp_size_w ;i++)
             {
-                if( tx_cmd[pos+i] == 0xFF)
+                if( sctrl->tx_cmd[pos+i] == 0xFF)
                 {
        //     esp_dbg(ESP_DBG_ERROR, "find ff pos = %d,i = %d\n",pos+i,i);
 
-                    if(i>spi_resp.max_dataW_resp_size)
+                    if(i>sctrl->spi_resp.max_dataW_resp_size)
                     {
-                        spi_resp.max_dataW_resp_size = i;
-                       // printk(KERN_ERR "new data write MAX 0xFF pos:%d",spi_resp.max_dataW_resp_size);
+                        sctrl->spi_resp.max_dataW_resp_size = i;
+                       // printk(KERN_ERR "new data write MAX 0xFF pos:%d",sctrl->spi_resp.max_dataW_resp_size);
                     }
 
                     //esp_dbg(ESP_DBG_ERROR, "0xFF pos:%d",i);
@@ -348,20 +661,12 @@ int sif_spi_write_bytes(struct spi_device *spi, unsigned int addr, unsigned char
             break;      
         }
     }
-    if(i>=spi_resp.data_resp_size_w)
+    if(i>=sctrl->spi_resp.data_resp_size_w)
     {
         if(dummymode == 0)
             esp_dbg(ESP_DBG, "normal byte write data no-busy wait byte 0xff no recv at the first time\n");
 
-        timeout = 200;
-        do {
-            timeout --;
-            //memset(check_buf,0x00,256);
-
-            sif_spi_read_raw(spi, check_buf, 256);
-        } while( memcmp(check_buf,ff_buf,256) != 0 && timeout >0 ) ;
-
-        if(timeout == 0)
+        if(sif_spi_poll_target(spi, false))
         {
             esp_dbg(ESP_DBG_ERROR, "spierr byte write data no-busy wait byte 0xff no recv \n"); 
             err_ret = -4;
@@ -373,362 +678,496 @@ goto_err:
     return err_ret;
 }
 
-int sif_spi_write_blocks(struct spi_device *spi, unsigned int addr,unsigned char *src, int count)
+/* cmd framing of a block write into ctl, returns its length */
+static int sif_spi_write_blocks_cmd(unsigned char *ctl, unsigned int addr, int count)
 {
-    int err_ret = 0;
-    int i,j;
-    int n;
-    int pos,len; 
-    unsigned char *tx_data = (unsigned char*)src;
-    int find_w_rsp = 0;
-    int timeout = 200;
-
-    if (spi == NULL) {
-    	ESSERT(0);
-	err_ret = -EINVAL;
-	goto goto_err;
-    }
-
-    tx_cmd[0]=0x75;
-
-    if( count <=0 )
-    {
-        err_ret = -1;
-        goto goto_err;
-    }
+    ctl[0]=0x75;
+    ctl[1]=0x90|0x0C|(addr>>15);   
+    ctl[2]=addr>>7;    
 
-    if( addr >= (1<<17) )
+    if(count >= 512 )
     {
-        err_ret = -2;
-        goto goto_err;
+        ctl[3]=( addr<<1|0x0 );
+        ctl[4]= 0x00;     
     }
     else
     {
-        tx_cmd[1]=0x90|0x0C|(addr>>15);   
-        tx_cmd[2]=addr>>7;    
-
-        if(count >= 512 )
-        {
-            tx_cmd[3]=( addr<<1|0x0 );
-            tx_cmd[4]= 0x00;     
-        }
-        else
-        {
-            tx_cmd[3]=( addr<<1|(count>>8 & 0x01) );
-            tx_cmd[4]= count & 0xff ;     
-        }
+        ctl[3]=( addr<<1|(count>>8 & 0x01) );
+        ctl[4]= count & 0xff ;     
     }
-    tx_cmd[5]=0x01;
+    ctl[5]=0x01;
 
-    pos = 5+1;
     //Add cmd respon
-    memset(tx_cmd+pos,0xff,CMD_RESP_SIZE);
-    pos =pos+ CMD_RESP_SIZE;
-    if(count < 3)
-    {
-        for(j=0;j<count;j++)
-        {
-            //Add token   
-            tx_cmd[pos]=0xFC;
-            pos = pos+1;
-            //Add data    
-            memcpy(tx_cmd+pos,tx_data+j*SPI_BLOCK_SIZE, SPI_BLOCK_SIZE);
-            pos = pos+SPI_BLOCK_SIZE;
-            //Add data respon
-            if( j==(count- 1) )
-            {
-                memset(tx_cmd+pos , 0xff , spi_resp.block_w_data_resp_size_final);
-                pos = pos+ spi_resp.block_w_data_resp_size_final;
-                continue;
-            }
-            memset(tx_cmd+pos , 0xff , BLOCK_W_DATA_RESP_SIZE_EACH);
-            pos = pos+ BLOCK_W_DATA_RESP_SIZE_EACH;
-        }
+    memset(ctl+6,0xff,CMD_RESP_SIZE);
 
-        if( pos%8 )
-        {
-            len = (8 - pos%8);
-            memset(tx_cmd+pos,0xff,len);
-        }
-        else
-            len = 0;
+    return 6 + CMD_RESP_SIZE;
+}
+
+/*
+ * block write burst without copying the payload: the framing (cmd,
+ * tokens, response windows, pad to 8) is laid out back to back in ctl
+ * and clocked in place so the responses land there, each 512 byte
+ * block goes out as its own transfer straight from src. The caller has
+ * put pos bytes of cmd framing in ctl already. Returns the framing
+ * length, a multiple of 8.
+ */
+static int sif_spi_write_blocks_msg(struct esp_spi_ctrl *sctrl, struct spi_message *msg,
+                                    unsigned char *ctl, struct spi_transfer *xfers,
+                                    int pos, unsigned char *src, int first, int last, int count)
+{
+    int nx = 0, start = 0, j, n, len;
+
+    spi_message_init(msg);
 
-        sif_spi_write_async_read(spi, tx_cmd,tx_cmd,pos+len);
+    for (j = first; j < last; j++) {
+        ctl[pos++] = 0xFC;
+        sif_spi_xfer_add(xfers, msg, &nx, ctl + start, ctl + start, pos - start);
+        sif_spi_xfer_add(xfers, msg, &nx, src + j * SPI_BLOCK_SIZE, NULL, SPI_BLOCK_SIZE);
 
+        n = (j == count - 1) ? sctrl->spi_resp.block_w_data_resp_size_final : BLOCK_W_DATA_RESP_SIZE_EACH;
+        memset(ctl + pos, 0xff, n);
+        start = pos;
+        pos += n;
+    }
+
+    /* payload is whole blocks, the framing alone decides the pad */
+    len = (pos % 8) ? 8 - pos % 8 : 0;
+    memset(ctl + pos, 0xff, len);
+    pos += len;
+    sif_spi_xfer_add(xfers, msg, &nx, ctl + start, ctl + start, pos - start);
+
+    return pos;
+}
+
+/*
+ * check the responses clocked into ctl for blocks [first, last), the
+ * cmd response first if the burst carried the cmd. Returns 1 when the
+ * target is still busy after the last block and busy_ok, the caller
+ * then polls it idle.
+ */
+static int sif_spi_write_blocks_resp(struct esp_spi_ctrl *sctrl, unsigned char *ctl, bool cmd,
+                                     int first, int last, int count, bool busy_ok)
+{
+    int i, j, n, pos = 0;
+    int find_w_rsp;
+
+    if (cmd) {
         //Judge Write cmd resp, and 1st block data resp.        
         pos = 5+1;
         for(i=0;i<CMD_RESP_SIZE;i++)
         {
-            if(tx_cmd[pos+i] == 0x00 && tx_cmd[pos+i-1] == 0xff)
+            if(ctl[pos+i] == 0x00 && ctl[pos+i-1] == 0xff)
             {
-                if(tx_cmd[pos+i+1] == 0x00 && tx_cmd[pos+i+2] == 0xff)
+                if(ctl[pos+i+1] == 0x00 && ctl[pos+i+2] == 0xff)
                     break;      
             }
 
         }
 
-        if(i>spi_resp.max_cmd_resp_size)
+        if(i>sctrl->spi_resp.max_cmd_resp_size)
         {
-            spi_resp.max_cmd_resp_size = i;
+            sctrl->spi_resp.max_cmd_resp_size = i;
         }
 
         if(i>=CMD_RESP_SIZE)
         {
             esp_dbg(ESP_DBG_ERROR, "spierr 1st block write cmd resp 0x00 no recv, %d\n", count);
-            err_ret = -3;
-            goto goto_err;
+            return -3;
         }
 
         pos = pos+CMD_RESP_SIZE;
+    }
 
-        for(j=0;j<count;j++)
-        {
-            find_w_rsp = 0;
-            //Judge block data resp
-            pos = pos+1;                   
-            pos = pos+SPI_BLOCK_SIZE;
+    for(j=first;j<last;j++)
+    {
+        find_w_rsp = 0;
+        //Judge block data resp, only the token is in ctl
+        pos = pos+1;                   
 
-            if( j==(count-1) )
-                n = spi_resp.block_w_data_resp_size_final;
-            else
-                n= BLOCK_W_DATA_RESP_SIZE_EACH;
+        if( j==(count-1) )
+            n = sctrl->spi_resp.block_w_data_resp_size_final;
+        else
+            n= BLOCK_W_DATA_RESP_SIZE_EACH;
 
-            for(i =0 ;i<4;i++)
+        for(i =0 ;i<4;i++)
+        {
+            if((ctl[pos+i] & 0x0F) == 0x05)
             {
-                if((tx_cmd[pos+i] & 0x0F) == 0x05)
-                {
-                    find_w_rsp = 1;
-                    break;
-                }
+                find_w_rsp = 1;
+                break;
             }
+        }
 
-            if(find_w_rsp == 1)
+        if(find_w_rsp == 1)
+        {
+            if(memcmp(ctl+pos+n-4,sctrl->ff_buf,4) != 0)
             {
-                if(memcmp(tx_cmd+pos+n-4,ff_buf,4) != 0)
-                {
+                if (busy_ok && j == last-1)
+                    return 1;
 
-                    esp_dbg(ESP_DBG, "block write  sleep 1\n");
-                    if(j == count-1)
-                    {
-                        timeout = 200;
-                        do {
-                            timeout --;
-                            //memset(check_buf,0x00,256);
-
-                            sif_spi_read_raw(spi, check_buf, 256);
-                        } while( memcmp(check_buf,ff_buf,256) != 0 && timeout >0 ) ;
-
-                        if(timeout == 0)
-                        {
-                            err_ret = -7;
-                            esp_dbg(ESP_DBG_ERROR, "spierr block write data no-busy wait byte 0xff no recv \n"); 
-                            goto goto_err;
-                        }
-                    }
-                    else
-                    {
-                        err_ret = -5;
-                        esp_dbg(ESP_DBG_ERROR, "spierr %s block%d write data not-busy wait error, %d\n", __func__, j+1, count);
-                        goto goto_err;
-                    }
-                }
-            }
-            else
-            {
-                err_ret = -6;
-                esp_dbg(ESP_DBG_ERROR, "spierr %s block%d write data no data res error, %d\n", __func__, j+1, count);
-                goto goto_err;
+                esp_dbg(ESP_DBG_ERROR, "spierr %s block%d write data not-busy wait error, %d\n", __func__, j+1, count);
+                return -5;
             }
-
-            pos = pos+n;     
         }
+        else
+        {
+            esp_dbg(ESP_DBG_ERROR, "spierr %s block%d write data no data res error, %d\n", __func__, j+1, count);
+            return -6;
+        }
+
+        pos = pos+n;     
     }
-    else
+
+    return 0;
+}
+
+/* target still busy after a block write, clock 0xff until it lets go */
+static int sif_spi_write_wait_idle(struct spi_device *spi)
+{
+    esp_dbg(ESP_DBG, "block write data during sleep \n"); 
+
+    if(sif_spi_poll_target(spi, false))
     {
-        for(j=0;j<2;j++)
-        {
-            //Add token   
-            tx_cmd[pos]=0xFC;
-            pos = pos+1;
+        esp_dbg(ESP_DBG_ERROR, "spierr block write data no-busy wait byte 0xff no recv \n"); 
+        return -7;
+    }
 
-            //Add data    
-            memcpy(tx_cmd+pos,tx_data+j*SPI_BLOCK_SIZE, SPI_BLOCK_SIZE);
-            pos = pos+SPI_BLOCK_SIZE;
+    return 0;
+}
 
-            memset(tx_cmd+pos , 0xff , BLOCK_W_DATA_RESP_SIZE_EACH);
-            pos = pos+ BLOCK_W_DATA_RESP_SIZE_EACH;
-        }
+int sif_spi_write_blocks(struct spi_device *spi, unsigned int addr,unsigned char *src, int count)
+{
+    struct esp_spi_ctrl *sctrl = NULL;
+    struct spi_message msg;
+    int err_ret = 0;
+    int pos, blks_a;
 
-        if( pos%8 )
-        {
-            len = (8 - pos%8);
-            memset(tx_cmd+pos,0xff,len);
-        }
-        else
-            len = 0;
-        
-        sif_spi_write_async_read(spi, tx_cmd,tx_cmd,pos+len);
+    if (spi == NULL) {
+    	ESSERT(0);
+	err_ret = -EINVAL;
+	goto goto_err;
+    }
 
-        //Judge Write cmd resp, and 1st block data resp.        
-        pos = 5+1;
-        for(i=0;i<CMD_RESP_SIZE;i++)
-        {
-            if(tx_cmd[pos+i] == 0x00 && tx_cmd[pos+i-1] == 0xff)
-            {
-                if(tx_cmd[pos+i+1] == 0x00 && tx_cmd[pos+i+2] == 0xff)
-                    break;      
-            }
+    sctrl = spi_get_drvdata(spi);
 
-        }
+    if( count <=0 )
+    {
+        err_ret = -1;
+        goto goto_err;
+    }
 
-        if(i>spi_resp.max_cmd_resp_size)
-        {
-            spi_resp.max_cmd_resp_size = i;
-        }
+    if (2 * count + 1 > SPI_MAX_XFERS)
+    {
+        err_ret = -EINVAL;
+        goto goto_err;
+    }
 
-        if(i>=CMD_RESP_SIZE)
-        {
-            esp_dbg(ESP_DBG_ERROR, "spierr 1st block write cmd resp 0x00 no recv, %d\n", count);
-            err_ret = -3;
-            goto goto_err;
-        }
+    if( addr >= (1<<17) )
+    {
+        err_ret = -2;
+        goto goto_err;
+    }
 
-        pos = pos+CMD_RESP_SIZE;
+    /* up to two blocks go with the cmd, the rest once those are through */
+    blks_a = count < 3 ? count : 2;
 
-        for(j=0;j<2;j++)
-        {
-            find_w_rsp = 0;
-            //Judge block data resp
-            pos = pos+1;                   
-            pos = pos+SPI_BLOCK_SIZE;
+    pos = sif_spi_write_blocks_cmd(sctrl->tx_cmd, addr, count);
+    sif_spi_write_blocks_msg(sctrl, &msg, sctrl->tx_cmd, sctrl->xfers, pos, src, 0, blks_a, count);
+    err_ret = spi_sync_locked(spi, &msg);
+    if (err_ret)
+        goto goto_err;
 
-            n = BLOCK_W_DATA_RESP_SIZE_EACH;
+    err_ret = sif_spi_write_blocks_resp(sctrl, sctrl->tx_cmd, true, 0, blks_a, count, true);
+    if (err_ret == 1)
+        err_ret = sif_spi_write_wait_idle(spi);
+    if (err_ret || blks_a == count)
+        goto goto_err;
 
-            for(i =0 ;i<4;i++)
-            {
-                if((tx_cmd[pos+i] & 0x0F) == 0x05)
-                {
-                    find_w_rsp = 1;
-                    break;
-                }
-            }
+    sif_spi_write_blocks_msg(sctrl, &msg, sctrl->tx_cmd, sctrl->xfers, 0, src, blks_a, count, count);
+    err_ret = spi_sync_locked(spi, &msg);
+    if (err_ret)
+        goto goto_err;
 
-            if(find_w_rsp == 1)
-            {
-                if(memcmp(tx_cmd+pos+n-4,ff_buf,4) != 0 )
-                {
-                    esp_dbg(ESP_DBG, "block write data during sleep \n"); 
+    err_ret = sif_spi_write_blocks_resp(sctrl, sctrl->tx_cmd, false, blks_a, count, count, false);
 
-                    if(j == 1)
-                    {
-                        timeout = 200;
-                        do {
-                            timeout --;
-
-                            sif_spi_read_raw(spi, check_buf, 256);
-                        } while( memcmp(check_buf,ff_buf,256) != 0 && timeout >0 ) ;
-
-                        if(timeout == 0)
-                        {
-                            err_ret = -7;
-                            esp_dbg(ESP_DBG_ERROR, "spierr block write data no-busy wait byte 0xff no recv \n"); 
-                            goto goto_err;
+goto_err:
+    return err_ret;
+}
+
+/*
+ * async block writes: each request is framed into its own slot at
+ * submit, io_work takes the bus and starts the first message, every
+ * completion checks the responses and starts the next one with
+ * spi_async_locked(), so the controller streams them back to back.
+ * Only a busy target (it needs polling) or the end of the chain hands
+ * the bus back to io_work.
+ */
+#define SPI_ASYNC_MAX_BLKS  (SIP_TX_AGGR_BUF_SIZE / SPI_BLOCK_SIZE)
+
+static void sif_spi_req_done(struct esp_spi_ctrl *sctrl, struct sif_req *req, int err)
+{
+        struct sif_io_ctx *ctx = req->ctx;
+        unsigned long flags;
+
+        spin_lock_irqsave(&sctrl->scat_lock, flags);
+        list_add_tail(&req->list, &sctrl->free_req);
+        spin_unlock_irqrestore(&sctrl->scat_lock, flags);
+
+        if (ctx && ctx->done)
+                ctx->done(sctrl->epub, ctx, err);
+}
+
+/* put the next queued request on the wire, or end the chain */
+static void sif_spi_chain_next(struct esp_spi_ctrl *sctrl)
+{
+        struct sif_req *req;
+        unsigned long flags;
+        int err;
+
+        for (;;) {
+                req = NULL;
+                spin_lock_irqsave(&sctrl->scat_lock, flags);
+                if (sctrl->io_budget > 0) {
+                        req = list_first_entry_or_null(&sctrl->scat_req, struct sif_req, list);
+                        if (req) {
+                                list_del(&req->list);
+                                sctrl->io_budget--;
                         }
-                    }
-                    else
-                    {
-                        err_ret = -5;
-                        esp_dbg(ESP_DBG_ERROR, "spierr %s block%d write data not-busy wait error, %d\n", __func__, j+1, count);
-                        goto goto_err;
-                    }
                 }
-            }
-            else
-            {
-                err_ret = -6;
-                esp_dbg(ESP_DBG_ERROR, "spierr %s block%d write data no data res error, %d\n", __func__, j+1, count);
-                goto goto_err;
-            }
+                spin_unlock_irqrestore(&sctrl->scat_lock, flags);
 
-            pos = pos+n;   
+                if (req == NULL) {
+                        complete(&sctrl->io_idle);
+                        return;
+                }
+
+                req->stage = 0;
+                err = spi_async_locked(req->spi, &req->msg[0]);
+                if (err == 0)
+                        return;
+                sif_spi_req_done(sctrl, req, err);
         }
-        
+}
 
-        pos = 0; 
-        for(j=2;j<count;j++)
-        {
-            //Add token   
-            tx_cmd[pos]=0xFC;
-            pos = 1+pos ;
-            //Add data    
-            memcpy(tx_cmd+pos,tx_data+j*SPI_BLOCK_SIZE, SPI_BLOCK_SIZE);
-            pos = pos+SPI_BLOCK_SIZE;
-            //Add data respon
-            if(j == count-1)
-            {
-                memset(tx_cmd+pos , 0xff ,spi_resp.block_w_data_resp_size_final);
-                pos = pos+spi_resp.block_w_data_resp_size_final;
-                continue;
-            }
-            memset(tx_cmd+pos , 0xff , BLOCK_W_DATA_RESP_SIZE_EACH);
-            pos = pos+ BLOCK_W_DATA_RESP_SIZE_EACH;
+/* a burst of req is through and checked */
+static void sif_spi_req_step(struct esp_spi_ctrl *sctrl, struct sif_req *req, int err)
+{
+        if (err == 0 && req->stage == 0 && req->blks_a < req->blks) {
+                req->stage = 1;
+                err = spi_async_locked(req->spi, &req->msg[1]);
+                if (err == 0)
+                        return;
         }
 
-        if( pos%8 )
-        {
-            len = (8 - pos%8);
-            memset(tx_cmd+pos,0xff,len);
+        sif_spi_req_done(sctrl, req, err);
+        sif_spi_chain_next(sctrl);
+}
+
+static void sif_spi_req_complete(void *context)
+{
+        struct sif_req *req = (struct sif_req *)context;
+        struct esp_spi_ctrl *sctrl = spi_get_drvdata(req->spi);
+        int err = req->msg[req->stage].status;
+
+        if (err == 0) {
+                if (req->stage == 0)
+                        err = sif_spi_write_blocks_resp(sctrl, req->ctl, true, 0, req->blks_a, req->blks, true);
+                else
+                        err = sif_spi_write_blocks_resp(sctrl, req->ctl + req->ctl_b, false, req->blks_a, req->blks, req->blks, false);
         }
-        else
-            len = 0;
 
-        sif_spi_write_async_read(spi, tx_cmd,tx_cmd,pos+len);
-        
-        pos = 0;
-        for(j=2;j<count;j++)
-        {
-            find_w_rsp = 0;
-            //Judge block data resp
-            pos = pos+1;                   
-            pos = pos+SPI_BLOCK_SIZE;
+        if (err == 1) {
+                /* can't poll from here */
+                sctrl->io_stalled = req;
+                complete(&sctrl->io_idle);
+                return;
+        }
 
-            if( j==(count-1) )
-                n = spi_resp.block_w_data_resp_size_final;
-            else
-                n= BLOCK_W_DATA_RESP_SIZE_EACH;
+        sif_spi_req_step(sctrl, req, err);
+}
 
-            for(i =0 ;i<4;i++)
-            {
-                if((tx_cmd[pos+i] & 0x0F) == 0x05)
-                {
-                    find_w_rsp = 1;
-                    break;
-                }
-            }
+static void sif_spi_io_work(struct work_struct *work)
+{
+        struct esp_spi_ctrl *sctrl = container_of(work, struct esp_spi_ctrl, io_work);
+        struct sif_req *req;
+        int err;
 
-            if(find_w_rsp == 1)
-            {
-                if(memcmp(tx_cmd+pos+n-4,ff_buf,4) != 0)
-                {
-                    err_ret = -5;
-                    esp_dbg(ESP_DBG_ERROR, "spierr %s block%d write data not-busy wait error, %d\n", __func__, j+1, count);
-                    goto goto_err;
+        while (!list_empty_careful(&sctrl->scat_req)) {
+                sif_bus_get(sctrl->epub, SIF_BUS_TX);
+                spi_bus_lock(sctrl->spi->master);
+
+                sctrl->io_budget = SIF_REQ_DEPTH;
+                reinit_completion(&sctrl->io_idle);
+                sif_spi_chain_next(sctrl);
+
+                for (;;) {
+                        wait_for_completion(&sctrl->io_idle);
+                        req = sctrl->io_stalled;
+                        if (req == NULL)
+                                break;
+                        sctrl->io_stalled = NULL;
+                        reinit_completion(&sctrl->io_idle);
+                        err = sif_spi_write_wait_idle(req->spi);
+                        sif_spi_req_step(sctrl, req, err);
                 }
-            }
-            else
-            {
-                err_ret = -6;
-                esp_dbg(ESP_DBG_ERROR, "spierr %s block%d write data no data res error, %d\n", __func__, j+1, count);
-                goto goto_err;
-            }
 
-            pos = pos+n;   
+                /* let rx or a cmd in before the rest of the queue */
+                spi_bus_unlock(sctrl->spi->master);
+                sif_bus_put(sctrl->epub);
+        }
+}
+
+/* only whole block writes are taken, -EBUSY tells the caller to go sync */
+int sif_io_async(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag, void * context)
+{
+        struct esp_spi_ctrl *sctrl = NULL;
+        struct sif_req *req;
+        unsigned long flags;
+        int blks, pos;
+
+	if (epub == NULL || buf == NULL) {
+        	ESSERT(0);
+		return -EINVAL;
+	}
+
+        sctrl = (struct esp_spi_ctrl *)epub->sif;
+        blks = len / SPI_BLOCK_SIZE;
+
+        if (!(flag & SIF_TO_DEVICE) || (len % SPI_BLOCK_SIZE) || blks == 0 ||
+            blks > SPI_ASYNC_MAX_BLKS || addr >= (1 << 17) || sctrl->reqs[0].ctl == NULL)
+                return -EBUSY;
+
+        spin_lock_irqsave(&sctrl->scat_lock, flags);
+        req = list_first_entry_or_null(&sctrl->free_req, struct sif_req, list);
+        if (req)
+                list_del(&req->list);
+        else
+                sctrl->io_busy++;
+        spin_unlock_irqrestore(&sctrl->scat_lock, flags);
+        if (req == NULL)
+                return -EBUSY;
+
+        req->addr = addr;
+        req->buf = buf;
+        req->len = len;
+        req->flag = flag | SIF_ASYNC;
+        req->ctx = (struct sif_io_ctx *)context;
+        req->spi = sctrl->spi;
+        req->blks = blks;
+        req->blks_a = blks < 3 ? blks : 2;
+
+        /* framed here, while the previous request may still be on the wire */
+        pos = sif_spi_write_blocks_cmd(req->ctl, addr, blks);
+        req->ctl_b = sif_spi_write_blocks_msg(sctrl, &req->msg[0], req->ctl, req->xfers, pos,
+                                              buf, 0, req->blks_a, blks);
+        req->msg[0].complete = sif_spi_req_complete;
+        req->msg[0].context = req;
+        if (req->blks_a < blks) {
+                sif_spi_write_blocks_msg(sctrl, &req->msg[1], req->ctl + req->ctl_b,
+                                         req->xfers + 2 * req->blks_a + 1, 0,
+                                         buf, req->blks_a, blks, blks);
+                req->msg[1].complete = sif_spi_req_complete;
+                req->msg[1].context = req;
+        }
+
+        spin_lock_irqsave(&sctrl->scat_lock, flags);
+        list_add_tail(&req->list, &sctrl->scat_req);
+        sctrl->io_reqs++;
+        spin_unlock_irqrestore(&sctrl->scat_lock, flags);
+
+        queue_work(system_highpri_wq, &sctrl->io_work);
+
+        return 0;
+}
+
+int sif_lldesc_write_async(struct esp_pub *epub, u8 *buf, u32 len, struct sif_io_ctx *ctx)
+{
+        struct esp_spi_ctrl *sctrl = NULL;
+        u32 write_len;
+
+	if (epub == NULL || buf == NULL) {
+        	ESSERT(0);
+		return -EINVAL;
+	}
+
+        sctrl = (struct esp_spi_ctrl *)epub->sif;
+
+        switch(sctrl->target_id) {
+        case 0x600:
+                write_len = roundup(len, sctrl->slc_blk_sz);
+                break;
+        default:
+                write_len = len;
+                break;
+        }
+
+        return sif_io_async(epub, sctrl->slc_window_end_addr - len, buf, write_len, SIF_TO_DEVICE, ctx);
+}
+
+/* wait for every queued request, must not be called with the bus held */
+void sif_io_flush(struct esp_pub *epub)
+{
+        EPUB_CTRL_CHECK(epub, _exit);
+
+        flush_work(&EPUB_TO_CTRL(epub)->io_work);
+_exit:
+        return;
+}
+
+static void sif_spi_engine_init(struct esp_spi_ctrl *sctrl)
+{
+        spin_lock_init(&sctrl->scat_lock);
+        INIT_LIST_HEAD(&sctrl->free_req);
+        INIT_LIST_HEAD(&sctrl->scat_req);
+        INIT_WORK(&sctrl->io_work, sif_spi_io_work);
+        init_completion(&sctrl->io_idle);
+}
+
+/* slots sized for a full tx aggregate once the response windows are known */
+static int sif_spi_engine_alloc(struct esp_spi_ctrl *sctrl)
+{
+        struct sif_req *req;
+        int i, ctl_sz;
+
+        if (sctrl->reqs[0].ctl)
+                return 0;
+
+        ctl_sz = 2 * (6 + CMD_RESP_SIZE + 8) + SPI_ASYNC_MAX_BLKS *
+                 (1 + max_t(int, BLOCK_W_DATA_RESP_SIZE_EACH, sctrl->spi_resp.block_w_data_resp_size_final));
+
+        for (i = 0; i < SIF_REQ_DEPTH; i++) {
+                req = &sctrl->reqs[i];
+                req->ctl = kmalloc(ctl_sz, GFP_KERNEL);
+                req->xfers = kcalloc(2 * SPI_ASYNC_MAX_BLKS + 2, sizeof(struct spi_transfer), GFP_KERNEL);
+                if (req->ctl == NULL || req->xfers == NULL)
+                        goto _err;
+                list_add_tail(&req->list, &sctrl->free_req);
         }
-    }
 
-goto_err:
+        return 0;
+_err:
+        for (; i >= 0; i--) {
+                kfree(sctrl->reqs[i].ctl);
+                kfree(sctrl->reqs[i].xfers);
+                sctrl->reqs[i].ctl = NULL;
+                sctrl->reqs[i].xfers = NULL;
+        }
+        INIT_LIST_HEAD(&sctrl->free_req);
+        return -ENOMEM;
+}
 
-    return err_ret;
+static void sif_spi_engine_free(struct esp_spi_ctrl *sctrl)
+{
+        int i;
+
+        cancel_work_sync(&sctrl->io_work);
+        INIT_LIST_HEAD(&sctrl->free_req);
+        for (i = 0; i < SIF_REQ_DEPTH; i++) {
+                kfree(sctrl->reqs[i].ctl);
+                kfree(sctrl->reqs[i].xfers);
+                sctrl->reqs[i].ctl = NULL;
+                sctrl->reqs[i].xfers = NULL;
+        }
 }
 
 int sif_spi_write_mix_nosync(struct spi_device *spi, unsigned int addr, unsigned char *buf, int len, int dummymode)
@@ -740,6 +1179,16 @@ int sif_spi_write_mix_nosync(struct spi_device *spi, unsigned int addr, unsigned
 		blk_cnt = len/SPI_BLOCK_SIZE;
 		remain_len = len%SPI_BLOCK_SIZE;
 
+		/* more blocks than one cmd carries: full cmds back to back first */
+		while (blk_cnt > SPI_WRITE_MAX_BLKS) {
+			err = sif_spi_write_blocks(spi, addr, buf, SPI_WRITE_MAX_BLKS);
+			if (err)
+				return err;
+			addr += SPI_WRITE_MAX_BLKS * SPI_BLOCK_SIZE;
+			buf += SPI_WRITE_MAX_BLKS * SPI_BLOCK_SIZE;
+			blk_cnt -= SPI_WRITE_MAX_BLKS;
+		}
+
 		if (blk_cnt > 0) {
 			err  = sif_spi_write_blocks(spi, addr, buf, blk_cnt);
 			if (err) 
@@ -807,6 +1256,7 @@ int sif_spi_epub_write_mix_sync(struct esp_pub *epub, unsigned int addr, unsigne
 
 int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *dst, int count, int dummymode)
 {      
+    struct esp_spi_ctrl *sctrl = NULL;
     int pos,total_num,len;
     int i;
     unsigned char *rx_data = (unsigned char *)dst;
@@ -814,10 +1264,9 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
     unsigned short crc = 0;
     char test_crc[2];
     int unexp_byte = 0;
+    struct esp_spi_win *win;
 
-    u32 timeout = 200;
     int find_start_token = 0;
-    spi_resp.data_resp_size_r = ((((((count>>2)+1) *25)>>5)*21+16)>>3) +1  ; 
 
     if (spi == NULL) {
     	ESSERT(0);
@@ -825,7 +1274,9 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
 	goto goto_err;
     }
 
-    rx_cmd[0]=0x75;
+    sctrl = spi_get_drvdata(spi);
+
+    sctrl->rx_cmd[0]=0x75;
 
     if(count > 512 )
     {
@@ -833,6 +1284,9 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
         goto goto_err;
     }
 
+    win = &sctrl->spi_resp.byte_r_win[count >> SPI_WIN_BYTE_SHIFT];
+    sctrl->spi_resp.data_resp_size_r = sif_spi_win(win, ((((((count>>2)+1) *25)>>5)*21+16)>>3) +1);
+
     if( addr >= (1<<17) )
     {
         err_ret = -2;
@@ -840,30 +1294,30 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
     }
     else
     {
-        rx_cmd[1]=0x10|0x04|(addr>>15);    //0x94;
-        rx_cmd[2]=addr>>7;    
+        sctrl->rx_cmd[1]=0x10|0x04|(addr>>15);    //0x94;
+        sctrl->rx_cmd[2]=addr>>7;    
 
         if(count == 512 )
         {
-            rx_cmd[3]=( addr<<1|0x0 );
-            rx_cmd[4]= 0x00;     //0x08;
+            sctrl->rx_cmd[3]=( addr<<1|0x0 );
+            sctrl->rx_cmd[4]= 0x00;     //0x08;
         }
         else
         {
-            rx_cmd[3]=( addr<<1|(count>>8 & 0x01) );
-            rx_cmd[4]= count & 0xff;     //0x08;
+            sctrl->rx_cmd[3]=( addr<<1|(count>>8 & 0x01) );
+            sctrl->rx_cmd[4]= count & 0xff;     //0x08;
         }
     }
 
-    rx_cmd[5]=0x01;
+    sctrl->rx_cmd[5]=0x01;
 
-    total_num = CMD_RESP_SIZE+spi_resp.data_resp_size_r+count+2;
-    memset(rx_cmd+6 , 0xFF ,total_num);
+    total_num = CMD_RESP_SIZE+sctrl->spi_resp.data_resp_size_r+count+2;
+    memset(sctrl->rx_cmd+6 , 0xFF ,total_num);
 
     if(6+total_num <128)
     {
         len =128 -6 -total_num;
-        memset(rx_cmd+6+total_num,0xff,len);
+        memset(sctrl->rx_cmd+6+total_num,0xff,len);
     }
     else
     {
@@ -871,29 +1325,29 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
         if( (6+total_num)%8 )
         {
             len = (8 - (6+total_num)%8);
-            memset(rx_cmd+6+total_num,0xff,len);
+            memset(sctrl->rx_cmd+6+total_num,0xff,len);
         }
         else
             len = 0;
 
     }  
 
-    sif_spi_write_async_read(spi, rx_cmd,rx_cmd,6+total_num+len);
+    sif_spi_write_async_read(spi, sctrl->rx_cmd,sctrl->rx_cmd,6+total_num+len);
 
     pos = 5+1;
     for(i=0;i<CMD_RESP_SIZE;i++)
     {
-        if(rx_cmd[pos+i] == 0x00 && rx_cmd[pos+i-1] == 0xff)
+        if(sctrl->rx_cmd[pos+i] == 0x00 && sctrl->rx_cmd[pos+i-1] == 0xff)
         {
-            if(rx_cmd[pos+i+1] == 0x00 && rx_cmd[pos+i+2] == 0xff)
+            if(sctrl->rx_cmd[pos+i+1] == 0x00 && sctrl->rx_cmd[pos+i+2] == 0xff)
                 break;      
         }
     }
 
-    if(i>spi_resp.max_cmd_resp_size)
+    if(i>sctrl->spi_resp.max_cmd_resp_size)
     {
-        spi_resp.max_cmd_resp_size = i;
-        //printk(KERN_ERR "new cmd write MAX 0xFF pos:%d",spi_resp.max_cmd_resp_size);
+        sctrl->spi_resp.max_cmd_resp_size = i;
+        //printk(KERN_ERR "new cmd write MAX 0xFF pos:%d",sctrl->spi_resp.max_cmd_resp_size);
     }
 
 
@@ -904,7 +1358,7 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
         /*
            char t = pos;
            while ( t < pos+32) {
-           printk(KERN_ERR "rx:[0x%02x] ", rx_cmd[t]);
+           printk(KERN_ERR "rx:[0x%02x] ", sctrl->rx_cmd[t]);
            t++;
            if ((t-pos)%8 == 0)
            printk(KERN_ERR "\n");
@@ -916,20 +1370,21 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
     //esp_dbg(ESP_DBG_ERROR, "0x00 pos:%d",pos+i);
     pos = pos+i+2;
 
-    for(i=0;i<spi_resp.data_resp_size_r;i++)
+    for(i=0;i<sctrl->spi_resp.data_resp_size_r;i++)
     {
-        if(rx_cmd[pos+i]==0xFE)
+        if(sctrl->rx_cmd[pos+i]==0xFE)
         {
 
             find_start_token = 1;   
-            if(i>spi_resp.max_dataR_resp_size)
+            sif_spi_win_hit(sctrl, win, i, sctrl->spi_resp.data_resp_size_r);
+            if(i>sctrl->spi_resp.max_dataR_resp_size)
             {
-                spi_resp.max_dataR_resp_size = i;
-                //printk(KERN_ERR "new data read MAX 0xFE pos:%d",spi_resp.max_dataR_resp_size);
+                sctrl->spi_resp.max_dataR_resp_size = i;
+                //printk(KERN_ERR "new data read MAX 0xFE pos:%d",sctrl->spi_resp.max_dataR_resp_size);
             }
             break;
         }
-        else if(rx_cmd[pos+i] != 0xff)
+        else if(sctrl->rx_cmd[pos+i] != 0xff)
         {
             unexp_byte ++;
             if(unexp_byte == 1)
@@ -939,22 +1394,23 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
 
     if(find_start_token == 0) 
     { 
+        sif_spi_win_miss(sctrl, win, sctrl->spi_resp.data_resp_size_r);
         if(dummymode == 0)  
             esp_dbg(ESP_DBG, " normal byte read start token 0xFE  not recv at the first time,count = %d,addr =%x \n",count,addr);
 
-        pos = pos +spi_resp.data_resp_size_r;
+        pos = pos +sctrl->spi_resp.data_resp_size_r;
 
         for(i=0;i< 6+total_num+len-pos;i++)
         {
-            if(rx_cmd[pos+i]==0xFE)
+            if(sctrl->rx_cmd[pos+i]==0xFE)
             {
-                sif_spi_read_raw(spi,rx_cmd,((count+4)>256)?(count+4):256);
-               // sif_spi_read_raw(spi, check_buf, 256);
+                sif_spi_read_raw(spi,sctrl->rx_cmd,((count+4)>256)?(count+4):256);
+               // sif_spi_read_raw(spi, sctrl->check_buf, 256);
                 find_start_token = 1;
                 err_ret = -4;
                 goto goto_err;
             }
-            else if(rx_cmd[pos+i] !=0xff)
+            else if(sctrl->rx_cmd[pos+i] !=0xff)
             {
                 unexp_byte ++;
                 if(unexp_byte == 1)
@@ -963,24 +1419,11 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
 
         }
 
-        timeout = 200;
-        do {
-            timeout --;
-
-            sif_spi_read_raw(spi, check_buf, 256);
-            for(i=0;i<256;i++)
-            {
-                if(check_buf[i] ==0xFE)
-                {
-                    find_start_token = 1;
-                    sif_spi_read_raw(spi,rx_cmd,((count+4)>256)?(count+4):256);
-
-                    break;
-                }
-            }
-        } while( find_start_token != 1 && timeout >0 ) ;
-
-        if(timeout == 0)
+        if(sif_spi_poll_target(spi, true) == 0)
+        {
+            sif_spi_read_raw(spi,sctrl->rx_cmd,((count+4)>256)?(count+4):256);
+        }
+        else
         {
             esp_dbg(ESP_DBG_ERROR, "spierr byte read start token 0xFE no recv ,count = %d,addr =%x \n",count,addr);
         }
@@ -991,19 +1434,19 @@ int sif_spi_read_bytes(struct spi_device *spi, unsigned int addr,unsigned char *
 
     //esp_dbg(ESP_DBG_ERROR, "0xFE pos:%d",pos+i);
     pos = pos+i+1;
-    memcpy(rx_data,rx_cmd+pos,count);
+    memcpy(rx_data,sctrl->rx_cmd+pos,count);
 
-    crc = crc_cal_by_byte(rx_data,count);
+    crc = spi_crc16(rx_data,count);
 
     test_crc[0] = crc & 0xff;
     test_crc[1] = (crc >>8) &0xff ;
 
-    if(test_crc[1] != rx_cmd[pos+count] || test_crc[0] != rx_cmd[pos+count+1] )
+    if(test_crc[1] != sctrl->rx_cmd[pos+count] || test_crc[0] != sctrl->rx_cmd[pos+count+1] )
     {
         esp_dbg(ESP_DBG, "crc test_crc0  %x\n",test_crc[0]);
         esp_dbg(ESP_DBG, "crc test_crc1  %x\n",test_crc[1]);
-        esp_dbg(ESP_DBG, "crc rx_data-2  %x\n",rx_cmd[pos+count]);
-        esp_dbg(ESP_DBG, "crc rx_data-1  %x\n",rx_cmd[pos+count+1] );
+        esp_dbg(ESP_DBG, "crc rx_data-2  %x\n",sctrl->rx_cmd[pos+count]);
+        esp_dbg(ESP_DBG, "crc rx_data-1  %x\n",sctrl->rx_cmd[pos+count+1] );
 
         esp_dbg(ESP_DBG, "crc err\n");
 
@@ -1021,15 +1464,16 @@ goto_err:
 
 int sif_spi_read_blocks(struct spi_device *spi, unsigned int addr, unsigned char *dst, int count)
 {
+    struct esp_spi_ctrl *sctrl = NULL;
     int err_ret = 0;
     int pos,len;
     int i,j;
     unsigned char *rx_data = (unsigned char *)dst;
     int total_num;
-    u32 timeout = 200;
     int find_start_token = 0;
     unsigned short crc = 0;
     char test_crc[2];
+    u32 each;
    
     if (spi == NULL) {
     	ESSERT(0);
@@ -1037,7 +1481,9 @@ int sif_spi_read_blocks(struct spi_device *spi, unsigned int addr, unsigned char
 	goto goto_err;
     }
 
-    rx_cmd[0]=0x75;
+    sctrl = spi_get_drvdata(spi);
+
+    sctrl->rx_cmd[0]=0x75;
 
     if( count <=0 )
     {
@@ -1051,48 +1497,56 @@ int sif_spi_read_blocks(struct spi_device *spi, unsigned int addr, unsigned char
     }
     else
     {
-        rx_cmd[1]=0x10|0x0C|(addr>>15);   
-        rx_cmd[2]=addr>>7;    
+        sctrl->rx_cmd[1]=0x10|0x0C|(addr>>15);   
+        sctrl->rx_cmd[2]=addr>>7;    
 
         if(count >= 512 )
         {
-            rx_cmd[3]=( addr<<1|0x0 );
-            rx_cmd[4]= 0x00;     
+            sctrl->rx_cmd[3]=( addr<<1|0x0 );
+            sctrl->rx_cmd[4]= 0x00;     
         }
         else
         {
-            rx_cmd[3]=( addr<<1|(count>>8 & 0x01) );
-            rx_cmd[4]= count & 0xff;     
+            sctrl->rx_cmd[3]=( addr<<1|(count>>8 & 0x01) );
+            sctrl->rx_cmd[4]= count & 0xff;     
         }
     }
-    rx_cmd[5]=0x01;
-    total_num = CMD_RESP_SIZE+spi_resp.block_r_data_resp_size_final+SPI_BLOCK_SIZE+ 2 + (count-1)*(BLOCK_R_DATA_RESP_SIZE_EACH+SPI_BLOCK_SIZE+2);
-    memset(rx_cmd+6, 0xFF ,total_num);
+    sctrl->rx_cmd[5]=0x01;
+    if (sctrl->epub->conf.ate != 5)
+        sctrl->spi_resp.block_r_data_resp_size_final = sif_spi_win(&sctrl->spi_resp.block_r_1st_win, BLOCK_R_DATA_RESP_SIZE_1ST);
+    each = sif_spi_win(&sctrl->spi_resp.block_r_each_win, BLOCK_R_DATA_RESP_SIZE_EACH);
+    total_num = CMD_RESP_SIZE+sctrl->spi_resp.block_r_data_resp_size_final+SPI_BLOCK_SIZE+ 2 + (count-1)*(each+SPI_BLOCK_SIZE+2);
+    if (6 + total_num + 8 > MAX_BUF_SIZE)
+    {
+        err_ret = -EINVAL;
+        goto goto_err;
+    }
+    memset(sctrl->rx_cmd+6, 0xFF ,total_num);
 
     if( (6+total_num)%8 )
     {
         len = (8 - (6+total_num)%8);
-        memset(rx_cmd+6+total_num,0xff,len);
+        memset(sctrl->rx_cmd+6+total_num,0xff,len);
     }
     else
         len = 0;
 
-    sif_spi_write_async_read(spi, rx_cmd,rx_cmd,6+total_num+len );
+    sif_spi_write_async_read(spi, sctrl->rx_cmd,sctrl->rx_cmd,6+total_num+len );
 
     pos = 5+1;
     for(i=0;i<CMD_RESP_SIZE;i++)
     {
-        if(rx_cmd[pos+i] == 0x00 && rx_cmd[pos+i-1] == 0xff)
+        if(sctrl->rx_cmd[pos+i] == 0x00 && sctrl->rx_cmd[pos+i-1] == 0xff)
         {
-            if(rx_cmd[pos+i+1] == 0x00 && rx_cmd[pos+i+2] == 0xff)
+            if(sctrl->rx_cmd[pos+i+1] == 0x00 && sctrl->rx_cmd[pos+i+2] == 0xff)
                 break;      
         }
     }
 
-    if(i>spi_resp.max_cmd_resp_size)
+    if(i>sctrl->spi_resp.max_cmd_resp_size)
     {
-        spi_resp.max_cmd_resp_size = i;
-        //printk(KERN_ERR "new cmd write MAX 0xFF pos:%d",spi_resp.max_cmd_resp_size);
+        sctrl->spi_resp.max_cmd_resp_size = i;
+        //printk(KERN_ERR "new cmd write MAX 0xFF pos:%d",sctrl->spi_resp.max_cmd_resp_size);
     }
 
     if(i>=CMD_RESP_SIZE)
@@ -1105,16 +1559,17 @@ int sif_spi_read_blocks(struct spi_device *spi, unsigned int addr, unsigned char
 
     pos = pos+i+2;
 
-    for(i=0;i<spi_resp.block_r_data_resp_size_final;i++)
+    for(i=0;i<sctrl->spi_resp.block_r_data_resp_size_final;i++)
     {
-        if(rx_cmd[pos+i]==0xFE)
+        if(sctrl->rx_cmd[pos+i]==0xFE)
         {
             //esp_dbg(ESP_DBG_ERROR, "0xFE pos:%d",i);
             find_start_token = 1;
-            if(i>spi_resp.max_block_dataR_resp_size)
+            sif_spi_win_hit(sctrl, &sctrl->spi_resp.block_r_1st_win, i, sctrl->spi_resp.block_r_data_resp_size_final);
+            if(i>sctrl->spi_resp.max_block_dataR_resp_size)
             {
-                spi_resp.max_block_dataR_resp_size = i;
-                //printk(KERN_ERR "new block data read MAX 0xFE pos:%d\n",spi_resp.max_block_dataR_resp_size);   
+                sctrl->spi_resp.max_block_dataR_resp_size = i;
+                //printk(KERN_ERR "new block data read MAX 0xFE pos:%d\n",sctrl->spi_resp.max_block_dataR_resp_size);   
             }
 
             break;
@@ -1124,39 +1579,27 @@ int sif_spi_read_blocks(struct spi_device *spi, unsigned int addr, unsigned char
     if( find_start_token == 0) 
     {       
         esp_dbg(ESP_DBG, "1st block read data resp 0xFE no recv,count = %d\n",count);
-        pos = pos +spi_resp.block_r_data_resp_size_final;
+        sif_spi_win_miss(sctrl, &sctrl->spi_resp.block_r_1st_win, sctrl->spi_resp.block_r_data_resp_size_final);
+        pos = pos +sctrl->spi_resp.block_r_data_resp_size_final;
         for(i=0;i< 6+total_num+len-pos;i++)
         {
-            if(rx_cmd[pos+i]==0xFE)
+            if(sctrl->rx_cmd[pos+i]==0xFE)
             {
-                sif_spi_read_raw(spi, check_buf, total_num+len);
+                sif_spi_read_raw(spi, sctrl->check_buf, total_num+len);
                 find_start_token = 1;
                 err_ret = -4;
                 goto goto_err;
             }
         }
 
-        timeout = 200;
-        do {
-            esp_dbg(ESP_DBG_ERROR, "block read  sleep ,count = %d\n",count);
-            timeout --;
-            sif_spi_read_raw(spi, check_buf, 256);
-            for(i=0;i<256;i++)
-            {
-                if(check_buf[i] ==0xFE)
-                {
-                    find_start_token= 1;
-                    sif_spi_read_raw(spi, rx_cmd, total_num+len);
-                    break;
-                }
-            }
-        } while( find_start_token != 1 && timeout >0 ) ;
-        if(timeout == 0)
+        esp_dbg(ESP_DBG_ERROR, "block read  sleep ,count = %d\n",count);
+        if(sif_spi_poll_target(spi, true))
         {
             err_ret = -8;
             esp_dbg(ESP_DBG_ERROR, "spierr block read start token 0xFE no recv\n");
         }else
         {
+            sif_spi_read_raw(spi, sctrl->rx_cmd, total_num+len);
             err_ret = -5;
         }
         goto goto_err;
@@ -1164,19 +1607,19 @@ int sif_spi_read_blocks(struct spi_device *spi, unsigned int addr, unsigned char
 
     pos = pos+i+1;
 
-    memcpy(rx_data,rx_cmd+pos,SPI_BLOCK_SIZE);
+    memcpy(rx_data,sctrl->rx_cmd+pos,SPI_BLOCK_SIZE);
 
-    crc = crc_cal_by_byte(rx_data,512);
+    crc = spi_crc16(rx_data,512);
 
     test_crc[0] = crc & 0xff;
     test_crc[1] = (crc >>8) &0xff ;
 
-    if(test_crc[1] != rx_cmd[pos+SPI_BLOCK_SIZE] || test_crc[0] != rx_cmd[pos+SPI_BLOCK_SIZE+1] )
+    if(test_crc[1] != sctrl->rx_cmd[pos+SPI_BLOCK_SIZE] || test_crc[0] != sctrl->rx_cmd[pos+SPI_BLOCK_SIZE+1] )
     {   
         esp_dbg(ESP_DBG, "crc test_crc0  %x\n",test_crc[0]);
         esp_dbg(ESP_DBG, "crc test_crc1  %x\n",test_crc[1]);
-        esp_dbg(ESP_DBG, "crc rx_data-2  %x\n",rx_cmd[pos+SPI_BLOCK_SIZE]);
-        esp_dbg(ESP_DBG, "crc rx_data-1  %x\n",rx_cmd[pos+SPI_BLOCK_SIZE+1] );
+        esp_dbg(ESP_DBG, "crc rx_data-2  %x\n",sctrl->rx_cmd[pos+SPI_BLOCK_SIZE]);
+        esp_dbg(ESP_DBG, "crc rx_data-1  %x\n",sctrl->rx_cmd[pos+SPI_BLOCK_SIZE+1] );
 
         esp_dbg(ESP_DBG_ERROR, "spierr crc err block = 1,count = %d\n",count);
 
@@ -1190,22 +1633,24 @@ int sif_spi_read_blocks(struct spi_device *spi, unsigned int addr, unsigned char
     for(j=1;j<count;j++)
     {
 
-        for(i=0;i<BLOCK_R_DATA_RESP_SIZE_EACH;i++)
+        for(i=0;i<each;i++)
         {
-            if(rx_cmd[pos+i]==0xFE)
+            if(sctrl->rx_cmd[pos+i]==0xFE)
             {
                 //esp_dbg(ESP_DBG_ERROR, "0xFE pos:%d",i);
-                if(i>spi_resp.max_block_dataR_resp_size)
+                sif_spi_win_hit(sctrl, &sctrl->spi_resp.block_r_each_win, i, each);
+                if(i>sctrl->spi_resp.max_block_dataR_resp_size)
                 {
-                    spi_resp.max_block_dataR_resp_size = i;
-                    //printk(KERN_ERR "new block data read MAX 0xFE pos:%d",spi_resp.max_block_dataR_resp_size);   
+                    sctrl->spi_resp.max_block_dataR_resp_size = i;
+                    //printk(KERN_ERR "new block data read MAX 0xFE pos:%d",sctrl->spi_resp.max_block_dataR_resp_size);   
                 }
 
                 break;
             }
         }
-        if(i>=BLOCK_R_DATA_RESP_SIZE_EACH)
+        if(i>=each)
         {
+            sif_spi_win_miss(sctrl, &sctrl->spi_resp.block_r_each_win, each);
             esp_dbg(ESP_DBG_ERROR, "spierr block%d read data token 0xFE no recv,total:%d\n",j+1,count);
             err_ret = -7;
             goto goto_err;
@@ -1213,19 +1658,19 @@ int sif_spi_read_blocks(struct spi_device *spi, unsigned int addr, unsigned char
 
         pos = pos+i+1;
 
-        memcpy(rx_data+j*SPI_BLOCK_SIZE,rx_cmd+pos,SPI_BLOCK_SIZE);
+        memcpy(rx_data+j*SPI_BLOCK_SIZE,sctrl->rx_cmd+pos,SPI_BLOCK_SIZE);
   
-        crc = crc_cal_by_byte(rx_data+j*SPI_BLOCK_SIZE ,512);
+        crc = spi_crc16(rx_data+j*SPI_BLOCK_SIZE ,512);
 
         test_crc[0] = crc & 0xff;
         test_crc[1] = (crc >>8) &0xff ;
 
-        if(test_crc[1] != rx_cmd[pos+SPI_BLOCK_SIZE] || test_crc[0] != rx_cmd[pos+SPI_BLOCK_SIZE+1] )
+        if(test_crc[1] != sctrl->rx_cmd[pos+SPI_BLOCK_SIZE] || test_crc[0] != sctrl->rx_cmd[pos+SPI_BLOCK_SIZE+1] )
         {
             esp_dbg(ESP_DBG, "crc test_crc0  %x\n",test_crc[0]);
             esp_dbg(ESP_DBG, "crc test_crc1  %x\n",test_crc[1]);
-            esp_dbg(ESP_DBG, "crc rx_data-2  %x\n",rx_cmd[pos+SPI_BLOCK_SIZE]);
-            esp_dbg(ESP_DBG, "crc rx_data-1  %x\n",rx_cmd[pos+SPI_BLOCK_SIZE+1] );
+            esp_dbg(ESP_DBG, "crc rx_data-2  %x\n",sctrl->rx_cmd[pos+SPI_BLOCK_SIZE]);
+            esp_dbg(ESP_DBG, "crc rx_data-1  %x\n",sctrl->rx_cmd[pos+SPI_BLOCK_SIZE+1] );
 
             esp_dbg(ESP_DBG_ERROR, "spierr crc err,count = %d,block =%d\n",count,j+1);
  
@@ -1241,47 +1686,78 @@ goto_err:
     return err_ret;
 }
 
+/* blocks one read cmd can clock into rx_cmd with the default windows */
+static int sif_spi_read_max_blks(struct esp_spi_ctrl *sctrl)
+{
+	int room = MAX_BUF_SIZE - 6 - 8 - CMD_RESP_SIZE - (SPI_BLOCK_SIZE + 2) -
+		   max_t(int, sctrl->spi_resp.block_r_data_resp_size_final, BLOCK_R_DATA_RESP_SIZE_1ST);
+
+	return 1 + room / (BLOCK_R_DATA_RESP_SIZE_EACH + SPI_BLOCK_SIZE + 2);
+}
+
+/* the read done ack to the slc only goes after the last block cmd */
+static int sif_spi_read_blocks_retry(struct spi_device *spi, unsigned int addr, unsigned char *buf,
+                                     int blk_cnt, bool ack)
+{
+	struct esp_spi_ctrl *sctrl = spi_get_drvdata(spi);
+	int err = 0;
+	int retry = 20;
+
+	do {
+		if(retry < 20) {
+			sctrl->spi_resp.retries++;
+			mdelay(10);
+		}
+		retry--;
+		sctrl->check_buf[0] = 1<<2;
+		err  = sif_spi_read_blocks(spi, addr, buf, blk_cnt);
+		if(err == 0)
+		{
+			if (ack)
+				sif_spi_write_bytes(spi,SLC_HOST_CONF_W4 + 2,sctrl->check_buf,1,0);
+		} else if(err == -4 ||err == -5 ||err == -6||err == -7 ||err == -8)
+		{
+			sif_ack_target_read_err(sctrl->epub);
+		} else if(err == -3)
+		{
+			continue;
+		} else
+		{
+			break;
+		}
+
+	}while(retry > 0 && err != 0);
+	if(err != 0 && retry == 0)
+		esp_dbg(ESP_DBG_ERROR, "spierr 20 times retry block read fail\n");
+
+	return err;
+}
+
 int sif_spi_read_mix_nosync(struct spi_device *spi, unsigned int addr, unsigned char *buf, int len, int dummymode)
 {
+	struct esp_spi_ctrl *sctrl = spi_get_drvdata(spi);
 	int blk_cnt;
 	int remain_len;
 	int err = 0;
 	int retry = 20;
+	int max_blks = sif_spi_read_max_blks(sctrl);
 
 	do{
 		blk_cnt = len/SPI_BLOCK_SIZE;
 		remain_len = len%SPI_BLOCK_SIZE;
 
-		if (blk_cnt > 0) {
-
-			retry = 20;
-			do {
-				if(retry < 20)
-					mdelay(10);
-				retry--;
-				check_buf[0] = 1<<2;
-				err  = sif_spi_read_blocks(spi, addr, buf, blk_cnt);
-				if(err == 0)
-				{
-					sif_spi_write_bytes(spi,SLC_HOST_CONF_W4 + 2,check_buf,1,0);
-				} else if(err == -4 ||err == -5 ||err == -6||err == -7 ||err == -8)
-				{
-					struct esp_spi_ctrl *sctrl = spi_get_drvdata(spi);
-					if(sctrl != NULL) {
-						sif_ack_target_read_err(sctrl->epub);
-					}
-				} else if(err == -3)
-				{
-					continue;
-				} else
-				{
-					break;
-				}
-
-			}while(retry > 0 && err != 0);
-			if(err != 0 && retry == 0)
-				esp_dbg(ESP_DBG_ERROR, "spierr 20 times retry block read fail\n");
+		/* more blocks than rx_cmd holds: full cmds back to back first */
+		while (blk_cnt > max_blks) {
+			err = sif_spi_read_blocks_retry(spi, addr, buf, max_blks, false);
+			if (err)
+				return err;
+			addr += max_blks * SPI_BLOCK_SIZE;
+			buf += max_blks * SPI_BLOCK_SIZE;
+			blk_cnt -= max_blks;
+		}
 
+		if (blk_cnt > 0) {
+			err = sif_spi_read_blocks_retry(spi, addr, buf, blk_cnt, true);
 			if(err)
 				return err;
 		}
@@ -1291,8 +1767,10 @@ int sif_spi_read_mix_nosync(struct spi_device *spi, unsigned int addr, unsigned
 			{
 				retry = 20;
 				do{
-					if(retry <20)
+					if(retry <20) {
+						sctrl->spi_resp.retries++;
 						mdelay(10);
+					}
 					retry--;
 					err = sif_spi_read_bytes(spi, addr, (buf + (blk_cnt*SPI_BLOCK_SIZE)), remain_len, dummymode);
 				}while(retry >0 && err != 0);
@@ -1757,52 +2235,132 @@ int sif_spi_protocol_init(struct spi_device *spi)
 	return 0;
 }
 
-static int spi_irq_thread(void *data)
-{
-	struct spi_device *spi = (struct spi_device *)data;
+/*
+ * the hard handler masks the platform irq and stamps it, sif_dsr() runs
+ * in the device's own irq thread (irq/<n>-<spi dev>) which unmasks once
+ * done. The thread follows the irq's affinity, spi_irq_cpu pins both.
+ */
+static int spi_irq_cpu = -1;
+module_param(spi_irq_cpu, int, 0444);
+MODULE_PARM_DESC(spi_irq_cpu, "cpu for the spi irq and its thread, -1: any");
 
-	do {
-		sif_dsr(spi);
-		
-		set_current_state(TASK_INTERRUPTIBLE);
-		sif_platform_irq_mask(0);
+static int spi_irq_prio;
+module_param(spi_irq_prio, int, 0444);
+MODULE_PARM_DESC(spi_irq_prio, "SCHED_FIFO priority of the spi irq thread, 0: kernel default");
+
+static void sif_irq_thread_prio(struct esp_spi_ctrl *sctrl)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+	struct sched_param param = { .sched_priority = spi_irq_prio };
+#endif
 
-		if (!kthread_should_stop())
-			schedule();
+	sctrl->irq_prio_set = true;
+	if (spi_irq_prio <= 0 || spi_irq_prio >= MAX_RT_PRIO)
+		return;
 
-		set_current_state(TASK_RUNNING);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+	sched_setscheduler(current, SCHED_FIFO, &param);
+#else
+	/* only the kernel's own rt levels are left to modules */
+	if (spi_irq_prio < MAX_RT_PRIO / 2)
+		sched_set_fifo_low(current);
+#endif
+}
 
-	} while (!kthread_should_stop());
-	return 0;	
+static void sif_irq_lat_account(struct esp_spi_ctrl *sctrl)
+{
+	struct esp_spi_irq_stat *st = &sctrl->irq_stat;
+	u32 us = (u32)div_u64(ktime_to_ns(ktime_get()) - sctrl->irq_t0, NSEC_PER_USEC);
+
+	st->irqs++;
+	st->sum_us += us;
+	if (us > st->max_us)
+		st->max_us = us;
+	st->lat[min_t(u32, us ? ilog2(us) + 1 : 0, SPI_IRQ_LAT_NR - 1)]++;
 }
 
-int sif_setup_irq_thread(struct spi_device *spi)
+static irqreturn_t sif_irq_thread_fn(int irq, void *dev_id)
 {
-	sif_irq_thread = kthread_run(spi_irq_thread, spi, "kspiirqd/eagle");
-	if (IS_ERR(sif_irq_thread)) {
-		esp_dbg(ESP_DBG_ERROR, "setup irq thread error!\n");
-		return -1;
-	}
-	return 0;
+	struct esp_spi_ctrl *sctrl = spi_get_drvdata((struct spi_device *)dev_id);
+
+	if (unlikely(!sctrl->irq_prio_set))
+		sif_irq_thread_prio(sctrl);
+
+	sif_irq_lat_account(sctrl);
+	sif_dsr((struct spi_device *)dev_id);
+	sif_platform_irq_mask(0);
+
+	return IRQ_HANDLED;
 }
 
 static irqreturn_t sif_irq_handler(int irq, void *dev_id)
 {
+	struct esp_spi_ctrl *sctrl = spi_get_drvdata((struct spi_device *)dev_id);
+
 	sif_platform_irq_mask(1);
 
 	if (sif_platform_is_irq_occur()) {
-		wake_up_process(sif_irq_thread);
-	} else {
-		sif_platform_irq_mask(0);
-		return IRQ_NONE;
+		sctrl->irq_t0 = ktime_to_ns(ktime_get());
+		return IRQ_WAKE_THREAD;
 	}
 
-	return IRQ_HANDLED;
+	sctrl->irq_stat.bogus++;
+	sif_platform_irq_mask(0);
+	return IRQ_NONE;
+}
+
+static ssize_t esp_spi_irq_stats_read(struct file *filp, char __user *buffer,
+				      size_t count, loff_t *ppos)
+{
+	struct esp_spi_ctrl *sctrl = filp->private_data;
+	struct esp_spi_irq_stat *st = &sctrl->irq_stat;
+	char buf[512];
+	int i, len;
+
+	len = snprintf(buf, sizeof(buf), "irqs %u bogus %u lat_us avg %llu max %u\n",
+		       st->irqs, st->bogus, st->irqs ? div_u64(st->sum_us, st->irqs) : 0,
+		       st->max_us);
+	for (i = 0; i < SPI_IRQ_LAT_NR - 1; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "<%u %u\n", 1U << i, st->lat[i]);
+	len += snprintf(buf + len, sizeof(buf) - len, ">=%u %u\n", 1U << (i - 1), st->lat[i]);
+
+	return simple_read_from_buffer(buffer, count, ppos, buf, len);
+}
+
+/* any write starts a new window */
+static ssize_t esp_spi_irq_stats_write(struct file *filp, const char __user *buffer,
+				       size_t count, loff_t *ppos)
+{
+	struct esp_spi_ctrl *sctrl = filp->private_data;
+
+	memset(&sctrl->irq_stat, 0, sizeof(sctrl->irq_stat));
+	return count;
+}
+
+static const struct file_operations esp_spi_irq_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = esp_spi_irq_stats_read,
+	.write = esp_spi_irq_stats_write,
+};
+
+static void sif_irq_debugfs(struct esp_spi_ctrl *sctrl)
+{
+	char name[32];
+
+	if (sctrl->irq_dir)
+		return;
+
+	snprintf(name, sizeof(name), "spi_irq_%s", wiphy_name(sctrl->epub->hw->wiphy));
+	sctrl->irq_dir = esp_debugfs_add_sub_dir(name);
+	if (sctrl->irq_dir)
+		esp_dump("stats", sctrl->irq_dir, sctrl, 0, (struct file_operations *)&esp_spi_irq_stats_fops);
 }
 
 void sif_enable_irq(struct esp_pub *epub) 
 {
         int err;
+        unsigned long flags;
 	struct esp_spi_ctrl *sctrl = NULL;
         struct spi_device *spi = NULL;
 
@@ -1820,34 +2378,38 @@ void sif_enable_irq(struct esp_pub *epub)
 	mdelay(100);
 
 	sif_platform_irq_init();
-	err = sif_setup_irq_thread(spi);
-        if (err) {
-                esp_dbg(ESP_DBG_ERROR, "%s setup sif irq failed\n", __func__);
-		return;
-	}
+	sctrl->irq_prio_set = false;
 
 /******************compat with other device in some shared irq system ********************/
 
 #ifdef  REQUEST_IRQ_SHARED
 #if   defined(REQUEST_IRQ_RISING)
-        err = request_irq(sif_platform_get_irq_no(), sif_irq_handler, IRQF_TRIGGER_RISING | IRQF_SHARED, "esp_spi_irq", spi);
+        flags = IRQF_TRIGGER_RISING | IRQF_SHARED;
 #elif defined(REQUEST_IRQ_FALLING)
-        err = request_irq(sif_platform_get_irq_no(), sif_irq_handler, IRQF_TRIGGER_FALLING | IRQF_SHARED, "esp_spi_irq", spi);
+        flags = IRQF_TRIGGER_FALLING | IRQF_SHARED;
 #elif defined(REQUEST_IRQ_LOWLEVEL)
-        err = request_irq(sif_platform_get_irq_no(), sif_irq_handler, IRQF_TRIGGER_LOW | IRQF_SHARED, "esp_spi_irq", spi);
+        flags = IRQF_TRIGGER_LOW | IRQF_SHARED;
 #elif defined(REQUEST_IRQ_HIGHLEVEL)
-        err = request_irq(sif_platform_get_irq_no(), sif_irq_handler, IRQF_TRIGGER_HIGH | IRQF_SHARED, "esp_spi_irq", spi);
+        flags = IRQF_TRIGGER_HIGH | IRQF_SHARED;
 #else   /* default */
-        err = request_irq(sif_platform_get_irq_no(), sif_irq_handler, IRQF_TRIGGER_LOW | IRQF_SHARED, "esp_spi_irq", spi);
+        flags = IRQF_TRIGGER_LOW | IRQF_SHARED;
 #endif /* TRIGGER MODE */
 #else
-        err = request_irq(sif_platform_get_irq_no(), sif_irq_handler, IRQF_TRIGGER_LOW, "esp_spi_irq", spi);
+        flags = IRQF_TRIGGER_LOW;
 #endif /* ESP_IRQ_SHARED */
 
+        err = request_threaded_irq(sif_platform_get_irq_no(), sif_irq_handler, sif_irq_thread_fn,
+                                   flags, dev_name(&spi->dev), spi);
         if (err) {
                 esp_dbg(ESP_DBG_ERROR, "sif %s failed\n", __func__);
+		sif_platform_irq_deinit();
 		return ;
 	}
+
+        if (spi_irq_cpu >= 0 && cpu_online(spi_irq_cpu))
+                irq_set_affinity_hint(sif_platform_get_irq_no(), cpumask_of(spi_irq_cpu));
+
+        sif_irq_debugfs(sctrl);
 #ifdef IRQ_WAKE_HOST
 	enable_irq_wake(sif_platform_get_irq_no());
 #endif
@@ -1882,116 +2444,257 @@ void sif_disable_irq(struct esp_pub *epub)
                 }
         }
 
+        if (spi_irq_cpu >= 0)
+                irq_set_affinity_hint(sif_platform_get_irq_no(), NULL);
         free_irq(sif_platform_get_irq_no(), spi);
-	kthread_stop(sif_irq_thread);
 
 	sif_platform_irq_deinit();
 
         atomic_set(&sctrl->irq_installed, 0);
 }
 
+/* a hung fw2 ignores interrupt 7, only the board's power and reset lines reach the rom */
+void sif_reset_target(struct esp_pub *epub)
+{
+        sif_disable_irq(epub);
+
+        sif_platform_target_poweroff();
+        msleep(ESP_RESET_OFF_MS);
+        sif_platform_target_poweron();
+        sif_platform_reset_target();
+}
+
+/* spi has no card state, just redo the protocol init the rom expects */
+int sif_reinit_card(struct esp_pub *epub)
+{
+        struct esp_spi_ctrl *sctrl = (struct esp_spi_ctrl *)epub->sif;
+
+        sif_disable_irq(epub);
+        msleep(100);    /* same settle as between the two boot stages */
+
+        return sif_spi_protocol_init(sctrl->spi);
+}
+
+
+/* esp_debug/spi_resp_<phy>: token windows, polls and retries */
+static void sif_spi_resp_debugfs(struct esp_spi_ctrl *sctrl)
+{
+	struct esp_spi_resp *r = &sctrl->spi_resp;
+	char name[32];
+
+	if (sctrl->resp_dir)
+		return;
+
+	snprintf(name, sizeof(name), "spi_resp_%s", wiphy_name(sctrl->epub->hw->wiphy));
+	sctrl->resp_dir = esp_debugfs_add_sub_dir(name);
+	if (sctrl->resp_dir == NULL)
+		return;
+
+	esp_dump_var("token_hits", sctrl->resp_dir, &r->token_hits, ESP_U32);
+	esp_dump_var("token_misses", sctrl->resp_dir, &r->token_misses, ESP_U32);
+	esp_dump_var("polls", sctrl->resp_dir, &r->polls, ESP_U32);
+	esp_dump_var("retries", sctrl->resp_dir, &r->retries, ESP_U32);
+	esp_dump_var("ready_waits", sctrl->resp_dir, &r->ready_waits, ESP_U32);
+	esp_dump_var("ready_timeouts", sctrl->resp_dir, &r->ready_timeouts, ESP_U32);
+	esp_dump_var("wasted_bytes", sctrl->resp_dir, &r->wasted_bytes, ESP_U64);
+	esp_dump_var("block_r_1st_win", sctrl->resp_dir, &r->block_r_1st_win.cur, ESP_U32);
+	esp_dump_var("block_r_each_win", sctrl->resp_dir, &r->block_r_each_win.cur, ESP_U32);
+	esp_dump_var("async_reqs", sctrl->resp_dir, &sctrl->io_reqs, ESP_U32);
+	esp_dump_var("async_busy", sctrl->resp_dir, &sctrl->io_busy, ESP_U32);
+}
+
+static void esp_spi_free_bufs(struct esp_spi_ctrl *sctrl)
+{
+	debugfs_remove_recursive(sctrl->resp_dir);
+	sctrl->resp_dir = NULL;
+	debugfs_remove_recursive(sctrl->irq_dir);
+	sctrl->irq_dir = NULL;
+	sif_spi_ready_free(sctrl);
+
+	if (sctrl->buf_addr) {
+#ifdef ESP_PREALLOC
+		esp_put_lspi_buf(&sctrl->buf_addr);
+#else
+		kfree(sctrl->buf_addr);
+#endif
+		sctrl->buf_addr = NULL;
+		sctrl->tx_cmd = NULL;
+		sctrl->rx_cmd = NULL;
+	}
+
+	if (sctrl->check_buf) {
+		kfree(sctrl->check_buf);
+		sctrl->check_buf = NULL;
+	}
+
+	if (sctrl->ff_buf) {
+		kfree(sctrl->ff_buf);
+		sctrl->ff_buf = NULL;
+	}
+
+	kfree(sctrl->xfers);
+	sctrl->xfers = NULL;
+
+	sif_spi_engine_free(sctrl);
+}
 
-int esp_setup_spi(struct spi_device *spi)
+int esp_setup_spi(struct esp_spi_ctrl *sctrl)
 {
 #ifndef ESP_PREALLOC
 	int retry = 10;
 #endif
-	/**** alloc buffer for spi io */
-	if (sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT) {
+	/**** alloc buffer for spi io, kept across the second stage */
+	if (sctrl->buf_addr == NULL) {
 #ifdef ESP_PREALLOC
-		if ((buf_addr = esp_get_lspi_buf()) == NULL)
+		if ((sctrl->buf_addr = esp_get_lspi_buf()) == NULL)
 			goto _err_buf_addr;
 #else
-		while ((buf_addr = (unsigned char *)kmalloc (MAX_BUF_SIZE, GFP_KERNEL)) == NULL) {
+		while ((sctrl->buf_addr = (unsigned char *)kmalloc (MAX_BUF_SIZE, GFP_KERNEL)) == NULL) {
 				if (--retry < 0)
 					goto _err_buf_addr;
 		}
 #endif
-        	if ((check_buf = (unsigned char *)kmalloc (256, GFP_KERNEL)) == NULL)
-					goto _err_check_buf;
+        	if ((sctrl->check_buf = (unsigned char *)kmalloc (256, GFP_KERNEL)) == NULL)
+					goto _err_bufs;
 
-        	if ((ff_buf = (unsigned char *)kmalloc (256, GFP_KERNEL)) == NULL)
-					goto _err_ff_buf;
+        	if ((sctrl->ff_buf = (unsigned char *)kmalloc (256, GFP_KERNEL)) == NULL)
+					goto _err_bufs;
         
-        	memset(ff_buf,0xff,256);
+        	memset(sctrl->ff_buf,0xff,256);
+
+		/* cmd plus a payload and a framing transfer per block */
+		sctrl->xfers = kcalloc(SPI_MAX_XFERS, sizeof(struct spi_transfer), GFP_KERNEL);
+		if (sctrl->xfers == NULL)
+					goto _err_bufs;
 
-		tx_cmd = buf_addr;
-        	rx_cmd = buf_addr;
+		sctrl->tx_cmd = sctrl->buf_addr;
+        	sctrl->rx_cmd = sctrl->buf_addr;
     	}
-	spi_resp.max_dataW_resp_size = 0;
-	spi_resp.max_dataR_resp_size = 0;
-	spi_resp.max_block_dataW_resp_size = 0;
-	spi_resp.max_block_dataR_resp_size = 0;
-	spi_resp.max_cmd_resp_size = 0;
-	if( sif_get_ate_config() != 5)
+	sctrl->spi_resp.max_dataW_resp_size = 0;
+	sctrl->spi_resp.max_dataR_resp_size = 0;
+	sctrl->spi_resp.max_block_dataW_resp_size = 0;
+	sctrl->spi_resp.max_block_dataR_resp_size = 0;
+	sctrl->spi_resp.max_cmd_resp_size = 0;
+	memset(sctrl->spi_resp.byte_r_win, 0, sizeof(sctrl->spi_resp.byte_r_win));
+	memset(&sctrl->spi_resp.block_r_1st_win, 0, sizeof(struct esp_spi_win));
+	memset(&sctrl->spi_resp.block_r_each_win, 0, sizeof(struct esp_spi_win));
+	if( sctrl->epub->conf.ate != 5)
 	{
-        	spi_resp.data_resp_size_w = DATA_RESP_SIZE_W;
-        	spi_resp.data_resp_size_r = DATA_RESP_SIZE_R;
-        	spi_resp.block_w_data_resp_size_final = BLOCK_W_DATA_RESP_SIZE_FINAL;
-        	spi_resp.block_r_data_resp_size_final = BLOCK_R_DATA_RESP_SIZE_1ST;
+        	sctrl->spi_resp.data_resp_size_w = DATA_RESP_SIZE_W;
+        	sctrl->spi_resp.data_resp_size_r = DATA_RESP_SIZE_R;
+        	sctrl->spi_resp.block_w_data_resp_size_final = BLOCK_W_DATA_RESP_SIZE_FINAL;
+        	sctrl->spi_resp.block_r_data_resp_size_final = BLOCK_R_DATA_RESP_SIZE_1ST;
 	} else {
-        	spi_resp.data_resp_size_w = 1000;
-        	spi_resp.data_resp_size_r = 1000;
-        	spi_resp.block_w_data_resp_size_final = 1000;
-        	spi_resp.block_r_data_resp_size_final = 1000;
+        	sctrl->spi_resp.data_resp_size_w = 1000;
+        	sctrl->spi_resp.data_resp_size_r = 1000;
+        	sctrl->spi_resp.block_w_data_resp_size_final = 1000;
+        	sctrl->spi_resp.block_r_data_resp_size_final = 1000;
 	}
 
+	/* no async slots just means sync tx */
+	if (sif_spi_engine_alloc(sctrl))
+		esp_dbg(ESP_DBG_ERROR, "%s no mem for async spi, sync tx\n", __func__);
+
+	sif_spi_ready_init(sctrl);
+	sif_spi_resp_debugfs(sctrl);
+
 	return 0;
 
-_err_ff_buf:
-	if (check_buf) {
-		kfree(check_buf);
-		check_buf = NULL;
-	}
-_err_check_buf:
-	if (buf_addr) {
-#ifdef ESP_PREALLOC
-		esp_put_lspi_buf(&buf_addr);
-#else
-		kfree(buf_addr);
-#endif
-		buf_addr = NULL;
-	}
+_err_bufs:
+	esp_spi_free_bufs(sctrl);
 _err_buf_addr:
 	return -ENOMEM;
 }
 
+/* first stage ctrls parked until their spi device is probed again,
+ * one per chip so several eagles can come up side by side */
+static LIST_HEAD(sif_pending_ctrls);
+static DEFINE_MUTEX(sif_pending_lock);
+
+static void sif_park_ctrl(struct esp_spi_ctrl *sctrl, void *key)
+{
+	sctrl->bus_key = key;
+	mutex_lock(&sif_pending_lock);
+	list_add_tail(&sctrl->pending_list, &sif_pending_ctrls);
+	mutex_unlock(&sif_pending_lock);
+}
+
+static struct esp_spi_ctrl *sif_unpark_ctrl(void *key)
+{
+	struct esp_spi_ctrl *sctrl = NULL, *pos;
+
+	mutex_lock(&sif_pending_lock);
+	list_for_each_entry(pos, &sif_pending_ctrls, pending_list) {
+		if (pos->bus_key == key) {
+			list_del_init(&pos->pending_list);
+			sctrl = pos;
+			break;
+		}
+	}
+	mutex_unlock(&sif_pending_lock);
+
+	return sctrl;
+}
+
+/* some chip finished its first stage and waits for the second */
+static bool sif_any_parked(void)
+{
+	bool parked;
+
+	mutex_lock(&sif_pending_lock);
+	parked = !list_empty(&sif_pending_ctrls);
+	mutex_unlock(&sif_pending_lock);
+
+	return parked;
+}
+
+static void esp_spi_free_ctrl(struct esp_spi_ctrl *sctrl)
+{
+	if (sctrl->epub->sip) {
+		sip_detach(sctrl->epub->sip);
+		sctrl->epub->sip = NULL;
+		esp_dbg(ESP_DBG_TRACE, "%s sip detached \n", __func__);
+	}
+#ifdef USE_EXT_GPIO
+	if (sctrl->epub->conf.ate == 0)
+		ext_gpio_deinit(sctrl->epub);
+#endif
+	esp_pub_dealloc_mac80211(sctrl->epub);
+	esp_dbg(ESP_DBG_TRACE, "%s dealloc mac80211 \n", __func__);
+
+	if (sctrl->dma_buffer) {
+		kfree(sctrl->dma_buffer);
+		sctrl->dma_buffer = NULL;
+		esp_dbg(ESP_DBG_TRACE, "%s free dma_buffer \n", __func__);
+	}
+
+	esp_spi_free_bufs(sctrl);
+
+	kfree(sctrl);
+}
 
 static int esp_spi_probe(struct spi_device *spi);
 static int esp_spi_remove(struct spi_device *spi); 
 
 static int esp_spi_probe(struct spi_device *spi) 
 {
-        int err;
+        int err = 0;
         struct esp_pub *epub;
         struct esp_spi_ctrl *sctrl;
 
         esp_dbg(ESP_DBG_ERROR, "%s enter\n", __func__);
-	
-	err = esp_setup_spi(spi);
-	if (err) {
-		esp_dbg(ESP_DBG_ERROR, "%s setup_spi error[%d]\n", __func__, err);
-                if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT)
-			goto _err_spi;
-		else
-			goto _err_second_init;
-	}
-	esp_dbg(ESP_DBG_ERROR, "%s init_protocol\n", __func__);
-	err = sif_spi_protocol_init(spi);
-	if(err){
-                if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT)
-			goto _err_spi;
-		else
-			goto _err_second_init;
-	}
 
-	if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+	/* a device with a parked ctrl has already run the first stage */
+	sctrl = sif_unpark_ctrl(spi);
+	if (sctrl == NULL) {
 		sctrl = kzalloc(sizeof(struct esp_spi_ctrl), GFP_KERNEL);
 
 		if (sctrl == NULL) {
                 	err = -ENOMEM;
-			goto _err_spi;
+			goto _err_first_init;
 		}
+		INIT_LIST_HEAD(&sctrl->pending_list);
+		sif_spi_engine_init(sctrl);
 
 		/* temp buffer reserved for un-dma-able request */
 		sctrl->dma_buffer = kzalloc(ESP_DMA_IBUFSZ, GFP_KERNEL);
@@ -2000,7 +2703,6 @@ static int esp_spi_probe(struct spi_device *spi)
                 	err = -ENOMEM;
 			goto _err_last;
 		}
-		sif_sctrl = sctrl;
         	sctrl->slc_blk_sz = SIF_SLC_BLOCK_SIZE;
         	
 		epub = esp_pub_alloc_mac80211(&spi->dev);
@@ -2012,97 +2714,82 @@ static int esp_spi_probe(struct spi_device *spi)
         	}
         	epub->sif = (void *)sctrl;
         	sctrl->epub = epub;
-	
-#ifdef USE_EXT_GPIO
-		if (sif_get_ate_config() == 0) {
-			err = ext_gpio_init(epub);
-			if (err) {
-                		esp_dbg(ESP_DBG_ERROR, "ext_irq_work_init failed %d\n", err);
-				goto _err_epub;
-			}
-		}
-#endif
+		sif_load_config(epub);
+		epub->sdio_state = ESP_SDIO_STATE_FIRST_INIT;
 	} else {
-		sctrl = sif_sctrl;
-		sif_sctrl = NULL;
 		epub = sctrl->epub;
 		SET_IEEE80211_DEV(epub->hw, &spi->dev);
 		epub->dev = &spi->dev;
+		epub->sdio_state = ESP_SDIO_STATE_SECOND_INIT;
 	}
 
-        epub->sdio_state = sif_sdio_state;
-
         sctrl->spi = spi;
         spi_set_drvdata(spi, sctrl);
-
-        if (err){
-                if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT)
-                	goto _err_ext_gpio;
+	
+	err = esp_setup_spi(sctrl);
+	if (err) {
+		esp_dbg(ESP_DBG_ERROR, "%s setup_spi error[%d]\n", __func__, err);
+                if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT)
+			goto _err_epub;
 		else
 			goto _err_second_init;
-        }
+	}
+	esp_dbg(ESP_DBG_ERROR, "%s init_protocol\n", __func__);
+	err = sif_spi_protocol_init(spi);
+	if(err){
+                if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT)
+			goto _err_spi;
+		else
+			goto _err_second_init;
+	}
+
+#ifdef USE_EXT_GPIO
+	if (epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT && epub->conf.ate == 0) {
+		err = ext_gpio_init(epub);
+		if (err) {
+                	esp_dbg(ESP_DBG_ERROR, "ext_irq_work_init failed %d\n", err);
+			goto _err_spi;
+		}
+	}
+#endif
+
         check_target_id(epub);
 
         err = esp_pub_init_all(epub);
 
         if (err) {
                 esp_dbg(ESP_DBG_ERROR, "esp_init_all failed: %d\n", err);
-                if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+                if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+			epub->sdio_state = ESP_SDIO_STATE_FIRST_ERROR_EXIT;
 			err = 0;
 			goto _err_first_init;
 		}
-                if(sif_sdio_state == ESP_SDIO_STATE_SECOND_INIT)
+                if(epub->sdio_state == ESP_SDIO_STATE_SECOND_INIT)
 			goto _err_second_init;
         }
 
         esp_dbg(ESP_DBG_TRACE, " %s return  %d\n", __func__, err);
-	if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+	if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT){
 		esp_dbg(ESP_DBG_ERROR, "first normal exit\n");
-		sif_sdio_state = ESP_SDIO_STATE_FIRST_NORMAL_EXIT;
-		up(&esp_powerup_sem);
+		epub->sdio_state = ESP_SDIO_STATE_FIRST_NORMAL_EXIT;
+		sif_park_ctrl(sctrl, spi);
 	}
 
         return err;
-_err_ext_gpio:
-#ifdef USE_EXT_GPIO	
-	if (sif_get_ate_config() == 0)
-		ext_gpio_deinit();
+_err_spi:
+	esp_spi_free_bufs(sctrl);
 _err_epub:
-#endif
+	spi_set_drvdata(spi, NULL);
         esp_pub_dealloc_mac80211(epub);
 _err_dma:
         kfree(sctrl->dma_buffer);
 _err_last:
         kfree(sctrl);
-_err_spi:
-	if (buf_addr) {
-#ifdef ESP_PREALLOC
-		esp_put_lspi_buf(&buf_addr);
-#else
-		kfree(buf_addr);
-#endif
-		buf_addr = NULL;
-		tx_cmd = NULL;
-		rx_cmd = NULL;
-	}
-	if (check_buf) {
-        	kfree(check_buf);
-        	check_buf = NULL;
-	}
-	if (ff_buf) {
-        	kfree(ff_buf);
-        	ff_buf = NULL;
-	}
-	
 _err_first_init:
-	if(sif_sdio_state == ESP_SDIO_STATE_FIRST_INIT){
-		esp_dbg(ESP_DBG_ERROR, "first error exit\n");
-		sif_sdio_state = ESP_SDIO_STATE_FIRST_ERROR_EXIT;
-		up(&esp_powerup_sem);
-	}
+	esp_dbg(ESP_DBG_ERROR, "first error exit\n");
         return err;
 _err_second_init:
-	sif_sdio_state = ESP_SDIO_STATE_SECOND_ERROR_EXIT;
+	epub->sdio_state = ESP_SDIO_STATE_SECOND_ERROR_EXIT;
 	esp_spi_remove(spi);
 	return err;
 }
@@ -2125,18 +2812,7 @@ static int esp_spi_remove(struct spi_device *spi)
                         esp_dbg(ESP_DBG_ERROR, "%s epub null\n", __func__);
                         break;
                 }
-		sctrl->epub->sdio_state = sif_sdio_state;
-		if(sif_sdio_state != ESP_SDIO_STATE_FIRST_NORMAL_EXIT){
-                	if (sctrl->epub->sip) {
-                        	sip_detach(sctrl->epub->sip);
-                        	sctrl->epub->sip = NULL;
-                        	esp_dbg(ESP_DBG_TRACE, "%s sip detached \n", __func__);
-                	}
-#ifdef USE_EXT_GPIO	
-			if (sif_get_ate_config() == 0)
-				ext_gpio_deinit();
-#endif
-		} else {
+		if(sctrl->epub->sdio_state == ESP_SDIO_STATE_FIRST_NORMAL_EXIT){
 			//sif_disable_target_interrupt(sctrl->epub);
 			atomic_set(&sctrl->epub->sip->state, SIP_STOP);
 			sif_disable_irq(sctrl->epub);
@@ -2145,40 +2821,9 @@ static int esp_spi_remove(struct spi_device *spi)
 #ifdef TEST_MODE
                 test_exit_netlink();
 #endif /* TEST_MODE */
-		if(sif_sdio_state != ESP_SDIO_STATE_FIRST_NORMAL_EXIT){
-                	esp_pub_dealloc_mac80211(sctrl->epub);
-                	esp_dbg(ESP_DBG_TRACE, "%s dealloc mac80211 \n", __func__);
-			
-			if (sctrl->dma_buffer) {
-				kfree(sctrl->dma_buffer);
-				sctrl->dma_buffer = NULL;
-				esp_dbg(ESP_DBG_TRACE, "%s free dma_buffer \n", __func__);
-			}
-
-			kfree(sctrl);
-
-			if (buf_addr) {
-#ifdef ESP_PREALLOC
-				esp_put_lspi_buf(&buf_addr);
-#else
-				kfree(buf_addr);
-#endif
-				buf_addr = NULL;
-				rx_cmd = NULL;
-				tx_cmd = NULL;
-			}
-            
-            		if (check_buf) {
-                		kfree(check_buf);
-                		check_buf = NULL;
-            		}
-            
-            		if (ff_buf) {
-                		kfree(ff_buf);
-                		ff_buf = NULL;
-            		}
-
-		}
+		/* a parked ctrl is kept for the second stage probe */
+		if(sctrl->epub->sdio_state != ESP_SDIO_STATE_FIRST_NORMAL_EXIT)
+			esp_spi_free_ctrl(sctrl);
 
         } while (0);
         
@@ -2196,18 +2841,20 @@ static int esp_spi_suspend(struct device *dev)
 	struct esp_pub *epub = sctrl->epub;
 
         printk("%s", __func__);
-#if 0
-        sip_send_suspend_config(epub, 1);
-#endif
         atomic_set(&epub->ps.state, ESP_PM_ON);	
+        /* spi slaves stay powered across host suspend */
+        esp_pm_suspend(epub, true);
 	return 0;
 }
 
 static int esp_spi_resume(struct device *dev)
 {
+	struct spi_device *spi = to_spi_device(dev);
+        struct esp_spi_ctrl *sctrl = spi_get_drvdata(spi);
+
         esp_dbg(ESP_DBG_ERROR, "%s", __func__);
 
-        return 0;
+        return esp_pm_resume(sctrl->epub);
 }
 
 static const struct dev_pm_ops esp_spi_pm_ops = {
@@ -2263,6 +2910,8 @@ int esp_spi_init(void)
 
         esp_dbg(ESP_DBG_TRACE, "%s \n", __func__);
 
+        spi_crc_init();
+
 #ifdef REGISTER_SPI_BOARD_INFO
 	sif_platform_register_board_info();
 #endif
@@ -2311,23 +2960,15 @@ int esp_spi_init(void)
 
         spi_unregister_driver(&esp_spi_dummy_driver);
 
-        sif_sdio_state = ESP_SDIO_STATE_FIRST_INIT;
-        sema_init(&esp_powerup_sem, 0);
-
+        /* probes the devices already there, each chip's stage lives in its ctrl */
         spi_register_driver(&esp_spi_driver);
 
-        if (down_timeout(&esp_powerup_sem,
-                                 msecs_to_jiffies(ESP_WAIT_UP_TIME_MS)) == 0 && sif_get_ate_config() == 0) {
-		if(sif_sdio_state == ESP_SDIO_STATE_FIRST_NORMAL_EXIT){
-                	spi_unregister_driver(&esp_spi_driver);
+        if (sif_get_ate_config() == 0 && sif_any_parked()) {
+		spi_unregister_driver(&esp_spi_driver);
 
-			msleep(100);
-                
-			sif_sdio_state = ESP_SDIO_STATE_SECOND_INIT;
-        	
-			spi_register_driver(&esp_spi_driver);
-		}
-                
+		msleep(100);
+
+		spi_register_driver(&esp_spi_driver);
         }
 
         esp_register_early_suspend();
@@ -2346,11 +2987,19 @@ _fail:
 
 void esp_spi_exit(void) 
 {
+	struct esp_spi_ctrl *sctrl, *tmp;
+
 	esp_dbg(ESP_SHOW, "%s \n", __func__);
 
         esp_unregister_early_suspend();
 
 	spi_unregister_driver(&esp_spi_driver);
+
+	/* chips that never came back for the second stage */
+	list_for_each_entry_safe(sctrl, tmp, &sif_pending_ctrls, pending_list) {
+		list_del(&sctrl->pending_list);
+		esp_spi_free_ctrl(sctrl);
+	}
 	
 #ifndef FPGA_DEBUG
 	sif_platform_target_poweroff();
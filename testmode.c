@@ -19,6 +19,8 @@
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/kthread.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
 #include <linux/mmc/host.h>
 #include <net/cfg80211.h>
 #include <net/mac80211.h>
@@ -90,7 +92,7 @@ static void sip_send_test_cmd(struct esp_sip *sip, struct sk_buff *skb)
 	else
         	skb_queue_head(&sip->epub->txq, skb);
 
-        if(sif_get_ate_config() == 0){
+        if(sip->epub->conf.ate == 0){
             ieee80211_queue_work(sip->epub->hw, &sip->epub->tx_work);
         } else {
             queue_work(sip->epub->esp_wkq, &sip->epub->tx_work);
@@ -616,6 +618,274 @@ out:
         return -EINVAL;
 }
 
+static struct bench_param bench;
+
+static u32 bench_para(struct genl_info *info, int i, u32 def)
+{
+        if (info->attrs[TEST_ATTR_PARA(i)] == NULL)
+                return def;
+        return nla_get_u32(info->attrs[TEST_ATTR_PARA(i)]);
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+        u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+        return x < y ? -1 : (x > y);
+}
+
+/* called from the SIP_EVT_LOOPBACK handler, returns true if consumed */
+bool esp_test_bench_loopback(struct esp_sip *sip, struct sip_evt_loopback *evt)
+{
+        unsigned long flags;
+        ktime_t now = ktime_get();
+        bool send = false, over = false;
+        u32 id = 0;
+
+        if (!atomic_read(&bench.start))
+                return false;
+
+        spin_lock_irqsave(&bench.lock, flags);
+        if (evt->txlen != bench.tx_len || evt->rxlen != bench.rx_len
+            || evt->pack_id >= bench.next_id) {
+                /* stale reply from a previous trial */
+                bench.errors++;
+                spin_unlock_irqrestore(&bench.lock, flags);
+                return true;
+        }
+
+        if (bench.nlat < BENCH_MAX_SAMPLES)
+                bench.lat_us[bench.nlat++] = (u32)ktime_us_delta(now,
+                                bench.sent_at[evt->pack_id % BENCH_MAX_DEPTH]);
+        bench.done++;
+
+        if (!bench.draining) {
+                if (bench.duration_ms)
+                        bench.draining = ktime_compare(now, bench.deadline) >= 0;
+                else
+                        bench.draining = bench.next_id >= bench.count;
+        }
+
+        if (!bench.draining) {
+                id = bench.next_id++;
+                bench.sent_at[id % BENCH_MAX_DEPTH] = now;
+                send = true;
+        } else if (bench.done + bench.lost == bench.next_id) {
+                over = true;
+        }
+        spin_unlock_irqrestore(&bench.lock, flags);
+
+        if (send && sip_send_loopback_mblk(sip, bench.tx_len, bench.rx_len, id)) {
+                spin_lock_irqsave(&bench.lock, flags);
+                bench.errors++;
+                bench.lost++;
+                bench.draining = true;
+                over = (bench.done + bench.lost == bench.next_id);
+                spin_unlock_irqrestore(&bench.lock, flags);
+        }
+
+        if (over)
+                complete(&bench.trial_done);
+
+        return true;
+}
+
+static int esp_test_bench_trial(u32 tx_len, u32 depth)
+{
+        char reply_str[200];
+        unsigned long flags;
+        ktime_t t0;
+        u64 us, bytes, kbps;
+        u32 done, nlat, last = 0;
+        u32 i, id, sent = 0;
+        bool over;
+        int ret = 0;
+
+        spin_lock_irqsave(&bench.lock, flags);
+        bench.tx_len = tx_len;
+        bench.depth = depth;
+        bench.next_id = 0;
+        bench.done = 0;
+        bench.lost = 0;
+        bench.errors = 0;
+        bench.nlat = 0;
+        bench.draining = false;
+        reinit_completion(&bench.trial_done);
+        t0 = ktime_get();
+        bench.deadline = ktime_add_ms(t0, bench.duration_ms);
+        spin_unlock_irqrestore(&bench.lock, flags);
+
+        /* prime the pipeline, target replies refill it */
+        for (i = 0; i < depth; i++) {
+                spin_lock_irqsave(&bench.lock, flags);
+                /* replies may already be taking ids, stop at the total */
+                if (bench.draining || (!bench.duration_ms && bench.next_id >= bench.count)) {
+                        spin_unlock_irqrestore(&bench.lock, flags);
+                        break;
+                }
+                id = bench.next_id++;
+                bench.sent_at[id % BENCH_MAX_DEPTH] = ktime_get();
+                spin_unlock_irqrestore(&bench.lock, flags);
+
+                ret = sip_send_loopback_mblk(SIP, tx_len, bench.rx_len, id);
+                if (ret) {
+                        /* the primer and the handler share ids, never hand one back */
+                        spin_lock_irqsave(&bench.lock, flags);
+                        bench.errors++;
+                        bench.lost++;
+                        bench.draining = true;
+                        over = (bench.done + bench.lost == bench.next_id);
+                        spin_unlock_irqrestore(&bench.lock, flags);
+                        if (over)
+                                complete(&bench.trial_done);
+                        break;
+                }
+                sent++;
+        }
+
+        if (sent == 0) {
+                esp_dbg(ESP_DBG_ERROR, "%s send failed %d\n", __func__, ret);
+                return ret ? ret : -EINVAL;
+        }
+
+        /* no progress for 2s means the target stopped answering */
+        while (!wait_for_completion_timeout(&bench.trial_done, 2*HZ)) {
+                spin_lock_irqsave(&bench.lock, flags);
+                done = bench.done;
+                spin_unlock_irqrestore(&bench.lock, flags);
+                if (done == last || kthread_should_stop()
+                    || !atomic_read(&bench.start)) {
+                        esp_dbg(ESP_DBG_ERROR, "%s tx %u depth %u stalled at %u\n",
+                                __func__, tx_len, depth, done);
+                        atomic_set(&bench.start, 0);
+                        sprintf(reply_str, "bench tx=%u rx=%u depth=%u err=timeout done=%u",
+                                tx_len, bench.rx_len, depth, done);
+                        esp_test_cmd_event(TEST_CMD_BENCH, reply_str);
+                        return -ETIMEDOUT;
+                }
+                last = done;
+        }
+
+        us = ktime_us_delta(ktime_get(), t0);
+        if (us == 0)
+                us = 1;
+
+        spin_lock_irqsave(&bench.lock, flags);
+        done = bench.done;
+        nlat = bench.nlat;
+        spin_unlock_irqrestore(&bench.lock, flags);
+
+        sort(bench.lat_us, nlat, sizeof(u32), bench_cmp_u32, NULL);
+
+        bytes = (u64)done * (tx_len + bench.rx_len);
+        kbps = div64_u64(bytes * 1000, us);     /* KB/s in units of 1000 bytes */
+
+        sprintf(reply_str, "bench tx=%u rx=%u depth=%u n=%u err=%u us=%llu "
+                "mbps=%llu.%03llu tps=%llu p50=%u p90=%u p99=%u max=%u",
+                tx_len, bench.rx_len, depth, done, bench.errors,
+                (unsigned long long)us,
+                (unsigned long long)div64_u64(kbps, 1000),
+                (unsigned long long)(kbps - div64_u64(kbps, 1000) * 1000),
+                (unsigned long long)div64_u64((u64)done * 1000000, us),
+                nlat ? bench.lat_us[(nlat - 1) * 50 / 100] : 0,
+                nlat ? bench.lat_us[(nlat - 1) * 90 / 100] : 0,
+                nlat ? bench.lat_us[(nlat - 1) * 99 / 100] : 0,
+                nlat ? bench.lat_us[nlat - 1] : 0);
+
+        esp_dbg(ESP_DBG_ERROR, "%s\n", reply_str);
+        esp_test_cmd_event(TEST_CMD_BENCH, reply_str);
+
+        return 0;
+}
+
+static int esp_test_bench_thread(void *param)
+{
+        struct bench_param *bp = (struct bench_param *)param;
+        u32 tx_len, depth;
+        int ret = 0;
+
+        while (!kthread_should_stop()) {
+
+                if (0 == atomic_read(&bp->start)) {
+                        set_current_state(TASK_INTERRUPTIBLE);
+                        if (!kthread_should_stop())
+                                schedule_timeout(MAX_SCHEDULE_TIMEOUT);
+                        set_current_state(TASK_RUNNING);
+                        continue;
+                }
+
+                for (tx_len = bp->tx_min; tx_len <= bp->tx_max; tx_len = tx_len ? tx_len << 1 : 1) {
+                        for (depth = 1; depth <= bp->depth_max; depth <<= 1) {
+                                if (kthread_should_stop() || !atomic_read(&bp->start))
+                                        goto _done;
+                                ret = esp_test_bench_trial(tx_len, depth);
+                                if (ret)
+                                        goto _done;
+                        }
+                }
+_done:
+                if (atomic_read(&bp->start))
+                        esp_test_cmd_event(TEST_CMD_BENCH, "bench over!");
+                atomic_set(&bp->start, 0);
+        }
+
+        esp_dbg(ESP_DBG_ERROR, "%s exit\n", __func__);
+
+        return ret;
+}
+
+/*
+ * PARA0 tx_min, PARA1 tx_max (0 stops a running bench), PARA2 rx_len,
+ * PARA3 depth_max, PARA4 duration_ms per trial, PARA5 count per trial
+ * when duration_ms is 0. One "key=value" line is sent per trial.
+ */
+static int esp_test_bench(struct sk_buff *skb_2,
+                          struct genl_info *info)
+{
+        u32 tx_max;
+
+        if (info == NULL || bench.lat_us == NULL)
+                goto out;
+
+        tx_max = bench_para(info, 1, 0);
+        if (tx_max == 0) {
+                atomic_set(&bench.start, 0);
+                complete(&bench.trial_done);
+                return esp_test_cmd_reply(info, TEST_CMD_BENCH, "bench stopped");
+        }
+
+        if (atomic_read(&bench.start))
+                return esp_test_cmd_reply(info, TEST_CMD_BENCH, "bench busy");
+
+        bench.tx_min = bench_para(info, 0, 0);
+        bench.tx_max = tx_max;
+        bench.rx_len = bench_para(info, 2, 0);
+        bench.depth_max = clamp_t(u32, bench_para(info, 3, 1), 1, BENCH_MAX_DEPTH);
+        bench.duration_ms = bench_para(info, 4, 1000);
+        bench.count = bench_para(info, 5, 1000);
+        if (bench.tx_min > bench.tx_max || bench.tx_max > SDIO_BUF_SIZE
+            || bench.rx_len > SDIO_BUF_SIZE || (!bench.duration_ms && !bench.count))
+                return esp_test_cmd_reply(info, TEST_CMD_BENCH, "bench bad param");
+
+        REGISTER_REPLY(info);
+        atomic_set(&bench.start, 1);
+        if (bench.thread == NULL) {
+                bench.thread = kthread_run(esp_test_bench_thread, &bench, "kespbenchd");
+                if (IS_ERR(bench.thread)) {
+                        bench.thread = NULL;
+                        atomic_set(&bench.start, 0);
+                        goto out;
+                }
+        } else {
+                wake_up_process(bench.thread);
+        }
+
+        return esp_test_cmd_reply(info, TEST_CMD_BENCH, "bench started");
+out:
+        OUT_DONE();
+        return -EINVAL;
+}
+
 /*
 u8 probe_req_frm[] = {0x40,0x00,0x00,0x00,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0x00,0x03,0x8F,0x11,0x22,0x88,
                       0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0x00,0x00,0x00,0x00,0x01,0x08,0x82,0x84,0x8B,0x96,
@@ -638,7 +908,7 @@ static int sip_send_tx_frame(struct esp_sip *sip, u32 packet_len)
                 ptr[i] = i;
         }
 
-		if(sif_get_ate_config() == 0){
+		if(sip->epub->conf.ate == 0){
 			sip_tx_data_pkt_enqueue(sip->epub, skb);
         	ieee80211_queue_work(sip->epub->hw, &sip->epub->tx_work);
         } else {
@@ -856,6 +1126,12 @@ static struct genl_ops esp_test_ops[] = {
                 .doit = esp_test_sdiospeed,
                 .flags = GENL_ADMIN_PERM,
         },
+        {
+                .cmd = TEST_CMD_BENCH,
+                .policy = test_genl_policy,
+                .doit = esp_test_bench,
+                .flags = GENL_ADMIN_PERM,
+        },
 };
 
 static int esp_test_netlink_notify(struct notifier_block *nb,
@@ -889,6 +1165,9 @@ int test_init_netlink(struct esp_sip *sip)
         /* temp buffer for sdio test */
         sdio_buff = kzalloc(8, GFP_KERNEL);
 	    sdiotest_buf = kzalloc(16*1024, GFP_KERNEL);
+        bench.lat_us = kzalloc(BENCH_MAX_SAMPLES * sizeof(u32), GFP_KERNEL);
+        spin_lock_init(&bench.lock);
+        init_completion(&bench.trial_done);
 
 	rc = genl_register_family_with_ops(&test_genl_family, esp_test_ops);
         if (rc)
@@ -910,6 +1189,10 @@ failure:
 		kfree(sdiotest_buf);
 		sdiotest_buf = NULL;
 	}
+	if (bench.lat_us) {
+		kfree(bench.lat_us);
+		bench.lat_us = NULL;
+	}
         return -EINVAL;
 }
 
@@ -928,6 +1211,16 @@ void test_exit_netlink(void)
 		kthread_stop(sdioTest.thread);
 		sdioTest.thread = NULL;
 	}
+	if (bench.thread) {
+		atomic_set(&bench.start, 0);
+		complete(&bench.trial_done);
+		kthread_stop(bench.thread);
+		bench.thread = NULL;
+	}
+	if (bench.lat_us) {
+		kfree(bench.lat_us);
+		bench.lat_us = NULL;
+	}
 	if (sdiotest_buf) {
 		kfree(sdiotest_buf);
 		sdiotest_buf = NULL;
@@ -1034,7 +1327,9 @@ void esp_stability_test(char *filename,struct esp_pub *epub)
 #if (!defined(CONFIG_DEBUG_FS) || !defined(DEBUGFS_BOOTMODE)) && !defined(ESP_CLASS)
             request_init_conf();
 #endif
-            if(sif_get_ate_config() == 0)
+            /* the conf file may have changed ate, refresh our copy */
+            sif_load_config(epub);
+            if(epub->conf.ate == 0)
             {
 
                 sprintf(test_res_str, "ok, count = %d !!!\n", count);
@@ -1047,7 +1342,7 @@ void esp_stability_test(char *filename,struct esp_pub *epub)
             }
 
             //for apk test
-            if(sif_get_ate_config() == 3)
+            if(epub->conf.ate == 3)
             {
                 sprintf(test_res_str, "error, count = %d !!!\n", count);
 
@@ -1233,7 +1528,7 @@ void esp_resp_test(char *filename,struct esp_pub *epub)
 
         }
     }
-    spi_resp = sif_get_spi_resp();
+    spi_resp = sif_get_spi_resp(epub);
     
     sprintf(test_res_str, "ok, max_dataW_resp_size=%d--max_dataR_resp_size=%d--max_block_dataW_resp_size=%d--max_block_dataR_resp_size=%d--max_cmd_resp_size=%d-- !!!\n",
               spi_resp->max_dataW_resp_size,spi_resp->max_dataR_resp_size,spi_resp->max_block_dataW_resp_size,spi_resp->max_block_dataR_resp_size,spi_resp->max_cmd_resp_size);
@@ -1319,18 +1614,18 @@ void esp_test_init(struct esp_pub *epub)
     sif_hda_io_enable(epub);
     sif_unlock_bus(epub);
 
-    if(sif_get_ate_config() == 2){
+    if(epub->conf.ate == 2){
         esp_stability_test(filename,epub);
 
-    } else if(sif_get_ate_config() == 4){
+    } else if(epub->conf.ate == 4){
         esp_rate_test(filename,epub);
     }
 #ifdef ESP_USE_SPI
-    else if(sif_get_ate_config() == 5){
+    else if(epub->conf.ate == 5){
         esp_resp_test(filename,epub);
     }        
 #endif
-    else if(sif_get_ate_config() == 6){
+    else if(epub->conf.ate == 6){
         esp_noisefloor_test(filename,epub);
     }
 }
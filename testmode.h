@@ -24,6 +24,7 @@ enum {
         TEST_CMD_ATE,
         TEST_CMD_SDIOTEST,
         TEST_CMD_SDIOSPEED,
+        TEST_CMD_BENCH,
         __TEST_CMD_MAX,
 };
 #define TEST_CMD_MAX (__TEST_CMD_MAX - 1)
@@ -69,6 +70,10 @@ u32 get_loopback_num(void);
 u32 get_loopback_id(void);
 void inc_loopback_id(void);
 
+struct sip_evt_loopback;
+struct esp_sip;
+bool esp_test_bench_loopback(struct esp_sip *sip, struct sip_evt_loopback *evt);
+
 void esp_test_ate_done_cb(char *ep);
 
 struct sdiotest_param {
@@ -79,6 +84,39 @@ struct sdiotest_param {
 	struct task_struct *thread;
 };
 
+#define BENCH_MAX_DEPTH   32
+#define BENCH_MAX_SAMPLES 4096
+
+/* loopback benchmark: sweep tx_len over [tx_min, tx_max] (x2 steps) and
+ * depth over [1, depth_max] (x2 steps); each trial runs duration_ms msec,
+ * or count transactions when duration_ms is 0 */
+struct bench_param {
+	atomic_t start;
+	u32 tx_min;
+	u32 tx_max;
+	u32 rx_len;
+	u32 depth_max;
+	u32 duration_ms;
+	u32 count;
+
+	/* current trial, protected by lock */
+	spinlock_t lock;
+	u32 tx_len;
+	u32 depth;
+	u32 next_id;
+	u32 done;
+	u32 lost;		/* ids taken whose send failed */
+	u32 errors;
+	bool draining;
+	ktime_t deadline;
+	ktime_t sent_at[BENCH_MAX_DEPTH];
+	u32 *lat_us;
+	u32 nlat;
+	struct completion trial_done;
+
+	struct task_struct *thread;
+};
+
 #endif //__TEST_MODE
 
 
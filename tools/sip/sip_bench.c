@@ -0,0 +1,207 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   frames/s and ns/frame of the driver's sip_rx_parse / sip_pack_data
+ *   over AMPDU depth and frame size
+ *
+ *   rx ampdu: one chain holding one aggregate of depth subframes
+ *   rx mpdu:  one chain holding depth single mpdu packets
+ *   tx pack:  depth ampdu frames packed into one tx aggregate
+ *
+ *   each rx round copies the chain into the skb first, the parser
+ *   rewrites the first sip_hdr, so that copy is in the numbers the same
+ *   way the sif read is in the driver's.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "sip_frames.h"
+
+#define BENCH_BUF_SZ    (64 * 1024)
+
+static const u32 depths[] = { 1, 2, 4, 8, 16, 32, 64 };
+static const u32 sizes[] = { 64, 256, 512, 1024, 1500 };
+
+static u64 now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct bench_case {
+        const char *name;
+        u32 depth;
+        u32 size;
+        u8 *chain;
+        u32 chain_len;
+};
+
+static void bench_report(const struct bench_case *bc, u64 frames, u64 ns)
+{
+        printf("%-9s %5u %5u %12.0f %9.1f\n", bc->name, bc->depth, bc->size,
+               frames * 1e9 / ns, (double)ns / frames);
+}
+
+static int bench_rx(struct bench_case *bc, u64 budget_ns)
+{
+        struct sip_rx_parser rxp;
+        struct sip_frames_sink sink;
+        struct sk_buff *skb;
+        struct sip_hdr *hdr = (struct sip_hdr *)bc->chain;
+        u32 first_seq = hdr->seq;
+        u32 pkts = 0, first_len;
+        u64 start, elapsed, rounds = 0;
+
+        /* seq of every packet in the chain is rewritten relative to rxseq */
+        first_len = hdr->h_credits >> 12;
+        pkts = SIP_HDR_IS_AMPDU(hdr) ? 1 : bc->chain_len / first_len;
+
+        skb = __dev_alloc_skb(bc->chain_len, GFP_ATOMIC);
+        if (skb == NULL)
+                return -1;
+        sip_frames_parser_init(&rxp, &sink, SIP_FRAMES_BLKSZ);
+        rxp.rxseq = first_seq;
+
+        start = now_ns();
+        do {
+                skb_reset(skb);
+                memcpy(skb_put(skb, bc->chain_len), bc->chain, bc->chain_len);
+                sip_rx_parse(&rxp, skb);
+                rxp.rxseq -= pkts;
+                rounds++;
+                elapsed = now_ns() - start;
+        } while (elapsed < budget_ns);
+
+        kfree_skb(skb);
+        if (sink.errors || sip_shim_esserts || sink.mpdus != rounds * bc->depth) {
+                fprintf(stderr, "%s depth %u size %u: %u errors, %lu esserts, %u/%llu frames\n",
+                        bc->name, bc->depth, bc->size, sink.errors, sip_shim_esserts,
+                        sink.mpdus, (unsigned long long)(rounds * bc->depth));
+                return -1;
+        }
+        bench_report(bc, rounds * bc->depth, elapsed);
+        return 0;
+}
+
+static int bench_rx_ampdu(u32 depth, u32 size, u64 budget_ns, u8 *buf)
+{
+        struct bench_case bc = { "rx ampdu", depth, size, buf, 0 };
+        u32 hlen = sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl);
+
+        if (depth > 0xff || size > SIP_FRAMES_SUBLEN_MAX ||
+            roundup(hlen + depth * roundup(size, 4), SIP_FRAMES_BLKSZ) +
+            depth * sizeof(struct esp_rx_ampdu_len) > 0xfffc)
+                return 1;
+
+        bc.chain_len = sip_frames_ampdu(buf, 0, SIP_FRAMES_BLKSZ, depth, size);
+        sip_frames_chain(buf, bc.chain_len, bc.chain_len);
+        return bench_rx(&bc, budget_ns);
+}
+
+static int bench_rx_mpdu(u32 depth, u32 size, u64 budget_ns, u8 *buf)
+{
+        struct bench_case bc = { "rx mpdu", depth, size, buf, 0 };
+        u32 hlen = sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl);
+        u32 i, len = 0;
+
+        if (depth * (hlen + roundup(size, 4)) > 0xfffc)
+                return 1;
+
+        for (i = 0; i < depth; i++)
+                len = sip_frames_mpdu(buf + i * len, i, size);
+        bc.chain_len = depth * len;
+        sip_frames_chain(buf, len, bc.chain_len);
+        return bench_rx(&bc, budget_ns);
+}
+
+static int bench_tx_pack(u32 depth, u32 size, u64 budget_ns, u8 *buf)
+{
+        struct bench_case bc = { "tx pack", depth, size, NULL, 0 };
+        u8 frame[1536];
+        u32 seq = 0, i;
+        u64 start, elapsed, rounds = 0;
+
+        if (size > sizeof(frame) ||
+            depth * roundup(sip_tx_data_offset(true) + size, SIP_FRAMES_BLKSZ) > BENCH_BUF_SZ)
+                return 1;
+
+        sip_frames_80211(frame, size, false, 0);
+        start = now_ns();
+        do {
+                u8 *wptr = buf;
+
+                for (i = 0; i < depth; i++) {
+                        struct sip_hdr *shdr = (struct sip_hdr *)wptr;
+
+                        shdr->fc[0] = 0;
+                        shdr->fc[1] = 0;
+                        SIP_HDR_SET_TYPE(shdr->fc[0], SIP_DATA_AMPDU);
+                        wptr += roundup(sip_pack_data(wptr, frame, size, seq++), SIP_FRAMES_BLKSZ);
+                }
+                rounds++;
+                elapsed = now_ns() - start;
+        } while (elapsed < budget_ns);
+
+        bench_report(&bc, rounds * depth, elapsed);
+        return 0;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-t ms per case] [-d depth] [-s size]\n", prog);
+        exit(2);
+}
+
+int main(int argc, char **argv)
+{
+        int (*const benches[])(u32, u32, u64, u8 *) = { bench_rx_ampdu, bench_rx_mpdu, bench_tx_pack };
+        u64 budget_ns = 200 * 1000000ull;
+        u32 only_depth = 0, only_size = 0;
+        u32 b, d, s;
+        int opt, ret = 0;
+        u8 *buf;
+
+        while ((opt = getopt(argc, argv, "t:d:s:")) != -1) {
+                switch (opt) {
+                case 't':
+                        budget_ns = strtoull(optarg, NULL, 0) * 1000000ull;
+                        break;
+                case 'd':
+                        only_depth = strtoul(optarg, NULL, 0);
+                        break;
+                case 's':
+                        only_size = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        buf = malloc(BENCH_BUF_SZ);
+        if (buf == NULL)
+                return 1;
+
+        printf("%-9s %5s %5s %12s %9s\n", "path", "depth", "size", "frames/s", "ns/frame");
+        for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+                for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+                        if (only_depth && depths[d] != only_depth)
+                                continue;
+                        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                                if (only_size && sizes[s] != only_size)
+                                        continue;
+                                if (benches[b](depths[d], sizes[s], budget_ns, buf) < 0)
+                                        ret = 1;
+                        }
+                }
+        }
+
+        free(buf);
+        return ret;
+}
@@ -0,0 +1,145 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   rx chains and tx frames laid out the way the target does
+ */
+
+#include "sip_frames.h"
+
+unsigned long sip_shim_esserts;
+
+void sip_shim_skb_over(struct sk_buff *skb, const char *op, u32 len)
+{
+        fprintf(stderr, "skb_%s %u over: head %p data %p len %u end %p\n", op, len,
+                (void *)skb->head, (void *)skb->data, skb->len, (void *)skb->end);
+        abort();
+}
+
+static void sink_credits(void *priv, u16 credits)
+{
+}
+
+static int sink_event(void *priv, u8 *buf)
+{
+        ((struct sip_frames_sink *)priv)->events++;
+        return 0;
+}
+
+static bool sink_mpdu(void *priv, struct sk_buff *rskb, struct esp_mac_rx_ctrl *mac_ctrl, bool sendup)
+{
+        struct sip_frames_sink *sink = priv;
+
+        sink->mpdus++;
+        sink->bytes += rskb->len;
+        if (sendup)
+                sink->sendup++;
+        kfree_skb(rskb);
+        return sendup;
+}
+
+static void sink_error(void *priv)
+{
+        ((struct sip_frames_sink *)priv)->errors++;
+}
+
+static const struct sip_rx_ops sink_ops = {
+        .credits = sink_credits,
+        .event = sink_event,
+        .mpdu = sink_mpdu,
+        .error = sink_error,
+};
+
+void sip_frames_parser_init(struct sip_rx_parser *rxp, struct sip_frames_sink *sink, u16 rx_blksz)
+{
+        memset(rxp, 0, sizeof(*rxp));
+        memset(sink, 0, sizeof(*sink));
+        rxp->ops = &sink_ops;
+        rxp->priv = sink;
+        rxp->rx_blksz = rx_blksz;
+        /* room for the wmm element the driver may append */
+        rxp->rx_tailroom = 28;
+}
+
+void sip_frames_80211(u8 *buf, u32 len, bool protected, u32 salt)
+{
+        struct ieee80211_hdr *wh = (struct ieee80211_hdr *)buf;
+        u32 i;
+
+        for (i = 0; i < len; i++)
+                buf[i] = (u8)(i * 31 + salt);
+        if (len < sizeof(*wh))
+                return;
+        wh->frame_control = 0x0088;     /* qos data */
+        if (protected)
+                wh->frame_control |= IEEE80211_FCTL_PROTECTED;
+}
+
+static struct esp_mac_rx_ctrl *sip_frames_hdr(u8 *buf, u8 type, u32 seq)
+{
+        struct sip_hdr *hdr = (struct sip_hdr *)buf;
+        struct esp_mac_rx_ctrl *mac_ctrl = (struct esp_mac_rx_ctrl *)(hdr + 1);
+
+        memset(hdr, 0, sizeof(*hdr) + sizeof(*mac_ctrl));
+        SIP_HDR_SET_TYPE(hdr->fc[0], type);
+        hdr->seq = seq;
+        mac_ctrl->rssi = 40;
+        mac_ctrl->sig_mode = 1;
+        mac_ctrl->MCS = 7;
+        mac_ctrl->channel = 6;
+        mac_ctrl->noise_floor = -96;
+
+        return mac_ctrl;
+}
+
+u32 sip_frames_mpdu(u8 *buf, u32 seq, u32 size)
+{
+        struct esp_mac_rx_ctrl *mac_ctrl = sip_frames_hdr(buf, SIP_DATA, seq);
+        u32 hlen = sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl);
+
+        mac_ctrl->HT_length = size + FCS_LEN;
+        sip_frames_80211(buf + hlen, roundup(size, 4), false, seq);
+        ((struct sip_hdr *)buf)->len = hlen + roundup(size, 4);
+
+        return ((struct sip_hdr *)buf)->len;
+}
+
+u32 sip_frames_ampdu(u8 *buf, u32 seq, u32 blksz, u32 depth, u32 size)
+{
+        struct esp_mac_rx_ctrl *mac_ctrl = sip_frames_hdr(buf, SIP_DATA_AMPDU, seq);
+        struct esp_rx_ampdu_len *ampdu_len;
+        u32 body, i;
+        u8 *p;
+
+        mac_ctrl->Aggregation = 1;
+        mac_ctrl->ampdu_cnt = depth;
+
+        p = buf + sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl);
+        for (i = 0; i < depth; i++) {
+                sip_frames_80211(p, size, false, seq + i);
+                memset(p + size, 0, roundup(size, 4) - size);
+                p += roundup(size, 4);
+        }
+
+        body = roundup(p - buf, blksz);
+        memset(p, 0, buf + body - p);
+        ampdu_len = (struct esp_rx_ampdu_len *)(buf + body);
+        for (i = 0; i < depth; i++) {
+                memset(&ampdu_len[i], 0, sizeof(*ampdu_len));
+                ampdu_len[i].sublen = size + FCS_LEN;
+        }
+        ((struct sip_hdr *)buf)->len = body + depth * sizeof(struct esp_rx_ampdu_len);
+
+        return ((struct sip_hdr *)buf)->len;
+}
+
+void sip_frames_chain(u8 *buf, u32 first_len, u32 total_len)
+{
+        struct sip_hdr *hdr = (struct sip_hdr *)buf;
+
+        hdr->len = total_len;
+        hdr->h_credits = first_len << 12;
+}
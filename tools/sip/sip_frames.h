@@ -0,0 +1,47 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   rx chains and tx frames laid out the way the target does,
+ *   for sip_bench and the fuzz seeds
+ */
+
+#ifndef _SIP_FRAMES_H_
+#define _SIP_FRAMES_H_
+
+#include "sip_shim.h"
+#include "sip_parse.h"
+
+#define SIP_FRAMES_BLKSZ        512
+#define SIP_FRAMES_SUBLEN_MAX   (0xfff - FCS_LEN)
+
+/* parser with no-op hooks that free every frame, counts what it saw */
+struct sip_frames_sink {
+        u32 events;
+        u32 mpdus;
+        u32 sendup;
+        u32 errors;
+        u64 bytes;
+};
+
+void sip_frames_parser_init(struct sip_rx_parser *rxp, struct sip_frames_sink *sink, u16 rx_blksz);
+
+/* a qos data frame of len bytes, protected sets the wep bit */
+void sip_frames_80211(u8 *buf, u32 len, bool protected, u32 salt);
+
+/* | sip_hdr | mac_rx_ctrl | frame padded to 4 |, returns hdr->len */
+u32 sip_frames_mpdu(u8 *buf, u32 seq, u32 size);
+
+/*
+ * | sip_hdr | mac_rx_ctrl | subframes padded to 4 | pad to blksz | esp_rx_ampdu_len x depth |
+ * returns hdr->len
+ */
+u32 sip_frames_ampdu(u8 *buf, u32 seq, u32 blksz, u32 depth, u32 size);
+
+/* fold the chain length and the first packet's length into the first sip_hdr */
+void sip_frames_chain(u8 *buf, u32 first_len, u32 total_len);
+
+#endif /* _SIP_FRAMES_H_ */
@@ -0,0 +1,59 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   what each fuzz target gives sip_fuzz_main.c besides
+ *   LLVMFuzzerTestOneInput
+ */
+
+#ifndef _SIP_FUZZ_H_
+#define _SIP_FUZZ_H_
+
+#include "sip_frames.h"
+
+#define SIP_FUZZ_MAX_INPUT      (64 * 1024)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* a well formed input to mutate from, returns its length */
+size_t sip_fuzz_seed(u8 *buf, size_t cap, u32 rnd);
+
+/*
+ * first input byte: parser options
+ * [1:0] rx_blksz 64 << n, [2] dump_rpbm_err, [3] sendup_rpbm_pkt,
+ * [4] rxabort_fixed, [5] off
+ */
+static inline void sip_fuzz_config(struct sip_rx_parser *rxp, u8 cfg)
+{
+        rxp->rx_blksz = 64 << (cfg & 3);
+        rxp->dump_rpbm_err = !!(cfg & BIT(2));
+        rxp->sendup_rpbm_pkt = !!(cfg & BIT(3));
+        rxp->rxabort_fixed = !!(cfg & BIT(4));
+        rxp->off = !!(cfg & BIT(5));
+}
+
+/* run one chain through a fresh parser, the skb is sized to the chain */
+static inline void sip_fuzz_parse(u8 cfg, const u8 *chain, size_t len)
+{
+        struct sip_rx_parser rxp;
+        struct sip_frames_sink sink;
+        struct sk_buff *skb;
+
+        skb = __dev_alloc_skb(len, GFP_ATOMIC);
+        if (skb == NULL)
+                return;
+        memcpy(skb_put(skb, len), chain, len);
+
+        sip_frames_parser_init(&rxp, &sink, 0);
+        sip_fuzz_config(&rxp, cfg);
+        if (len >= sizeof(struct sip_hdr))
+                rxp.rxseq = ((struct sip_hdr *)chain)->seq;
+
+        sip_rx_parse(&rxp, skb);
+        kfree_skb(skb);
+}
+
+#endif /* _SIP_FUZZ_H_ */
@@ -0,0 +1,154 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   fuzz the AMPDU subframe walk of sip_rx_parse
+ *
+ *   the input describes the trailers, the aggregate is laid out from
+ *   them so most inputs get past the length checks and into the
+ *   substate handling and the rx abort repair:
+ *
+ *   | config | depth | n x (substate, sublen lo, sublen hi:4 slack:4) | payload |
+ *
+ *   substate < 8 picks a known state, otherwise it is used as is.
+ *   slack moves where the next subframe starts by -32..28 bytes.
+ *   a good single-frame aggregate goes first so the repair has a head.
+ */
+
+#include "sip_fuzz.h"
+
+static const u8 substates[] = {
+        0, RX_ABORT, RX_RPBM_ERR, RX_TKIPMIC_ERR, RX_CCMPMIC_ERR,
+        RX_FCS_ERR, RX_SECOV_ERR, RX_AMPDUSF_ERR,
+};
+
+struct fuzz_sub {
+        u8 substate;
+        u32 sublen;
+        int slack;
+};
+
+static bool fuzz_occupies(const struct sip_rx_parser *rxp, u8 substate)
+{
+        return substate == 0 || esp_wmac_rxsec_error(substate) ||
+               (rxp->dump_rpbm_err && substate == RX_RPBM_ERR);
+}
+
+/* copy from the payload stream, wrapping around, zeros if there is none */
+static void fuzz_fill(u8 *dst, u32 len, const u8 *payload, size_t plen, size_t *pos)
+{
+        u32 i;
+
+        if (plen == 0) {
+                memset(dst, 0, len);
+                return;
+        }
+        for (i = 0; i < len; i++) {
+                dst[i] = payload[*pos];
+                *pos = (*pos + 1) % plen;
+        }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+        static u8 chain[2 * SIP_FUZZ_MAX_INPUT];
+        struct fuzz_sub subs[256];
+        struct sip_rx_parser cfg;
+        struct sip_frames_sink sink;
+        struct esp_mac_rx_ctrl *mac_ctrl;
+        struct esp_rx_ampdu_len *ampdu_len;
+        struct sip_hdr *hdr;
+        const u8 *payload;
+        size_t plen, pos = 0;
+        u32 depth, first, body, off, i;
+
+        if (size < 2 || size > SIP_FUZZ_MAX_INPUT)
+                return 0;
+
+        sip_frames_parser_init(&cfg, &sink, 0);
+        sip_fuzz_config(&cfg, data[0]);
+        depth = data[1];
+        if (size < 2 + depth * 3)
+                return 0;
+
+        for (i = 0; i < depth; i++) {
+                const u8 *d = data + 2 + i * 3;
+
+                subs[i].substate = d[0] < sizeof(substates) ? substates[d[0]] : d[0];
+                subs[i].sublen = d[1] | (d[2] & 0xf) << 8;
+                subs[i].slack = ((int)(d[2] >> 4) - 8) * 4;
+        }
+        payload = data + 2 + depth * 3;
+        plen = size - 2 - depth * 3;
+
+        /* the good aggregate in front */
+        first = sip_frames_ampdu(chain, 0, cfg.rx_blksz, 1, 64);
+        fuzz_fill(chain + sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl), 64, payload, plen, &pos);
+
+        /* the fuzzed one */
+        hdr = (struct sip_hdr *)(chain + first);
+        memset(hdr, 0, sizeof(*hdr) + sizeof(*mac_ctrl));
+        SIP_HDR_SET_TYPE(hdr->fc[0], SIP_DATA_AMPDU);
+        hdr->seq = 1;
+        mac_ctrl = (struct esp_mac_rx_ctrl *)(hdr + 1);
+        mac_ctrl->Aggregation = 1;
+        mac_ctrl->ampdu_cnt = depth;
+
+        off = sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl);
+        for (i = 0; i < depth; i++) {
+                u32 len;
+
+                if (!fuzz_occupies(&cfg, subs[i].substate))
+                        continue;
+                len = subs[i].sublen > FCS_LEN ? roundup(subs[i].sublen - FCS_LEN, 4) : 0;
+                if ((int)(off + len) + subs[i].slack < (int)off)
+                        len = 0;
+                else
+                        len += subs[i].slack;
+                if (first + off + len > SIP_FUZZ_MAX_INPUT)
+                        return 0;
+                fuzz_fill((u8 *)hdr + off, len, payload, plen, &pos);
+                off += len;
+        }
+
+        body = roundup(off, cfg.rx_blksz);
+        if (first + body + depth * sizeof(*ampdu_len) > 0xfffc)
+                return 0;
+        memset((u8 *)hdr + off, 0, body - off);
+        ampdu_len = (struct esp_rx_ampdu_len *)((u8 *)hdr + body);
+        for (i = 0; i < depth; i++) {
+                memset(&ampdu_len[i], 0, sizeof(*ampdu_len));
+                ampdu_len[i].substate = subs[i].substate;
+                ampdu_len[i].sublen = subs[i].sublen;
+        }
+        hdr->len = body + depth * sizeof(*ampdu_len);
+
+        sip_frames_chain(chain, first, first + hdr->len);
+        sip_fuzz_parse(data[0], chain, first + hdr->len);
+        return 0;
+}
+
+/* the frames of the good aggregate again, one aborted in between */
+size_t sip_fuzz_seed(u8 *buf, size_t cap, u32 rnd)
+{
+        u32 depth = 2 + rnd % 6;
+        u32 sublen = 64 + FCS_LEN;
+        u8 *p = buf;
+        u32 i;
+
+        if (cap < 2 + depth * 3 + 64)
+                return 0;
+
+        *p++ = (rnd >> 8) & 0x1f;
+        *p++ = depth;
+        for (i = 0; i < depth; i++) {
+                *p++ = i == 1 ? 1 : 0;
+                *p++ = sublen & 0xff;
+                *p++ = sublen >> 8 | 8 << 4;
+        }
+        sip_frames_80211(p, 64, false, 0);
+        return p + 64 - buf;
+}
@@ -0,0 +1,54 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   fuzz sip_rx_parse with a raw rx chain
+ *
+ *   input: | config byte | chain as read off the bus |
+ */
+
+#include "sip_fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+        if (size < 1 || size > SIP_FUZZ_MAX_INPUT)
+                return 0;
+
+        sip_fuzz_parse(data[0], data + 1, size - 1);
+        return 0;
+}
+
+/* an event, an mpdu and an aggregate in one chain */
+size_t sip_fuzz_seed(u8 *buf, size_t cap, u32 rnd)
+{
+        static u32 chain[SIP_FUZZ_MAX_INPUT / 4];
+        u32 blksz = 64 << (rnd & 3);
+        u32 depth = 1 + (rnd >> 2) % 16;
+        u32 size = 24 + (rnd >> 6) % 200;
+        u8 *start = (u8 *)chain, *p = start;
+        struct sip_hdr *hdr;
+        u32 first;
+
+        if (cap < 1 + 64 + 4096 + depth * (roundup(size, 4) + 4) + blksz)
+                return 0;
+
+        /* built aligned, the input carries it one byte in */
+        hdr = (struct sip_hdr *)p;
+        memset(hdr, 0, 64);
+        SIP_HDR_SET_TYPE(hdr->fc[0], SIP_CTRL);
+        hdr->c_evtid = SIP_EVT_CREDIT_RPT;
+        hdr->len = first = 64;
+        hdr->seq = 0;
+        p += first;
+
+        p += sip_frames_mpdu(p, 1, size);
+        p += sip_frames_ampdu(p, 2, blksz, depth, size);
+        sip_frames_chain(start, first, p - start);
+
+        buf[0] = rnd & 0x1f;
+        memcpy(buf + 1, start, p - start);
+        return 1 + (p - start);
+}
@@ -0,0 +1,169 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   standalone driver for the fuzz targets when libFuzzer is not around
+ *
+ *   sip_fuzz_X file...   run each file once, e.g. a crash to reproduce
+ *   sip_fuzz_X -r N [-S seed]
+ *                        N inputs from sip_fuzz_seed() with random byte
+ *                        flips, inserts and truncation
+ *
+ * the input of a run that dies is left in ./crash-input
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifndef __has_feature
+#define __has_feature(x) 0
+#endif
+#if defined(__SANITIZE_ADDRESS__) || __has_feature(address_sanitizer)
+#include <sanitizer/common_interface_defs.h>
+#define SIP_FUZZ_ASAN
+#endif
+
+#include "sip_fuzz.h"
+
+#define CRASH_FILE      "crash-input"
+
+static u32 rnd_state;
+static const u8 *cur_input;
+static size_t cur_len;
+
+/* leave the input that brought us down behind for a file run */
+static void dump_input(void)
+{
+        int fd = open(CRASH_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0)
+                return;
+        if (write(fd, cur_input, cur_len) < 0)
+                ;
+        close(fd);
+}
+
+static void on_abort(int sig)
+{
+        dump_input();
+        signal(sig, SIG_DFL);
+        raise(sig);
+}
+
+static u32 rnd(void)
+{
+        /* xorshift32 */
+        rnd_state ^= rnd_state << 13;
+        rnd_state ^= rnd_state >> 17;
+        rnd_state ^= rnd_state << 5;
+        return rnd_state;
+}
+
+static size_t mutate(u8 *buf, size_t len, size_t cap)
+{
+        u32 n = 1 + rnd() % 8;
+
+        while (n-- && len) {
+                size_t at = rnd() % len;
+
+                switch (rnd() % 6) {
+                case 0:
+                        buf[at] ^= 1 << (rnd() % 8);
+                        break;
+                case 1:
+                        buf[at] = rnd();
+                        break;
+                case 2:
+                        /* lengths and counts live in little endian u16/u32 */
+                        buf[at] += (int)(rnd() % 9) - 4;
+                        break;
+                case 3:
+                        if (len < cap) {
+                                memmove(buf + at + 1, buf + at, len - at);
+                                buf[at] = rnd();
+                                len++;
+                        }
+                        break;
+                case 4:
+                        memmove(buf + at, buf + at + 1, len - at - 1);
+                        len--;
+                        break;
+                default:
+                        len = at + 1;
+                        break;
+                }
+        }
+
+        return len;
+}
+
+static int run_file(const char *path, u8 *buf)
+{
+        FILE *f = fopen(path, "rb");
+        size_t len;
+
+        if (f == NULL) {
+                perror(path);
+                return 1;
+        }
+        len = fread(buf, 1, SIP_FUZZ_MAX_INPUT, f);
+        fclose(f);
+        cur_len = len;
+        LLVMFuzzerTestOneInput(buf, len);
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        unsigned long runs = 0, i;
+        int opt, ret = 0;
+        u8 *buf;
+
+        rnd_state = 0x5eed;
+        while ((opt = getopt(argc, argv, "r:S:")) != -1) {
+                switch (opt) {
+                case 'r':
+                        runs = strtoul(optarg, NULL, 0);
+                        break;
+                case 'S':
+                        rnd_state = strtoul(optarg, NULL, 0);
+                        if (rnd_state == 0)
+                                rnd_state = 1;
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-r runs] [-S seed] [file...]\n", argv[0]);
+                        return 2;
+                }
+        }
+
+        buf = malloc(SIP_FUZZ_MAX_INPUT);
+        if (buf == NULL)
+                return 1;
+        cur_input = buf;
+#ifdef SIP_FUZZ_ASAN
+        __sanitizer_set_death_callback(dump_input);
+#endif
+        signal(SIGABRT, on_abort);
+        signal(SIGSEGV, on_abort);
+
+        for (; optind < argc; optind++)
+                ret |= run_file(argv[optind], buf);
+
+        for (i = 0; i < runs; i++) {
+                size_t len = sip_fuzz_seed(buf, SIP_FUZZ_MAX_INPUT, rnd());
+
+                if (i % 8)
+                        len = mutate(buf, len, SIP_FUZZ_MAX_INPUT);
+                cur_len = len;
+                LLVMFuzzerTestOneInput(buf, len);
+        }
+        if (runs)
+                printf("%s: %lu runs, %lu esserts\n", argv[0], runs, sip_shim_esserts);
+
+        free(buf);
+        return ret;
+}
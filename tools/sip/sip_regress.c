@@ -0,0 +1,152 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   fixed inputs for parser bugs the fuzzers cannot see, they do not
+ *   crash, they only deliver the wrong frames
+ *
+ *   sip_regress          run every case, exit 1 if one fails
+ */
+
+#include "sip_frames.h"
+
+#define REGRESS_BLKSZ   512
+#define REGRESS_SIZE    64
+
+/* keeps the frames sent up so a case can look at them */
+struct regress_sink {
+        u32 mpdus;
+        u32 sendup;
+        u32 errors;
+        u8 last[REGRESS_SIZE];
+        u32 last_len;
+};
+
+static void regress_credits(void *priv, u16 credits)
+{
+}
+
+static int regress_event(void *priv, u8 *buf)
+{
+        return 0;
+}
+
+static bool regress_mpdu(void *priv, struct sk_buff *rskb, struct esp_mac_rx_ctrl *mac_ctrl, bool sendup)
+{
+        struct regress_sink *sink = priv;
+
+        sink->mpdus++;
+        if (sendup) {
+                sink->sendup++;
+                sink->last_len = rskb->len < REGRESS_SIZE ? rskb->len : REGRESS_SIZE;
+                memcpy(sink->last, rskb->data, sink->last_len);
+        }
+        kfree_skb(rskb);
+        return sendup;
+}
+
+static void regress_error(void *priv)
+{
+        ((struct regress_sink *)priv)->errors++;
+}
+
+static const struct sip_rx_ops regress_ops = {
+        .credits = regress_credits,
+        .event = regress_event,
+        .mpdu = regress_mpdu,
+        .error = regress_error,
+};
+
+static void regress_init(struct sip_rx_parser *rxp, struct regress_sink *sink)
+{
+        memset(rxp, 0, sizeof(*rxp));
+        memset(sink, 0, sizeof(*sink));
+        rxp->ops = &regress_ops;
+        rxp->priv = sink;
+        rxp->rx_blksz = REGRESS_BLKSZ;
+}
+
+static void regress_parse(struct sip_rx_parser *rxp, u8 *chain, u32 len)
+{
+        struct sk_buff *skb = __dev_alloc_skb(len, GFP_ATOMIC);
+
+        if (skb == NULL)
+                abort();
+        sip_frames_chain(chain, len, len);
+        memcpy(skb_put(skb, len), chain, len);
+        sip_rx_parse(rxp, skb);
+        kfree_skb(skb);
+}
+
+/*
+ * rx abort repair, the "11 bytes lost" case: the subframe after an
+ * aborted one arrives without its first 11 bytes. The parser has to
+ * match the rest against the head kept from the last good frame, put
+ * the 11 bytes back and send the frame up. The match used memcpy
+ * instead of memcmp, so it never hit and overwrote the kept head.
+ */
+static int regress_rxabort_repair11(void)
+{
+        static u8 chain[2 * REGRESS_BLKSZ];
+        struct sip_rx_parser rxp;
+        struct regress_sink sink;
+        struct esp_mac_rx_ctrl *mac_ctrl;
+        struct esp_rx_ampdu_len *ampdu_len;
+        struct sip_hdr *hdr;
+        u8 frame[REGRESS_SIZE], head[sizeof(rxp.frame_head)];
+        u32 hlen = sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl);
+        u32 len;
+
+        regress_init(&rxp, &sink);
+        sip_frames_80211(frame, REGRESS_SIZE, false, 0);
+
+        /* a good aggregate, its frame head is kept */
+        len = sip_frames_ampdu(chain, 0, REGRESS_BLKSZ, 1, REGRESS_SIZE);
+        regress_parse(&rxp, chain, len);
+        memcpy(head, rxp.frame_head, sizeof(head));
+
+        /* | aborted, no buffer | the same frame less its first 11 bytes | */
+        hdr = (struct sip_hdr *)chain;
+        memset(chain, 0, sizeof(chain));
+        SIP_HDR_SET_TYPE(hdr->fc[0], SIP_DATA_AMPDU);
+        hdr->seq = 1;
+        mac_ctrl = (struct esp_mac_rx_ctrl *)(hdr + 1);
+        mac_ctrl->Aggregation = 1;
+        mac_ctrl->ampdu_cnt = 2;
+        memcpy(chain + hlen, frame + 11, REGRESS_SIZE - 11);
+        ampdu_len = (struct esp_rx_ampdu_len *)(chain + REGRESS_BLKSZ);
+        ampdu_len[0].substate = RX_ABORT;
+        ampdu_len[1].sublen = REGRESS_SIZE + FCS_LEN;
+        hdr->len = REGRESS_BLKSZ + 2 * sizeof(*ampdu_len);
+        regress_parse(&rxp, chain, hdr->len);
+
+        if (sink.errors || sip_shim_esserts) {
+                fprintf(stderr, "%s: %u errors, %lu esserts\n", __func__, sink.errors, sip_shim_esserts);
+                return -1;
+        }
+        if (memcmp(rxp.frame_head, head, sizeof(head))) {
+                fprintf(stderr, "%s: kept frame head was overwritten\n", __func__);
+                return -1;
+        }
+        if (sink.sendup != 2 || sink.last_len < 16 || memcmp(sink.last, frame, 16)) {
+                fprintf(stderr, "%s: repaired frame not sent up (%u of 2)\n", __func__, sink.sendup);
+                return -1;
+        }
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int (*const cases[])(void) = { regress_rxabort_repair11 };
+        u32 i, failed = 0;
+
+        for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+                if (cases[i]())
+                        failed++;
+
+        printf("%s: %u cases, %u failed\n", argv[0], i, failed);
+        return failed ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   User space stand-ins for the bits of the kernel sip_parse.c uses:
+ *   the u8/u16/u32 types, a flat sk_buff with head/data/tail/end and
+ *   the put/pull/push that check their bounds, ieee80211_hdr, and
+ *   esp_dbg/ESSERT/show_buf.
+ */
+
+#ifndef _SIP_SHIM_H_
+#define _SIP_SHIM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef uint16_t __le16;
+typedef uint32_t __le32;
+
+#define __packed __attribute__((packed))
+
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+
+#define roundup(x, y)   ((((x) + ((y) - 1)) / (y)) * (y))
+#define BIT(nr)         (1UL << (nr))
+
+#define ETH_ALEN        6
+#define GFP_ATOMIC      0
+#define NET_SKB_PAD     32
+
+/* the walk has to fail soft, an assert only counts */
+extern unsigned long sip_shim_esserts;
+
+#define ESSERT(v) do { if (!(v)) sip_shim_esserts++; } while (0)
+
+/* -DSIP_SHIM_VERBOSE to see the walk's trace */
+#ifdef SIP_SHIM_VERBOSE
+#define SIP_SHIM_LOG 1
+#else
+#define SIP_SHIM_LOG 0
+#endif
+
+#define esp_dbg(mask, fmt, args...) do {                  \
+        if (SIP_SHIM_LOG)                                 \
+                printf(fmt, ##args);                      \
+    } while (0)
+
+enum {
+        ESP_DBG_ERROR = BIT(0),
+        ESP_DBG_TRACE = BIT(1),
+        ESP_DBG_LOG = BIT(2),
+        ESP_DBG = BIT(3),
+};
+
+static inline void show_buf(u8 *buf, u32 len)
+{
+}
+
+struct sk_buff {
+        u8 *head;
+        u8 *data;
+        u8 *tail;
+        u8 *end;
+        u32 len;
+};
+
+void sip_shim_skb_over(struct sk_buff *skb, const char *op, u32 len);
+
+static inline u8 *skb_put(struct sk_buff *skb, u32 len)
+{
+        u8 *tmp = skb->tail;
+
+        if (skb->tail + len > skb->end)
+                sip_shim_skb_over(skb, "put", len);
+        skb->tail += len;
+        skb->len += len;
+        return tmp;
+}
+
+static inline u8 *skb_pull(struct sk_buff *skb, u32 len)
+{
+        if (len > skb->len)
+                sip_shim_skb_over(skb, "pull", len);
+        skb->len -= len;
+        return skb->data += len;
+}
+
+static inline u8 *skb_push(struct sk_buff *skb, u32 len)
+{
+        if (skb->data - len < skb->head)
+                sip_shim_skb_over(skb, "push", len);
+        skb->data -= len;
+        skb->len += len;
+        return skb->data;
+}
+
+static inline void skb_reset(struct sk_buff *skb)
+{
+        skb->data = skb->tail = skb->head + NET_SKB_PAD;
+        skb->len = 0;
+}
+
+/* one allocation, headroom of NET_SKB_PAD like the kernel's */
+static inline struct sk_buff *__dev_alloc_skb(unsigned int length, int gfp_mask)
+{
+        struct sk_buff *skb = malloc(sizeof(*skb) + NET_SKB_PAD + length);
+
+        if (skb == NULL)
+                return NULL;
+        skb->head = (u8 *)(skb + 1);
+        skb->end = skb->head + NET_SKB_PAD + length;
+        skb_reset(skb);
+        return skb;
+}
+
+static inline void kfree_skb(struct sk_buff *skb)
+{
+        free(skb);
+}
+
+#define IEEE80211_FCTL_PROTECTED        0x4000
+
+struct ieee80211_hdr {
+        __le16 frame_control;
+        __le16 duration_id;
+        u8 addr1[ETH_ALEN];
+        u8 addr2[ETH_ALEN];
+        u8 addr3[ETH_ALEN];
+        __le16 seq_ctrl;
+} __packed;
+
+static inline bool ieee80211_has_protected(__le16 fc)
+{
+        return !!(fc & IEEE80211_FCTL_PROTECTED);
+}
+
+#endif /* _SIP_SHIM_H_ */
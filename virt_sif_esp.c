@@ -0,0 +1,1069 @@
+/* Copyright (c) 2008 -2014 Espressif System.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ *
+ *   virtual serial i/f driver
+ *    - emulated target behind the SLC registers and window
+ *    - lets the sip/mac80211 layers run without an eagle attached
+ *
+ */
+#ifdef ESP_USE_VIRT
+
+#include <linux/module.h>
+#include <net/mac80211.h>
+#include <linux/platform_device.h>
+#include <linux/workqueue.h>
+#include <asm/unaligned.h>
+
+#include "esp_pub.h"
+#include "esp_sif.h"
+#include "esp_sip.h"
+#include "esp_debug.h"
+#include "slc_host_register.h"
+#include "esp_version.h"
+#include "esp_ctrl.h"
+#include "esp_file.h"
+#include "esp_wmac.h"
+#include "sip_parse.h"
+#ifdef USE_EXT_GPIO
+#include "esp_ext.h"
+#endif /* USE_EXT_GPIO */
+
+#define ESP_DMA_IBUFSZ   2048
+
+//unsigned int esp_msg_level = 0;
+unsigned int esp_msg_level = ESP_DBG_ERROR | ESP_SHOW;
+
+
+#ifdef ESP_ANDROID_LOGGER
+bool log_off = false;
+#endif /* ESP_ANDROID_LOGGER */
+
+static int virt_devices = 1;
+module_param(virt_devices, int, 0444);
+MODULE_PARM_DESC(virt_devices, "number of emulated eagle targets");
+
+/* 0: no rx, 1: reflect tx data as mpdu, 2: reflect as ampdu aggregate */
+static int virt_reflect = 0;
+module_param(virt_reflect, int, 0644);
+MODULE_PARM_DESC(virt_reflect, "reflect tx data back as rx (0 off, 1 mpdu, 2 ampdu)");
+
+#define VIRT_MAX_DEVICES	4
+#define VIRT_REGS_SIZE		0x80
+#define VIRT_WIN_REGS		32
+#define VIRT_TX_CREDITS		32
+#define VIRT_BLK_SIZE		512
+#define VIRT_TARGET_ID		0x600
+#define VIRT_MAX_REPORT		32
+#define VIRT_MAX_AMPDU		8
+#define VIRT_NOISE_FLOOR	(-96)
+
+/*
+ * target side state, owned by the ctrl so it survives the re-probe
+ * between the two boot stages like a powered chip would
+ */
+struct esp_virt_target {
+	struct mutex lock;
+	struct sk_buff_head to_host;
+	u8 regs[VIRT_REGS_SIZE];
+	u32 win_regs[VIRT_WIN_REGS];
+	u8 to_host_seq;
+	u32 txseq;
+	u32 credits;		/* recycled, not yet reported */
+	bool credit_abs;	/* next report is absolute (recalc) */
+	u32 credit_abs_free;	/* free blocks as of the recalc cmd */
+	u32 credit_abs_covers;	/* recycled up to the recalc cmd */
+	bool booted;		/* ram code up, credits in use */
+	int bootups;
+	u8 channel;
+	u8 mac_addr[ETH_ALEN];
+
+	u32 tx_report[VIRT_MAX_REPORT];
+	int tx_report_cnt;
+	struct sk_buff_head ampdu;	/* reflected frames to aggregate */
+
+	u32 stat_tx_pkts;
+	u32 stat_rx_pkts;
+};
+
+void sif_platform_rescan_card(unsigned insert)
+{
+}
+
+void sif_platform_reset_target(void)
+{
+}
+
+void sif_platform_target_poweroff(void)
+{
+}
+
+void sif_platform_target_poweron(void)
+{
+}
+
+void sif_platform_target_speed(int high_speed)
+{
+}
+
+#ifdef ESP_ACK_INTERRUPT
+void sif_platform_ack_interrupt(struct esp_pub *epub)
+{
+}
+#endif //ESP_ACK_INTERRUPT
+
+void sif_lock_bus(struct esp_pub *epub)
+{
+        EPUB_FUNC_CHECK(epub, _exit);
+
+        mutex_lock(&EPUB_TO_CTRL(epub)->bus_mtx);
+_exit:
+	return;
+}
+
+void sif_unlock_bus(struct esp_pub *epub)
+{
+        EPUB_FUNC_CHECK(epub, _exit);
+
+        mutex_unlock(&EPUB_TO_CTRL(epub)->bus_mtx);
+_exit:
+	return;
+}
+
+/*
+ *  emulated target
+ */
+
+static struct sk_buff *virt_alloc_pkt(u8 type, u8 evtid, u32 len)
+{
+	struct sk_buff *skb;
+	struct sip_hdr *hdr;
+
+	skb = alloc_skb(len, GFP_KERNEL);
+	if (skb == NULL) {
+		esp_dbg(ESP_DBG_ERROR, "%s no mem for %u bytes\n", __func__, len);
+		return NULL;
+	}
+	memset(skb_put(skb, len), 0, len);
+
+	hdr = (struct sip_hdr *)skb->data;
+	SIP_HDR_SET_TYPE(hdr->fc[0], type);
+	if (type == SIP_CTRL)
+		hdr->c_evtid = evtid;
+	hdr->len = len;
+
+	return skb;
+}
+
+static void virt_queue_pkt(struct esp_virt_target *vt, struct sk_buff *skb)
+{
+	struct sip_hdr *hdr = (struct sip_hdr *)skb->data;
+
+	hdr->seq = vt->txseq++;
+	skb_queue_tail(&vt->to_host, skb);
+}
+
+static void *virt_queue_evt(struct esp_virt_target *vt, u8 evtid, u32 evtlen)
+{
+	struct sk_buff *skb;
+
+	skb = virt_alloc_pkt(SIP_CTRL, evtid, roundup(SIP_CTRL_HDR_LEN + evtlen, 4));
+	if (skb == NULL)
+		return NULL;
+
+	virt_queue_pkt(vt, skb);
+
+	return skb->data + SIP_CTRL_HDR_LEN;
+}
+
+static void virt_target_reset(struct esp_virt_target *vt)
+{
+	skb_queue_purge(&vt->to_host);
+	skb_queue_purge(&vt->ampdu);
+	vt->to_host_seq = 0;
+	vt->txseq = 0;
+	vt->credits = 0;
+	vt->credit_abs = false;
+	vt->credit_abs_covers = 0;
+	vt->booted = false;
+	vt->tx_report_cnt = 0;
+}
+
+static void virt_target_bootup(struct esp_virt_target *vt)
+{
+	/* a new image is running, seq counts restart with the host */
+	virt_target_reset(vt);
+
+	if (vt->bootups++ == 0) {
+		/* rom stage: ask the host to reset us into the second stage */
+		virt_queue_evt(vt, SIP_EVT_RESETTING, 0);
+		return;
+	}
+
+	vt->booted = true;
+	virt_queue_evt(vt, SIP_EVT_TARGET_ON, 0);
+	vt->credits = VIRT_TX_CREDITS;
+}
+
+static void virt_target_init(struct esp_virt_target *vt)
+{
+	struct sip_evt_bootup2 *bevt;
+
+	bevt = virt_queue_evt(vt, SIP_EVT_BOOTUP, sizeof(struct sip_evt_bootup2));
+	if (bevt == NULL)
+		return;
+
+	bevt->tx_blksz = VIRT_BLK_SIZE;
+	bevt->rx_blksz = VIRT_BLK_SIZE;
+	memcpy(bevt->mac_addr, vt->mac_addr, ETH_ALEN);
+	bevt->credit_to_reserve = 0;
+	bevt->options = SIP_RXABORT_FIXED;
+	bevt->noise_floor = VIRT_NOISE_FLOOR;
+	bevt->mac_type = 1;
+}
+
+static void virt_target_loopback(struct esp_virt_target *vt, struct sip_cmd_loopback *cmd)
+{
+	struct sip_evt_loopback *evt;
+
+	if (cmd->rxlen > SIP_TX_AGGR_BUF_SIZE)
+		return;
+
+	evt = virt_queue_evt(vt, SIP_EVT_LOOPBACK, sizeof(struct sip_evt_loopback) + cmd->rxlen);
+	if (evt == NULL)
+		return;
+
+	evt->txlen = cmd->txlen;
+	evt->rxlen = cmd->rxlen;
+	evt->pack_id = cmd->pack_id;
+	memset((u8 *)(evt + 1), 0xa5, cmd->rxlen);
+}
+
+static void virt_target_cmd(struct esp_virt_target *vt, struct sip_hdr *hdr)
+{
+	void *cmd = (u8 *)hdr + SIP_CTRL_HDR_LEN;
+
+	esp_dbg(ESP_DBG_TRACE, "%s cmd %u len %u seq %u\n", __func__, hdr->c_cmdid, hdr->len, hdr->seq);
+
+	switch (hdr->c_cmdid) {
+	case SIP_CMD_BOOTUP:
+		virt_target_bootup(vt);
+		break;
+	case SIP_CMD_INIT:
+		virt_target_init(vt);
+		break;
+	case SIP_CMD_LOOPBACK:
+		virt_target_loopback(vt, (struct sip_cmd_loopback *)cmd);
+		break;
+	case SIP_CMD_SCAN: {
+		struct sip_evt_scan_report *report;
+
+		report = virt_queue_evt(vt, SIP_EVT_SCAN_RESULT, sizeof(struct sip_evt_scan_report));
+		if (report)
+			report->aborted = 0;
+		break;
+	}
+	case SIP_CMD_CONFIG: {
+		struct sip_cmd_config *config = (struct sip_cmd_config *)cmd;
+
+		vt->channel = ieee80211_frequency_to_channel(config->center_freq) & 0xf;
+		break;
+	}
+	case SIP_CMD_RECALC_CREDIT:
+		/*
+		 * the answer is the free count as of this cmd: it covers what
+		 * was recycled so far, the cmd itself and every packet behind
+		 * it come back as increments. A later recalc answers for itself.
+		 */
+		vt->credit_abs = true;
+		vt->credit_abs_free = VIRT_TX_CREDITS - roundup(hdr->len, VIRT_BLK_SIZE) / VIRT_BLK_SIZE;
+		vt->credit_abs_covers = vt->credits;
+		break;
+	case SIP_CMD_WAKEUP: {
+		struct sip_evt_wakeup *wakeup;
+
+		wakeup = virt_queue_evt(vt, SIP_EVT_WAKEUP, sizeof(struct sip_evt_wakeup));
+		if (wakeup)
+			wakeup->check_data = ((struct sip_cmd_wakeup *)cmd)->check_data;
+		break;
+	}
+	default:
+		/* WRITE_MEMORY and the like need no reply */
+		break;
+	}
+}
+
+static struct esp_mac_rx_ctrl *virt_fill_rx_ctrl(struct esp_virt_target *vt, u8 *p)
+{
+	struct esp_mac_rx_ctrl *mac_ctrl = (struct esp_mac_rx_ctrl *)p;
+
+	mac_ctrl->rssi = 40;
+	mac_ctrl->sig_mode = 1;
+	mac_ctrl->MCS = 7;
+	mac_ctrl->channel = vt->channel;
+	mac_ctrl->noise_floor = VIRT_NOISE_FLOOR;
+
+	return mac_ctrl;
+}
+
+/* one mpdu: | sip_hdr | mac_rx_ctrl | frame padded to 4 | */
+static void virt_queue_mpdu(struct esp_virt_target *vt, struct sk_buff *frame)
+{
+	struct esp_mac_rx_ctrl *mac_ctrl;
+	struct sk_buff *skb;
+	u32 hlen = sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl);
+
+	skb = virt_alloc_pkt(SIP_DATA, 0, hlen + roundup(frame->len, 4));
+	if (skb == NULL)
+		return;
+
+	mac_ctrl = virt_fill_rx_ctrl(vt, skb->data + sizeof(struct sip_hdr));
+	mac_ctrl->HT_length = frame->len + FCS_LEN;
+	memcpy(skb->data + hlen, frame->data, frame->len);
+
+	virt_queue_pkt(vt, skb);
+	vt->stat_rx_pkts++;
+}
+
+/*
+ * ampdu: | sip_hdr | mac_rx_ctrl | subframes padded to 4 | pad to rx_blksz | esp_rx_ampdu_len x n |
+ * hdr->len covers the trailers, host finds them at hdr->len / rx_blksz * rx_blksz
+ */
+static void virt_flush_ampdu(struct esp_virt_target *vt)
+{
+	struct esp_mac_rx_ctrl *mac_ctrl;
+	struct esp_rx_ampdu_len *ampdu_len;
+	struct sk_buff *skb, *frame;
+	u32 body, n = 0;
+	u8 *p;
+
+	n = skb_queue_len(&vt->ampdu);
+	if (n == 0)
+		return;
+
+	body = sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl);
+	skb_queue_walk(&vt->ampdu, frame)
+		body += roundup(frame->len, 4);
+
+	skb = virt_alloc_pkt(SIP_DATA_AMPDU, 0, roundup(body, VIRT_BLK_SIZE) + n * sizeof(struct esp_rx_ampdu_len));
+	if (skb == NULL) {
+		skb_queue_purge(&vt->ampdu);
+		return;
+	}
+
+	mac_ctrl = virt_fill_rx_ctrl(vt, skb->data + sizeof(struct sip_hdr));
+	mac_ctrl->Aggregation = 1;
+	mac_ctrl->ampdu_cnt = n;
+
+	p = skb->data + sizeof(struct sip_hdr) + sizeof(struct esp_mac_rx_ctrl);
+	ampdu_len = (struct esp_rx_ampdu_len *)(skb->data + roundup(body, VIRT_BLK_SIZE));
+	while ((frame = skb_dequeue(&vt->ampdu)) != NULL) {
+		memcpy(p, frame->data, frame->len);
+		p += roundup(frame->len, 4);
+		ampdu_len->substate = 0;
+		ampdu_len->sublen = frame->len + FCS_LEN;
+		ampdu_len++;
+		kfree_skb(frame);
+	}
+
+	virt_queue_pkt(vt, skb);
+	vt->stat_rx_pkts += n;
+}
+
+static void virt_reflect_data(struct esp_virt_target *vt, struct sip_hdr *hdr)
+{
+	u32 offset = sip_tx_data_offset(SIP_HDR_IS_AMPDU(hdr));
+	struct ieee80211_hdr *wh;
+	struct sk_buff *frame;
+	u32 flen;
+
+	if (hdr->len <= offset)
+		return;
+	flen = hdr->len - offset;
+	wh = (struct ieee80211_hdr *)((u8 *)hdr + offset);
+	if (flen < 24 || flen + FCS_LEN > 0xfff || !ieee80211_is_data(wh->frame_control))
+		return;
+
+	frame = alloc_skb(flen, GFP_KERNEL);
+	if (frame == NULL)
+		return;
+	memcpy(skb_put(frame, flen), wh, flen);
+
+	/* the peer answers: swap ra/ta, payload goes back in the clear */
+	wh = (struct ieee80211_hdr *)frame->data;
+	memcpy(wh->addr1, ((struct ieee80211_hdr *)((u8 *)hdr + offset))->addr2, ETH_ALEN);
+	memcpy(wh->addr2, ((struct ieee80211_hdr *)((u8 *)hdr + offset))->addr1, ETH_ALEN);
+	wh->frame_control &= ~cpu_to_le16(IEEE80211_FCTL_PROTECTED);
+
+	if (virt_reflect == 2) {
+		skb_queue_tail(&vt->ampdu, frame);
+		if (skb_queue_len(&vt->ampdu) >= VIRT_MAX_AMPDU)
+			virt_flush_ampdu(vt);
+		return;
+	}
+
+	virt_queue_mpdu(vt, frame);
+	kfree_skb(frame);
+}
+
+static void virt_flush_tx_report(struct esp_virt_target *vt)
+{
+	struct sip_evt_tx_report *report;
+	int i;
+
+	if (vt->tx_report_cnt == 0)
+		return;
+
+	report = virt_queue_evt(vt, SIP_EVT_TX_STATUS, sizeof(struct sip_evt_tx_report) +
+				vt->tx_report_cnt * sizeof(struct sip_tx_status));
+	if (report) {
+		report->pkts = vt->tx_report_cnt;
+		for (i = 0; i < vt->tx_report_cnt; i++) {
+			report->status[i].sip_seq = vt->tx_report[i];
+			report->status[i].errno = SIP_TX_ST_OK;
+			report->status[i].ack_signal = 40;
+		}
+	}
+	vt->tx_report_cnt = 0;
+}
+
+static void virt_target_data(struct esp_virt_target *vt, struct sip_hdr *hdr)
+{
+	vt->stat_tx_pkts++;
+
+	vt->tx_report[vt->tx_report_cnt++] = hdr->seq;
+	if (vt->tx_report_cnt == VIRT_MAX_REPORT)
+		virt_flush_tx_report(vt);
+
+	if (virt_reflect)
+		virt_reflect_data(vt, hdr);
+}
+
+/* host wrote a transfer: walk the packets, each one padded to tx_blksz */
+static void virt_target_from_host(struct esp_virt_target *vt, u8 *buf, u32 len)
+{
+	u32 offset = 0;
+
+	while (offset + sizeof(struct sip_hdr) <= len) {
+		struct sip_hdr *hdr = (struct sip_hdr *)(buf + offset);
+		u32 plen = hdr->len;
+
+		if (plen < sizeof(struct sip_hdr) || offset + plen > len)
+			break;
+
+		if (SIP_HDR_IS_CTRL(hdr)) {
+			virt_target_cmd(vt, hdr);
+			/* chip init is charged one credit whatever its size */
+			if (vt->booted && hdr->c_cmdid == SIP_CMD_INIT)
+				vt->credits++;
+			else if (vt->booted && hdr->c_cmdid != SIP_CMD_BOOTUP)
+				vt->credits += roundup(plen, VIRT_BLK_SIZE) / VIRT_BLK_SIZE;
+		} else {
+			virt_target_data(vt, hdr);
+			vt->credits += roundup(plen, VIRT_BLK_SIZE) / VIRT_BLK_SIZE;
+		}
+
+		offset += roundup(plen, VIRT_BLK_SIZE);
+	}
+
+	virt_flush_tx_report(vt);
+	virt_flush_ampdu(vt);
+
+	if ((vt->credits || vt->credit_abs) && skb_queue_empty(&vt->to_host))
+		virt_queue_evt(vt, SIP_EVT_CREDIT_RPT, 0);
+}
+
+/* host reads the head transfer, recycled credits ride along in h_credits */
+static int virt_target_to_host(struct esp_virt_target *vt, u8 *buf, u32 len)
+{
+	struct sk_buff *skb;
+	struct sip_hdr *hdr;
+	u32 credits;
+
+	skb = skb_dequeue(&vt->to_host);
+	if (skb == NULL)
+		return -EIO;
+
+	hdr = (struct sip_hdr *)skb->data;
+	if (vt->credit_abs) {
+		credits = 0x800 | vt->credit_abs_free;
+		vt->credits -= vt->credit_abs_covers;
+		vt->credit_abs = false;
+	} else {
+		credits = min_t(u32, vt->credits, 0x7ff);
+		vt->credits -= credits;
+	}
+	hdr->h_credits = (skb->len << 12) | credits;
+
+	/* what was recycled behind the recalc cmd still has to be reported */
+	if (vt->credits && skb_queue_empty(&vt->to_host))
+		virt_queue_evt(vt, SIP_EVT_CREDIT_RPT, 0);
+
+	memcpy(buf, skb->data, min_t(u32, len, skb->len));
+	if (len > skb->len)
+		memset(buf + skb->len, 0, len - skb->len);
+
+	vt->to_host_seq++;
+	kfree_skb(skb);
+
+	return 0;
+}
+
+static void virt_target_sync_regs(struct esp_virt_target *vt)
+{
+	struct sk_buff *head = skb_peek(&vt->to_host);
+	u32 raw = vt->to_host_seq;
+
+	if (head)
+		raw |= SLC_HOST_RX_ST;
+	put_unaligned_le32(raw, &vt->regs[SLC_HOST_INT_RAW]);
+	put_unaligned_le32(head ? head->len : 0, &vt->regs[SLC_HOST_CONF_W0]);
+}
+
+static void virt_target_reg_write(struct esp_virt_target *vt, u32 addr, u8 *buf, u32 len)
+{
+	u32 end = min_t(u32, addr + len, VIRT_REGS_SIZE);
+	u8 cmd;
+
+	if (addr >= VIRT_REGS_SIZE)
+		return;
+	memcpy(&vt->regs[addr], buf, end - addr);
+
+	/* window access: 0x80|reg latches into STATE_W0, 0xc0|reg stores CONF_W5 */
+	if (addr <= SLC_HOST_WIN_CMD && end > SLC_HOST_WIN_CMD) {
+		cmd = vt->regs[SLC_HOST_WIN_CMD];
+		if ((cmd & 0xc0) == 0xc0)
+			vt->win_regs[cmd & 0x1f] = get_unaligned_le32(&vt->regs[SLC_HOST_CONF_W5]);
+		else if (cmd & 0x80)
+			put_unaligned_le32(vt->win_regs[cmd & 0x1f], &vt->regs[SLC_HOST_STATE_W0]);
+	}
+
+	/* CONF_W4 byte 2 interrupts the target, bit 7 resets it */
+	if (addr <= SLC_HOST_CONF_W4 + 2 && end > SLC_HOST_CONF_W4 + 2) {
+		if (vt->regs[SLC_HOST_CONF_W4 + 2] & BIT(7))
+			virt_target_reset(vt);
+		vt->regs[SLC_HOST_CONF_W4 + 2] = 0;
+	}
+}
+
+static void virt_target_reg_read(struct esp_virt_target *vt, u32 addr, u8 *buf, u32 len)
+{
+	u32 end = min_t(u32, addr + len, VIRT_REGS_SIZE);
+
+	memset(buf, 0, len);
+	if (addr >= VIRT_REGS_SIZE)
+		return;
+
+	virt_target_sync_regs(vt);
+	memcpy(buf, &vt->regs[addr], end - addr);
+}
+
+static struct esp_virt_target *virt_target_alloc(int id)
+{
+	struct esp_virt_target *vt;
+
+	vt = kzalloc(sizeof(struct esp_virt_target), GFP_KERNEL);
+	if (vt == NULL)
+		return NULL;
+
+	mutex_init(&vt->lock);
+	skb_queue_head_init(&vt->to_host);
+	skb_queue_head_init(&vt->ampdu);
+	vt->channel = 1;
+	vt->mac_addr[0] = 0x18;
+	vt->mac_addr[1] = 0xfe;
+	vt->mac_addr[2] = 0x34;
+	vt->mac_addr[5] = id;
+	put_unaligned_le32(VIRT_TARGET_ID, &vt->regs[SLC_HOST_ID]);
+
+	return vt;
+}
+
+static void virt_target_free(struct esp_virt_target *vt)
+{
+	esp_dbg(ESP_SHOW, "%s tx %u rx %u\n", __func__, vt->stat_tx_pkts, vt->stat_rx_pkts);
+	skb_queue_purge(&vt->to_host);
+	skb_queue_purge(&vt->ampdu);
+	mutex_destroy(&vt->lock);
+	kfree(vt);
+}
+
+/*
+ *  host side entry points
+ */
+
+static void sif_virt_kick(struct esp_virt_ctrl *sctrl)
+{
+	if (atomic_read(&sctrl->irq_installed) && !skb_queue_empty(&sctrl->target->to_host))
+		schedule_work(&sctrl->irq_work);
+}
+
+int sif_virt_io(struct esp_pub *epub, u32 addr, u8 *buf, u32 len, u32 flag)
+{
+	struct esp_virt_ctrl *sctrl;
+	struct esp_virt_target *vt;
+
+	EPUB_FUNC_CHECK(epub, _exit);
+	sctrl = EPUB_TO_CTRL(epub);
+	vt = sctrl->target;
+
+	if (flag & SIF_SYNC)
+		sif_lock_bus(epub);
+
+	mutex_lock(&vt->lock);
+	if (flag & SIF_TO_DEVICE)
+		virt_target_reg_write(vt, addr, buf, len);
+	else
+		virt_target_reg_read(vt, addr, buf, len);
+	mutex_unlock(&vt->lock);
+
+	if (flag & SIF_SYNC)
+		sif_unlock_bus(epub);
+
+	return 0;
+_exit:
+	return -EINVAL;
+}
+
+int sif_virt_lldesc_io(struct esp_pub *epub, u8 *buf, u32 len, u32 flag)
+{
+	struct esp_virt_ctrl *sctrl;
+	struct esp_virt_target *vt;
+	int err = 0;
+
+	EPUB_FUNC_CHECK(epub, _exit);
+	sctrl = EPUB_TO_CTRL(epub);
+	vt = sctrl->target;
+
+	if (flag & SIF_SYNC)
+		sif_lock_bus(epub);
+
+	mutex_lock(&vt->lock);
+	if (flag & SIF_TO_DEVICE)
+		virt_target_from_host(vt, buf, len);
+	else
+		err = virt_target_to_host(vt, buf, len);
+	mutex_unlock(&vt->lock);
+
+	if (flag & SIF_SYNC)
+		sif_unlock_bus(epub);
+
+	if (flag & SIF_TO_DEVICE)
+		sif_virt_kick(sctrl);
+
+	return err;
+_exit:
+	return -EINVAL;
+}
+
+static void sif_virt_irq_work(struct work_struct *work)
+{
+	struct esp_virt_ctrl *sctrl = container_of(work, struct esp_virt_ctrl, irq_work);
+	int budget = 64;
+
+	while (atomic_read(&sctrl->irq_installed) &&
+	       !skb_queue_empty(&sctrl->target->to_host)) {
+		sif_dsr(sctrl->pdev);
+		if (--budget == 0) {
+			/* let the rx side breathe, come back later */
+			schedule_work(&sctrl->irq_work);
+			break;
+		}
+	}
+}
+
+void sif_enable_irq(struct esp_pub *epub)
+{
+	struct esp_virt_ctrl *sctrl = NULL;
+
+	if (epub == NULL) {
+		ESSERT(0);
+		return;
+	}
+        sctrl = (struct esp_virt_ctrl *)epub->sif;
+
+        atomic_set(&epub->sip->state, SIP_BOOT);
+
+        atomic_set(&sctrl->irq_installed, 1);
+
+	sif_virt_kick(sctrl);
+}
+
+void sif_disable_irq(struct esp_pub *epub)
+{
+	struct esp_virt_ctrl *sctrl = NULL;
+
+	if (epub == NULL) {
+		ESSERT(0);
+		return;
+	}
+        sctrl = (struct esp_virt_ctrl *)epub->sif;
+
+        if (atomic_read(&sctrl->irq_installed) == 0)
+                return;
+
+        atomic_set(&sctrl->irq_installed, 0);
+
+	cancel_work_sync(&sctrl->irq_work);
+}
+
+/* a power cycle: the model is back in its rom, the next boot is a first stage */
+void sif_reset_target(struct esp_pub *epub)
+{
+	struct esp_virt_target *vt = EPUB_TO_CTRL(epub)->target;
+
+	sif_disable_irq(epub);
+
+	mutex_lock(&vt->lock);
+	virt_target_reset(vt);
+	vt->bootups = 0;
+	mutex_unlock(&vt->lock);
+}
+
+/* nothing to re-enumerate, the model keeps its state across the stages */
+int sif_reinit_card(struct esp_pub *epub)
+{
+	sif_disable_irq(epub);
+	return 0;
+}
+
+/* first stage ctrls parked until their device is probed again */
+static LIST_HEAD(sif_pending_ctrls);
+static DEFINE_MUTEX(sif_pending_lock);
+
+static void sif_park_ctrl(struct esp_virt_ctrl *sctrl, void *key)
+{
+	sctrl->bus_key = key;
+	mutex_lock(&sif_pending_lock);
+	list_add_tail(&sctrl->pending_list, &sif_pending_ctrls);
+	mutex_unlock(&sif_pending_lock);
+}
+
+static struct esp_virt_ctrl *sif_unpark_ctrl(void *key)
+{
+	struct esp_virt_ctrl *sctrl = NULL, *pos;
+
+	mutex_lock(&sif_pending_lock);
+	list_for_each_entry(pos, &sif_pending_ctrls, pending_list) {
+		if (pos->bus_key == key) {
+			list_del_init(&pos->pending_list);
+			sctrl = pos;
+			break;
+		}
+	}
+	mutex_unlock(&sif_pending_lock);
+
+	return sctrl;
+}
+
+/* some chip finished its first stage and waits for the second */
+static bool sif_any_parked(void)
+{
+	bool parked;
+
+	mutex_lock(&sif_pending_lock);
+	parked = !list_empty(&sif_pending_ctrls);
+	mutex_unlock(&sif_pending_lock);
+
+	return parked;
+}
+
+static void esp_virt_free_ctrl(struct esp_virt_ctrl *sctrl)
+{
+	if (sctrl->epub->sip) {
+		sip_detach(sctrl->epub->sip);
+		sctrl->epub->sip = NULL;
+		esp_dbg(ESP_DBG_TRACE, "%s sip detached \n", __func__);
+	}
+#ifdef USE_EXT_GPIO
+	if (sctrl->epub->conf.ate == 0)
+		ext_gpio_deinit(sctrl->epub);
+#endif
+	esp_pub_dealloc_mac80211(sctrl->epub);
+	esp_dbg(ESP_DBG_TRACE, "%s dealloc mac80211 \n", __func__);
+
+	if (sctrl->dma_buffer) {
+		kfree(sctrl->dma_buffer);
+		sctrl->dma_buffer = NULL;
+	}
+
+	if (sctrl->target) {
+		virt_target_free(sctrl->target);
+		sctrl->target = NULL;
+	}
+
+	mutex_destroy(&sctrl->bus_mtx);
+	kfree(sctrl);
+}
+
+static int esp_virt_remove(struct platform_device *pdev);
+
+static int esp_virt_probe(struct platform_device *pdev)
+{
+        int err = 0;
+        struct esp_pub *epub;
+        struct esp_virt_ctrl *sctrl;
+
+        esp_dbg(ESP_DBG_ERROR, "%s enter %d\n", __func__, pdev->id);
+
+	/* a device with a parked ctrl has already run the first stage */
+	sctrl = sif_unpark_ctrl(pdev);
+	if (sctrl == NULL) {
+		sctrl = kzalloc(sizeof(struct esp_virt_ctrl), GFP_KERNEL);
+
+		if (sctrl == NULL) {
+                	err = -ENOMEM;
+			goto _err_first_init;
+		}
+		INIT_LIST_HEAD(&sctrl->pending_list);
+		mutex_init(&sctrl->bus_mtx);
+		INIT_WORK(&sctrl->irq_work, sif_virt_irq_work);
+
+		sctrl->dma_buffer = kzalloc(ESP_DMA_IBUFSZ, GFP_KERNEL);
+
+		if (sctrl->dma_buffer == NULL) {
+                	err = -ENOMEM;
+			goto _err_last;
+		}
+
+		sctrl->target = virt_target_alloc(pdev->id);
+		if (sctrl->target == NULL) {
+                	err = -ENOMEM;
+			goto _err_dma;
+		}
+        	sctrl->slc_blk_sz = SIF_SLC_BLOCK_SIZE;
+
+		epub = esp_pub_alloc_mac80211(&pdev->dev);
+
+        	if (epub == NULL) {
+                	esp_dbg(ESP_DBG_ERROR, "no mem for epub \n");
+                	err = -ENOMEM;
+                	goto _err_target;
+        	}
+        	epub->sif = (void *)sctrl;
+        	sctrl->epub = epub;
+		sif_load_config(epub);
+		epub->sdio_state = ESP_SDIO_STATE_FIRST_INIT;
+	} else {
+		epub = sctrl->epub;
+		SET_IEEE80211_DEV(epub->hw, &pdev->dev);
+		epub->dev = &pdev->dev;
+		epub->sdio_state = ESP_SDIO_STATE_SECOND_INIT;
+	}
+
+        sctrl->pdev = pdev;
+        sctrl->id = platform_get_device_id(pdev);
+        platform_set_drvdata(pdev, sctrl);
+
+#ifdef USE_EXT_GPIO
+	if (epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT && epub->conf.ate == 0) {
+		err = ext_gpio_init(epub);
+		if (err) {
+                	esp_dbg(ESP_DBG_ERROR, "ext_irq_work_init failed %d\n", err);
+			goto _err_epub;
+		}
+	}
+#endif
+
+        check_target_id(epub);
+
+        err = esp_pub_init_all(epub);
+
+        if (err) {
+                esp_dbg(ESP_DBG_ERROR, "esp_init_all failed: %d\n", err);
+                if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+			epub->sdio_state = ESP_SDIO_STATE_FIRST_ERROR_EXIT;
+			err = 0;
+			goto _err_first_init;
+		}
+                if(epub->sdio_state == ESP_SDIO_STATE_SECOND_INIT)
+			goto _err_second_init;
+        }
+
+        esp_dbg(ESP_DBG_TRACE, " %s return  %d\n", __func__, err);
+	if(epub->sdio_state == ESP_SDIO_STATE_FIRST_INIT){
+		esp_dbg(ESP_DBG_ERROR, "first normal exit\n");
+		epub->sdio_state = ESP_SDIO_STATE_FIRST_NORMAL_EXIT;
+		sif_park_ctrl(sctrl, pdev);
+	}
+
+        return err;
+#ifdef USE_EXT_GPIO
+_err_epub:
+	platform_set_drvdata(pdev, NULL);
+        esp_pub_dealloc_mac80211(epub);
+#endif
+_err_target:
+	virt_target_free(sctrl->target);
+_err_dma:
+        kfree(sctrl->dma_buffer);
+_err_last:
+        kfree(sctrl);
+_err_first_init:
+	esp_dbg(ESP_DBG_ERROR, "first error exit\n");
+        return err;
+_err_second_init:
+	epub->sdio_state = ESP_SDIO_STATE_SECOND_ERROR_EXIT;
+	esp_virt_remove(pdev);
+	return err;
+}
+
+static int esp_virt_remove(struct platform_device *pdev)
+{
+        struct esp_virt_ctrl *sctrl = NULL;
+
+	esp_dbg(ESP_SHOW, "%s \n", __func__);
+
+        sctrl = platform_get_drvdata(pdev);
+
+        if (sctrl == NULL) {
+                esp_dbg(ESP_DBG_ERROR, "%s no sctrl\n", __func__);
+                return -EINVAL;
+        }
+
+        do {
+                if (sctrl->epub == NULL) {
+                        esp_dbg(ESP_DBG_ERROR, "%s epub null\n", __func__);
+                        break;
+                }
+		if(sctrl->epub->sdio_state == ESP_SDIO_STATE_FIRST_NORMAL_EXIT){
+			atomic_set(&sctrl->epub->sip->state, SIP_STOP);
+			sif_disable_irq(sctrl->epub);
+		}
+
+#ifdef TEST_MODE
+                test_exit_netlink();
+#endif /* TEST_MODE */
+		/* a parked ctrl is kept for the second stage probe */
+		if(sctrl->epub->sdio_state != ESP_SDIO_STATE_FIRST_NORMAL_EXIT) {
+			sif_disable_irq(sctrl->epub);
+			esp_virt_free_ctrl(sctrl);
+		}
+
+        } while (0);
+
+	platform_set_drvdata(pdev, NULL);
+
+        esp_dbg(ESP_DBG_TRACE, "eagle virt remove complete\n");
+
+	return 0;
+}
+
+static int esp_virt_suspend(struct device *dev)
+{
+        struct esp_virt_ctrl *sctrl = dev_get_drvdata(dev);
+
+        atomic_set(&sctrl->epub->ps.state, ESP_PM_ON);
+        esp_pm_suspend(sctrl->epub, true);
+
+        return 0;
+}
+
+static int esp_virt_resume(struct device *dev)
+{
+        struct esp_virt_ctrl *sctrl = dev_get_drvdata(dev);
+
+        return esp_pm_resume(sctrl->epub);
+}
+
+static const struct dev_pm_ops esp_virt_pm_ops = {
+        .suspend = esp_virt_suspend,
+        .resume = esp_virt_resume,
+};
+
+static const struct platform_device_id esp_virt_id[] = {
+	{ "eagle_virt", 0 },
+	{ },
+};
+MODULE_DEVICE_TABLE(platform, esp_virt_id);
+
+static struct platform_driver esp_virt_driver = {
+	.id_table = esp_virt_id,
+	.driver	= {
+		.name	= "eagle_virt",
+		.owner	= THIS_MODULE,
+		.pm	= &esp_virt_pm_ops,
+	},
+	.probe	= esp_virt_probe,
+	.remove	= esp_virt_remove,
+};
+
+static struct platform_device *esp_virt_devs[VIRT_MAX_DEVICES];
+
+int esp_virt_init(void)
+{
+        int err;
+        int i, n;
+
+        esp_dbg(ESP_DBG_TRACE, "%s \n", __func__);
+
+        esp_wakelock_init();
+        esp_wake_lock();
+
+        err = platform_driver_register(&esp_virt_driver);
+        if (err) {
+                esp_dbg(ESP_DBG_ERROR, "eagle virt driver registration failed, error code: %d\n", err);
+                goto _fail;
+        }
+
+        n = clamp(virt_devices, 1, VIRT_MAX_DEVICES);
+        for (i = 0; i < n; i++) {
+                esp_virt_devs[i] = platform_device_register_simple("eagle_virt", i, NULL, 0);
+                if (IS_ERR(esp_virt_devs[i])) {
+                        esp_dbg(ESP_DBG_ERROR, "eagle virt device %d failed: %ld\n", i, PTR_ERR(esp_virt_devs[i]));
+                        esp_virt_devs[i] = NULL;
+                        break;
+                }
+        }
+
+        /* every device probed above, each target's stage lives in its ctrl */
+        if (sif_get_ate_config() == 0 && sif_any_parked()) {
+		platform_driver_unregister(&esp_virt_driver);
+		platform_driver_register(&esp_virt_driver);
+        }
+
+        esp_register_early_suspend();
+	esp_wake_unlock();
+        return err;
+
+_fail:
+        esp_wake_unlock();
+        esp_wakelock_destroy();
+
+        return err;
+}
+
+void esp_virt_exit(void)
+{
+	struct esp_virt_ctrl *sctrl, *tmp;
+	int i;
+
+	esp_dbg(ESP_SHOW, "%s \n", __func__);
+
+        esp_unregister_early_suspend();
+
+	platform_driver_unregister(&esp_virt_driver);
+
+	for (i = 0; i < VIRT_MAX_DEVICES; i++) {
+		if (esp_virt_devs[i]) {
+			platform_device_unregister(esp_virt_devs[i]);
+			esp_virt_devs[i] = NULL;
+		}
+	}
+
+	/* targets that never came back for the second stage */
+	list_for_each_entry_safe(sctrl, tmp, &sif_pending_ctrls, pending_list) {
+		list_del(&sctrl->pending_list);
+		esp_virt_free_ctrl(sctrl);
+	}
+
+        esp_wakelock_destroy();
+}
+
+MODULE_AUTHOR("Espressif System");
+MODULE_DESCRIPTION("Driver for emulated eagle low-power WLAN devices");
+MODULE_LICENSE("GPL");
+#endif /* ESP_USE_VIRT */